@@ -0,0 +1,102 @@
+# Build the filesystem image contents (data/) from the web sources (web/)
+#
+# Every file is gzipped and given a strong ETag (hash of its content). Stylesheets, scripts and images also get the hash in
+# their name (style.css -> style.1a2b3c4d.css) and the references in the HTML pages are rewritten, so the browser may cache
+# them forever. data/manifest.txt tells the controller how to serve each file - one line per file:
+#
+#   <url> <file> <etag> <content type> <immutable> <size of file>
+#
+# Runs before every PlatformIO build (extra_scripts = pre:scripts/build_web.py) and can also be run by hand: python scripts/build_web.py
+
+import gzip
+import hashlib
+import os
+import re
+
+CONTENT_TYPES = {
+    ".html": "text/html",
+    ".css": "text/css",
+    ".js": "application/javascript",
+    ".json": "application/json",
+    ".svg": "image/svg+xml",
+    ".png": "image/png",
+    ".ico": "image/x-icon",
+}
+
+MANIFEST = "manifest.txt"
+NAME_LENGTH = 31  # The controller keeps the names in WebAsset.File[32]
+
+
+def content_hash(content):
+    return hashlib.sha256(content).hexdigest()
+
+
+def build(project_dir):
+    source_dir = os.path.join(project_dir, "web")
+    data_dir = os.path.join(project_dir, "data")
+    os.makedirs(data_dir, exist_ok=True)
+
+    # Remove the output of the previous build
+    for name in os.listdir(data_dir):
+        if name.endswith(".gz") or name == MANIFEST:
+            os.remove(os.path.join(data_dir, name))
+
+    sources = {}
+    for name in sorted(os.listdir(source_dir)):
+        extension = os.path.splitext(name)[1]
+        if extension not in CONTENT_TYPES:
+            print("build_web: skipping %s (unknown type)" % name)
+            continue
+        with open(os.path.join(source_dir, name), "rb") as f:
+            sources[name] = f.read()
+
+    # Assets other than pages are served under a name including their hash
+    urls = {}
+    for name, content in sources.items():
+        stem, extension = os.path.splitext(name)
+        if extension == ".html":
+            urls[name] = name
+        else:
+            urls[name] = "%s.%s%s" % (stem, content_hash(content)[:8], extension)
+
+    # Point the pages to the hashed names
+    for name in sources:
+        if not name.endswith(".html"):
+            continue
+        page = sources[name].decode("utf-8")
+        for asset, url in urls.items():
+            if asset != url:
+                page = re.sub(r'((?:href|src)\s*=\s*["\']/?)' + re.escape(asset) + r'(["\'])', r"\g<1>" + url + r"\g<2>", page)
+        sources[name] = page.encode("utf-8")
+
+    lines = []
+    total_source = 0
+    total_gzip = 0
+    for name, content in sources.items():
+        url = "/" + urls[name]
+        file_name = url + ".gz"
+        if len(file_name) > NAME_LENGTH:
+            raise Exception("build_web: file name too long: " + file_name)
+
+        # mtime=0 makes the output identical for identical input
+        compressed = gzip.compress(content, compresslevel=9, mtime=0)
+        with open(os.path.join(data_dir, file_name[1:]), "wb") as f:
+            f.write(compressed)
+
+        extension = os.path.splitext(name)[1]
+        immutable = 0 if extension == ".html" else 1
+        lines.append("%s %s %s %s %d %d" % (url, file_name, content_hash(content)[:16], CONTENT_TYPES[extension], immutable, len(compressed)))
+        total_source += len(content)
+        total_gzip += len(compressed)
+        print("build_web: %-28s %7d -> %6d bytes" % (url, len(content), len(compressed)))
+
+    with open(os.path.join(data_dir, MANIFEST), "w", newline="\n") as f:
+        f.write("\n".join(lines) + "\n")
+    print("build_web: %d files, %d -> %d bytes" % (len(lines), total_source, total_gzip))
+
+
+try:
+    Import("env")  # noqa: F821 - defined when run by PlatformIO
+    build(env["PROJECT_DIR"])  # noqa: F821
+except NameError:
+    build(os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
@@ -0,0 +1,95 @@
+# Generate src/ntc_table.h - the table used by ntcTemperature() to convert the ADS1115 value measured across the reference resistor
+# of an NTC into a temperature
+#
+# The NTC is connected from VIN to the ADC input and the reference resistor from the input to ground:
+#
+#   Vout = VIN * RREF / (RREF + Rntc)       ADC value = Vout / ADC_LSB
+#
+# The temperature is calculated with the Beta model of the NTC: 1/T = 1/T25 + ln(Rntc/R25) / BETA
+# The table holds the temperature for every TABLE_STEP'th ADC value - the controller interpolates linearly between the entries.
+# The script fails if the interpolation differs more than MAX_ERROR from the Beta model anywhere in the range shown on the display
+#
+# Run by hand when a parameter is changed: python scripts/ntc_table.py
+
+import math
+import os
+
+R25 = 4700.0        # Resistance of the NTC at 25 degrees Celcius (ohms)
+BETA = 3500.0       # Beta of the NTC (K)
+RREF = 10000.0      # Reference resistor (ohms)
+VIN = 3.3           # Supply of the divider (volts)
+ADC_LSB = 4.096 / 32768  # ADS1115 with GAIN_ONE: +/- 4.096V full scale, 0.125mV per bit
+
+TABLE_FIRST = 10240  # ADC value of the first entry (about -6 degrees Celcius)
+TABLE_STEP = 256     # ADC values between two entries - a power of 2, so the interpolation needs no division
+TABLE_LAST = 25344   # ADC value of the last entry (about 102 degrees Celcius)
+
+RANGE = (0.0, 65.0)  # Range shown on the display (degrees Celcius)
+MAX_ERROR = 0.05     # Largest error allowed for the interpolation within RANGE (degrees Celcius)
+LIMIT_MAX = 99       # Highest Trigger1Temp/Trigger2Temp accepted by the settings - the table must reach it, or the limit could never trip
+
+KELVIN = 273.15
+
+
+def temperature(adc):
+    vout = adc * ADC_LSB
+    rntc = RREF * (VIN / vout - 1)
+    return 1.0 / (1.0 / (25.0 + KELVIN) + math.log(rntc / R25) / BETA) - KELVIN
+
+
+def adc_value(temp):
+    rntc = R25 * math.exp(BETA * (1.0 / (temp + KELVIN) - 1.0 / (25.0 + KELVIN)))
+    return VIN * RREF / (RREF + rntc) / ADC_LSB
+
+
+def interpolate(table, adc):
+    # As ntcTemperature() - in 1/100 degrees Celcius with integer arithmetic
+    index = (adc - TABLE_FIRST) // TABLE_STEP
+    fraction = (adc - TABLE_FIRST) % TABLE_STEP
+    return table[index] + (table[index + 1] - table[index]) * fraction // TABLE_STEP
+
+
+def generate(project_dir):
+    if TABLE_STEP & (TABLE_STEP - 1) != 0 or (TABLE_LAST - TABLE_FIRST) % TABLE_STEP != 0:
+        raise Exception("ntc_table: TABLE_STEP must be a power of 2 dividing the range")
+    codes = range(TABLE_FIRST, TABLE_LAST + 1, TABLE_STEP)
+    table = [int(round(temperature(code) * 100)) for code in codes]
+    if temperature(TABLE_FIRST) > RANGE[0] or temperature(TABLE_LAST) < RANGE[1]:
+        raise Exception("ntc_table: the table does not cover %g - %g degrees Celcius" % RANGE)
+    if temperature(TABLE_LAST) < LIMIT_MAX + 1:
+        raise Exception("ntc_table: the table ends below the highest temperature limit (%d degrees Celcius)" % LIMIT_MAX)
+
+    # Compare the interpolation with the Beta model for every ADC value within RANGE
+    worst = 0.0
+    for adc in range(int(math.ceil(adc_value(RANGE[0]))), int(adc_value(RANGE[1])) + 1):
+        worst = max(worst, abs(interpolate(table, adc) / 100.0 - temperature(adc)))
+    print("ntc_table: %d entries, largest error %.3f degrees Celcius" % (len(table), worst))
+    if worst > MAX_ERROR:
+        raise Exception("ntc_table: largest error %.3f exceeds %.3f - reduce TABLE_STEP" % (worst, MAX_ERROR))
+
+    lines = [
+        "// Generated by scripts/ntc_table.py - do not edit",
+        "// NTC %g ohms at 25 degrees Celcius, Beta %g K, reference resistor %g ohms, divider supply %gV, ADS1115 %gmV per bit" % (
+            R25, BETA, RREF, VIN, ADC_LSB * 1000),
+        "// Largest error of the linear interpolation between %g and %g degrees Celcius: %.3f degrees" % (RANGE[0], RANGE[1], worst),
+        "",
+        "#ifndef NTC_TABLE_H",
+        "#define NTC_TABLE_H",
+        "",
+        "#define NTC_TABLE_FIRST %d // ADC value of the first entry" % TABLE_FIRST,
+        "#define NTC_TABLE_SHIFT %d // log2 of the ADC values between two entries" % int(math.log2(TABLE_STEP)),
+        "#define NTC_TABLE_SIZE %d" % len(table),
+        "",
+        "// Temperature in 1/100 degrees Celcius for ADC value NTC_TABLE_FIRST + (index << NTC_TABLE_SHIFT)",
+        "const int16_t ntcTable[NTC_TABLE_SIZE] = {",
+    ]
+    for i in range(0, len(table), 12):
+        lines.append("  " + ", ".join("%d" % t for t in table[i:i + 12]) + ",")
+    lines[-1] = lines[-1][:-1]
+    lines += ["};", "", "#endif", ""]
+
+    with open(os.path.join(project_dir, "src", "ntc_table.h"), "w", newline="\n") as f:
+        f.write("\n".join(lines))
+
+
+generate(os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
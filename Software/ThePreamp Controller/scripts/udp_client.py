@@ -0,0 +1,169 @@
+# Client for the UDP control protocol of the controller (see UDP_PORT in src/main.cpp)
+#
+#   python scripts/udp_client.py <host> state
+#   python scripts/udp_client.py <host> volume 30
+#   python scripts/udp_client.py <host> input 2
+#   python scripts/udp_client.py <host> mute 1
+#   python scripts/udp_client.py <host> listen          (print the multicast announcements)
+#   python scripts/udp_client.py <host> bench [count]   (round-trip times of UDP compared with the HTTP API)
+#
+# A request is sent again with the same sequence number if no reply arrives - the controller answers the repeat without executing it twice
+
+import socket
+import statistics
+import struct
+import sys
+import time
+import urllib.request
+
+PORT = 5005
+MULTICAST_GROUP = "239.255.84.80"
+VERSION = 1
+TIMEOUT = 0.25  # Seconds to wait for a reply before the request is sent again
+RETRIES = 4
+
+GET_STATE = 0x01
+SET_VOLUME = 0x02
+SET_INPUT = 0x03
+SET_MUTE = 0x04
+STATE = 0x80
+ANNOUNCE = 0x81
+
+HEADER = struct.Struct("<2sBBI")
+STATE_PACKET = struct.Struct("<2sBBIBIBBBBBBhh")
+STATUS_NAMES = ["ok", "duplicate", "invalid", "busy"]
+MODE_NAMES = ["normal", "balance", "standby"]
+
+
+class Client:
+    def __init__(self, host):
+        self.address = (host, PORT)
+        self.sequence = int(time.time() * 1000) & 0xFFFFFFFF  # Newer than the sequence numbers of an earlier run
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+        self.sock.settimeout(TIMEOUT)
+
+    def request(self, packet_type, value=None):
+        self.sequence = (self.sequence + 1) & 0xFFFFFFFF
+        packet = HEADER.pack(b"TP", VERSION, packet_type, self.sequence)
+        if value is not None:
+            packet += bytes([value])
+        for _ in range(RETRIES):
+            self.sock.sendto(packet, self.address)
+            try:
+                while True:
+                    data, _ = self.sock.recvfrom(64)
+                    state = parse_state(data)
+                    # Ignore late replies to earlier requests
+                    if state is not None and state["sequence"] == self.sequence:
+                        return state
+            except socket.timeout:
+                continue
+        raise Exception("no reply from %s:%d" % self.address)
+
+
+def parse_state(data):
+    if len(data) < STATE_PACKET.size:
+        return None
+    fields = STATE_PACKET.unpack(data[:STATE_PACKET.size])
+    if fields[0] != b"TP" or fields[1] != VERSION or fields[2] not in (STATE, ANNOUNCE):
+        return None
+    return {
+        "type": fields[2],
+        "sequence": fields[3],
+        "status": STATUS_NAMES[fields[4]] if fields[4] < len(STATUS_NAMES) else fields[4],
+        "ticket": fields[5],
+        "mode": MODE_NAMES[fields[6]] if fields[6] < len(MODE_NAMES) else fields[6],
+        "input": fields[7],
+        "volume": fields[8],
+        "steps": fields[9],
+        "muted": bool(fields[10]),
+        "balance": fields[11],
+        "temp1": fields[12] / 10.0,
+        "temp2": fields[13] / 10.0,
+    }
+
+
+def print_state(state):
+    print("%-9s input %d  volume %d/%d  %s  balance %d  %.1f/%.1f C  (%s, ticket %d)" % (
+        state["mode"], state["input"], state["volume"], state["steps"], "muted" if state["muted"] else "unmuted",
+        state["balance"], state["temp1"], state["temp2"], state["status"], state["ticket"]))
+
+
+def listen():
+    sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM, socket.IPPROTO_UDP)
+    sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    sock.bind(("", PORT))
+    membership = struct.pack("4s4s", socket.inet_aton(MULTICAST_GROUP), socket.inet_aton("0.0.0.0"))
+    sock.setsockopt(socket.IPPROTO_IP, socket.IP_ADD_MEMBERSHIP, membership)
+    while True:
+        data, sender = sock.recvfrom(64)
+        state = parse_state(data)
+        if state is not None and state["type"] == ANNOUNCE:
+            print(sender[0], end=": ")
+            print_state(state)
+
+
+def measure(function, count):
+    times = []
+    for _ in range(count):
+        start = time.perf_counter()
+        function()
+        times.append((time.perf_counter() - start) * 1000)
+    times.sort()
+    return times
+
+
+def print_times(name, times):
+    print("%-28s min %6.1f  median %6.1f  p95 %6.1f  max %6.1f ms" % (
+        name, times[0], statistics.median(times), times[int(len(times) * 0.95) - 1], times[-1]))
+
+
+# Compares the round trip of UDP with the HTTP API - every HTTP request uses a new connection, as a knob app would for each nudge
+# The volume is set to its current value, so the benchmark does not change what is heard
+def bench(client, host, count):
+    volume = client.request(GET_STATE)["volume"]
+    url = "http://%s/api/v1/state" % host
+    body = ('{"volume":%d}' % volume).encode()
+
+    def http_get():
+        urllib.request.urlopen(url, timeout=2).read()
+
+    def http_patch():
+        request = urllib.request.Request(url, data=body, method="PATCH", headers={"Content-Type": "application/json"})
+        urllib.request.urlopen(request, timeout=2).read()
+
+    print("%d requests each" % count)
+    print_times("UDP get state", measure(lambda: client.request(GET_STATE), count))
+    print_times("HTTP GET /api/v1/state", measure(http_get, count))
+    print_times("UDP set volume", measure(lambda: client.request(SET_VOLUME, volume), count))
+    print_times("HTTP PATCH /api/v1/state", measure(http_patch, count))
+
+
+def main(args):
+    if len(args) < 2:
+        print("usage: udp_client.py <host> state|volume|input|mute|listen|bench [value]")
+        return 1
+    host, command = args[0], args[1]
+    if command == "listen":
+        listen()
+        return 0
+
+    client = Client(host)
+    if command == "state":
+        print_state(client.request(GET_STATE))
+    elif command == "volume":
+        print_state(client.request(SET_VOLUME, int(args[2])))
+    elif command == "input":
+        print_state(client.request(SET_INPUT, int(args[2])))
+    elif command == "mute":
+        print_state(client.request(SET_MUTE, int(args[2])))
+    elif command == "bench":
+        bench(client, host, int(args[2]) if len(args) > 2 else 100)
+    else:
+        print("unknown command: " + command)
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv[1:]))
@@ -0,0 +1,145 @@
+// The command bus between the tasks (webserver, WebSerial, MQTT, UDP, timers) and the control loop in main.cpp
+// Any task posts a command and gets a ticket back at once. The control loop executes the commands in ticket order and publishes the
+// ticket of the last command done. The queue is reached through CommandBus, so the host tests run this code on a std::deque
+
+#ifndef COMMAND_BUS_H
+#define COMMAND_BUS_H
+
+#include <stdint.h>
+#include <atomic>
+
+enum CommandTypes
+{
+  CMD_KEY,          // Handle Value as user input (a UserInput key)
+  CMD_INPUT,        // Select input Value (0-4)
+  CMD_MUTE,         // Mute the output
+  CMD_UNMUTE,       // Unmute the output
+  CMD_PRESET,       // Recall preset Value (0-7)
+  CMD_STORE_PRESET, // Store the current setup as preset Value with the name in Text
+  CMD_WS_RESYNC,    // Send the full state to WebSocket client Value (posted when a client connects or asks for it)
+  CMD_TARGET,       // Apply apiTarget as one transition
+  CMD_IMPORT_SETTINGS, // Apply importedSettings
+  CMD_IR_LEARN,     // Store the next code received by the IR receiver in the SETTING_IR field SettingFields[Value]
+  CMD_EEPROM_DUMP,  // Write a hexdump of the EEPROM to WebSerial - Value = address << 16 | length
+  CMD_VOLUME,       // Set the volume waiting in pendingVolume (see commandPostVolume)
+  CMD_LINK,         // Apply linkPending - the state of the leader of the linked group
+  CMD_SEQUENCE,     // Execute the steps of the power sequence that are due (posted by sequenceTimer)
+  CMD_RESTART,      // Restart the controller RESTART_DELAY from now (posted by the WiFi configuration portal)
+  CMD_SET_MUTE      // Mute (Value = 1) or unmute (Value = 0) as a TARGET_MUTE transition, so the state reported by RuntimeSettings.Muted follows
+};
+
+enum CommandSources
+{
+  SRC_LOCAL,
+  SRC_WEB,
+  SRC_WEBSERIAL,
+  SRC_MQTT,
+  SRC_UDP,
+  SRC_LINK
+};
+
+struct Command
+{
+  uint32_t Ticket;
+  uint8_t Type;
+  uint8_t Source;
+  int32_t Value;
+  char Text[12];
+};
+
+// The queue of the bus - none of the callbacks may block
+struct CommandBus
+{
+  bool (*Send)(const Command &cmd); // Add cmd at the back - false if the queue is full
+  bool (*Peek)(Command &cmd);       // Copy the command at the front - false if the queue is empty
+  void (*Pop)();                    // Remove the command at the front
+  void (*Lock)(bool Take);          // Take or give the lock of the posting tasks
+  std::atomic<uint32_t> Issued;     // The ticket of the last command posted
+  std::atomic<uint32_t> Completed;  // The ticket of the last command done by the control loop
+  uint32_t Dropped;                 // Commands not posted because the queue was full
+};
+
+// A volume waiting for the control loop - requests are merged into Volume and only the one finding it empty (-1) posts a CMD_VOLUME
+// A knob spinning fast therefore gives a few transitions to the latest volume instead of one per request
+struct VolumeSlot
+{
+  std::atomic<int> Volume;   // -1 when no volume is waiting
+  uint32_t Ticket;           // The ticket of the CMD_VOLUME in the queue - only used under the lock of the bus
+};
+
+// Issue the next ticket to cmd and queue it - the caller holds the lock. A ticket is only used up if the command is queued
+inline uint32_t commandSend(CommandBus &Bus, Command &cmd)
+{
+  cmd.Ticket = Bus.Issued + 1;
+  if (!Bus.Send(cmd))
+  {
+    Bus.Dropped++;
+    return 0;
+  }
+  Bus.Issued = cmd.Ticket;
+  return cmd.Ticket;
+}
+
+// Post a command - returns its ticket or 0 if the queue is full
+// The ticket is issued and the command queued under one lock, so the tickets reach the control loop in order and a ticket not
+// above Bus.Completed is done. Without the lock a task could queue ticket 5 after another task's ticket 6 was done
+inline uint32_t commandPost(CommandBus &Bus, Command &cmd)
+{
+  Bus.Lock(true);
+  uint32_t Ticket = commandSend(Bus, cmd);
+  Bus.Lock(false);
+  return Ticket;
+}
+
+// Post a CMD_VOLUME for Volume, or merge Volume into the one waiting - returns the ticket of the CMD_VOLUME that applies it or 0 if
+// the queue is full. The control loop takes the volume with commandTakeVolume() without the lock
+inline uint32_t commandPostVolume(CommandBus &Bus, VolumeSlot &Slot, Command &cmd, int Volume)
+{
+  Bus.Lock(true);
+  uint32_t Ticket;
+  if (Slot.Volume.exchange(Volume) >= 0)
+    Ticket = Slot.Ticket;
+  else
+  {
+    cmd.Type = CMD_VOLUME;
+    Ticket = commandSend(Bus, cmd);
+    if (Ticket == 0)
+      Slot.Volume = -1;
+    else
+      Slot.Ticket = Ticket;
+  }
+  Bus.Lock(false);
+  return Ticket;
+}
+
+// Take the waiting volume when a CMD_VOLUME is executed - -1 if a CMD_VOLUME before it took it already
+inline int commandTakeVolume(VolumeSlot &Slot)
+{
+  return Slot.Volume.exchange(-1);
+}
+
+// Take the next command to execute from the front of the queue - false if the queue is empty or the command has to wait
+// A CMD_KEY waits while keyAllowed is false and a CMD_TARGET while targetDue is false. The commands behind it wait too, so the order is kept
+inline bool commandTake(CommandBus &Bus, Command &cmd, bool keyAllowed, bool targetDue)
+{
+  if (!Bus.Peek(cmd))
+    return false;
+  if ((cmd.Type == CMD_KEY && !keyAllowed) || (cmd.Type == CMD_TARGET && !targetDue))
+    return false;
+  Bus.Pop();
+  return true;
+}
+
+// Mark cmd done - call after executing it
+inline void commandDone(CommandBus &Bus, const Command &cmd)
+{
+  Bus.Completed = cmd.Ticket;
+}
+
+// True if the command with Ticket has been executed
+inline bool commandIsDone(const CommandBus &Bus, uint32_t Ticket)
+{
+  return Ticket != 0 && Ticket <= Bus.Completed;
+}
+
+#endif
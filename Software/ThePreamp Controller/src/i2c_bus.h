@@ -0,0 +1,39 @@
+// The order i2cTask in main.cpp serves the I2C bus in - the relays (the high queue) are always served before the EEPROM and the ADS1115
+// (the low queue), and EEPROM reads and writes are split into transactions of at most one page. A relay change posted while a large
+// block of settings is saved therefore waits for at most one page write
+
+#ifndef I2C_BUS_H
+#define I2C_BUS_H
+
+#include <stdint.h>
+
+#define I2C_PAGE_SIZE 32 // Page size of the 24C64 - the most data moved by one transaction
+
+enum I2CQueues
+{
+  I2C_QUEUE_NONE = -1,
+  I2C_QUEUE_HIGH,  // The relays
+  I2C_QUEUE_LOW    // The EEPROM and the ADS1115
+};
+
+// Receive the transaction at the front of the high or the low queue to T without waiting - false if the queue is empty
+typedef bool (*I2CReceive)(bool High, void *T);
+
+// The length of the transaction for Remaining bytes from Address - it ends at the end of the page, as a 24C64 write wraps within the page
+inline uint8_t i2cPageLength(uint32_t Address, uint32_t Remaining)
+{
+  uint32_t Length = I2C_PAGE_SIZE - Address % I2C_PAGE_SIZE;
+  return Remaining < Length ? Remaining : Length;
+}
+
+// Take the next transaction to execute - returns the queue it was taken from or I2C_QUEUE_NONE if both are empty
+inline int i2cTake(I2CReceive Receive, void *T)
+{
+  if (Receive(true, T))
+    return I2C_QUEUE_HIGH;
+  if (Receive(false, T))
+    return I2C_QUEUE_LOW;
+  return I2C_QUEUE_NONE;
+}
+
+#endif
@@ -0,0 +1,86 @@
+// Ring buffer of the logger - log messages are put in it by any task and written to Serial/WebSerial by logDrainTask
+
+#ifndef LOG_RING_H
+#define LOG_RING_H
+
+#include <stdint.h>
+#include <atomic>
+
+#define LOG_BUFFER_SIZE 128 // Number of messages in the ring buffer (must be a power of 2)
+#define LOG_MAX_ARGS 4
+
+struct LogRecord
+{
+  uint32_t Time;      // millis() when the message was logged
+  const char *Format; // printf format - NULL for text written via debug()/debugln()
+  union
+  {
+    int32_t Args[LOG_MAX_ARGS];
+    char Text[LOG_MAX_ARGS * sizeof(int32_t)];
+  };
+  uint8_t Level;
+  uint8_t Length;     // Number of characters in Text
+};
+
+// A slot of the ring buffer - Sequence tells if the slot is free for the writer or holds a message for the reader (bounded MPMC queue by D. Vyukov)
+// Any task can log without taking a lock. If the buffer is full the message is dropped and counted in logDropped
+struct LogSlot
+{
+  std::atomic<uint32_t> Sequence;
+  LogRecord Record;
+};
+
+// Defined in main.cpp
+extern LogSlot logSlots[LOG_BUFFER_SIZE];
+extern std::atomic<uint32_t> logHead; // Next slot to write
+extern uint32_t logTail;              // Next slot to read - only used by logDrainTask
+extern std::atomic<uint32_t> logDropped;
+
+// Prepare the ring buffer of the logger - every slot is free for the writer, starting at the next slot to read
+inline void logInit()
+{
+  for (uint32_t i = 0; i < LOG_BUFFER_SIZE; i++)
+    logSlots[(logTail + i) & (LOG_BUFFER_SIZE - 1)].Sequence.store(logTail + i, std::memory_order_relaxed);
+  logHead.store(logTail, std::memory_order_relaxed);
+}
+
+// Put a record in the ring buffer - can be called from any task. Returns false if the buffer is full
+inline bool logPush(const LogRecord &Record)
+{
+  uint32_t Position = logHead.load(std::memory_order_relaxed);
+  LogSlot *Slot;
+  for (;;)
+  {
+    Slot = &logSlots[Position & (LOG_BUFFER_SIZE - 1)];
+    int32_t Difference = (int32_t)(Slot->Sequence.load(std::memory_order_acquire) - Position);
+    if (Difference == 0)
+    {
+      if (logHead.compare_exchange_weak(Position, Position + 1, std::memory_order_relaxed))
+        break;
+    }
+    else if (Difference < 0)
+    {
+      logDropped++;
+      return false;
+    }
+    else
+      Position = logHead.load(std::memory_order_relaxed);
+  }
+  Slot->Record = Record;
+  Slot->Sequence.store(Position + 1, std::memory_order_release);
+  return true;
+}
+
+// Take the oldest record from the ring buffer - only called by logDrainTask. Returns false if the buffer is empty
+inline bool logPop(LogRecord &Record)
+{
+  LogSlot *Slot = &logSlots[logTail & (LOG_BUFFER_SIZE - 1)];
+  if ((int32_t)(Slot->Sequence.load(std::memory_order_acquire) - (logTail + 1)) < 0)
+    return false;
+  Record = Slot->Record;
+  Slot->Sequence.store(logTail + LOG_BUFFER_SIZE, std::memory_order_release);
+  logTail++;
+  return true;
+}
+
+#endif
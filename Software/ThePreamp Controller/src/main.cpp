@@ -13,7 +13,7 @@
 **   - Add support for balance control
 **   - DONE - Add support for gain control
 **   - Add support for temperature display
-**   - Add support for MQTT
+**   - DONE - Add support for MQTT
 **   - Add UI for settings
 **   - Shrink Elegant OTA - Remove personalization
 **   - Add trigger control at startup - around line 780
@@ -21,7 +21,7 @@
 */
 
 
-#define VERSION (float)0.995
+#define VERSION (float)0.998
 // IRCONF == 1 Jan 
 // IRCONF == 0 Carsten
 // Remember to change VERSION to update eprom
@@ -45,35 +45,164 @@
 #include <ESPAsyncWebServer.h>
 #include <ElegantOTA.h>
 #include <DNSServer.h>
-#include "SPIFFS.h"
+#include <LittleFS.h>
 #include <AsyncTCP.h>
 #include <WebSerial.h>
 #include <ArduinoJson.h>
+#include <AsyncJson.h>
+#include <mqtt_client.h>
+#include <AsyncUDP.h>
+#include <esp_system.h>
+#include <esp_timer.h>
+#include <esp_sleep.h>
+#include <driver/gpio.h>
+#include <atomic>
 #include "logo.h"
 #include "wifi_QR.h"
+#include "ntc.h"
+#include "log_ring.h"
+#include "udp_sequence.h"
+#include "relays.h"
+#include "sequence.h"
+#include "scheduler.h"
+#include "settings.h"
+#include "state_target.h"
+#include "command_bus.h"
+#include "i2c_bus.h"
+#include "protection.h"
+#include "standby.h"
 
 #define ROTARY_ENCODER_STEPS 4
 
+#undef minimum
+#ifndef minimum
+#define minimum(a, b) ((a) < (b) ? (a) : (b))
+#endif
+
 // To enable debug define DEBUG 1
 // To disable debug define DEBUG 0
 #define DEBUG 1
+
+// Logging
+// Log messages are put in a ring buffer and written to Serial/WebSerial by a low priority task (logDrainTask), so logging never waits for the output
+// LOG_ERROR() ... LOG_TRACE() take a printf format and up to 4 integer arguments. Only the pointer to the format and the raw arguments are stored -
+// the text is formatted by logDrainTask. The format must therefore be a string literal. Messages above LOG_LEVEL are removed at compile time
+// Trace messages are compiled in with DEBUG but only logged while logTraceEnabled is set (the TRACE command of the WebSerial shell)
+// debug()/debugln() print anything Print can print - the text is formatted at once but also written via the ring buffer
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
+#define LOG_LEVEL_TRACE 5 // Ie. every step of a volume ramp
+
 #if DEBUG == 1
-#define debug(x) Serial.print(x); WebSerial.print(x);
-#define debugln(x) Serial.println(x); WebSerial.println(x);
+#define LOG_LEVEL LOG_LEVEL_TRACE
+#else
+#define LOG_LEVEL LOG_LEVEL_NONE
+#endif
+
+LogSlot logSlots[LOG_BUFFER_SIZE]; // The ring buffer (see log_ring.h)
+std::atomic<uint32_t> logHead(0);
+uint32_t logTail = 0;
+std::atomic<uint32_t> logDropped(0);
+volatile bool logTraceEnabled = false;
+
+void logWrite(byte, const char *, int32_t = 0, int32_t = 0, int32_t = 0, int32_t = 0);
+void logDrainTask(void *);
+
+// Print interface for debug()/debugln() - the text is split into records of the ring buffer
+class LogPrint : public Print
+{
+public:
+  size_t write(uint8_t c) override { return write(&c, 1); }
+  size_t write(const uint8_t *buffer, size_t size) override
+  {
+    LogRecord Record;
+    Record.Time = millis();
+    Record.Format = NULL;
+    Record.Level = LOG_LEVEL_DEBUG;
+    for (size_t i = 0; i < size; i += sizeof(Record.Text))
+    {
+      Record.Length = minimum(sizeof(Record.Text), size - i);
+      memcpy(Record.Text, buffer + i, Record.Length);
+      if (!logPush(Record))
+        return i;
+    }
+    return size;
+  }
+  using Print::write;
+};
+
+LogPrint Logger;
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(...) logWrite(LOG_LEVEL_ERROR, __VA_ARGS__)
+#else
+#define LOG_ERROR(...)
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOG_WARN(...) logWrite(LOG_LEVEL_WARN, __VA_ARGS__)
+#else
+#define LOG_WARN(...)
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(...) logWrite(LOG_LEVEL_INFO, __VA_ARGS__)
 #else
+#define LOG_INFO(...)
+#endif
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) logWrite(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define debug(x) Logger.print(x)
+#define debugln(x) Logger.println(x)
+#else
+#define LOG_DEBUG(...)
 #define debug(x)
 #define debugln(x)
 #endif
-
-#undef minimum
-#ifndef minimum
-#define minimum(a, b) ((a) < (b) ? (a) : (b))
+#if LOG_LEVEL >= LOG_LEVEL_TRACE
+#define LOG_TRACE(...) do { if (logTraceEnabled) logWrite(LOG_LEVEL_TRACE, __VA_ARGS__); } while (0)
+#else
+#define LOG_TRACE(...)
 #endif
 
 // Webserver
 AsyncWebServer server(80);
 DNSServer dnsServer;
 
+// Web pages - the files in the filesystem are built from the sources in web/ by scripts/build_web.py: they are gzipped and listed in
+// /manifest.txt with a strong ETag. A browser revalidating a page gets a 304 without the file being read. Stylesheets etc. have the hash
+// in their name and are cached by the browser forever
+#define WEB_ASSET_MAX 16
+
+struct WebAsset
+{
+  char Url[32];
+  char File[32];
+  char ETag[20];
+  char Type[24];
+  bool Immutable;       // The name includes the hash of the content - the browser never has to revalidate
+  uint32_t Size;        // Size of the gzipped file
+  uint32_t Requests;    // Number of requests
+  uint32_t NotModified; // Number of requests answered with 304
+};
+
+WebAsset webAssets[WEB_ASSET_MAX];
+byte webAssetCount = 0;
+uint32_t webBytesServed = 0; // Bytes of files sent (excluding headers)
+bool filesystemReady = false; // Set if the LittleFS filesystem has been mounted
+
+// Served instead of the pages if they are not in the filesystem - allows the WiFi to be configured and the filesystem image to be uploaded
+const char fallbackPage[] PROGMEM = R"rawliteral(<!DOCTYPE html>
+<html><head><title>ThePreAmp</title><meta name="viewport" content="width=device-width, initial-scale=1"></head>
+<body><h1>ThePreAmp</h1>
+<p>The web pages are missing. Upload the filesystem image via <a href="/update">/update</a>.</p>
+<form action="/" method="POST"><p>WiFi (only via the Access Point of ThePreAmp)</p>
+<p><input name="ssid" placeholder="SSID"> <input name="pass" placeholder="Password"></p>
+<p><input name="ip" placeholder="IP-address"> <input name="gateway" placeholder="Router address"></p>
+<p><input type="submit" value="Submit"></p></form>
+</body></html>)rawliteral";
+
 // Search for parameter in HTTP POST request - used for wifi configuration page
 const char *PARAM_INPUT_1 = "ssid";
 const char *PARAM_INPUT_2 = "pass";
@@ -88,9 +217,280 @@ IPAddress localGateway;
 // IPAddress localGateway(192, 168, 1, 1); //hardcoded
 IPAddress subnet(255, 255, 0, 0);
 
-// Timer variables
-unsigned long previousMillis = 0;
-const long interval = 10000; // interval to wait for Wi-Fi connection (milliseconds)
+// WiFi connection manager - the connection is made in the background and is retried with exponential backoff, so the controller is fully usable while offline
+#define WIFI_CONNECT_TIMEOUT 10000  // Time to wait for a connection attempt to succeed (milliseconds)
+#define WIFI_BACKOFF_MIN 2000       // Delay before the first reconnect attempt (milliseconds)
+#define WIFI_BACKOFF_MAX 300000     // Maximum delay between reconnect attempts (milliseconds)
+#define WIFI_RSSI_INTERVAL 5000     // Interval between updates of the cached signal strength (milliseconds)
+
+enum WiFiStates
+{
+  WIFI_STATE_UNCONFIGURED, // No SSID/IP address has been configured
+  WIFI_STATE_CONNECTING,   // Waiting for a connection attempt to succeed
+  WIFI_STATE_CONNECTED,    // Connected and got IP address
+  WIFI_STATE_DISCONNECTED, // Connection lost or attempt failed - a reconnect will be scheduled
+  WIFI_STATE_WAITING       // Waiting for the next reconnect attempt
+};
+
+volatile byte wifiState = WIFI_STATE_UNCONFIGURED;
+volatile bool wifiDisplayUpdatePending = false; // Set when the WiFi state shown on the display has changed
+int8_t wifiRSSI = -127;                         // Cached signal strength - read every WIFI_RSSI_INTERVAL instead of on every display update
+unsigned long mil_WiFiStateChanged;             // millis() when the current connection attempt was started or the wait for the next attempt began
+unsigned long mil_WiFiRSSI;                     // millis() when wifiRSSI was last updated
+unsigned long wifiBackoff = WIFI_BACKOFF_MIN;   // Current delay before the next reconnect attempt
+uint32_t wifiReconnects = 0;                    // Number of reconnect attempts since boot
+
+// WebSocket state push - clients connected to /ws get the full state when they connect and after that only the fields that have changed
+// Changes are collected and sent at most once per WS_FRAME_INTERVAL, so a volume ramp does not flood the clients
+#define WS_FRAME_INTERVAL 50   // Minimum time between two state messages (milliseconds)
+#define WS_MAX_CLIENTS 8       // Maximum number of WebSocket clients (as the default of ESPAsyncWebServer)
+#define WS_MESSAGE_SIZE 192    // Size of the buffer for a state message
+
+AsyncWebSocket ws("/ws");
+
+// The state shown to the WebSocket clients
+struct StateSnapshot
+{
+  byte Mode;           // appMode
+  byte Input;          // RuntimeSettings.CurrentInput
+  byte Volume;         // RuntimeSettings.CurrentVolume
+  byte Muted;          // RuntimeSettings.Muted
+  byte Balance;        // RuntimeSettings.InputLastBal of the current input
+  byte Preset;         // UserSettings.LastRecalledPreset
+  byte Triggers;       // Bit 0 = Trigger 1 on, bit 1 = Trigger 2 on (WarmState.Triggers)
+  byte Sequence;       // sequenceState
+  byte SequenceLeft;   // Steps of the power sequence not yet executed
+  int16_t Temp1;       // Temperature measured by NTC 1 (1/10 degrees Celcius)
+  int16_t Temp2;       // Temperature measured by NTC 2 (1/10 degrees Celcius)
+};
+
+// The WebSocket clients known by the control loop - a client that could not keep up is marked to get the full state when its queue has room again
+struct WsClientState
+{
+  uint32_t Id;      // 0 = unused
+  bool NeedsResync; // Send the full state instead of the next delta
+};
+
+WsClientState wsClients[WS_MAX_CLIENTS];
+StateSnapshot wsLastState;         // The state last sent to the clients
+unsigned long mil_WsFrame;         // millis() when the last frame was handled
+unsigned long mil_WsTemperature;   // millis() when the temperatures were last measured
+int16_t wsTemperature[2];          // Cached temperatures (1/10 degrees Celcius) - measuring takes time so it is only done every TEMP_REFRESH_INTERVAL
+uint32_t wsResyncs = 0;            // Number of full state messages sent because a client asked for it or could not keep up
+
+// MQTT - the state is published as retained topics under Settings.MqttTopic (ie. thepreamp/volume) and commands are received on
+// <topic>/<name>/set. The ESP-IDF MQTT client runs in its own task and reconnects by itself, so neither connecting nor publishing blocks loop()
+// The state is compared at most every MQTT_PUBLISH_INTERVAL and only the topics that changed are published - a fast volume spin gives a
+// few messages with the latest volume, not one message per step
+#define MQTT_PUBLISH_INTERVAL 250    // Minimum time between two publications of the state (milliseconds)
+#define MQTT_RECONNECT_INTERVAL 5000 // Time between two connection attempts (milliseconds)
+#define MQTT_TOPIC_LENGTH 48
+
+esp_mqtt_client_handle_t mqttClient = NULL;
+volatile bool mqttConnected = false;  // Set by the MQTT task while connected to the broker
+volatile bool mqttResync = false;     // Set when (re)connected - all topics are published again as the broker may have lost them
+StateSnapshot mqttLastState;          // The state last published
+unsigned long mil_MqttPublish;        // millis() when the state was last compared
+std::atomic<uint32_t> mqttPublished(0);
+std::atomic<uint32_t> mqttCommands(0);
+
+// UDP control protocol - compact binary packets on UDP_PORT for knob apps and hardware remotes (no connection setup as with HTTP)
+// Every packet starts with an 8 byte header: 'T' 'P', version, type and a 32 bit sequence number chosen by the client (little endian)
+// Requests:  UDP_GET_STATE, UDP_SET_VOLUME (step), UDP_SET_INPUT (1-5), UDP_SET_MUTE (0/1) - one byte of payload for the SET requests
+// Every request is answered with UDP_STATE carrying the same sequence number, a status and the current state. The SET requests are
+// absolute, so repeating one is harmless - a request with a sequence number not newer than the last one from the same client (a
+// duplicate or a packet overtaken by a newer one) is answered but not executed
+// When UDP_ANNOUNCE_ENABLED is set the state is multicast to UDP_MULTICAST_GROUP:UDP_PORT when it changes (and every UDP_ANNOUNCE_HEARTBEAT)
+// scripts/udp_client.py is a client for the protocol
+#define UDP_PORT 5005
+#define UDP_ANNOUNCE_ENABLED true
+#define UDP_MULTICAST_GROUP IPAddress(239, 255, 84, 80)
+#define UDP_ANNOUNCE_INTERVAL 100    // Minimum time between two announcements (milliseconds)
+#define UDP_ANNOUNCE_HEARTBEAT 10000 // Announce the state at least this often (milliseconds)
+#define UDP_VERSION 1
+
+enum UdpTypes
+{
+  UDP_GET_STATE = 0x01,
+  UDP_SET_VOLUME = 0x02,
+  UDP_SET_INPUT = 0x03,
+  UDP_SET_MUTE = 0x04,
+  UDP_STATE = 0x80,   // Reply to a request
+  UDP_ANNOUNCE = 0x81 // Multicast state (sequence number 0)
+};
+
+enum UdpStatus
+{
+  UDP_OK,         // The request has been queued (or was a UDP_GET_STATE)
+  UDP_DUPLICATE,  // The sequence number was not newer than the last one - not executed
+  UDP_INVALID,    // Unknown type or value out of range
+  UDP_BUSY        // The command queue is full
+};
+
+struct __attribute__((packed)) UdpHeader
+{
+  char Magic[2]; // 'T' 'P'
+  byte Version;
+  byte Type;
+  uint32_t Sequence;
+};
+
+struct __attribute__((packed)) UdpStatePacket
+{
+  UdpHeader Header;
+  byte Status;
+  uint32_t Ticket; // The ticket of the command posted for the request (0 if none)
+  byte Mode;
+  byte Input;      // 1-5
+  byte Volume;
+  byte VolumeSteps;
+  byte Muted;
+  byte Balance;
+  int16_t Temp1;   // 1/10 degrees Celcius
+  int16_t Temp2;
+};
+
+AsyncUDP udp;
+UdpClient udpClients[UDP_MAX_CLIENTS]; // The last sequence number of each client (see udp_sequence.h) - only used by the AsyncUDP task
+uint8_t udpNextClient = 0;
+StateSnapshot udpLastState;            // The state last announced
+unsigned long mil_UdpAnnounce;         // millis() when the state was last announced
+std::atomic<uint32_t> udpRequests(0);
+std::atomic<uint32_t> udpDuplicates(0);
+std::atomic<uint32_t> udpInvalid(0);
+
+// Linked controllers - controllers with the same LinkGroup follow the volume, mute and input of the one with LinkRole = LINK_LEADER
+// (ie. one controller per channel of a dual mono setup). The leader multicasts its state to LINK_MULTICAST_GROUP:LINK_PORT when it
+// changes and every LINK_SYNC_INTERVAL. A volume ramp is scheduled LINK_LEAD_TIME ahead: the packet carries the start time in the
+// clock of the leader and the leader starts its own ramp then from rampJob(), so all controllers start the ramp at the same moment
+// The followers estimate the offset to the clock of the leader from the time stamps of the packets - the largest of the last
+// LINK_OFFSET_SAMPLES differences (the packet that was delayed the least). Mute and input changes are applied as they arrive
+#define LINK_PORT 5006
+#define LINK_MULTICAST_GROUP IPAddress(239, 255, 84, 81)
+#define LINK_LEAD_TIME 30       // Time between sending a ramp and starting it (milliseconds) - must cover the multicast delivery over WiFi
+#define LINK_SPIN_LIMIT 5       // A follower applies a ramp from linkApply() when it starts within this time - earlier it is scheduled (milliseconds)
+#define LINK_SYNC_INTERVAL 1000 // The leader sends its state at least this often (milliseconds)
+#define LINK_OFFSET_SAMPLES 8
+#define LINK_VERSION 1
+#define LINK_LEADER 0
+#define LINK_FOLLOWER 1
+
+struct __attribute__((packed)) LinkPacket
+{
+  char Magic[2];       // 'T' 'L'
+  byte Version;
+  byte Group;          // LinkGroup of the leader
+  uint32_t Session;    // Random number chosen by the leader at boot - a new session resets the sequence number and the clock offset
+  uint32_t Sequence;
+  int64_t LeaderTime;  // esp_timer_get_time() of the leader when the packet was sent (microseconds)
+  int64_t StartTime;   // When to start the ramp in the clock of the leader - 0 = apply at once
+  byte Input;          // 0-4
+  byte Volume;
+  byte Muted;
+  byte Reserved;
+  int16_t Attenuation; // Attenuation of the leader after the ramp - a follower ending up at another attenuation counts a mismatch
+};
+
+// The state waiting to be applied by a follower - written by the AsyncUDP task, read by the control loop
+struct LinkState
+{
+  byte Input;
+  byte Volume;
+  byte Muted;
+  int16_t Attenuation;
+  int64_t Start; // Local esp_timer_get_time() to start at - 0 = at once
+};
+
+// The ramp of the leader waiting to be started by rampJob()
+struct VolumeRamp
+{
+  int From;
+  int To;
+  int64_t Start; // esp_timer_get_time() to start at - the start time sent to the followers
+};
+
+AsyncUDP linkUdp;
+bool linkReady = false;
+uint32_t linkSession;                           // Session of this controller
+uint32_t linkSequence = 0;                      // Last sequence number sent
+StateSnapshot linkLastState;                    // The state last sent by the leader
+unsigned long mil_LinkSync;                     // millis() when the leader last sent its state
+uint32_t linkLeaderSession = 0;                 // Session and last sequence number of the leader - only used by the AsyncUDP task
+uint32_t linkLeaderSequence = 0;
+int64_t linkOffsets[LINK_OFFSET_SAMPLES];       // Leader time - local time of the last packets (microseconds)
+byte linkOffsetCount = 0;
+byte linkOffsetNext = 0;
+LinkState linkPending;
+bool linkQueued = false;                        // Set while a CMD_LINK for linkPending is in the command queue
+bool linkFresh = false;                         // Set while linkPending has not been applied - a ramp starting later waits for JOB_LINK
+portMUX_TYPE linkMux = portMUX_INITIALIZER_UNLOCKED;
+VolumeRamp rampPending;
+bool rampScheduled = false;                     // Set while rampPending waits for JOB_RAMP - only used by the control loop
+std::atomic<uint32_t> linkSent(0);
+std::atomic<uint32_t> linkReceived(0);
+std::atomic<uint32_t> linkLost(0);              // Sequence numbers skipped by the leader packets received
+std::atomic<uint32_t> linkLate(0);              // Ramps received after their start time - applied at once
+std::atomic<uint32_t> linkMismatches(0);        // Ramps ending at another attenuation than on the leader
+std::atomic<int32_t> linkOffsetSpread(0);       // Largest - smallest clock offset of the last packets (microseconds)
+
+// How late a follower started the scheduled ramps (microseconds)
+#define LINK_LATENESS_BUCKETS 8
+const uint32_t linkLatenessBounds[LINK_LATENESS_BUCKETS] = {50, 100, 250, 500, 1000, 2500, 5000, 10000};
+std::atomic<uint32_t> linkLatenessCounts[LINK_LATENESS_BUCKETS + 1];
+std::atomic<uint32_t> linkLatenessSumUs(0);
+
+// Metrics - served by /metrics in the Prometheus text format
+// The counters are only updated with relaxed atomic increments (no locks and no interrupts disabled), so they are cheap enough
+// to be left on and may be updated from any task - or from an interrupt as the encoder timer does
+enum MetricDevices
+{
+  DEVICE_MUSES,
+  DEVICE_LEFT_DISPLAY,
+  DEVICE_RIGHT_DISPLAY,
+  DEVICE_MCP23008,
+  DEVICE_ADS1115,
+  DEVICE_EEPROM,
+  DEVICE_COUNT
+};
+
+const char *metricDeviceNames[DEVICE_COUNT] = {"muses72323", "left_display", "right_display", "mcp23008", "ads1115", "24c64"};
+const char *metricDeviceBus[DEVICE_COUNT] = {"spi", "spi", "spi", "i2c", "i2c", "i2c"};
+
+std::atomic<uint32_t> busTransactions[DEVICE_COUNT]; // SPI/I2C transactions per device
+std::atomic<uint32_t> busErrors[DEVICE_COUNT];       // Failed I2C transactions per device (as reported by the drivers)
+std::atomic<uint32_t> busRetries[DEVICE_COUNT];      // I2C transactions repeated because they failed (see I2C_RETRIES)
+std::atomic<uint32_t> eepromWrites(0);
+std::atomic<uint32_t> eepromBytesWritten(0);
+std::atomic<uint32_t> irFramesDecoded(0);            // Frames decoded by the IR receiver
+std::atomic<uint32_t> irFramesRejected(0);           // Decoded frames not matching any learned code
+std::atomic<uint32_t> encoderInterrupts(0);          // Calls of the encoder timer interrupt
+
+// Histogram of the time between two calls of loop() - the upper bounds of the buckets are in microseconds, the last bucket is +Inf
+#define LOOP_TIME_BUCKETS 9
+const uint32_t loopTimeBounds[LOOP_TIME_BUCKETS] = {100, 500, 1000, 5000, 10000, 50000, 100000, 500000, 1000000};
+std::atomic<uint32_t> loopTimeCounts[LOOP_TIME_BUCKETS + 1];
+std::atomic<uint32_t> loopTimeSumMs(0); // Sum of the observed loop times in milliseconds (a sum in microseconds would wrap after 71 minutes)
+uint32_t loopTimeRemainderUs = 0;       // Microseconds not yet added to loopTimeSumMs - only used by loop()
+unsigned long loopTimeLast = 0;         // micros() when loop() was last called
+
+inline void metricBus(byte Device, uint32_t Transactions = 1)
+{
+  busTransactions[Device].fetch_add(Transactions, std::memory_order_relaxed);
+}
+
+// Counts a transaction of a driver returning a status (0 = success)
+inline uint8_t metricBusStatus(byte Device, uint8_t Status)
+{
+  metricBus(Device);
+  if (Status != 0)
+    busErrors[Device].fetch_add(1, std::memory_order_relaxed);
+  return Status;
+}
+
+void observeLoopTime();
+void printMetricHeader(Print &, const char *, const char *, const char *);
+void printMetric(Print &, const char *, const char *, const char *, uint32_t);
+void exportMetrics(Print &);
 
 /* ----- Hardware SPI -----
   GND    ->    GND
@@ -118,8 +518,23 @@ const long interval = 10000; // interval to wait for Wi-Fi connection (milliseco
 #define SPI_RST_RIGHT_DISPLAY_PIN 32
 #define SPI_RST_LEFT_DISPLAY_PIN 33
 
-U8G2_SH1122_256X64_F_4W_HW_SPI right_display(U8G2_R0, SPI_CS_RIGHT_DISPLAY_PIN, SPI_DC_BOTH_DISPLAYS_PIN, SPI_RST_RIGHT_DISPLAY_PIN);
-U8G2_SH1122_256X64_F_4W_HW_SPI left_display(U8G2_R0, SPI_CS_LEFT_DISPLAY_PIN, SPI_DC_BOTH_DISPLAYS_PIN, SPI_RST_LEFT_DISPLAY_PIN);
+// The displays count the calls sending data to the display for /metrics - drawing only changes the buffer in RAM
+class MeteredDisplay : public U8G2_SH1122_256X64_F_4W_HW_SPI
+{
+public:
+  MeteredDisplay(byte device, const u8g2_cb_t *rotation, uint8_t cs, uint8_t dc, uint8_t reset) : U8G2_SH1122_256X64_F_4W_HW_SPI(rotation, cs, dc, reset), Device(device) {}
+  bool begin() { metricBus(Device); return U8G2_SH1122_256X64_F_4W_HW_SPI::begin(); }
+  void sendBuffer() { metricBus(Device); U8G2_SH1122_256X64_F_4W_HW_SPI::sendBuffer(); }
+  void clearDisplay() { metricBus(Device); U8G2_SH1122_256X64_F_4W_HW_SPI::clearDisplay(); }
+  void setContrast(uint8_t value) { metricBus(Device); U8G2_SH1122_256X64_F_4W_HW_SPI::setContrast(value); }
+  void setPowerSave(uint8_t is_enable) { metricBus(Device); U8G2_SH1122_256X64_F_4W_HW_SPI::setPowerSave(is_enable); }
+
+private:
+  byte Device;
+};
+
+MeteredDisplay right_display(DEVICE_RIGHT_DISPLAY, U8G2_R0, SPI_CS_RIGHT_DISPLAY_PIN, SPI_DC_BOTH_DISPLAYS_PIN, SPI_RST_RIGHT_DISPLAY_PIN);
+MeteredDisplay left_display(DEVICE_LEFT_DISPLAY, U8G2_R0, SPI_CS_LEFT_DISPLAY_PIN, SPI_DC_BOTH_DISPLAYS_PIN, SPI_RST_LEFT_DISPLAY_PIN);
 
 /* ----- I2C -----
 GND    ->    GND
@@ -130,7 +545,90 @@ SDA    ->    D21
 #define I2C_SCL_PIN 22 // ESP32 standard pin for SCL
 #define I2C_SDA_PIN 21 // ESP32 standard pin for SDA
 
-Adafruit_ADS1115 ads1115;
+// startADCReading and getLastConversionResults of the ADS1115 driver do not report errors - the conversions are therefore started and
+// read with the transactions below, which return the status of the transaction (0 = success). Not counted here, as the caller counts
+// the transaction with its status
+class MeteredADS1115 : public Adafruit_ADS1115
+{
+public:
+  bool begin() { return metricBusStatus(DEVICE_ADS1115, Adafruit_ADS1115::begin() ? 0 : 1) == 0; }
+
+  // Start a single conversion of the input(s) selected by mux with the gain and data rate set - the comparator is not used
+  uint8_t startConversion(uint16_t mux)
+  {
+    uint16_t Config = ADS1X15_REG_CONFIG_OS_SINGLE | ADS1X15_REG_CONFIG_MODE_SINGLE | ADS1X15_REG_CONFIG_CQUE_NONE | getGain() | getDataRate() | mux;
+    Wire.beginTransmission(ADS1X15_ADDRESS);
+    Wire.write((uint8_t)ADS1X15_REG_POINTER_CONFIG);
+    Wire.write((uint8_t)(Config >> 8));
+    Wire.write((uint8_t)(Config & 0xFF));
+    return Wire.endTransmission();
+  }
+
+  // Read the result of the last conversion to Value
+  uint8_t readConversion(int16_t &Value)
+  {
+    Wire.beginTransmission(ADS1X15_ADDRESS);
+    Wire.write((uint8_t)ADS1X15_REG_POINTER_CONVERT);
+    uint8_t Status = Wire.endTransmission();
+    if (Status != 0)
+      return Status;
+    if (Wire.requestFrom(ADS1X15_ADDRESS, 2) != 2)
+      return 4; // As endTransmission: other error
+    uint8_t High = Wire.read();
+    uint8_t Low = Wire.read();
+    Value = (int16_t)((High << 8) | Low);
+    return 0;
+  }
+};
+
+MeteredADS1115 ads1115;
+bool adsReady = false;
+
+// Temperature sampler - the NTCs on A0 and A1 are measured in turn by temperatureLoop() without waiting for the ADS1115: a conversion
+// is started, and the result is read TEMP_CONVERSION_TIME later on a following pass of loop(). Both are transactions of i2cTask
+// The readings are filtered (median of the last 3 followed by a first order IIR filter) and published in temperatureSnapshot, so
+// the displays, the network and the protection only read a cached value
+#define TEMP_CHANNELS 2
+#define TEMP_SAMPLE_INTERVAL 250          // Time between two conversions - each channel is measured every TEMP_CHANNELS * TEMP_SAMPLE_INTERVAL (milliseconds)
+#define TEMP_SAMPLE_INTERVAL_STANDBY 5000 // Time between two conversions in standby (milliseconds)
+#define TEMP_CONVERSION_TIME 10           // Time to wait for a conversion at 128 samples per second (milliseconds)
+#define TEMP_FILTER_SHIFT 2               // The IIR filter adds 1/4 of the difference to the filtered value for each sample
+
+enum TempPhases
+{
+  TEMP_IDLE,       // Waiting for the next sample
+  TEMP_CONVERTING, // The conversion has been started
+  TEMP_READING     // The result has been asked for - it is in i2cAdcResult when read
+};
+
+struct TempChannel
+{
+  int16_t Raw[3];   // The last ADC values (for the median)
+  byte RawNext;     // The entry of Raw to write next
+  byte RawCount;    // Number of entries of Raw used
+  int32_t Filtered; // ADC value * TEMP_FILTER_SCALE (see ntc.h)
+};
+
+TempChannel tempChannels[TEMP_CHANNELS];
+byte tempChannel = 0;                             // The channel being measured
+byte tempPhase = TEMP_IDLE;                       // TempPhases of the measurement of tempChannel
+unsigned long mil_TempSample;                     // millis() when the last conversion was started
+std::atomic<uint32_t> temperatureSnapshot(0);     // The filtered temperatures (1/10 degrees Celcius) - A0 in the low 16 bits, A1 in the high 16 bits, so both are read at once
+std::atomic<uint32_t> temperatureSamples(0);
+std::atomic<uint32_t> temperatureErrors(0);       // Measurements discarded because the ADS1115 could not be started or read
+std::atomic<uint8_t> temperatureFaults(0);        // Bit 0 = NTC 1, bit 1 = NTC 2 - set while the filtered value is outside the NTC table (see ntcFault)
+
+// Thermal protection - protectionLoop() compares the filtered temperatures with Settings.Trigger1Temp (NTC 1) and Trigger2Temp (NTC 2)
+// every PROTECTION_INTERVAL (JOB_PROTECTION) - see protection.h. A trip mutes the Muses72323 at once and turns the controller off (triggers
+// off, standby) no matter what the user is doing
+// An NTC with a limit that reads outside the NTC table (open or shorted) trips the protection as well, as its temperature is unknown
+// The reaction time is at most two conversions of the channel (TEMP_CHANNELS * TEMP_SAMPLE_INTERVAL), PROTECTION_INTERVAL and one pass of loop()
+#define TEMP_NOT_SIMULATED INT16_MIN
+
+ProtectionHistory protectionHistory[TEMP_CHANNELS];                 // The temperatures of the last evaluations
+volatile byte protectionTripped = 0;                               // The ProtectionCauses while tripped - 0 = not tripped
+std::atomic<uint32_t> protectionTrips(0);
+volatile int16_t tempSimulated[TEMP_CHANNELS] = {TEMP_NOT_SIMULATED, TEMP_NOT_SIMULATED}; // Set by the TEMP shell command to test the protection
 
 #define IR_RECEIVER_INPUT_PIN 15
 IRrecv irrecv(IR_RECEIVER_INPUT_PIN);
@@ -145,14 +643,94 @@ decode_results IRresults;
 #define ROTARY2_CCW_PIN 14
 #define ROTARY2_SW_PIN 35
 #define POWER_CONTROL_PIN 2
-#define INPUT_HT_PASSTHROUGH 0
-#define INPUT_NORMAL 1
-#define INPUT_INACTIVATED 2
+
+// Power sequencer - the external power relay, the triggers and the output relay are switched as a list of timed steps instead of
+// waiting in delay(). A step is executed when its delay after the previous step has passed: sequenceTimer posts a CMD_SEQUENCE, and
+// the control loop executes the step (the relays are on the I2C bus) and starts the timer for the next one. Steps with no delay are
+// executed at once, so the output relay is switched off without delay when the controller is turned off
+// The order of the outputs is set by Settings.PowerUpOrder/PowerDownOrder - a trigger is switched on Trigger1OnDelay/Trigger2OnDelay
+// seconds after the controller was turned on at the earliest
+// The steps are composed by sequenceCompose() (see sequence.h)
+enum SequenceStates
+{
+  SEQUENCE_IDLE,
+  SEQUENCE_POWER_UP,
+  SEQUENCE_POWER_DOWN
+};
+
+SequenceStep sequenceSteps[SEQUENCE_MAX_STEPS];
+byte sequenceCount = 0;          // Number of steps in sequenceSteps
+byte sequenceNext = 0;           // The next step to execute - the sequence is done when sequenceNext == sequenceCount
+int64_t sequenceLast;            // esp_timer_get_time() when the previous step was executed
+volatile byte sequenceState = SEQUENCE_IDLE;
+esp_timer_handle_t sequenceTimer = NULL;
+
+// Scheduler - the work of loop() that is due at a given time rather than on every pass is a job (see jobDefinitions). A periodic job is
+// run every Period milliseconds. A one-shot job (Period 0) is run once when it is due and schedules itself again with jobSchedule()
+// The due times are compared as the signed difference to millis(), so the jobs keep working when millis() wraps around after 49.7 days
+// (a job may be scheduled at most 24.8 days ahead). The jobs that are due are run in the order of their priority
+// When nothing is due loop() sleeps until the next job is - at most SCHEDULER_MAX_SLEEP, as the IR receiver and the encoder buttons
+// are polled - or until a command is posted. Another task can have a job run at once with jobSignal() (ie. when an I2C transaction
+// the job waits for is done), so the job does not have to poll
+#define SCHEDULER_MAX_SLEEP 10 // Longest sleep of loop() (milliseconds)
+#define JOB_CHECK_INTERVAL 1000 // Interval of the timeouts of the user interface (screen saver, inactivity)
+#define STARTUP_LOGO_TIME 1000  // Time the logo is shown when the controller is turned on (milliseconds)
+#define RESTART_DELAY 3000      // Time between a CMD_RESTART and the restart, so the reply reaches the browser (milliseconds)
+
+enum JobPriorities
+{
+  JOB_PRIORITY_HIGH,
+  JOB_PRIORITY_NORMAL,
+  JOB_PRIORITY_LOW,
+  JOB_PRIORITY_COUNT
+};
+
+enum Jobs
+{
+  JOB_PROTECTION,
+  JOB_TEMPERATURE,
+  JOB_SCREEN_SAVER,
+  JOB_INACTIVITY,
+  JOB_LOGO,
+  JOB_RESTART,
+  JOB_RAMP,
+  JOB_LINK,
+  JOB_COUNT
+};
+
+struct JobDefinition
+{
+  const char *Name;
+  void (*Function)();
+  uint32_t Period; // Milliseconds - 0 = one-shot
+  byte Priority;   // JobPriorities
+};
+
+uint32_t jobDue[JOB_COUNT];               // millis() when the job is due
+bool jobScheduled[JOB_COUNT];             // Cleared when a one-shot job has been run
+std::atomic<uint32_t> jobRuns[JOB_COUNT];
+SemaphoreHandle_t loopWake = NULL;        // Given by postCommand() and jobSignal() to wake loop() when it sleeps
+std::atomic<uint32_t> jobSignals(0);      // Bit per job to be run at once - set by jobSignal()
+
+// Low power standby - in standby the encoder timer is stopped, the CPU runs at STANDBY_CPU_FREQUENCY and the WiFi radio uses
+// modem sleep. When WiFi is not connected (and the configuration portal is not active) loop() sleeps in light sleep instead of
+// waiting, and is woken by the IR receiver, the encoder buttons or when the next job is due (see standby.h)
+// An encoder button (polled, or the wake from light sleep) starts the encoder timer. The IR frame that wakes the controller from
+// light sleep may be lost - the next frame of the remote is decoded
+#define NORMAL_CPU_FREQUENCY 240
+#define STANDBY_CPU_FREQUENCY 80     // The lowest frequency the WiFi works at (MHz)
+
+StandbyState standby = {false, false, 0};
+std::atomic<uint32_t> sleepIdleMs(0);            // Time loop() has waited for the next job (milliseconds)
+std::atomic<uint32_t> sleepLightMs(0);           // Time spent in light sleep (milliseconds)
+uint32_t sleepIdleRemainderUs = 0;               // Microseconds not yet added to sleepIdleMs - only used by loop()
+uint32_t sleepLightRemainderUs = 0;
+std::atomic<uint32_t> lightSleepWakeupsGpio(0);  // Wakes from light sleep by the IR receiver or an encoder button
+std::atomic<uint32_t> lightSleepWakeupsTimer(0); // Wakes from light sleep because a job was due
 
 unsigned long mil_On = millis(); // Holds the millis from last power on (or restart)
 bool ScreenSaverIsOn = false; // Used to indicate whether the screen saver is running or not
 unsigned long mil_LastUserInput = millis(); // Used to keep track of the time of the last user interaction (part of the screen saver timing)
-unsigned long mil_onRefreshTemperatureDisplay; // Used to time how often the display of temperatures is updated
 
 // Update intervals for the display/notification of temperatures
 #define TEMP_REFRESH_INTERVAL 10000         // Interval while on
@@ -187,88 +765,30 @@ enum UserInput
   KEY_MUTE,    // IR
   KEY_ON,      // IR
   KEY_OFF,     // IR
-  KEY_PREVIOUS // IR
+  KEY_PREVIOUS, // IR
+  KEY_PRESET,  // Rotary 1 switch held or IR (the preset to recall is held in requestedPreset)
+  KEY_WIFI_SETUP // Rotary 2 switch held
 };
 
 byte UIkey; // holds the last received user input (from rotary encoders or IR)
 byte lastReceivedInput = KEY_NONE;
 unsigned long last_KEY_ONOFF = millis(); // Used to ensure that fast repetition of KEY_ONOFF is not accepted
 
-struct InputSettings
-{
-  byte Active;
-  char Name[8];
-  byte MaxVol;  // The maximum volume allowed for this input in steps
-  byte MinVol;  // The minimum volume allowed for this input in steps
-  byte Gain;
-
-};
-
-// This holds all the settings of the controller
-// It is saved to the I2C EEPROM on the first run and read back into memory on subsequent runs
-// The settings can be changed from the menu and the user can also chose to reset to default values if something goes wrong
-// On startup of the controller it is checked if the EEPROM contains valid data by checking if the Version field equals the VERSION defined by the source code. If they are not the same default values will be written to EEPROM
-// This is created as a union to be able to serialize/deserialize the data when writing and reading to/from the EEPROM
-typedef union
-{
-  struct
-  {
-    char ssid[33];    // Wifi network SSDI
-    char pass[33];    // Wifi network password
-    char ip[16];      // Wifi network assigned IP address
-    char gateway[16]; // Wifi network gateway IP address
-
-    byte VolumeSteps;    // The number of steps of the volume control
-    byte MinAttenuation; // Minimum attenuation in -dB (as 0 db equals no attenuation this is equal to the highest volume allowed)
-    byte MaxAttenuation; // Maximum attenuation in -dB (as -111.5 db is the limit of the Muses72323 this is equal to the lowest volume possible). We only keep this setting as a positive number, and we do also only allow the user to set the value in 1 dB steps
-    byte MaxStartVolume; // If StoreSetLevel is true, then limit the volume to the specified value when the controller is powered on
-    byte MuteLevel;      // The level to be set when Mute is activated by the user. The Mute function of the Muses72323 is activated if 0 is specified
-    byte RecallSetLevel; // Remember/store the volume level for each separate input
-
-    uint64_t IR_ON;               // IR data to be interpreted as ON
-    uint64_t IR_OFF;              // IR data to be interpreted as OFF
-    uint64_t IR_UP;               // IR data to be interpreted as UP
-    uint64_t IR_DOWN;             // IR data to be interpreted as DOWN
-    uint64_t IR_REPEAT;           // IR data to be interpreted as REPEAT (ie Apple remotes sends a specific code, if a key is held down to indicate repeat of the previously sent code
-    uint64_t IR_LEFT;             // IR data to be interpreted as LEFT
-    uint64_t IR_RIGHT;            // IR data to be interpreted as RIGHT
-    uint64_t IR_SELECT;           // IR data to be interpreted as SELECT
-    uint64_t IR_BACK;             // IR data to be interpreted as BACK
-    uint64_t IR_MUTE;             // IR data to be interpreted as MUTE
-    uint64_t IR_PREVIOUS;         // IR data to be interpreted as "switch to previous selected input"
-    uint64_t IR_1;                // IR data to be interpreted as 1 (to select input 1 directly)
-    uint64_t IR_2;                // IR data to be interpreted as 2
-    uint64_t IR_3;                // IR data to be interpreted as 3
-    uint64_t IR_4;                // IR data to be interpreted as 5
-    uint64_t IR_5;                // IR data to be interpreted as 4
-    
-    struct InputSettings Input[5]; // Settings for all 5 inputs
-    bool ExtPowerRelayTrigger;     // Enable triggering of relay for external power (we use it to control the power of the Mezmerize)
-    byte Trigger1Active;           // 0 = the trigger is not active, 1 = the trigger is active
-    byte Trigger1Type;             // 0 = momentary, 1 = latching
-    byte Trigger1OnDelay;          // Seconds from controller power up to activation of trigger. The default delay allows time for the output relay of the Mezmerize to be activated before we turn on the power amps. The selection of an input of the Mezmerize will also be delayed.
-    byte Trigger1Temp;             // Temperature protection: if the temperature is measured to the set number of degrees Celcius (via the LDRs), the controller will attempt to trigger a shutdown of the connected power amps (if set to 0, the temperature protection is not active
-    byte Trigger2Active;           // 0 = the trigger is not active, 1 = the trigger is active
-    byte Trigger2Type;             // 0 = momentary, 1 = latching
-    byte Trigger2OnDelay;          // Seconds from controller power up to activation of trigger. The default delay allows time for the output relay of the Mezmerize to be activated before we turn on the power amps. The selection of an input of the Mezmerize will also be delayed.
-    byte Trigger2Temp;             // Temperature protection: if the temperature is measured to the set number of degrees Celcius (via the LDRs), the controller will attempt to trigger a shutdown of the connected power amps (if set to 0, the temperature protection is not active)
-    byte TriggerInactOffTimer;     // Hours without user interaction before automatic power down (0 = never)
-    byte ScreenSaverActive;        // 0 = the display will stay on/not be dimmed, 1 = the display will be dimmed to the specified level after a specified period of time with no user input
-    byte DisplayOnLevel;           // The contrast level of the display when it is on, 0 = 25%, 1 = 50%, 2 = 75%, 3 = 100%
-    byte DisplayDimLevel;          // The contrast level of the display when screen saver is active. 0 = off, 1 = 3, 2 = 7 ... 32 = 127. If DisplayDimLevel = 0 the display will be turned off when the screen saver is active (to reduce electrical noise)
-    byte DisplayTimeout;           // Number of seconds before the screen saver is activated.
-    byte DisplayVolume;            // 0 = no display of volume, 1 = show step number, 2 = show as -dB
-    byte DisplaySelectedInput;     // 0 = the name of the active input is not shown on the display (ie. if only one input is used), 1 = the name of the selected input is shown on the display
-    byte DisplayTemperature1;      // 0 = do not display the temperature measured by NTC 1, 1 = display in number of degrees Celcious, 2 = display as graphical representation, 3 = display both
-    byte DisplayTemperature2;      // 0 = do not display the temperature measured by NTC 2, 1 = display in number of degrees Celcious, 2 = display as graphical representation, 3 = display both
-    float Version;                 // Used to check if data read from the EEPROM is valid with the compiled version of the code - if not a reset to default settings is necessary and they must be written to the EEPROM
-  };
-  byte data[318]; // Allows us to be able to write/read settings from EEPROM byte-by-byte (to avoid specific serialization/deserialization code)
-} mySettings;
-
 mySettings Settings; // Holds all the current settings
 void setSettingsToDefault(void);
 
+// Settings import via /api/settings - the request body is collected in importBuffer (no String copies) and validated into a staged copy
+// The control loop then applies the bytes that differ between importBase and importedSettings and saves the settings to the EEPROM once
+#define IMPORT_BUFFER_SIZE 2048
+
+char importBuffer[IMPORT_BUFFER_SIZE];
+AsyncWebServerRequest *importRequest = NULL; // The request currently using importBuffer
+int importStatus;                            // HTTP status of the import in importRequest
+const char *importError;                     // The field that failed validation
+mySettings importBase;                       // Settings as they were when the import was validated
+mySettings importedSettings;                 // The validated settings waiting to be applied
+volatile bool importPending = false;         // Set while importedSettings waits to be applied by the control loop
+
 typedef union
 {
   struct
@@ -286,6 +806,130 @@ typedef union
 
 myRuntimeSettings RuntimeSettings;
 
+#define PRESET_COUNT 8 // Number of presets stored in the user settings area of the EEPROM
+
+// A preset holds a complete listening setup (ie. "Vinyl night" or "TV") which can be recalled in a single transition
+struct PresetSettings
+{
+  uint64_t IR;               // IR data to be interpreted as "recall this preset" (0 = no IR code assigned)
+  char Name[12];             // Name of the preset - an empty name marks the preset as unused
+  byte Input;                // The input to select
+  byte Volume;               // The volume step to set
+  byte Balance;              // The balance to set: 127 = no balance shift (values < 127 = shift balance to the left channel, values > 127 = shift balance to the right channel)
+  byte Gain;                 // The gain of the Muses72323 to set: 0 = 0 dB, 1 = 3 dB ... 7 = 21 dB
+  byte Triggers;             // Bit 0 = Trigger 1 on, bit 1 = Trigger 2 on
+  byte DisplayVolume;        // As Settings.DisplayVolume
+  byte DisplayOnLevel;       // As Settings.DisplayOnLevel
+  byte DisplaySelectedInput; // As Settings.DisplaySelectedInput
+};
+
+// This holds the presets - it is stored in the user settings area of the EEPROM (after Settings and RuntimeSettings)
+typedef union
+{
+  struct
+  {
+    struct PresetSettings Preset[PRESET_COUNT]; // The presets
+    byte LastRecalledPreset;                    // The preset recalled most recently (used to step through the presets with a long press on rotary 1)
+    float Version;                              // Used to check if data read from the EEPROM is valid with the compiled version of the code - if not the presets are reset to default
+  };
+  byte data[264]; // Allows us to be able to write/read settings from EEPROM byte-by-byte (to avoid specific serialization/deserialization code)
+} myUserSettings;
+
+myUserSettings UserSettings;
+byte requestedPreset; // The preset to recall when KEY_PRESET is received
+
+// The display settings in use: copied from Settings when they are read or changed, and set by recallPreset()
+// A preset never changes Settings - those would be saved to the EEPROM by the next writeSettingsToEEPROM()
+struct DisplayOptions
+{
+  byte Volume;        // As Settings.DisplayVolume
+  byte OnLevel;       // As Settings.DisplayOnLevel
+  byte SelectedInput; // As Settings.DisplaySelectedInput
+};
+
+DisplayOptions displayOptions;
+
+// Targets received via /api/v1/state are merged into apiTarget until the control loop applies them - a slider drag ends up as a few
+// transitions to the latest position instead of one per request. A new transition is started at most once per API_TRANSITION_INTERVAL
+#define API_TRANSITION_INTERVAL 50 // Minimum time between two transitions requested via the API (milliseconds)
+
+TargetSlot apiTarget;                                // The merged target waiting to be applied (see state_target.h)
+portMUX_TYPE apiTargetMux = portMUX_INITIALIZER_UNLOCKED;
+unsigned long mil_LastTransition;                    // millis() when the last API transition was applied
+
+// Command bus
+// The control loop is the single owner of the audio state (RuntimeSettings, the SPI bus, the MCP23008 etc.). The webserver, WebSerial and other tasks
+// must not change it directly - they post a command to the queue and get a ticket back at once. loop() executes the commands in the order they were posted
+#define COMMAND_QUEUE_LENGTH 16
+
+QueueHandle_t commandQueue = NULL;
+SemaphoreHandle_t commandLock = NULL; // Held by the posting task while it issues a ticket and queues the command (see command_bus.h)
+
+bool commandQueueSend(const Command &);
+bool commandQueuePeek(Command &);
+void commandQueuePop();
+void commandQueueLock(bool);
+
+CommandBus commandBus = {commandQueueSend, commandQueuePeek, commandQueuePop, commandQueueLock, {0}, {0}, 0};
+
+VolumeSlot pendingVolume = {-1, 0}; // Volume requests from MQTT and UDP waiting for a CMD_VOLUME (see postVolume)
+
+// IR learning - started by CMD_IR_LEARN. The next code received is stored in the field instead of being handled as user input
+#define IR_LEARN_TIMEOUT 10000 // Time to wait for a code (milliseconds)
+
+int irLearnField = -1;         // Index in SettingFields of the field to learn - -1 when not learning
+unsigned long mil_IrLearn;     // millis() when learning was started
+
+// WebSerial command shell
+// A received line is split into words in place (no String or heap allocation) and looked up in ShellCommands. The arguments are checked
+// against the schema of the command before its handler is called - one character per argument: N = number, W = word, lower case = optional
+// Commands that change the state are posted to the command bus like the commands from the web API
+#define SHELL_LINE_LENGTH 96
+#define SHELL_MAX_ARGS 4
+#define EEPROM_SIZE 8192    // 24C64
+#define EEPROM_DUMP_MAX 256 // Maximum number of bytes in one EEPROM hexdump
+
+struct ShellArg
+{
+  const char *Text;
+  long Number; // The value of a number argument
+};
+
+struct ShellCommand
+{
+  const char *Name;
+  const char *Schema; // The arguments (see above)
+  void (*Handler)(byte, const ShellArg *);
+  const char *Usage;  // Arguments as shown by HELP
+  const char *Help;
+};
+
+char shellLine[SHELL_LINE_LENGTH]; // Only used by shellExecute, which is always called from the AsyncTCP task
+
+// The live audio state is kept in RTC memory, which survives a warm restart (ESP.restart(), OTA update or watchdog reset) but not a power cycle
+// The relays and the Muses72323 keep their state while the ESP32 restarts, so setup() writes this state back to them before doing anything else - that way a restart is not audible
+// It is updated every time the state of the relays or the Muses72323 is changed
+typedef struct
+{
+  uint32_t Magic;          // WARM_STATE_MAGIC if the state has been written since power on
+  byte RelayMask;          // The outputs of the MCP23008: bit 0 = mute relay, bit 1-2 = triggers, bit 3-7 = input relays
+  byte PowerOn;            // The state of POWER_CONTROL_PIN
+  byte Gain;               // The gain set on the Muses72323
+  byte MusesMuted;         // True if the Mute function of the Muses72323 is active
+  int16_t Attenuation;     // The attenuation set on the Muses72323 (if not muted)
+  byte Balance;            // The balance applied to Attenuation (see musesSetVolume)
+  byte AppMode;            // The active app mode
+  byte CurrentInput;       // As RuntimeSettings
+  byte CurrentVolume;      // As RuntimeSettings
+  byte Muted;              // As RuntimeSettings
+  byte PrevSelectedInput;  // As RuntimeSettings
+  byte Triggers;           // Bit 0 = Trigger 1 on, bit 1 = Trigger 2 on - a momentary trigger is on from its on pulse until its off pulse
+  uint32_t Checksum;       // Checksum of the fields above - used to check if the data survived the restart
+} myWarmState;
+
+#define WARM_STATE_MAGIC 0x50726541 // "PreA"
+RTC_NOINIT_ATTR myWarmState WarmState;
+
 // Setup Rotary encoders ------------------------------------------------------
 ClickEncoder *encoder1 = new ClickEncoder(ROTARY1_CW_PIN, ROTARY1_CCW_PIN, ROTARY1_SW_PIN, ROTARY_ENCODER_STEPS, LOW);
 ClickEncoder::Button button1;
@@ -306,6 +950,7 @@ void IRAM_ATTR timerIsr()
 {
   encoder1->service();
   encoder2->service();
+  encoderInterrupts.fetch_add(1, std::memory_order_relaxed);
   portENTER_CRITICAL_ISR(&timerMux);
   interruptCounter++;
   portEXIT_CRITICAL_ISR(&timerMux);
@@ -326,22 +971,166 @@ void setupRotaryEncoders()
 }
 
 // Setup Muses72323 -----------------------------------------------------------
-Muses72323 muses(0, SPI_CS_MUSES_PIN); // Run at 500kHz
+// Every write to the Muses72323 is one SPI transaction - setting the volume or muting takes two (left and right channel)
+class MeteredMuses72323 : public Muses72323
+{
+public:
+  using Muses72323::Muses72323;
+  void setVolume(volume_t left, volume_t right) { metricBus(DEVICE_MUSES, 2); Muses72323::setVolume(left, right); }
+  void setGain(data_t gain) { metricBus(DEVICE_MUSES); Muses72323::setGain(gain); }
+  void mute() { metricBus(DEVICE_MUSES, 2); Muses72323::mute(); }
+  void setExternalClock(bool enabled) { metricBus(DEVICE_MUSES); Muses72323::setExternalClock(enabled); }
+  void setZeroCrossingOn(bool enabled) { metricBus(DEVICE_MUSES); Muses72323::setZeroCrossingOn(enabled); }
+};
+
+MeteredMuses72323 muses(0, SPI_CS_MUSES_PIN); // Run at 500kHz
+#define MUSES_MIN_VOLUME -447 // The lowest volume of the Muses72323 (-111.75 dB)
 
 // Setup Relay Controller------------------------------------------------------
-Adafruit_MCP23008 relayController;
+// pinMode and digitalWrite read the register before writing it - two I2C transactions. The relays are therefore only set with
+// writeRegister (one transaction) from the state kept in WarmState.RelayMask - see relaySet()
+#define MCP23008_ADDRESS 0x20
+#define MCP23008_IODIR 0x00
+#define MCP23008_GPIO 0x09
+
+class MeteredMCP23008 : public Adafruit_MCP23008
+{
+public:
+  void begin() { metricBus(DEVICE_MCP23008); Adafruit_MCP23008::begin(); }
+  void pinMode(uint8_t pin, uint8_t mode) { metricBus(DEVICE_MCP23008, 2); Adafruit_MCP23008::pinMode(pin, mode); }
+  void digitalWrite(uint8_t pin, uint8_t value) { metricBus(DEVICE_MCP23008, 2); Adafruit_MCP23008::digitalWrite(pin, value); }
+  void writeGPIO(uint8_t value) { metricBus(DEVICE_MCP23008); Adafruit_MCP23008::writeGPIO(value); }
+
+  // Write a register (ie. the direction of all pins or all outputs at once) - returns the status of the transaction (0 = success)
+  // Not counted here, as the caller counts the transaction with its status
+  uint8_t writeRegister(uint8_t reg, uint8_t value)
+  {
+    Wire.beginTransmission(MCP23008_ADDRESS);
+    Wire.write(reg);
+    Wire.write(value);
+    return Wire.endTransmission();
+  }
+};
+
+MeteredMCP23008 relayController;
 
 // Setup EEPROM ---------------------------------------------------------------
 #define EEPROM_Address 0x50
 extEEPROM eeprom(kbits_64, 1, 32); // Set to use 24C64 Eeprom - look in the datasheet for capacity in kbits (kbits_64) and page size in bytes (32) if you use another type 
 
+// I2C bus manager - the EEPROM, the MCP23008 and the ADS1115 share the I2C bus. When setup() is done the bus is only used by i2cTask,
+// which executes the transactions posted to two queues: i2cHighQueue for the relays and i2cLowQueue for the EEPROM and the ADS1115 (see
+// i2c_bus.h for the order they are served in). Before i2cStart() the transactions are executed at once by the task posting them
+// The bus clock is set once for all devices (I2C_CLOCK). A failed transaction is retried I2C_RETRIES times
+#define I2C_CLOCK extEEPROM::twiClock400kHz
+#define I2C_RETRIES 2
+#define I2C_HIGH_QUEUE_LENGTH 8
+#define I2C_LOW_QUEUE_LENGTH 32    // Room for all settings, runtime settings and presets (27 pages) at once
+#define I2C_POST_TIMEOUT 1000      // Time to wait for room in a queue before a transaction is dropped (milliseconds)
+#define I2C_ADC_PENDING INT32_MIN      // i2cAdcResult while the result of the ADS1115 has not been read
+#define I2C_ADC_ERROR (INT32_MIN + 1)  // i2cAdcResult if the conversion could not be started or read
+
+enum I2CTransactionTypes
+{
+  I2C_SYNC,         // Nothing - used by i2cSync() to wait for the transactions posted before it
+  I2C_RELAYS,       // Write Data[0] to the outputs of the MCP23008
+  I2C_EEPROM_READ,  // Read Length bytes from Address to Target
+  I2C_EEPROM_WRITE, // Write Length bytes of Data to Address (within one page)
+  I2C_ADC_START,    // Start a single conversion of the ADS1115 - Address is the multiplexer setting. Sets i2cAdcResult to I2C_ADC_ERROR if it fails
+  I2C_ADC_READ      // Read the result of the conversion to i2cAdcResult (I2C_ADC_ERROR if it fails)
+};
+
+struct I2CTransaction
+{
+  byte Type;                // I2CTransactionTypes
+  byte Length;
+  uint16_t Address;
+  byte *Target;
+  TaskHandle_t Waiter;      // Task notified when the transaction is done (or NULL)
+  int64_t Posted;           // esp_timer_get_time() when posted
+  byte Data[I2C_PAGE_SIZE];
+};
+
+QueueHandle_t i2cHighQueue = NULL;
+QueueHandle_t i2cLowQueue = NULL;
+SemaphoreHandle_t i2cPending = NULL;                 // Counts the transactions in the queues
+std::atomic<int32_t> i2cAdcResult(I2C_ADC_PENDING);
+std::atomic<uint32_t> i2cDropped(0);                 // Transactions dropped because a queue stayed full
+std::atomic<uint32_t> i2cWaitMaxUs[2];               // Longest time a transaction has waited in i2cHighQueue/i2cLowQueue (microseconds)
+volatile bool i2cBusy = false;                       // Set while i2cTask executes a transaction
+
+// Boot stages - used for the boot time report printed when the controller has started
+// The times are micros() - from the start of the firmware, so the time spent in the bootloader before it is not included
+// BOOT_AUDIO ends when the input and the volume are set and the power sequence is started - the output relay follows after the delays
+// of the sequence
+#define BOOT_AUDIO_TARGET 300 // Time from the start of the firmware until BOOT_AUDIO ends on a cold start (milliseconds)
+
+enum BootStages
+{
+  BOOT_BUS,
+  BOOT_WARM_RESTART,
+  BOOT_RELAYS,
+  BOOT_SETTINGS,
+  BOOT_MUSES,
+  BOOT_AUDIO,
+  BOOT_INPUTS,
+  BOOT_DISPLAYS,
+  BOOT_FILESYSTEM,
+  BOOT_WIFI,
+  BOOT_WEBSERVER,
+  BOOT_STAGE_COUNT
+};
+
+const char *bootStageNames[BOOT_STAGE_COUNT] = {"SPI/I2C", "Warm restart", "Relays", "Settings", "Muses72323", "Audio", "User input", "Displays", "Filesystem", "WiFi", "Webserver"};
+unsigned long bootStageStart[BOOT_STAGE_COUNT]; // micros() at the start of each boot stage
+unsigned long bootStageDone[BOOT_STAGE_COUNT];  // micros() at the end of each boot stage (0 = the stage has not been run)
+
+volatile bool settingsWereReset = false;        // Set if the settings in EEPROM were invalid and have been reset to default
+volatile bool displaysReady = false;            // Set by displayInitTask when the displays are initialized
+volatile bool displayRefreshPending = false;    // Set by displayInitTask to make loop() redraw the displays
+bool logoShown = false;                         // Set while startUp() shows the logo - the displays are not updated until logoJob() ends it
+bool restartPending = false;                    // Set by CMD_RESTART - restartJob() restarts the controller
+volatile bool networkReady = false;             // Set when the webserver has been started in WiFi station mode
+volatile bool provisioningActive = false;          // Set while the Access Point of the WiFi configuration portal is running
+volatile bool provisioningScreenRequested = false; // Set to make loop() show the QR code for the WiFi configuration portal
+bool provisioningScreenShown = false;              // Set while the QR code is shown
+volatile bool bootComplete = false;             // Set by networkInitTask when all boot stages have been run
+bool bootReportPrinted = false;
+
 // Function declarations
 void setup();
-void initSPIFFS();
+void displayInitTask(void *);
+void networkInitTask(void *);
+void bootStageBegin(byte);
+void bootStageEnd(byte);
+void printBootReport();
+void initFilesystem();
 bool initWiFi();
+bool isWiFiConfigured();
+void wifiConnect();
+void wifiEvent(WiFiEvent_t, WiFiEventInfo_t);
+void wifiManagerLoop();
+byte rssiLevel(int);
 void setupWIFIsupport();
+void setupProvisioningPortal();
+bool loadWebManifest();
+int findWebAsset(const char *);
+void serveWebAsset(AsyncWebServerRequest *, int);
+void startProvisioning();
+void stopProvisioning();
+void showProvisioningScreen();
+void hideProvisioningScreen();
+void dropProvisioningScreen();
 void startUp();
 void loop();
+void eepromRead(unsigned long, byte *, unsigned int);
+void eepromWrite(unsigned long, byte *, unsigned int);
+void i2cStart();
+bool i2cPost(I2CTransaction &, bool, bool = false);
+void i2cSync();
+void i2cExecute(I2CTransaction &);
+bool i2cReceive(bool, void *);
+void i2cTask(void *);
 void writeSettingsToEEPROM();
 void readSettingsFromEEPROM();
 void writeDefaultSettingsToEEPROM();
@@ -350,11 +1139,35 @@ void readRuntimeSettingsFromEEPROM();
 void readUserSettingsFromEEPROM();
 void writeUserSettingsToEEPROM();
 void setSettingsToDefault();
+void setUserSettingsToDefault();
 void setVolume(int16_t);
+void rampVolume(int fromAttenuation, int toAttenuation);
+void rampRun(int fromAttenuation, int toAttenuation);
+void rampCancel();
 void left_display_update();
 void right_display_update();
 void drawSignalStrength(int);
 float getTemperature(uint8_t pinNmbr);
+int16_t readTemperature(byte);
+void temperatureLoop();
+void protectionLoop();
+void screenSaverJob();
+void inactivityJob();
+void logoJob();
+void restartJob();
+void rampJob();
+extern const JobDefinition jobDefinitions[JOB_COUNT];
+void jobSchedule(byte, unsigned long);
+void jobSignal(byte);
+void schedulerStart();
+void schedulerRun();
+void schedulerSleep();
+void standbyLoop();
+void standbyWake();
+byte standbyBusy();
+void standbyLightSleep(long);
+void addSleepTime(std::atomic<uint32_t> &, uint32_t &, int64_t);
+void protectionTrip(byte);
 void drawTemperatureMeasurements(void);
 byte getUserInput();
 void toAppNormalMode();
@@ -370,50 +1183,131 @@ void muteOutput();
 void unmuteOutput();
 bool changeBalance();
 void displayBalance(byte);
+void musesSetVolume(int, byte);
+void displayOptionsFromSettings();
+void setDisplayContrast();
 int calculateAttenuation(byte logicalStep, byte maxLogicalSteps, byte minAttenuation_dB, byte maxAttenuation_dB);
+void sequenceTimerCallback(void *);
+void sequenceAddTrigger(byte, bool, bool, uint32_t);
+void sequenceStart(byte);
+void sequenceRun();
 void setTrigger1On();
 void setTrigger1Off();
 void setTrigger2On();
 void setTrigger2Off();
 void unmuteOutput();
 void muteOutput();
-String exportSettingsAsJson();
+void relaySet(byte, byte, bool = false);
+void relaySwitch(byte, byte);
+void relayWrite(uint8_t, bool);
+void relayPause(uint32_t);
+void saveWarmState();
+uint32_t calculateWarmStateChecksum();
+bool restoreWarmState();
+void resumeAfterWarmRestart();
+boolean applyTransition(StateTarget);
+boolean recallPreset(uint8_t);
+boolean storePreset(uint8_t, const char *);
+byte getNextPreset();
+void exportSettings(Print &);
+void printSettingValue(Print &, const SettingField *);
+int findSettingField(const char *);
+void printJsonString(Print &, const char *);
+void handleSettingsImport(AsyncWebServerRequest *, uint8_t *, size_t, size_t, size_t);
+int queueSettings(const mySettings &, const mySettings &, byte);
+void applyImportedSettings();
+uint32_t postCommand(byte, int32_t, byte, const char * = NULL);
+void onWebSocketEvent(AsyncWebSocket *, AsyncWebSocketClient *, AwsEventType, void *, uint8_t *, size_t);
+StateSnapshot getStateSnapshot();
+size_t buildStateMessage(const StateSnapshot &, const StateSnapshot *, char *, size_t);
+void refreshTemperatures();
+void mqttStart();
+void mqttEvent(void *, esp_event_base_t, int32_t, void *);
+void mqttHandleCommand(const char *, int, const char *, int);
+void mqttPublish(const char *, const char *);
+void mqttLoop();
+void udpStart();
+void udpBuildState(UdpStatePacket &, byte, uint32_t, byte, uint32_t);
+void udpHandlePacket(AsyncUDPPacket &);
+void udpLoop();
+void linkStart();
+void linkSend(int64_t, int16_t);
+void linkWaitUntil(int64_t);
+bool linkIsLeader();
+bool linkDue(int64_t);
+void linkHandlePacket(AsyncUDPPacket &);
+void linkLoop();
+void linkApply();
+void webSocketLoop();
+byte processCommands(bool);
+void executeCommand(const Command &);
+void sendTicket(AsyncWebServerRequest *, uint32_t);
+void handleStatePatch(AsyncWebServerRequest *, JsonVariant &);
+uint32_t postTarget(const StateTarget &, byte);
+uint32_t postVolume(byte, byte);
+void shellReport(uint32_t);
+void shellHelp(byte, const ShellArg *);
+void shellGet(byte, const ShellArg *);
+void shellSet(byte, const ShellArg *);
+void shellVolume(byte, const ShellArg *);
+void shellInput(byte, const ShellArg *);
+void shellPreset(byte, const ShellArg *);
+void shellMute(byte, const ShellArg *);
+void shellUnmute(byte, const ShellArg *);
+void shellKey(byte, const ShellArg *);
+void shellIrLearn(byte, const ShellArg *);
+void shellMetrics(byte, const ShellArg *);
+void shellLink(byte, const ShellArg *);
+void shellWebStats(byte, const ShellArg *);
+void shellTrace(byte, const ShellArg *);
+void shellEEPROM(byte, const ShellArg *);
+void shellTemp(byte, const ShellArg *);
+char *shellNextWord(char *&);
+void shellExecute(uint8_t *, size_t);
+void dumpEEPROM(Print &, uint16_t, uint16_t);
 
 void setup() {
   // Serial port for debugging purposes
   #if DEBUG == 1
     Serial.begin(115200);
   #endif
+  #if LOG_LEVEL > LOG_LEVEL_NONE
+    logInit();
+    xTaskCreatePinnedToCore(logDrainTask, "logDrain", 3072, NULL, tskIDLE_PRIORITY, NULL, 0);
+  #endif
   
+  // The boot is split into stages: the audio critical hardware (relays, settings and Muses72323) is brought up first by setup() itself
+  // The displays and the filesystem/network are brought up by background tasks while setup() continues, so the audio does not wait for them
   //delay(5000); // Allow power supply to stabilize before starting up the controller
+  bootStageBegin(BOOT_BUS);
   SPI.begin();
   Wire.begin();
-
-  right_display.setBusClock(4000000);
-  right_display.begin();
-  right_display.setFont(u8g2_font_inb63_mn); 
-  
-  left_display.setBusClock(4000000);
-  left_display.begin();
-  left_display.setFont(u8g2_font_inb63_mn);
-  
-  setupRotaryEncoders();
-  
-  relayController.begin();
-  // Define all pins as OUTPUT and disable all relays
-  for (byte pin = 0; pin <= 7; pin++)
+  // Also sets the bus clock for the MCP23008 and the ADS1115
+  metricBusStatus(DEVICE_EEPROM, eeprom.begin(I2C_CLOCK));
+  bootStageEnd(BOOT_BUS);
+
+  // After a warm restart the relays and the Muses72323 are set back to the state they had before the restart - before any display or WiFi work
+  bootStageBegin(BOOT_WARM_RESTART);
+  bool WarmRestart = restoreWarmState();
+  bootStageEnd(BOOT_WARM_RESTART);
+  if (WarmRestart)
   {
-    relayController.pinMode(pin, OUTPUT);
-    relayController.digitalWrite(pin, LOW);
+    debug("Warm restart - time to audio: "); debug(millis()); debugln(" ms");
   }
-
-  ads1115.setGain(GAIN_ONE);        // 1x gain   +/- 4.096V  1 bit = 2mV      0.125mV
-  ads1115.begin();
   
-  // Start IR reader
-  irrecv.enableIRIn();
+  bootStageBegin(BOOT_RELAYS);
+  if (!WarmRestart)
+  {
+    memset(&WarmState, 0, sizeof(WarmState));
+    relayController.begin();
+    // Disable all relays and define all pins as OUTPUT
+    metricBusStatus(DEVICE_MCP23008, relayController.writeRegister(MCP23008_GPIO, 0));
+    metricBusStatus(DEVICE_MCP23008, relayController.writeRegister(MCP23008_IODIR, 0x00));
+  }
+  bootStageEnd(BOOT_RELAYS);
 
   // Read setting from EEPROM
+  bootStageBegin(BOOT_SETTINGS);
   readSettingsFromEEPROM();
   readRuntimeSettingsFromEEPROM();
 
@@ -423,10 +1317,7 @@ void setup() {
     debugln("Eeprom settings are invalid - writing default settings to EEPROM");
     debug("Settings.Version: "); debug(Settings.Version); debug(" != "); debugln((float)VERSION);
     debug("RuntimeSettings.Version: "); debug(RuntimeSettings.Version); debug(" != "); debugln((float)VERSION);
-    right_display.clearBuffer();
-    right_display.drawStr(0, 63, "Reset");
-    right_display.sendBuffer();
-    delay(2000);
+    settingsWereReset = true; // "Reset" is shown by displayInitTask
     writeDefaultSettingsToEEPROM();
   }
   else
@@ -435,1139 +1326,3864 @@ void setup() {
     debug("Settings.Version: "); debug(Settings.Version); debug(" = "); debugln((float)VERSION);
     debug("RuntimeSettings.Version: "); debug(RuntimeSettings.Version); debug(" = "); debugln((float)VERSION);
   }
-  
-  setupWIFIsupport();
-
-  // Set pin mode for control of power relay
-  pinMode(POWER_CONTROL_PIN, OUTPUT);
-
-  muses.begin();
-  muses.setExternalClock(false);
-  muses.setZeroCrossingOn(true);
-    
-  startUp();
-}
 
-// Initialize SPIFFS
-void initSPIFFS()
-{
-  if (!SPIFFS.begin(true))
+  // The presets are kept apart from the other settings - if they are invalid only the presets are reset to default
+  readUserSettingsFromEEPROM();
+  if (UserSettings.Version != (float)VERSION)
   {
-    debugln("An error has occurred while mounting SPIFFS");
+    debugln("Eeprom presets are invalid - writing default presets to EEPROM");
+    setUserSettingsToDefault();
+    writeUserSettingsToEEPROM();
   }
-  debugln("SPIFFS mounted successfully");
-}
 
-// Initialize WiFi
-bool initWiFi()
-{ 
-  if (Settings.ssid == "" || Settings.ip == "")
+  // The state in RTC memory is newer than the runtime settings last saved to the EEPROM
+  if (WarmRestart)
   {
-    debugln("Undefined SSID or IP address.");
-    return false;
+    RuntimeSettings.CurrentInput = WarmState.CurrentInput;
+    RuntimeSettings.CurrentVolume = WarmState.CurrentVolume;
+    RuntimeSettings.Muted = WarmState.Muted;
+    RuntimeSettings.PrevSelectedInput = WarmState.PrevSelectedInput;
+    RuntimeSettings.InputLastVol[RuntimeSettings.CurrentInput] = RuntimeSettings.CurrentVolume;
   }
+  displayOptionsFromSettings();
+  bootStageEnd(BOOT_SETTINGS);
 
-  WiFi.mode(WIFI_STA);
-  WiFi.setTxPower(WIFI_POWER_19_5dBm); // Set maximum transmit power
-  localIP.fromString(Settings.ip);
-  localGateway.fromString(Settings.gateway);
+  // The command queue must exist before the webserver can post to it
+  commandLock = xSemaphoreCreateMutex();
+  commandQueue = xQueueCreate(COMMAND_QUEUE_LENGTH, sizeof(Command));
 
-  if (!WiFi.config(localIP, localGateway, subnet))
-  {
-    debugln("STA Failed to configure");
-    return false;
-  }
+  // The timer of the power sequencer only posts a command - the steps are executed by the control loop
+  esp_timer_create_args_t SequenceTimerArgs = {};
+  SequenceTimerArgs.callback = sequenceTimerCallback;
+  SequenceTimerArgs.name = "sequence";
+  esp_timer_create(&SequenceTimerArgs, &sequenceTimer);
 
-  WiFi.begin(Settings.ssid, Settings.pass);
-  
-  debug("Connecting to WiFi... "); debugln(Settings.ssid);
+  schedulerStart();
 
-  unsigned long currentMillis = millis();
-  previousMillis = currentMillis;
+  // Displays and network only depend on the settings - start them in the background
+  xTaskCreatePinnedToCore(displayInitTask, "displayInit", 4096, NULL, 1, NULL, 1);
+  xTaskCreatePinnedToCore(networkInitTask, "networkInit", 8192, NULL, 1, NULL, 0);
 
-  while (WiFi.status() != WL_CONNECTED)
+  if (WarmRestart)
   {
-    currentMillis = millis();
-    if (currentMillis - previousMillis >= interval)
-    {
-      debugln("Failed to connect.");
-      return false;
-    }
+    resumeAfterWarmRestart();
   }
-  debug("Connected to WiFi. IP: "); debugln(WiFi.localIP());
-  return true;
-}
-
-void setupWIFIsupport()
-{
-  initSPIFFS();
-
-  if (initWiFi())
+  else
   {
-    // Web Server Root URL
-    server.on("/", HTTP_GET, [](AsyncWebServerRequest *request)
-              { request->send(SPIFFS, "/index.html", "text/html"); });
-    
-    // Web : InputSelector
-    server.on("/INPUT1", HTTP_GET, [](AsyncWebServerRequest *request)
-              { request->send(200, "text/plain", String(setInput(0)));});
-
-    server.on("/INPUT2", HTTP_GET, [](AsyncWebServerRequest *request)
-              { request->send(200, "text/plain", String(setInput(1)));});
+    // Set pin mode for control of power relay
+    bootStageBegin(BOOT_MUSES);
+    pinMode(POWER_CONTROL_PIN, OUTPUT);
+
+    muses.begin();
+    muses.setExternalClock(false);
+    muses.setZeroCrossingOn(true);
+    bootStageEnd(BOOT_MUSES);
+      
+    bootStageBegin(BOOT_AUDIO);
+    startUp();
+    bootStageEnd(BOOT_AUDIO);
+    debug("Cold start - time to audio: "); debug(millis()); debugln(" ms");
+  }
 
-    server.on("/INPUT3", HTTP_GET, [](AsyncWebServerRequest *request)
-              { request->send(200, "text/plain", String(setInput(2)));});
+  // User input is not needed before the audio is restored
+  bootStageBegin(BOOT_INPUTS);
+  setupRotaryEncoders();
 
-    server.on("/INPUT4", HTTP_GET, [](AsyncWebServerRequest *request)
-              { request->send(200, "text/plain", String(setInput(3)));});
+  ads1115.setGain(GAIN_ONE);        // 1x gain   +/- 4.096V  1 bit = 2mV      0.125mV
+  ads1115.setDataRate(RATE_ADS1115_128SPS);
+  adsReady = ads1115.begin();
+  
+  // Start IR reader
+  irrecv.enableIRIn();
+  bootStageEnd(BOOT_INPUTS);
 
-    server.on("/INPUT5", HTTP_GET, [](AsyncWebServerRequest *request)
-              { request->send(200, "text/plain", String(setInput(4)));});
+  // From now on the I2C bus is only used by i2cTask
+  i2cStart();
+}
 
-    server.on("/MUTE", HTTP_GET, [](AsyncWebServerRequest *request)
-              { muteOutput(); request->send(200, "text/plain", "Mute");});
+// Background task started by setup(): initializes the displays and shows the logo (or "Reset" if the settings were reset to default)
+// Until displaysReady is set, the display update functions do nothing - when it is set loop() redraws the displays
+void displayInitTask(void *parameter)
+{
+  bootStageBegin(BOOT_DISPLAYS);
+  right_display.setBusClock(4000000);
+  right_display.begin();
+  right_display.setFont(u8g2_font_inb63_mn); 
+  
+  left_display.setBusClock(4000000);
+  left_display.begin();
+  left_display.setFont(u8g2_font_inb63_mn);
+  setDisplayContrast();
+  bootStageEnd(BOOT_DISPLAYS);
 
-    server.on("/UNMUTE", HTTP_GET, [](AsyncWebServerRequest *request)
-              { unmuteOutput(); request->send(200, "text/plain", "Unmute");});
-
-    server.serveStatic("/", SPIFFS, "/");
-
-    ElegantOTA.begin(&server);
-    WebSerial.begin(&server); // WebSerial is accessible at "<IP Address>/webserial" in browser
-
-    /* Attach Message Callback */
-    WebSerial.onMessage([&](uint8_t *data, size_t len) {
-    Serial.printf("Received %u bytes from WebSerial: ", len);
-    Serial.write(data, len);
-    Serial.println();
-    WebSerial.println("Received Data...");
-    String input = "";
-    String command = "";
-    String value = "";
-    for(size_t i=0; i < len; i++){
-      input += char(data[i]);
-    }
-      int spaceIndex = input.indexOf(' ');
-      if (spaceIndex > 0) {
-        command = input.substring(0, spaceIndex);
-        value = input.substring(spaceIndex + 1);
-      } else {
-        command = input;
-        value = "";
-      }
-      command.trim();
-      value.trim();
-           
-      WebSerial.print("Command: ");
-      WebSerial.println(command);
-      WebSerial.print("Value: ");
-      WebSerial.println(value);
-
-      if (command == "HELP") {
-        WebSerial.println("IR_UP value");
-        WebSerial.println("IR_DOWN value");
-      }
-
-      if (command == "EXPORT-SETTINGS") {
-        String json = exportSettingsAsJson();
-        WebSerial.println(json);
-      }
-    });
-
-    server.begin();
+  if (settingsWereReset)
+  {
+    right_display.clearBuffer();
+    right_display.drawStr(0, 63, "Reset");
+    right_display.sendBuffer();
+    delay(2000);
   }
-  else
+  else if (appMode != APP_STANDBY_MODE)
   {
-    // Setting up AP (Access Point) for WiFi configuration 
-    debugln("Setting AP (Access Point)");
-
-    WiFi.mode(WIFI_AP);
-    WiFi.setTxPower(WIFI_POWER_19_5dBm); // Set maximum transmit power
-    WiFi.softAP("ThePreAmp", NULL, 6, 0); // NULL sets an open Access Point
-    dnsServer.start(53, "*", WiFi.softAPIP());
-
-    IPAddress IP = WiFi.softAPIP();
-    debug("AP IP address: ");
-    debugln(IP);
-
-    server.on("/style.css", HTTP_GET, [](AsyncWebServerRequest *request)
-              { AsyncWebServerResponse *response = request->beginResponse(SPIFFS, "/style.css.gz", "text/css");
-                response->addHeader("Content-Encoding", "gzip");
-                request->send(response);
-                debugln("style.css");
-    });
-
-    server.on("update.html", HTTP_GET, [](AsyncWebServerRequest *request)
-    {
-      request->send(SPIFFS, "/update.html", "text/html");
-      debug(request->url());
-      debug(request->host());
-      debug(": ");
-      debugln("NotFound");
-    });
-
-    server.onNotFound([](AsyncWebServerRequest *request)
-    {
-      request->send(SPIFFS, "/wifi.html", "text/html");
-      debug(request->url());
-      debug(request->host());
-      debug(": ");
-      debugln("NotFound");
-    });
-
-    //What this statement ment for?
-    //server.serveStatic("/", SPIFFS, "/");
-
-    server.on("/", HTTP_POST, [](AsyncWebServerRequest *request)
-       {
-      int params = request->params();
-      for(size_t i=0;i<params;i++){
-        const AsyncWebParameter* p = request->getParam(i);
-        if(p->isPost()){
-          // HTTP POST ssid value
-          if (p->name() == PARAM_INPUT_1) {
-            strcpy(Settings.ssid, p->value().c_str()); /* String copy*/
-            debug("SSID set to: ");
-            debugln(Settings.ssid);
-          }
-          // HTTP POST pass value
-          if (p->name() == PARAM_INPUT_2) {
-            strcpy(Settings.pass, p->value().c_str()); /* String copy */
-            debug("Password set to: ");
-            debugln(Settings.pass);
-          }
-          // HTTP POST ip value
-          if (p->name() == PARAM_INPUT_3) {
-            strcpy(Settings.ip, p->value().c_str()); /* String copy*/
-            debug("IP Address set to: ");
-            debugln(Settings.ip);
-          }
-          // HTTP POST gateway value
-          if (p->name() == PARAM_INPUT_4) {
-            strcpy(Settings.gateway, p->value().c_str()); /* String copy */
-            debug("Gateway set to: ");
-            debugln(Settings.gateway);
-          }
-          //Serial.printf("POST[%s]: %s\n", p->name().c_str(), p->value().c_str());
-        }
-      }
-
-      writeSettingsToEEPROM();
-      request->send(200, "text/plain", "Done. ESP will restart, connect to your router and go to IP address: " + String(Settings.ip));
-      //oled.clear();
-      //oled.setCursor(0, 1);
-      //oled.print(F("Wifi is configured"));
-      //oled.setCursor(0, 3);
-      debugln("Restarting...");
-      delay(3000);
-      ESP.restart(); 
-    });
-    ElegantOTA.begin(&server);
-    server.begin();
-
-    // Display WiFi QR code
+    // Display logo
     left_display.clearBuffer();
-    left_display.drawXBMP(0, 0, 64, 64, ThePreAmp_wifi_QR);
-    left_display.setFont(u8g2_font_luBS18_tf);
-    left_display.drawStr(74, 31, "Scan to");
-    left_display.drawStr(74, 58, "setup WiFi");
+    left_display.drawXBMP(77, 0, 130, 64, thePreAmpLogo);
     left_display.sendBuffer();
 
     right_display.clearBuffer();
-    right_display.setFont(u8g2_font_luBS18_tf);
-    right_display.drawStr(0, 31, "Push volume");
-    right_display.drawStr(0, 58, "button to skip");
     right_display.sendBuffer();
-    while (getUserInput() != KEY_SELECT) {
-       ElegantOTA.loop();
-       dnsServer.processNextRequest();
-    };
+    delay(1000);
   }
+
+  displayRefreshPending = true;
+  displaysReady = true;
+  vTaskDelete(NULL);
 }
 
-void startUp()
+// Background task started by setup(): mounts the filesystem, connects to WiFi and starts the webserver
+// If WiFi is not configured or the connection fails, loop() starts the WiFi configuration portal once the displays are ready
+void networkInitTask(void *parameter)
 {
-  debugln("Starting up...");
-  // Display logo
-  left_display.clearBuffer();
-  left_display.drawXBMP(77, 0, 130, 64, thePreAmpLogo);
-  left_display.sendBuffer();
+  setupWIFIsupport();
+  bootComplete = true;
+  vTaskDelete(NULL);
+}
 
-  right_display.clearBuffer();
-  right_display.sendBuffer();
-  delay(1000);
+void bootStageBegin(byte stage)
+{
+  bootStageStart[stage] = micros();
+}
 
-  if(WiFi.status() != WL_CONNECTED)
-  {
-     initWiFi();
-  }
- 
-  // Turn on external circuit via optocoupler
-  if (Settings.ExtPowerRelayTrigger)
-  {
-    digitalWrite(POWER_CONTROL_PIN, HIGH);
-  }
-  
-  // The controller is now ready - save the timestamp
-  mil_On = millis();
+void bootStageEnd(byte stage)
+{
+  bootStageDone[stage] = micros();
+}
 
-  /*
-  // If triggers are active then wait for the set number of seconds and turn them on
-  unsigned long delayTrigger1 = (Settings.Trigger1Active) ? (mil_On + Settings.Trigger1OnDelay * 1000) : 0;
-  unsigned long delayTrigger2 = (Settings.Trigger2Active) ? (mil_On + Settings.Trigger2OnDelay * 1000) : 0;
+// Log a message - use the LOG_... macros instead of calling this directly
+void logWrite(byte Level, const char *Format, int32_t Arg1, int32_t Arg2, int32_t Arg3, int32_t Arg4)
+{
+  LogRecord Record;
+  Record.Time = millis();
+  Record.Format = Format;
+  Record.Level = Level;
+  Record.Length = 0;
+  Record.Args[0] = Arg1;
+  Record.Args[1] = Arg2;
+  Record.Args[2] = Arg3;
+  Record.Args[3] = Arg4;
+  logPush(Record);
+}
+
+// Write the messages in the ring buffer to Serial and WebSerial - runs at the lowest priority so it only uses time nothing else needs
+void logDrainTask(void *parameter)
+{
+  static const char LevelNames[] = " EWIDT";
+  char Line[160];
+  uint32_t DroppedReported = 0;
 
-  while (delayTrigger1 || delayTrigger2)
+  for (;;)
   {
-    if (millis() > delayTrigger1 && delayTrigger1 != 0)
-    {
-      setTrigger1On();
-      delayTrigger1 = 0;
-      // oled.print3x3Number(2, 1, 0, false);
-    }
-    else
+    LogRecord Record;
+    if (!logPop(Record))
     {
-      //if (Settings.Trigger1Active && delayTrigger1 != 0)
-        // oled.print3x3Number(2, 1, (delayTrigger1 - millis()) / 1000, false);
+      // Empty - report lost messages and wait for more
+      if (logDropped != DroppedReported)
+      {
+        DroppedReported = logDropped;
+        snprintf(Line, sizeof(Line), "[log] %lu messages dropped\n", (unsigned long)DroppedReported);
+        Serial.print(Line);
+      }
+      vTaskDelay(pdMS_TO_TICKS(10));
+      continue;
     }
 
-    if (millis() > delayTrigger2 && delayTrigger2 != 0)
+    size_t Length;
+    if (Record.Format == NULL)
     {
-      setTrigger2On();
-      delayTrigger2 = 0;
-      // oled.print3x3Number(11, 1, 0, false);
+      memcpy(Line, Record.Text, Record.Length);
+      Length = Record.Length;
     }
     else
     {
-      //if (Settings.Trigger2Active && delayTrigger2 != 0)
-      //  oled.print3x3Number(11, 1, (delayTrigger2 - millis()) / 1000, false);
+      int Prefix = snprintf(Line, sizeof(Line), "[%6lu.%03lu] %c ", (unsigned long)(Record.Time / 1000), (unsigned long)(Record.Time % 1000), LevelNames[Record.Level]);
+      int Message = snprintf(Line + Prefix, sizeof(Line) - Prefix - 1, Record.Format, Record.Args[0], Record.Args[1], Record.Args[2], Record.Args[3]);
+      Length = minimum(Prefix + Message, (int)sizeof(Line) - 2);
+      Line[Length++] = '\n';
     }
+    Serial.write((const uint8_t *)Line, Length);
+    if (networkReady)
+      WebSerial.write((const uint8_t *)Line, Length);
   }
-  // oled.clear();
-  */
-
-  ScreenSaverOff();
-  appMode = APP_NORMAL_MODE;
-  
-  // Keep start volume for current input lower than max allowed start volume
-  RuntimeSettings.InputLastVol[RuntimeSettings.CurrentInput] = minimum(RuntimeSettings.InputLastVol[RuntimeSettings.CurrentInput], Settings.MaxStartVolume); // Avoid setting volume higher than MaxStartVol
-  setInput(RuntimeSettings.CurrentInput);
-
-  // Enable output / trigger output relay
-  unmuteOutput();
+}
 
-  left_display_update();
-  right_display_update();
+// Print the time spent in each boot stage - called by loop() when all stages are completed
+void printBootReport()
+{
+  debugln("Boot stage        start ms   duration ms");
+  for (byte stage = 0; stage < BOOT_STAGE_COUNT; stage++)
+  {
+    if (bootStageDone[stage] == 0)
+      continue;
+    char line[48];
+    snprintf(line, sizeof(line), "%-16s %9.1f %13.1f", bootStageNames[stage], bootStageStart[stage] / 1000.0, (bootStageDone[stage] - bootStageStart[stage]) / 1000.0);
+    debugln(line);
+  }
+  if (bootStageDone[BOOT_AUDIO] != 0)
+  {
+    int32_t Audio = bootStageDone[BOOT_AUDIO] / 1000;
+    if (Audio > BOOT_AUDIO_TARGET)
+      LOG_WARN("Audio restored after %d ms - over the target of %d ms", Audio, BOOT_AUDIO_TARGET);
+    else
+      LOG_INFO("Audio restored after %d ms - target %d ms", Audio, BOOT_AUDIO_TARGET);
+  }
+}
 
-  UIkey = KEY_NONE;
-  lastReceivedInput = KEY_NONE;
+// Mount the LittleFS filesystem holding the web pages
+// The filesystem is never formatted here: formatting takes seconds and would wipe the web pages. If it can not be mounted the
+// controller runs without it and serves fallbackPage instead - the filesystem image can then be uploaded via /update
+void initFilesystem()
+{
+  bootStageBegin(BOOT_FILESYSTEM);
+  filesystemReady = LittleFS.begin(false);
+  if (filesystemReady)
+  {
+    debug("LittleFS mounted: "); debug(LittleFS.usedBytes()); debug(" of "); debug(LittleFS.totalBytes()); debugln(" bytes used");
+  }
+  else
+  {
+    debugln("An error has occurred while mounting LittleFS - the built-in page is served");
+  }
+  bootStageEnd(BOOT_FILESYSTEM);
 }
 
-void loop()
+// Read the list of web pages etc. built by scripts/build_web.py from /manifest.txt
+// Each line: <url> <file> <etag> <content type> <immutable> <size of file>
+bool loadWebManifest()
 {
-  ElegantOTA.loop();
-  WebSerial.loop();
-  
-  UIkey = getUserInput();
+  if (!filesystemReady)
+    return false;
 
-  switch (appMode)
+  File manifest = LittleFS.open("/manifest.txt", "r");
+  if (!manifest)
   {
-  case APP_NORMAL_MODE:
-    /*- TO DO
-        if (millis() > mil_onRefreshTemperatureDisplay + TEMP_REFRESH_INTERVAL)
-        {
-          displayTemperatures();
-          notifyClients(getJSONTempValues());
-          if (((Settings.Trigger1Temp != 0) && (getTemperature(NTC1_PIN) >= Settings.Trigger1Temp)) || ((Settings.Trigger2Temp != 0) && (getTemperature(NTC2_PIN) >= Settings.Trigger2Temp)))
-          {
-            toStandbyMode();
-          }
-        }
-    */
+    debugln("No /manifest.txt - upload the filesystem image");
+    return false;
+  }
 
-    // Turn Screen Saver on/off if it is activated and if no user input has been received during the defined number of seconds
-  if (UIkey == KEY_NONE)
+  webAssetCount = 0;
+  while (manifest.available() && webAssetCount < WEB_ASSET_MAX)
   {
-    if ((!ScreenSaverIsOn && (millis() - mil_LastUserInput > (unsigned long)Settings.DisplayTimeout * 1000)) && Settings.ScreenSaverActive)
+    String line = manifest.readStringUntil('\n');
+    WebAsset *Asset = &webAssets[webAssetCount];
+    int Immutable;
+    unsigned long Size;
+    memset(Asset, 0, sizeof(WebAsset));
+    if (sscanf(line.c_str(), "%31s %31s %19s %23s %d %lu", Asset->Url, Asset->File, Asset->ETag, Asset->Type, &Immutable, &Size) == 6)
     {
-      ScreenSaverOn();
+      Asset->Immutable = Immutable;
+      Asset->Size = Size;
+      webAssetCount++;
     }
   }
-  else if (appMode != APP_STANDBY_MODE)
-    ScreenSaverOff();
+  manifest.close();
+  debug("Web pages in manifest: "); debugln(webAssetCount);
+  return true;
+}
 
-    switch (UIkey)
-    {
-    case KEY_NONE:
-      // If inactivity timer is set, go to standby if the set number of hours have passed since last user input
-      if ((Settings.TriggerInactOffTimer > 0) && ((mil_LastUserInput + Settings.TriggerInactOffTimer * 3600000) < millis()))
-        toStandbyMode();
-      break;
-    case KEY_BACK:
-      break;
-    case KEY_UP:
-      // Turn volume up if we're not muted and we'll not exceed the maximum volume set for the currently selected input
-      // TO DO: The checks for mute and MaxVol are done in setVolume so can be deleted here?
-      if (!RuntimeSettings.Muted && (RuntimeSettings.CurrentVolume < Settings.Input[RuntimeSettings.CurrentInput].MaxVol))
-        setVolume(RuntimeSettings.CurrentVolume + 1);
-      break;
-    case KEY_DOWN:
-      // Turn volume down if we're not muted and we'll not get below the minimum volume set for the currently selected input
-      // TO DO: The checks for mute and MinVol are done in setVolume so can be deleted here?
-      if (!RuntimeSettings.Muted && (RuntimeSettings.CurrentVolume > Settings.Input[RuntimeSettings.CurrentInput].MinVol))
-        setVolume(RuntimeSettings.CurrentVolume - 1);
-      break;
-    case KEY_LEFT:
-    {
-      setPrevInput();
-      break;
-    }
-    case KEY_RIGHT:
-    {
-      setNextInput();
-      break;
-    }
-    case KEY_1:
-    case KEY_2:
-    case KEY_3:
-    case KEY_4:
-    case KEY_5:
-      setInput(UIkey - KEY_1);
-      break;
-    case KEY_PREVIOUS:
-      // Switch to previous selected input (to allow for A-B comparison)
-      setInput(RuntimeSettings.PrevSelectedInput);
-      break;
-    case KEY_MUTE:
-      // toggle mute
-      if (RuntimeSettings.Muted)
-        unmute();
-      else
-        mute();
-      right_display_update();
-      break;
-    case KEY_SELECT:
-      // Set channel balance
-      changeBalance();
-      toAppNormalMode();
-      break;
-    case KEY_OFF:
-      if (last_KEY_ONOFF + 5000 < millis()) // Cancel received KEY_ONOFF if it has been received within the last 5 seconds
-      {
-        last_KEY_ONOFF = millis();
-        toStandbyMode();
-      }
-      break;
-    }
-    break;
+// Returns the index of the web asset with the url - or -1 if it is not in the manifest
+int findWebAsset(const char *Url)
+{
+  for (byte i = 0; i < webAssetCount; i++)
+    if (strcmp(webAssets[i].Url, Url) == 0)
+      return i;
+  return -1;
+}
 
-  case APP_STANDBY_MODE:
+// Send a web asset - or 304 if the browser already has this version (If-None-Match equals the ETag), in which case the file is not read
+void serveWebAsset(AsyncWebServerRequest *request, int Index)
+{
+  // Only the pages are looked up by name - if one is missing the filesystem image has not been uploaded (or could not be mounted)
+  if (Index < 0)
   {
-    // Do nothing if in APP_STANDBY_MODE - unless the user presses KEY_ONOFF. By the way: you don't need an IR remote: a doubleclick on encoder_2 is also KEY_ONOFF
-    switch (UIkey)
-    {
-    case KEY_ON:
-      if (last_KEY_ONOFF + 5000 < millis()) // Cancel received KEY_ONOFF if it has been received within the last 5 seconds
-      {
-        last_KEY_ONOFF = millis();
-        startUp();
-      }
-      break;
-    }
-    /*- TO DO
-    // Send temperature notification via websocket while in standby mode
-    if (millis() > mil_onRefreshTemperatureDisplay + (TEMP_REFRESH_INTERVAL_STANDBY))
-    {
-      // notifyClients(getJSONTempValues());
-      mil_onRefreshTemperatureDisplay = millis();
-    }
-    */
-    break;
-  }
+    request->send(200, "text/html", fallbackPage);
+    return;
   }
-}
 
+  WebAsset *Asset = &webAssets[Index];
+  char ETag[24];
+  snprintf(ETag, sizeof(ETag), "\"%s\"", Asset->ETag);
+  Asset->Requests++;
 
-// Function definitions
+  AsyncWebServerResponse *response;
+  if (request->hasHeader("If-None-Match") && request->header("If-None-Match").indexOf(ETag) >= 0)
+  {
+    response = request->beginResponse(304);
+    Asset->NotModified++;
+  }
+  else
+  {
+    response = request->beginResponse(LittleFS, Asset->File, Asset->Type);
+    response->addHeader("Content-Encoding", "gzip");
+    webBytesServed += Asset->Size;
+  }
+  response->addHeader("ETag", ETag);
+  response->addHeader("Cache-Control", Asset->Immutable ? "public, max-age=31536000, immutable" : "no-cache");
+  request->send(response);
+}
 
-// Write Settings to EEPROM
-void writeSettingsToEEPROM()
+// Add the time since the last call of loop() to the loop time histogram
+void observeLoopTime()
 {
-  // Write the settings to the EEPROM
-  eeprom.begin(extEEPROM::twiClock400kHz);
-  eeprom.write(0, Settings.data, sizeof(Settings));
+  unsigned long Now = micros();
+  if (loopTimeLast != 0)
+  {
+    uint32_t Elapsed = Now - loopTimeLast;
+    byte Bucket = 0;
+    while (Bucket < LOOP_TIME_BUCKETS && Elapsed > loopTimeBounds[Bucket])
+      Bucket++;
+    loopTimeCounts[Bucket].fetch_add(1, std::memory_order_relaxed);
+    loopTimeRemainderUs += Elapsed;
+    if (loopTimeRemainderUs >= 1000)
+    {
+      loopTimeSumMs.fetch_add(loopTimeRemainderUs / 1000, std::memory_order_relaxed);
+      loopTimeRemainderUs %= 1000;
+    }
+  }
+  loopTimeLast = Now;
 }
 
-// Read Settings from EEPROM
-void readSettingsFromEEPROM()
+void printMetricHeader(Print &Out, const char *Name, const char *Type, const char *Help)
 {
-  // Read settings from EEPROM
-  eeprom.begin(extEEPROM::twiClock400kHz);
-  eeprom.read(0, Settings.data, sizeof(Settings));
+  Out.printf("# HELP %s %s\n# TYPE %s %s\n", Name, Help, Name, Type);
 }
 
-// Write Default Settings and RuntimeSettings to EEPROM - called if the EEPROM data is not valid or if the user chooses to reset all settings to default value
-void writeDefaultSettingsToEEPROM()
+void printMetric(Print &Out, const char *Name, const char *Type, const char *Help, uint32_t Value)
 {
-  // Read default settings into Settings
-  setSettingsToDefault();
-  // Write the settings to the EEPROM
-  writeSettingsToEEPROM();
-  // Write the runtime settings to the EEPROM
-  writeRuntimeSettingsToEEPROM();
+  printMetricHeader(Out, Name, Type, Help);
+  Out.printf("%s %lu\n", Name, (unsigned long)Value);
 }
 
-// Write the current runtime settings to EEPROM - called if a power drop is detected or if the EEPROM data is not valid or if the user chooses to reset all settings to default values
-void writeRuntimeSettingsToEEPROM()
+// Write all metrics in the Prometheus text format - the counters are read one at a time, so they are not a consistent snapshot
+void exportMetrics(Print &Out)
 {
-  // Write the settings to the EEPROM
-  eeprom.begin(extEEPROM::twiClock400kHz);
-  eeprom.write(sizeof(Settings) + 1, RuntimeSettings.data, sizeof(RuntimeSettings));
+  printMetricHeader(Out, "preamp_loop_time_seconds", "histogram", "Time between two calls of loop()");
+  uint32_t Count = 0;
+  for (byte i = 0; i <= LOOP_TIME_BUCKETS; i++)
+  {
+    Count += loopTimeCounts[i].load(std::memory_order_relaxed);
+    if (i < LOOP_TIME_BUCKETS)
+      Out.printf("preamp_loop_time_seconds_bucket{le=\"%g\"} %lu\n", loopTimeBounds[i] / 1000000.0, (unsigned long)Count);
+    else
+      Out.printf("preamp_loop_time_seconds_bucket{le=\"+Inf\"} %lu\n", (unsigned long)Count);
+  }
+  Out.printf("preamp_loop_time_seconds_sum %.3f\n", loopTimeSumMs.load(std::memory_order_relaxed) / 1000.0);
+  Out.printf("preamp_loop_time_seconds_count %lu\n", (unsigned long)Count);
+
+  printMetricHeader(Out, "preamp_bus_transactions_total", "counter", "SPI and I2C transactions per device");
+  for (byte i = 0; i < DEVICE_COUNT; i++)
+    Out.printf("preamp_bus_transactions_total{bus=\"%s\",device=\"%s\"} %lu\n", metricDeviceBus[i], metricDeviceNames[i], (unsigned long)busTransactions[i].load(std::memory_order_relaxed));
+  printMetricHeader(Out, "preamp_bus_errors_total", "counter", "Failed I2C transactions per device");
+  for (byte i = 0; i < DEVICE_COUNT; i++)
+    if (strcmp(metricDeviceBus[i], "i2c") == 0)
+      Out.printf("preamp_bus_errors_total{bus=\"i2c\",device=\"%s\"} %lu\n", metricDeviceNames[i], (unsigned long)busErrors[i].load(std::memory_order_relaxed));
+  printMetricHeader(Out, "preamp_bus_retries_total", "counter", "I2C transactions repeated because they failed");
+  for (byte i = 0; i < DEVICE_COUNT; i++)
+    if (strcmp(metricDeviceBus[i], "i2c") == 0)
+      Out.printf("preamp_bus_retries_total{bus=\"i2c\",device=\"%s\"} %lu\n", metricDeviceNames[i], (unsigned long)busRetries[i].load(std::memory_order_relaxed));
+  printMetricHeader(Out, "preamp_i2c_queue_wait_max_seconds", "gauge", "Longest time an I2C transaction has waited in the queue");
+  Out.printf("preamp_i2c_queue_wait_max_seconds{queue=\"relays\"} %.6f\n", i2cWaitMaxUs[I2C_QUEUE_HIGH].load(std::memory_order_relaxed) / 1000000.0);
+  Out.printf("preamp_i2c_queue_wait_max_seconds{queue=\"eeprom_adc\"} %.6f\n", i2cWaitMaxUs[I2C_QUEUE_LOW].load(std::memory_order_relaxed) / 1000000.0);
+  printMetricHeader(Out, "preamp_sleep_seconds_total", "counter", "Time loop() has waited for the next job or spent in light sleep");
+  Out.printf("preamp_sleep_seconds_total{state=\"idle\"} %.3f\n", sleepIdleMs.load(std::memory_order_relaxed) / 1000.0);
+  Out.printf("preamp_sleep_seconds_total{state=\"light\"} %.3f\n", sleepLightMs.load(std::memory_order_relaxed) / 1000.0);
+  printMetricHeader(Out, "preamp_light_sleep_wakeups_total", "counter", "Wakes from light sleep by cause");
+  Out.printf("preamp_light_sleep_wakeups_total{cause=\"input\"} %lu\n", (unsigned long)lightSleepWakeupsGpio.load(std::memory_order_relaxed));
+  Out.printf("preamp_light_sleep_wakeups_total{cause=\"timer\"} %lu\n", (unsigned long)lightSleepWakeupsTimer.load(std::memory_order_relaxed));
+  printMetric(Out, "preamp_cpu_frequency_mhz", "gauge", "CPU frequency (lowered in standby)", getCpuFrequencyMhz());
+  printMetricHeader(Out, "preamp_job_runs_total", "counter", "Runs of the jobs of the scheduler");
+  for (byte i = 0; i < JOB_COUNT; i++)
+    Out.printf("preamp_job_runs_total{job=\"%s\"} %lu\n", jobDefinitions[i].Name, (unsigned long)jobRuns[i].load(std::memory_order_relaxed));
+  printMetric(Out, "preamp_i2c_dropped_total", "counter", "I2C transactions dropped because the queue was full", i2cDropped.load(std::memory_order_relaxed));
+
+  printMetric(Out, "preamp_eeprom_writes_total", "counter", "Writes to the EEPROM", eepromWrites.load(std::memory_order_relaxed));
+  printMetric(Out, "preamp_eeprom_written_bytes_total", "counter", "Bytes written to the EEPROM", eepromBytesWritten.load(std::memory_order_relaxed));
+  printMetric(Out, "preamp_ir_frames_decoded_total", "counter", "Frames decoded by the IR receiver", irFramesDecoded.load(std::memory_order_relaxed));
+  printMetric(Out, "preamp_ir_frames_rejected_total", "counter", "Decoded IR frames not matching a learned code", irFramesRejected.load(std::memory_order_relaxed));
+  printMetric(Out, "preamp_encoder_interrupts_total", "counter", "Calls of the rotary encoder timer interrupt", encoderInterrupts.load(std::memory_order_relaxed));
+  printMetric(Out, "preamp_temperature_samples_total", "counter", "Conversions read from the ADS1115", temperatureSamples.load(std::memory_order_relaxed));
+  printMetric(Out, "preamp_temperature_errors_total", "counter", "Measurements discarded because of I2C errors", temperatureErrors.load(std::memory_order_relaxed));
+  printMetricHeader(Out, "preamp_temperature_celsius", "gauge", "Filtered temperature of the NTCs");
+  Out.printf("preamp_temperature_celsius{ntc=\"1\"} %.1f\npreamp_temperature_celsius{ntc=\"2\"} %.1f\n", getTemperature(0), getTemperature(1));
+  printMetric(Out, "preamp_protection_trips_total", "counter", "Shutdowns by the thermal protection", protectionTrips.load(std::memory_order_relaxed));
+  printMetric(Out, "preamp_protection_tripped", "gauge", "The causes while the thermal protection is tripped (0 = not tripped)", protectionTripped);
+  printMetric(Out, "preamp_mqtt_published_total", "counter", "MQTT state messages published", mqttPublished.load(std::memory_order_relaxed));
+  printMetric(Out, "preamp_mqtt_commands_total", "counter", "MQTT commands accepted", mqttCommands.load(std::memory_order_relaxed));
+  printMetric(Out, "preamp_udp_requests_total", "counter", "UDP control requests", udpRequests.load(std::memory_order_relaxed));
+  printMetric(Out, "preamp_udp_duplicates_total", "counter", "UDP requests not executed because the sequence number was not newer", udpDuplicates.load(std::memory_order_relaxed));
+  printMetric(Out, "preamp_udp_invalid_total", "counter", "Invalid UDP packets and requests", udpInvalid.load(std::memory_order_relaxed));
+  printMetric(Out, "preamp_link_sent_total", "counter", "Packets sent to the linked group", linkSent.load(std::memory_order_relaxed));
+  printMetric(Out, "preamp_link_received_total", "counter", "Packets received from the leader of the linked group", linkReceived.load(std::memory_order_relaxed));
+  printMetric(Out, "preamp_link_lost_total", "counter", "Packets from the leader that never arrived", linkLost.load(std::memory_order_relaxed));
+  printMetric(Out, "preamp_link_late_total", "counter", "Ramps received after their start time", linkLate.load(std::memory_order_relaxed));
+  printMetric(Out, "preamp_link_mismatches_total", "counter", "Ramps ending at another attenuation than on the leader", linkMismatches.load(std::memory_order_relaxed));
+  printMetricHeader(Out, "preamp_link_offset_spread_seconds", "gauge", "Spread of the clock offset to the leader over the last packets");
+  Out.printf("preamp_link_offset_spread_seconds %g\n", linkOffsetSpread.load(std::memory_order_relaxed) / 1000000.0);
+  printMetricHeader(Out, "preamp_link_start_lateness_seconds", "histogram", "How late the scheduled ramps of the leader were started");
+  Count = 0;
+  for (byte i = 0; i <= LINK_LATENESS_BUCKETS; i++)
+  {
+    Count += linkLatenessCounts[i].load(std::memory_order_relaxed);
+    if (i < LINK_LATENESS_BUCKETS)
+      Out.printf("preamp_link_start_lateness_seconds_bucket{le=\"%g\"} %lu\n", linkLatenessBounds[i] / 1000000.0, (unsigned long)Count);
+    else
+      Out.printf("preamp_link_start_lateness_seconds_bucket{le=\"+Inf\"} %lu\n", (unsigned long)Count);
+  }
+  Out.printf("preamp_link_start_lateness_seconds_sum %g\n", linkLatenessSumUs.load(std::memory_order_relaxed) / 1000000.0);
+  Out.printf("preamp_link_start_lateness_seconds_count %lu\n", (unsigned long)Count);
+  printMetric(Out, "preamp_commands_dropped_total", "counter", "Commands dropped because the command queue was full", commandBus.Dropped);
+  printMetric(Out, "preamp_log_dropped_total", "counter", "Log messages dropped because the log buffer was full", logDropped.load(std::memory_order_relaxed));
+  printMetric(Out, "preamp_heap_free_bytes", "gauge", "Free heap", ESP.getFreeHeap());
+  printMetric(Out, "preamp_heap_min_free_bytes", "gauge", "Lowest free heap since boot", ESP.getMinFreeHeap());
+  printMetric(Out, "preamp_heap_largest_free_block_bytes", "gauge", "Largest block that can be allocated", ESP.getMaxAllocHeap());
+  printMetric(Out, "preamp_wifi_reconnects_total", "counter", "WiFi reconnect attempts", wifiReconnects);
+  printMetricHeader(Out, "preamp_uptime_seconds", "counter", "Time since boot");
+  Out.printf("preamp_uptime_seconds %.3f\n", esp_timer_get_time() / 1000000.0);
 }
 
-// Read the last runtime settings from EEPROM
-void readRuntimeSettingsFromEEPROM()
-{
-  // Read the settings from the EEPROM
-  eeprom.begin(extEEPROM::twiClock400kHz);
-  eeprom.read(sizeof(Settings) + 1, RuntimeSettings.data, sizeof(RuntimeSettings));
+// Initialize WiFi and start connecting - the connection is completed in the background by wifiEvent and wifiManagerLoop
+// Returns false if WiFi is not configured
+bool initWiFi()
+{ 
+  if (!isWiFiConfigured())
+  {
+    debugln("Undefined SSID or IP address.");
+    wifiState = WIFI_STATE_UNCONFIGURED;
+    return false;
+  }
+
+  WiFi.mode(WIFI_STA);
+  WiFi.setTxPower(WIFI_POWER_19_5dBm); // Set maximum transmit power
+  WiFi.setAutoReconnect(false);        // Reconnects are handled by wifiManagerLoop
+  localIP.fromString(Settings.ip);
+  localGateway.fromString(Settings.gateway);
+
+  if (!WiFi.config(localIP, localGateway, subnet))
+  {
+    debugln("STA Failed to configure");
+    return false;
+  }
+
+  WiFi.onEvent(wifiEvent);
+  wifiBackoff = WIFI_BACKOFF_MIN;
+  wifiConnect();
+  return true;
 }
 
-// Read the user defined settings from EEPROM
-void readUserSettingsFromEEPROM()
+// Returns true if a SSID and a valid IP address have been configured (the default settings are blank)
+bool isWiFiConfigured()
 {
-  // Read the settings from the EEPROM
-  eeprom.begin(extEEPROM::twiClock400kHz);
-  eeprom.read(sizeof(Settings) + sizeof(RuntimeSettings) + 1, Settings.data, sizeof(Settings));
+  IPAddress ip;
+  bool ssidSet = false;
+  for (byte i = 0; i < sizeof(Settings.ssid) && Settings.ssid[i] != '\0'; i++)
+  {
+    if (Settings.ssid[i] != ' ')
+      ssidSet = true;
+  }
+  return ssidSet && ip.fromString(Settings.ip);
 }
 
-// Read the user defined settings from EEPROM
-void writeUserSettingsToEEPROM()
+// Start a connection attempt
+void wifiConnect()
 {
-  // Write the user settings to the EEPROM
-  eeprom.begin(extEEPROM::twiClock400kHz);
-  eeprom.write(sizeof(Settings) + sizeof(RuntimeSettings) + 1, Settings.data, sizeof(Settings));
+  debug("Connecting to WiFi... "); debugln(Settings.ssid);
+  mil_WiFiStateChanged = millis();
+  wifiState = WIFI_STATE_CONNECTING;
+  WiFi.begin(Settings.ssid, Settings.pass);
 }
 
-// Loads default settings into Settings and RuntimeSettings - this is only done when the EEPROM does not contain valid settings or when reset is chosen by user in the menu
-void setSettingsToDefault()
+// Called by the WiFi driver (in its own task) - only the state is changed here, the rest is handled by wifiManagerLoop
+void wifiEvent(WiFiEvent_t event, WiFiEventInfo_t info)
 {
-  strcpy(Settings.ssid, "                                ");
-  strcpy(Settings.pass, "                                ");
-  strcpy(Settings.ip, "               ");
-  strcpy(Settings.gateway, "               ");
-  Settings.ExtPowerRelayTrigger = true;
-  Settings.VolumeSteps = 60;
+  switch (event)
+  {
+  case ARDUINO_EVENT_WIFI_STA_GOT_IP:
+    wifiState = WIFI_STATE_CONNECTED;
+    wifiDisplayUpdatePending = true;
+    if (bootStageDone[BOOT_WIFI] == 0)
+      bootStageEnd(BOOT_WIFI);
+    break;
+  case ARDUINO_EVENT_WIFI_STA_DISCONNECTED:
+    // The driver reports every failed attempt - only the first one after connecting/connected is of interest
+    if (wifiState == WIFI_STATE_CONNECTED || wifiState == WIFI_STATE_CONNECTING)
+    {
+      wifiState = WIFI_STATE_DISCONNECTED;
+      wifiDisplayUpdatePending = true;
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+// Keep the WiFi connection - called from loop()
+void wifiManagerLoop()
+{
+  switch (wifiState)
+  {
+  case WIFI_STATE_CONNECTING:
+    if (millis() - mil_WiFiStateChanged >= WIFI_CONNECT_TIMEOUT)
+    {
+      debugln("Failed to connect.");
+      WiFi.disconnect();
+      wifiState = WIFI_STATE_DISCONNECTED;
+    }
+    break;
+  case WIFI_STATE_DISCONNECTED:
+    // Schedule the next attempt and double the delay for the one after that
+    debug("WiFi disconnected - reconnecting in "); debug(wifiBackoff / 1000); debugln(" s");
+    mil_WiFiStateChanged = millis();
+    wifiState = WIFI_STATE_WAITING;
+    break;
+  case WIFI_STATE_WAITING:
+    if (millis() - mil_WiFiStateChanged >= wifiBackoff)
+    {
+      wifiBackoff = minimum(wifiBackoff * 2, (unsigned long)WIFI_BACKOFF_MAX);
+      wifiReconnects++;
+      wifiConnect();
+    }
+    break;
+  case WIFI_STATE_CONNECTED:
+    if (wifiDisplayUpdatePending)
+    {
+      // Just connected
+      debug("Connected to WiFi. IP: "); debugln(WiFi.localIP());
+      wifiBackoff = WIFI_BACKOFF_MIN;
+    }
+    if (millis() - mil_WiFiRSSI >= WIFI_RSSI_INTERVAL || wifiDisplayUpdatePending)
+    {
+      mil_WiFiRSSI = millis();
+      int8_t rssi = WiFi.RSSI();
+      if (rssiLevel(rssi) != rssiLevel(wifiRSSI))
+        wifiDisplayUpdatePending = true;
+      wifiRSSI = rssi;
+    }
+    break;
+  default:
+    break;
+  }
+
+  if (wifiDisplayUpdatePending)
+  {
+    wifiDisplayUpdatePending = false;
+    if (appMode == APP_NORMAL_MODE && !ScreenSaverIsOn)
+      right_display_update();
+  }
+}
+
+// Returns the number of bars shown by drawSignalStrength for the signal strength
+byte rssiLevel(int rssi)
+{
+  if (rssi >= -55)
+    return 5;
+  if (rssi >= -67)
+    return 4;
+  if (rssi >= -70)
+    return 3;
+  if (rssi >= -80)
+    return 2;
+  if (rssi >= -90)
+    return 1;
+  return 0;
+}
+
+// Mount the filesystem, start connecting to WiFi and start the webserver - runs in networkInitTask
+// The webserver is started without waiting for the connection. If WiFi is not configured the WiFi configuration portal is started as well
+void setupWIFIsupport()
+{
+  initFilesystem();
+
+  bootStageBegin(BOOT_WIFI);
+  bool configured = initWiFi();
+
+  bootStageBegin(BOOT_WEBSERVER);
+  loadWebManifest();
+
+  // The routes of the WiFi configuration portal only answer requests received on the Access Point - they must be added before the normal routes
+  setupProvisioningPortal();
+
+  // Web Server Root URL
+  server.on("/", HTTP_GET, [](AsyncWebServerRequest *request)
+            { serveWebAsset(request, findWebAsset("/index.html")); });
+
+  // Web : Pages, stylesheets etc. listed in the manifest
+  for (byte i = 0; i < webAssetCount; i++)
+    server.on(webAssets[i].Url, HTTP_GET, [i](AsyncWebServerRequest *request)
+              { serveWebAsset(request, i); });
+  
+  // Web : Presets - /PRESET?id=1 recalls preset 1, /STOREPRESET?id=1&name=TV stores the current setup as preset 1
+  // The handlers below run in the AsyncTCP task - they only post a command to the control loop and answer with the ticket of the command
+  server.on("/PRESET", HTTP_GET, [](AsyncWebServerRequest *request)
+            { int id = request->hasParam("id") ? request->getParam("id")->value().toInt() : 0;
+              sendTicket(request, postCommand(CMD_PRESET, id - 1, SRC_WEB));});
+
+  server.on("/STOREPRESET", HTTP_GET, [](AsyncWebServerRequest *request)
+            { int id = request->hasParam("id") ? request->getParam("id")->value().toInt() : 0;
+              String name = request->hasParam("name") ? request->getParam("name")->value() : String("Preset ") + String(id);
+              sendTicket(request, postCommand(CMD_STORE_PRESET, id - 1, SRC_WEB, name.c_str()));});
+
+  // Web : InputSelector
+  server.on("/INPUT1", HTTP_GET, [](AsyncWebServerRequest *request)
+            { sendTicket(request, postCommand(CMD_INPUT, 0, SRC_WEB));});
+
+  server.on("/INPUT2", HTTP_GET, [](AsyncWebServerRequest *request)
+            { sendTicket(request, postCommand(CMD_INPUT, 1, SRC_WEB));});
+
+  server.on("/INPUT3", HTTP_GET, [](AsyncWebServerRequest *request)
+            { sendTicket(request, postCommand(CMD_INPUT, 2, SRC_WEB));});
+
+  server.on("/INPUT4", HTTP_GET, [](AsyncWebServerRequest *request)
+            { sendTicket(request, postCommand(CMD_INPUT, 3, SRC_WEB));});
+
+  server.on("/INPUT5", HTTP_GET, [](AsyncWebServerRequest *request)
+            { sendTicket(request, postCommand(CMD_INPUT, 4, SRC_WEB));});
+
+  server.on("/MUTE", HTTP_GET, [](AsyncWebServerRequest *request)
+            { sendTicket(request, postCommand(CMD_MUTE, 0, SRC_WEB));});
+
+  server.on("/UNMUTE", HTTP_GET, [](AsyncWebServerRequest *request)
+            { sendTicket(request, postCommand(CMD_UNMUTE, 0, SRC_WEB));});
+
+  // Web : Command status - /COMMAND?ticket=12 answers "done" when the command with ticket 12 has been executed by the control loop
+  server.on("/COMMAND", HTTP_GET, [](AsyncWebServerRequest *request)
+            { uint32_t ticket = request->hasParam("ticket") ? request->getParam("ticket")->value().toInt() : 0;
+              request->send(200, "text/plain", commandIsDone(commandBus, ticket) ? "done" : "pending");});
+
+  // API : State - GET returns the current state, PATCH changes one or more fields in one transition, ie. {"input":2,"volume":40,"muted":false}
+  // Fields: input (1-5), volume (0-VolumeSteps), balance (118-136, 127 = centre), muted, trigger1, trigger2
+  server.on("/api/v1/state", HTTP_GET, [](AsyncWebServerRequest *request)
+            { char buffer[WS_MESSAGE_SIZE];
+              buildStateMessage(getStateSnapshot(), NULL, buffer, sizeof(buffer));
+              request->send(200, "application/json", buffer);});
+
+  AsyncCallbackJsonWebHandler *stateHandler = new AsyncCallbackJsonWebHandler("/api/v1/state", handleStatePatch);
+  stateHandler->setMethod(HTTP_PATCH);
+  stateHandler->setMaxContentLength(256);
+  server.addHandler(stateHandler);
+
+  // Metrics in the Prometheus text format
+  server.on("/metrics", HTTP_GET, [](AsyncWebServerRequest *request)
+            { AsyncResponseStream *response = request->beginResponseStream("text/plain; version=0.0.4");
+              exportMetrics(*response);
+              request->send(response);});
+
+  // API : Settings - GET exports all settings as JSON, POST imports them (all fields are optional, the values are validated before anything is changed)
+  server.on("/api/settings", HTTP_GET, [](AsyncWebServerRequest *request)
+            { uint32_t freeHeap = ESP.getFreeHeap();
+              AsyncResponseStream *response = request->beginResponseStream("application/json");
+              exportSettings(*response);
+              debug("Settings export - heap used: "); debugln(freeHeap - ESP.getFreeHeap());
+              request->send(response);});
+
+  server.on("/api/settings", HTTP_POST, [](AsyncWebServerRequest *request)
+            { if (importRequest == NULL)
+                request->send(400, "application/json", "{\"error\":\"body\"}");
+              else if (request != importRequest)
+                request->send(409, "application/json", "{\"error\":\"busy\"}");
+              else if (importStatus == 202)
+                request->send(202, "application/json", "{\"status\":\"queued\"}");
+              else if (importStatus == 200)
+                request->send(200, "application/json", "{\"status\":\"unchanged\"}");
+              else
+                request->send(importStatus, "application/json", String("{\"error\":\"") + importError + "\"}");
+              if (request == importRequest)
+                importRequest = NULL;},
+            NULL, handleSettingsImport);
+
+  // Web : State push - see webSocketLoop
+  ws.onEvent(onWebSocketEvent);
+  server.addHandler(&ws);
+
+  ElegantOTA.begin(&server);
+  WebSerial.begin(&server); // WebSerial is accessible at "<IP Address>/webserial" in browser
+
+  // Commands typed in WebSerial are handled by the shell - HELP lists them
+  WebSerial.onMessage(shellExecute);
+
+  mqttStart();
+  udpStart();
+  linkStart();
+
+  server.begin();
+  bootStageEnd(BOOT_WEBSERVER);
+  networkReady = true;
+
+  // Without a WiFi configuration the portal is started at once and the QR code for it is shown
+  if (!configured)
+  {
+    startProvisioning();
+    provisioningScreenRequested = true;
+  }
+}
+
+// Add the routes of the WiFi configuration portal - they only answer requests received on the Access Point started by startProvisioning
+// and take all of them, except the static files
+void setupProvisioningPortal()
+{
+  // Captive portal: any other page requested via the Access Point gets the WiFi configuration page (the stylesheet etc. are served as on the normal network)
+  server.on("/", HTTP_GET, [](AsyncWebServerRequest *request)
+            { serveWebAsset(request, findWebAsset("/wifi.html")); }).setFilter(ON_AP_FILTER);
+
+  server.onNotFound([](AsyncWebServerRequest *request)
+  {
+    if (provisioningActive && ON_AP_FILTER(request))
+      serveWebAsset(request, findWebAsset("/wifi.html"));
+    else
+      request->send(404, "text/plain", "Not found");
+    debug(request->url());
+    debug(request->host());
+    debug(": ");
+    debugln("NotFound");
+  });
+
+  // The form runs in the AsyncTCP task: the values are validated like an import of the settings and applied and saved by the control loop,
+  // which also restarts the controller
+  server.on("/", HTTP_POST, [](AsyncWebServerRequest *request)
+     {
+    const char *Names[] = {PARAM_INPUT_1, PARAM_INPUT_2, PARAM_INPUT_3, PARAM_INPUT_4};
+    JsonDocument doc;
+    for (byte i = 0; i < 4; i++)
+      if (request->hasParam(Names[i], true))
+        doc[Names[i]] = request->getParam(Names[i], true)->value();
+
+    char Json[320];
+    size_t Length = measureJson(doc);
+    if (Length >= sizeof(Json))
+    {
+      request->send(400, "text/plain", "Invalid value: too long");
+      return;
+    }
+    serializeJson(doc, Json, sizeof(Json));
+
+    mySettings Base = Settings;
+    mySettings Staged = Settings;
+    const char *Error = stageSettings(Json, Length, Staged);
+    if (Error != NULL)
+    {
+      request->send(400, "text/plain", String("Invalid value: ") + Error);
+      return;
+    }
+    int Status = queueSettings(Base, Staged, SRC_WEB);
+    if ((Status != 200 && Status != 202) || postCommand(CMD_RESTART, 0, SRC_WEB) == 0)
+    {
+      request->send(503, "text/plain", "Busy - try again");
+      return;
+    }
+    debug("SSID set to: ");
+    debugln(Staged.ssid);
+    request->send(200, "text/plain", "Done. ESP will restart, connect to your router and go to IP address: " + String(Staged.ip));
+  }).setFilter(ON_AP_FILTER);
+
+  // The Access Point is open, so nothing but the portal and the static files is reachable via it: the OTA update, the settings, WebSerial,
+  // the WebSocket and the control routes only answer on the normal network. Any other request via the Access Point gets the WiFi configuration page
+  server.on("/*", HTTP_ANY, [](AsyncWebServerRequest *request)
+            { serveWebAsset(request, findWebAsset("/wifi.html")); }).setFilter([](AsyncWebServerRequest *request)
+            { return ON_AP_FILTER(request) && findWebAsset(request->url().c_str()) < 0; });
+}
+
+// Start the Access Point and the DNS server of the WiFi configuration portal - the controller keeps running normally while the portal is active
+// If WiFi is configured the station connection is kept (WIFI_AP_STA)
+void startProvisioning()
+{
+  if (provisioningActive)
+    return;
+
+  // Setting up AP (Access Point) for WiFi configuration 
+  debugln("Setting AP (Access Point)");
+
+  WiFi.mode(isWiFiConfigured() ? WIFI_AP_STA : WIFI_AP);
+  WiFi.setTxPower(WIFI_POWER_19_5dBm); // Set maximum transmit power
+  WiFi.softAP("ThePreAmp", NULL, 6, 0); // NULL sets an open Access Point
+  dnsServer.start(53, "*", WiFi.softAPIP());
+
+  IPAddress IP = WiFi.softAPIP();
+  debug("AP IP address: ");
+  debugln(IP);
+  provisioningActive = true;
+}
+
+// Stop the Access Point and the DNS server of the WiFi configuration portal
+void stopProvisioning()
+{
+  if (!provisioningActive)
+    return;
+
+  debugln("Stopping AP (Access Point)");
+  provisioningActive = false;
+  dnsServer.stop();
+  WiFi.softAPdisconnect(true);
+}
+
+// Show the QR code for the WiFi configuration portal (and start the portal if needed) - the next user input closes the screen again
+void showProvisioningScreen()
+{
+  startProvisioning();
+  provisioningScreenShown = true;
+
+  // Display WiFi QR code
+  left_display.clearBuffer();
+  left_display.drawXBMP(0, 0, 64, 64, ThePreAmp_wifi_QR);
+  left_display.setFont(u8g2_font_luBS18_tf);
+  left_display.drawStr(74, 31, "Scan to");
+  left_display.drawStr(74, 58, "setup WiFi");
+  left_display.sendBuffer();
+
+  right_display.clearBuffer();
+  right_display.setFont(u8g2_font_luBS18_tf);
+  right_display.drawStr(0, 31, "Push a button");
+  right_display.drawStr(0, 58, "to close");
+  right_display.sendBuffer();
+}
+
+// Close the QR code screen and show the normal screens again
+void hideProvisioningScreen()
+{
+  dropProvisioningScreen();
+  left_display_update();
+  right_display_update();
+}
+
+// Forget the QR code screen when the displays are cleared or redrawn - the portal is stopped with it unless WiFi is not configured,
+// so the Access Point is never left running after the screen is gone
+void dropProvisioningScreen()
+{
+  if (!provisioningScreenShown)
+    return;
+  provisioningScreenShown = false;
+  if (isWiFiConfigured())
+    stopProvisioning();
+}
+
+void startUp()
+{
+  debugln("Starting up...");
+  // Display logo - at boot the logo is shown by displayInitTask instead, so the audio does not wait for it
+  // The control loop is not held up while it is shown: logoJob() redraws the displays STARTUP_LOGO_TIME later
+  if (displaysReady)
+  {
+    left_display.clearBuffer();
+    left_display.drawXBMP(77, 0, 130, 64, thePreAmpLogo);
+    left_display.sendBuffer();
+
+    right_display.clearBuffer();
+    right_display.sendBuffer();
+    logoShown = true;
+    jobSchedule(JOB_LOGO, STARTUP_LOGO_TIME);
+  }
+
+  // WiFi is (re)connected in the background by wifiManagerLoop
+ 
+  // The controller is now ready - save the timestamp
+  mil_On = millis();
+
+
+  ScreenSaverOff();
+  appMode = APP_NORMAL_MODE;
+  
+  // Keep start volume for current input lower than max allowed start volume
+  RuntimeSettings.InputLastVol[RuntimeSettings.CurrentInput] = minimum(RuntimeSettings.InputLastVol[RuntimeSettings.CurrentInput], Settings.MaxStartVolume); // Avoid setting volume higher than MaxStartVol
+  setInput(RuntimeSettings.CurrentInput);
+
+  // Turn on the external power relay, the triggers and the output relay in the order of Settings.PowerUpOrder
+  sequenceStart(SEQUENCE_POWER_UP);
+
+  left_display_update();
+  right_display_update();
+
+  UIkey = KEY_NONE;
+  lastReceivedInput = KEY_NONE;
+}
+
+void loop()
+{
+  observeLoopTime();
+
+  if (networkReady)
+  {
+    ElegantOTA.loop();
+    WebSerial.loop();
+    wifiManagerLoop();
+    webSocketLoop();
+    mqttLoop();
+    udpLoop();
+    linkLoop();
+  }
+
+  // Temperatures, protection and the timeouts of the user interface
+  schedulerRun();
+
+  // Redraw the displays when displayInitTask has initialized them
+  if (displayRefreshPending)
+  {
+    displayRefreshPending = false;
+    if (appMode == APP_STANDBY_MODE)
+    {
+      left_display.clearDisplay();
+      right_display.clearDisplay();
+    }
+    else
+    {
+      left_display_update();
+      right_display_update();
+    }
+  }
+
+  // The WiFi configuration portal is serviced here, while the controller keeps running normally
+  if (provisioningActive)
+    dnsServer.processNextRequest();
+
+  if (provisioningScreenRequested && displaysReady && appMode == APP_NORMAL_MODE)
+  {
+    provisioningScreenRequested = false;
+    showProvisioningScreen();
+  }
+
+  if (bootComplete && displaysReady && !bootReportPrinted)
+  {
+    bootReportPrinted = true;
+    printBootReport();
+  }
+  
+  standbyLoop();
+  UIkey = getUserInput();
+
+  // Execute the commands posted by the webserver and WebSerial - a posted key is handled as user input when there is no other user input
+  byte postedKey = processCommands(UIkey == KEY_NONE);
+  if (postedKey != KEY_NONE)
+    UIkey = postedKey;
+
+  switch (appMode)
+  {
+  case APP_NORMAL_MODE:
+    // The temperatures are checked by protectionLoop() in every mode - the screen saver is turned on by screenSaverJob()
+    if (UIkey != KEY_NONE)
+      ScreenSaverOff();
+
+    // Any user input closes the QR code screen of the WiFi configuration portal - BACK and SELECT only close it, other keys also do their normal job
+    if (provisioningScreenShown && UIkey != KEY_NONE)
+    {
+      hideProvisioningScreen();
+      if (UIkey == KEY_BACK || UIkey == KEY_SELECT || UIkey == KEY_WIFI_SETUP)
+        UIkey = KEY_NONE;
+    }
+
+    switch (UIkey)
+    {
+    case KEY_BACK:
+      break;
+    case KEY_WIFI_SETUP:
+      // Show the QR code for the WiFi configuration portal
+      if (networkReady)
+        showProvisioningScreen();
+      break;
+    case KEY_UP:
+      // Turn volume up if we're not muted and we'll not exceed the maximum volume set for the currently selected input
+      // TO DO: The checks for mute and MaxVol are done in setVolume so can be deleted here?
+      if (!RuntimeSettings.Muted && (RuntimeSettings.CurrentVolume < Settings.Input[RuntimeSettings.CurrentInput].MaxVol))
+        setVolume(RuntimeSettings.CurrentVolume + 1);
+      break;
+    case KEY_DOWN:
+      // Turn volume down if we're not muted and we'll not get below the minimum volume set for the currently selected input
+      // TO DO: The checks for mute and MinVol are done in setVolume so can be deleted here?
+      if (!RuntimeSettings.Muted && (RuntimeSettings.CurrentVolume > Settings.Input[RuntimeSettings.CurrentInput].MinVol))
+        setVolume(RuntimeSettings.CurrentVolume - 1);
+      break;
+    case KEY_LEFT:
+    {
+      setPrevInput();
+      break;
+    }
+    case KEY_RIGHT:
+    {
+      setNextInput();
+      break;
+    }
+    case KEY_1:
+    case KEY_2:
+    case KEY_3:
+    case KEY_4:
+    case KEY_5:
+      setInput(UIkey - KEY_1);
+      break;
+    case KEY_PREVIOUS:
+      // Switch to previous selected input (to allow for A-B comparison)
+      setInput(RuntimeSettings.PrevSelectedInput);
+      break;
+    case KEY_PRESET:
+      recallPreset(requestedPreset);
+      break;
+    case KEY_MUTE:
+      // toggle mute
+      if (RuntimeSettings.Muted)
+        unmute();
+      else
+        mute();
+      right_display_update();
+      break;
+    case KEY_SELECT:
+      // Set channel balance
+      changeBalance();
+      toAppNormalMode();
+      break;
+    case KEY_OFF:
+      if (millis() - last_KEY_ONOFF > 5000) // Cancel received KEY_ONOFF if it has been received within the last 5 seconds
+      {
+        last_KEY_ONOFF = millis();
+        toStandbyMode();
+      }
+      break;
+    }
+    break;
+
+  case APP_STANDBY_MODE:
+  {
+    // Do nothing if in APP_STANDBY_MODE - unless the user presses KEY_ONOFF. By the way: you don't need an IR remote: a doubleclick on encoder_2 is also KEY_ONOFF
+    switch (UIkey)
+    {
+    case KEY_ON:
+      if (protectionTripped)
+      {
+        LOG_WARN("Thermal protection - not turned on until the temperatures are %d degrees below the limits", PROTECTION_HYSTERESIS / 10);
+        break;
+      }
+      if (millis() - last_KEY_ONOFF > 5000) // Cancel received KEY_ONOFF if it has been received within the last 5 seconds
+      {
+        last_KEY_ONOFF = millis();
+        startUp();
+      }
+      break;
+    }
+    // The temperatures are sent to the WebSocket clients by webSocketLoop() while in standby mode
+    break;
+  }
+  }
+
+  schedulerSleep();
+}
+
+// The jobs run by schedulerRun() - in the order of enum Jobs
+const JobDefinition jobDefinitions[JOB_COUNT] = {
+  {"protection", protectionLoop, PROTECTION_INTERVAL, JOB_PRIORITY_HIGH},
+  {"temperature", temperatureLoop, 0, JOB_PRIORITY_NORMAL},
+  {"screen_saver", screenSaverJob, JOB_CHECK_INTERVAL, JOB_PRIORITY_LOW},
+  {"inactivity", inactivityJob, JOB_CHECK_INTERVAL, JOB_PRIORITY_LOW},
+  {"logo", logoJob, 0, JOB_PRIORITY_LOW},
+  {"restart", restartJob, 0, JOB_PRIORITY_LOW},
+  {"ramp", rampJob, 0, JOB_PRIORITY_HIGH},
+  {"link", linkApply, 0, JOB_PRIORITY_HIGH},
+};
+
+// Schedule Job to be run Delay milliseconds from now - a periodic job continues with its period from then
+void jobSchedule(byte Job, unsigned long Delay)
+{
+  jobDue[Job] = millis() + Delay;
+  jobScheduled[Job] = true;
+}
+
+// Run Job on the next pass of loop() and wake it - can be called from any task
+void jobSignal(byte Job)
+{
+  jobSignals.fetch_or(1UL << Job);
+  if (loopWake != NULL)
+    xSemaphoreGive(loopWake);
+}
+
+// Schedule all jobs to be run on the first pass of loop()
+void schedulerStart()
+{
+  loopWake = xSemaphoreCreateBinary();
+  for (byte Job = 0; Job < JOB_COUNT; Job++)
+    jobSchedule(Job, 0);
+}
+
+// Run the jobs that are due - the jobs of a higher priority first
+void schedulerRun()
+{
+  uint32_t Signals = jobSignals.exchange(0);
+  for (byte Job = 0; Job < JOB_COUNT; Job++)
+    if (Signals & (1UL << Job))
+      jobSchedule(Job, 0);
+
+  for (byte Priority = 0; Priority < JOB_PRIORITY_COUNT; Priority++)
+    for (byte Job = 0; Job < JOB_COUNT; Job++)
+    {
+      const JobDefinition *Definition = &jobDefinitions[Job];
+      unsigned long Now = millis();
+      if (Definition->Priority != Priority || !jobScheduled[Job] || !jobIsDue(Now, jobDue[Job]))
+        continue;
+
+      // A periodic job keeps its rhythm (see jobNextDue) - a one-shot job waits until it is scheduled again
+      if (Definition->Period > 0)
+        jobDue[Job] = jobNextDue(jobDue[Job], Definition->Period, Now);
+      else
+        jobScheduled[Job] = false;
+      jobRuns[Job].fetch_add(1, std::memory_order_relaxed);
+      Definition->Function();
+    }
+}
+
+// Sleep until the next job is due, a command is posted or SCHEDULER_MAX_SLEEP has passed - in low power standby the light sleep
+// lasts until the next job is due, as it is also woken by the inputs
+// A command left waiting in the queue (an API transition) is checked again on the next tick
+void schedulerSleep()
+{
+  long Sleep = jobSleepTime(millis(), jobDue, jobScheduled, JOB_COUNT);
+  if (commandQueue != NULL && uxQueueMessagesWaiting(commandQueue) > 0)
+    Sleep = minimum(Sleep, 1L);
+  if (loopWake == NULL || jobSignals.load() != 0)
+    return;
+
+  int64_t Start = esp_timer_get_time();
+  byte Kind = standbySleepKind(standby, Sleep, standbyBusy());
+  if (Kind == SLEEP_LIGHT)
+  {
+    standbyLightSleep(Sleep);
+    addSleepTime(sleepLightMs, sleepLightRemainderUs, esp_timer_get_time() - Start);
+  }
+  else if (Kind == SLEEP_IDLE)
+  {
+    xSemaphoreTake(loopWake, pdMS_TO_TICKS(minimum(Sleep, (long)SCHEDULER_MAX_SLEEP)));
+    addSleepTime(sleepIdleMs, sleepIdleRemainderUs, esp_timer_get_time() - Start);
+  }
+}
+
+// Add the microseconds Us to the total in milliseconds - the part of a millisecond is kept in Remainder
+void addSleepTime(std::atomic<uint32_t> &Total, uint32_t &Remainder, int64_t Us)
+{
+  Remainder += Us;
+  Total.fetch_add(Remainder / 1000, std::memory_order_relaxed);
+  Remainder %= 1000;
+}
+
+// Enter or leave low power standby when appMode changes, and stop the encoder timer again when STANDBY_AWAKE_TIME has passed
+void standbyLoop()
+{
+  bool Standby = (appMode == APP_STANDBY_MODE);
+  if (standbySet(standby, Standby))
+  {
+    setCpuFrequencyMhz(Standby ? STANDBY_CPU_FREQUENCY : NORMAL_CPU_FREQUENCY);
+    if (WiFi.getMode() != WIFI_OFF)
+      WiFi.setSleep(Standby ? WIFI_PS_MAX_MODEM : WIFI_PS_MIN_MODEM);
+    if (Standby)
+      timerStop(timer);
+    else
+      timerStart(timer);
+    if (Standby)
+      LOG_INFO("Low power standby on");
+    else
+      LOG_INFO("Low power standby off");
+  }
+  if (!standby.LowPower)
+    return;
+
+  if (digitalRead(ROTARY1_SW_PIN) == LOW || digitalRead(ROTARY2_SW_PIN) == LOW)
+    standbyWake();
+  if (standbyAwakeEnded(standby, millis()))
+    timerStop(timer);
+}
+
+// An input has woken the controller - run the encoder timer for STANDBY_AWAKE_TIME
+void standbyWake()
+{
+  if (standbyWakeUp(standby, millis()))
+    timerStart(timer);
+}
+
+// Light sleep stops everything but the RTC - returns what is going on that it would disturb (StandbyBusy). The input in the last
+// STANDBY_AWAKE_TIME is checked by standbySleepKind()
+byte standbyBusy()
+{
+  byte Busy = 0;
+  if (!bootComplete)
+    Busy |= STANDBY_BUSY_BOOT;
+  if (provisioningActive || (wifiState != WIFI_STATE_UNCONFIGURED && wifiState != WIFI_STATE_WAITING))
+    Busy |= STANDBY_BUSY_WIFI;
+  if (uxQueueMessagesWaiting(commandQueue) > 0)
+    Busy |= STANDBY_BUSY_COMMAND;
+  if (sequenceState != SEQUENCE_IDLE)
+    Busy |= STANDBY_BUSY_SEQUENCE;
+  if (i2cBusy || uxQueueMessagesWaiting(i2cHighQueue) > 0 || uxQueueMessagesWaiting(i2cLowQueue) > 0)
+    Busy |= STANDBY_BUSY_I2C;
+  if (jobSignals.load() != 0)
+    Busy |= STANDBY_BUSY_JOB;
+  return Busy;
+}
+
+// Light sleep for at most Duration milliseconds - woken by the IR receiver or an encoder button going low
+// The interrupt of the IR receiver is detached meanwhile, as the wake configures the pin for a level interrupt
+void standbyLightSleep(long Duration)
+{
+  const gpio_num_t WakePins[] = {(gpio_num_t)IR_RECEIVER_INPUT_PIN, (gpio_num_t)ROTARY1_SW_PIN, (gpio_num_t)ROTARY2_SW_PIN};
+
+  irrecv.disableIRIn();
+  for (byte i = 0; i < sizeof(WakePins) / sizeof(WakePins[0]); i++)
+    gpio_wakeup_enable(WakePins[i], GPIO_INTR_LOW_LEVEL);
+  esp_sleep_enable_gpio_wakeup();
+  esp_sleep_enable_timer_wakeup(Duration * 1000ULL);
+
+  esp_light_sleep_start();
+
+  for (byte i = 0; i < sizeof(WakePins) / sizeof(WakePins[0]); i++)
+  {
+    gpio_wakeup_disable(WakePins[i]);
+    gpio_set_intr_type(WakePins[i], GPIO_INTR_DISABLE);
+  }
+  irrecv.enableIRIn();
+
+  if (esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_GPIO)
+  {
+    lightSleepWakeupsGpio.fetch_add(1, std::memory_order_relaxed);
+    standbyWake();
+  }
+  else
+    lightSleepWakeupsTimer.fetch_add(1, std::memory_order_relaxed);
+}
+
+// End the logo shown by startUp() - unless the controller has been turned off meanwhile, the state is shown
+void logoJob()
+{
+  if (!logoShown)
+    return;
+  logoShown = false;
+  if (appMode == APP_NORMAL_MODE)
+  {
+    left_display_update();
+    right_display_update();
+  }
+}
+
+// Restart the controller requested by CMD_RESTART - the settings are written to the EEPROM by i2cTask first
+void restartJob()
+{
+  if (!restartPending)
+    return;
+  debugln("Restarting...");
+  i2cSync();
+  ESP.restart();
+}
+
+// Turn the screen saver on if it is activated and no user input has been received for Settings.DisplayTimeout seconds
+void screenSaverJob()
+{
+  if (appMode == APP_NORMAL_MODE && Settings.ScreenSaverActive && !ScreenSaverIsOn &&
+      millis() - mil_LastUserInput > (unsigned long)Settings.DisplayTimeout * 1000)
+    ScreenSaverOn();
+}
+
+// If the inactivity timer is set, go to standby when the set number of hours have passed since the last user input
+void inactivityJob()
+{
+  if (appMode == APP_NORMAL_MODE && Settings.TriggerInactOffTimer > 0 &&
+      millis() - mil_LastUserInput > Settings.TriggerInactOffTimer * 3600000UL)
+    toStandbyMode();
+}
+
+
+// Function definitions
+
+// Read from/write to the EEPROM through i2cTask - one transaction per page. A read waits until the data is read, a write only until
+// the data has been copied to the queue (the reads are posted to the same queue, so they return what was written before)
+void eepromRead(unsigned long address, byte *data, unsigned int size)
+{
+  I2CTransaction T;
+  memset(&T, 0, sizeof(T));
+  T.Type = I2C_EEPROM_READ;
+  for (unsigned int Offset = 0; Offset < size; Offset += T.Length)
+  {
+    T.Address = address + Offset;
+    T.Length = i2cPageLength(T.Address, size - Offset);
+    T.Target = data + Offset;
+    i2cPost(T, false, Offset + T.Length == size);
+  }
+}
+
+void eepromWrite(unsigned long address, byte *data, unsigned int size)
+{
+  I2CTransaction T;
+  memset(&T, 0, sizeof(T));
+  T.Type = I2C_EEPROM_WRITE;
+  for (unsigned int Offset = 0; Offset < size; Offset += T.Length)
+  {
+    T.Address = address + Offset;
+    T.Length = i2cPageLength(T.Address, size - Offset);
+    memcpy(T.Data, data + Offset, T.Length);
+    i2cPost(T, false);
+  }
+  eepromWrites.fetch_add(1, std::memory_order_relaxed);
+  eepromBytesWritten.fetch_add(size, std::memory_order_relaxed);
+}
+
+// Create the queues and start i2cTask - called at the end of setup(), when the devices have been set up
+void i2cStart()
+{
+  i2cHighQueue = xQueueCreate(I2C_HIGH_QUEUE_LENGTH, sizeof(I2CTransaction));
+  i2cLowQueue = xQueueCreate(I2C_LOW_QUEUE_LENGTH, sizeof(I2CTransaction));
+  i2cPending = xSemaphoreCreateCounting(I2C_HIGH_QUEUE_LENGTH + I2C_LOW_QUEUE_LENGTH, 0);
+  // Above the control loop, so a relay change is written as soon as the bus is free
+  xTaskCreatePinnedToCore(i2cTask, "i2c", 3072, NULL, 2, NULL, 1);
+}
+
+// Post a transaction to i2cHighQueue (High) or i2cLowQueue - if Wait is set, return when it has been executed
+// Returns false if the transaction was dropped because the queue stayed full
+bool i2cPost(I2CTransaction &T, bool High, bool Wait)
+{
+  if (i2cPending == NULL)
+  {
+    i2cExecute(T);
+    return true;
+  }
+
+  T.Waiter = Wait ? xTaskGetCurrentTaskHandle() : NULL;
+  T.Posted = esp_timer_get_time();
+  if (xQueueSend(High ? i2cHighQueue : i2cLowQueue, &T, pdMS_TO_TICKS(I2C_POST_TIMEOUT)) != pdTRUE)
+  {
+    i2cDropped.fetch_add(1, std::memory_order_relaxed);
+    LOG_ERROR("I2C queue full - transaction type %d dropped", T.Type);
+    return false;
+  }
+  xSemaphoreGive(i2cPending);
+  if (Wait)
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+  return true;
+}
+
+// Wait until the transactions posted to i2cLowQueue before have been executed (ie. the EEPROM has been written)
+void i2cSync()
+{
+  I2CTransaction T;
+  memset(&T, 0, sizeof(T));
+  T.Type = I2C_SYNC;
+  i2cPost(T, false, true);
+}
+
+// Execute a transaction - retried up to I2C_RETRIES times if it fails. All transactions are counted by device for /metrics
+void i2cExecute(I2CTransaction &T)
+{
+  byte Device = DEVICE_EEPROM;
+  for (byte Attempt = 0;; Attempt++)
+  {
+    uint8_t Status = 0;
+    switch (T.Type)
+    {
+    case I2C_RELAYS:
+      Device = DEVICE_MCP23008;
+      Status = metricBusStatus(Device, relayController.writeRegister(MCP23008_GPIO, T.Data[0]));
+      break;
+    case I2C_EEPROM_READ:
+      Status = metricBusStatus(Device, eeprom.read(T.Address, T.Target, T.Length));
+      break;
+    case I2C_EEPROM_WRITE:
+      Status = metricBusStatus(Device, eeprom.write(T.Address, T.Data, T.Length));
+      break;
+    case I2C_ADC_START:
+      Device = DEVICE_ADS1115;
+      Status = metricBusStatus(Device, ads1115.startConversion(T.Address));
+      break;
+    case I2C_ADC_READ:
+    {
+      // If the conversion could not be started the ADS1115 holds the result of the previous conversion (of the other channel)
+      if (i2cAdcResult.load(std::memory_order_acquire) == I2C_ADC_ERROR)
+        return;
+      Device = DEVICE_ADS1115;
+      int16_t Value;
+      Status = metricBusStatus(Device, ads1115.readConversion(Value));
+      if (Status == 0)
+        i2cAdcResult.store(Value, std::memory_order_release);
+      break;
+    }
+    }
+    if (Status == 0)
+      return;
+    if (Attempt == I2C_RETRIES)
+    {
+      LOG_ERROR("I2C transaction type %d failed with status %d", T.Type, Status);
+      // The temperature sampler discards the measurement
+      if (T.Type == I2C_ADC_START || T.Type == I2C_ADC_READ)
+        i2cAdcResult.store(I2C_ADC_ERROR, std::memory_order_release);
+      return;
+    }
+    busRetries[Device].fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+// Receive a transaction for i2cTask (see i2cTake)
+bool i2cReceive(bool High, void *T)
+{
+  return xQueueReceive(High ? i2cHighQueue : i2cLowQueue, T, 0) == pdTRUE;
+}
+
+// The only user of the I2C bus once setup() is done - the relays are served first
+void i2cTask(void *parameter)
+{
+  I2CTransaction T;
+
+  for (;;)
+  {
+    xSemaphoreTake(i2cPending, portMAX_DELAY);
+    i2cBusy = true;
+    int Queue = i2cTake(i2cReceive, &T);
+    if (Queue == I2C_QUEUE_NONE)
+    {
+      i2cBusy = false;
+      continue;
+    }
+
+    uint32_t Wait = esp_timer_get_time() - T.Posted;
+    if (Wait > i2cWaitMaxUs[Queue].load(std::memory_order_relaxed))
+      i2cWaitMaxUs[Queue].store(Wait, std::memory_order_relaxed);
+
+    i2cExecute(T);
+    // The temperature sampler is not scheduled while it waits for the result - i2cBusy is cleared after, so loop() does not go to light sleep in between
+    if (T.Type == I2C_ADC_READ)
+      jobSignal(JOB_TEMPERATURE);
+    i2cBusy = false;
+    if (T.Waiter != NULL)
+      xTaskNotifyGive(T.Waiter);
+  }
+}
+
+// Write Settings to EEPROM
+void writeSettingsToEEPROM()
+{
+  // Write the settings to the EEPROM
+  eepromWrite(0, Settings.data, sizeof(Settings));
+}
+
+// Read Settings from EEPROM
+void readSettingsFromEEPROM()
+{
+  // Read settings from EEPROM
+  eepromRead(0, Settings.data, sizeof(Settings));
+}
+
+// Write Default Settings and RuntimeSettings to EEPROM - called if the EEPROM data is not valid or if the user chooses to reset all settings to default value
+void writeDefaultSettingsToEEPROM()
+{
+  // Read default settings into Settings
+  setSettingsToDefault();
+  // Write the settings to the EEPROM
+  writeSettingsToEEPROM();
+  // Write the runtime settings to the EEPROM
+  writeRuntimeSettingsToEEPROM();
+}
+
+// Write the current runtime settings to EEPROM - called if a power drop is detected or if the EEPROM data is not valid or if the user chooses to reset all settings to default values
+void writeRuntimeSettingsToEEPROM()
+{
+  // Write the settings to the EEPROM
+  eepromWrite(sizeof(Settings) + 1, RuntimeSettings.data, sizeof(RuntimeSettings));
+}
+
+// Read the last runtime settings from EEPROM
+void readRuntimeSettingsFromEEPROM()
+{
+  // Read the settings from the EEPROM
+  eepromRead(sizeof(Settings) + 1, RuntimeSettings.data, sizeof(RuntimeSettings));
+}
+
+// Read the user defined settings (presets) from EEPROM
+void readUserSettingsFromEEPROM()
+{
+  // Read the settings from the EEPROM
+  eepromRead(sizeof(Settings) + sizeof(RuntimeSettings) + 1, UserSettings.data, sizeof(UserSettings));
+}
+
+// Write the user defined settings (presets) to EEPROM
+void writeUserSettingsToEEPROM()
+{
+  // Write the user settings to the EEPROM
+  eepromWrite(sizeof(Settings) + sizeof(RuntimeSettings) + 1, UserSettings.data, sizeof(UserSettings));
+}
+
+// Loads default settings into Settings and RuntimeSettings - this is only done when the EEPROM does not contain valid settings or when reset is chosen by user in the menu
+void setSettingsToDefault()
+{
+  strcpy(Settings.ssid, "                                ");
+  strcpy(Settings.pass, "                                ");
+  strcpy(Settings.ip, "               ");
+  strcpy(Settings.gateway, "               ");
+  Settings.ExtPowerRelayTrigger = true;
+  Settings.VolumeSteps = 60;
   Settings.MinAttenuation = 0;
   Settings.MaxAttenuation = 59;
   Settings.MaxStartVolume = Settings.VolumeSteps;
   Settings.MuteLevel = 0;
   Settings.RecallSetLevel = true;
 
-  #if IRCONF == 1
-    Settings.IR_UP = 0x80840BF;
-    Settings.IR_DOWN = 0x808E01F;
-    Settings.IR_REPEAT = 0xFFFFFFFFFFFFFFFF;
-    Settings.IR_LEFT = 0x808807F;
-    Settings.IR_RIGHT = 0x808609F;
-    Settings.IR_SELECT = 0x808AC53;
-    Settings.IR_BACK = 0x80822DD;
-    Settings.IR_MUTE = 0x80828D7;
-    Settings.IR_PREVIOUS = 0x80818E7;
-    Settings.IR_ON = 0x808926D;
-    Settings.IR_OFF = 0x808926D;
-    Settings.IR_1 = 0x808827D;
-    Settings.IR_2 = 0x80842BD;
-    Settings.IR_3 = 0x808E21D;
-    Settings.IR_4 = 0x808CC33;
-    Settings.IR_5 = 0x8082CD3;
-  #else
-    Settings.IR_UP = 0x48AC40BF;
-    Settings.IR_DOWN = 0x48AC609F;
-    Settings.IR_REPEAT = 0xFFFFFFFFFFFFFFFF;
-    Settings.IR_LEFT = 0x48ACC03F;
-    Settings.IR_RIGHT = 0x48ACA05F;
-    Settings.IR_SELECT = 0x48AC20DF;
-    Settings.IR_BACK = 0x80822DD;
-    Settings.IR_MUTE = 0x80828D7;
-    Settings.IR_PREVIOUS = 0x80818E7;
-    Settings.IR_ON = 0x48AC807F;
-    Settings.IR_OFF = 0x48AC807F;
-    Settings.IR_1 = 0x808827D;
-    Settings.IR_2 = 0x80842BD;
-    Settings.IR_3 = 0x808E21D;
-    Settings.IR_4 = 0x808CC33;
-    Settings.IR_5 = 0x8082CD3;
-  #endif
+  #if IRCONF == 1
+    Settings.IR_UP = 0x80840BF;
+    Settings.IR_DOWN = 0x808E01F;
+    Settings.IR_REPEAT = 0xFFFFFFFFFFFFFFFF;
+    Settings.IR_LEFT = 0x808807F;
+    Settings.IR_RIGHT = 0x808609F;
+    Settings.IR_SELECT = 0x808AC53;
+    Settings.IR_BACK = 0x80822DD;
+    Settings.IR_MUTE = 0x80828D7;
+    Settings.IR_PREVIOUS = 0x80818E7;
+    Settings.IR_ON = 0x808926D;
+    Settings.IR_OFF = 0x808926D;
+    Settings.IR_1 = 0x808827D;
+    Settings.IR_2 = 0x80842BD;
+    Settings.IR_3 = 0x808E21D;
+    Settings.IR_4 = 0x808CC33;
+    Settings.IR_5 = 0x8082CD3;
+  #else
+    Settings.IR_UP = 0x48AC40BF;
+    Settings.IR_DOWN = 0x48AC609F;
+    Settings.IR_REPEAT = 0xFFFFFFFFFFFFFFFF;
+    Settings.IR_LEFT = 0x48ACC03F;
+    Settings.IR_RIGHT = 0x48ACA05F;
+    Settings.IR_SELECT = 0x48AC20DF;
+    Settings.IR_BACK = 0x80822DD;
+    Settings.IR_MUTE = 0x80828D7;
+    Settings.IR_PREVIOUS = 0x80818E7;
+    Settings.IR_ON = 0x48AC807F;
+    Settings.IR_OFF = 0x48AC807F;
+    Settings.IR_1 = 0x808827D;
+    Settings.IR_2 = 0x80842BD;
+    Settings.IR_3 = 0x808E21D;
+    Settings.IR_4 = 0x808CC33;
+    Settings.IR_5 = 0x8082CD3;
+  #endif
+
+/*
+  Settings.IR_UP = 0x80840BF;
+  Settings.IR_DOWN = 0x808E01F;
+  Settings.IR_REPEAT = 0xFFFFFFFFFFFFFFFF;
+  Settings.IR_LEFT = 0x808807F;
+  Settings.IR_RIGHT = 0x808609F;
+  Settings.IR_SELECT = 0x808AC53;
+  Settings.IR_BACK = 0x80822DD;
+  Settings.IR_MUTE = 0x80828D7;
+  Settings.IR_PREVIOUS = 0x80818E7;
+  Settings.IR_ON = 0x808926D;
+  Settings.IR_OFF = 0x808926D;
+  Settings.IR_1 = 0x808827D;
+  Settings.IR_2 = 0x80842BD;
+  Settings.IR_3 = 0x808E21D;
+  Settings.IR_4 = 0x808CC33;
+  Settings.IR_5 = 0x8082CD3;
+
+  Settings.IR_UP = 0x48AC40BF;
+  Settings.IR_DOWN = 0x48AC609F;
+  Settings.IR_REPEAT = 0xFFFFFFFFFFFFFFFF;
+  Settings.IR_LEFT = 0x48ACC03F;
+  Settings.IR_RIGHT = 0x48ACA05F;
+  Settings.IR_SELECT = 0x48AC20DF;
+  Settings.IR_BACK = 0x80822DD;
+  Settings.IR_MUTE = 0x80828D7;
+  Settings.IR_PREVIOUS = 0x80818E7;
+  Settings.IR_ON = 0x48AC807F;
+  Settings.IR_OFF = 0x48AC807F;
+  Settings.IR_1 = 0x808827D;
+  Settings.IR_2 = 0x80842BD;
+  Settings.IR_3 = 0x808E21D;
+  Settings.IR_4 = 0x808CC33;
+  Settings.IR_5 = 0x8082CD3;
+*/   
+  Settings.Input[0].Active = INPUT_NORMAL;
+  strcpy(Settings.Input[0].Name, "Input 1");
+  Settings.Input[0].MaxVol = Settings.VolumeSteps;
+  Settings.Input[0].MinVol = 1;
+  Settings.Input[0].Gain = 0;
+  Settings.Input[1].Active = INPUT_NORMAL;
+  strcpy(Settings.Input[1].Name, "Input 2");
+  Settings.Input[1].MaxVol = Settings.VolumeSteps;
+  Settings.Input[1].MinVol = 1;
+  Settings.Input[1].Gain = 0;
+  Settings.Input[2].Active = INPUT_NORMAL;
+  strcpy(Settings.Input[2].Name, "Input 3");
+  Settings.Input[2].MaxVol = Settings.VolumeSteps;
+  Settings.Input[2].MinVol = 1;
+  Settings.Input[2].Gain = 0;
+  Settings.Input[3].Active = INPUT_NORMAL;
+  strcpy(Settings.Input[3].Name, "Input 4");
+  Settings.Input[3].MaxVol = Settings.VolumeSteps;
+  Settings.Input[3].MinVol = 1;
+  Settings.Input[3].Gain = 0;
+  Settings.Input[4].Active = INPUT_INACTIVATED;
+  strcpy(Settings.Input[4].Name, "Input 5");
+  Settings.Input[4].MaxVol = Settings.VolumeSteps;
+  Settings.Input[4].MinVol = 1;
+  Settings.Input[4].Gain = 0;
+  Settings.Trigger1Active = 1;
+  Settings.Trigger1Type = 0;
+  Settings.Trigger1OnDelay = 0;
+  Settings.Trigger1Temp = 0;
+  Settings.Trigger2Active = 1;
+  Settings.Trigger2Type = 0;
+  Settings.Trigger2OnDelay = 0;
+  Settings.Trigger2Temp = 0;
+  Settings.TriggerInactOffTimer = 0;
+  Settings.ScreenSaverActive = true;
+  Settings.DisplayOnLevel = 3;
+  Settings.DisplayDimLevel = 0;
+  Settings.DisplayTimeout = 30;
+  Settings.DisplayVolume = 1;
+  Settings.DisplaySelectedInput = true;
+  Settings.DisplayTemperature1 = 3;
+  Settings.DisplayTemperature2 = 3;
+  memset(Settings.MqttUri, 0, sizeof(Settings.MqttUri));
+  memset(Settings.MqttUser, 0, sizeof(Settings.MqttUser));
+  memset(Settings.MqttPass, 0, sizeof(Settings.MqttPass));
+  memset(Settings.MqttTopic, 0, sizeof(Settings.MqttTopic));
+  strcpy(Settings.MqttTopic, "thepreamp");
+  Settings.LinkGroup = 0;
+  Settings.LinkRole = 0;
+  memset(Settings.PowerUpOrder, 0, sizeof(Settings.PowerUpOrder));
+  strcpy(Settings.PowerUpOrder, "P12O");
+  memset(Settings.PowerDownOrder, 0, sizeof(Settings.PowerDownOrder));
+  strcpy(Settings.PowerDownOrder, "O21P");
+  Settings.Version = VERSION;
+
+  RuntimeSettings.CurrentInput = 0;
+  RuntimeSettings.CurrentVolume = 0;
+  RuntimeSettings.Muted = 0;
+  RuntimeSettings.InputLastVol[0] = 0;
+  RuntimeSettings.InputLastVol[1] = 0;
+  RuntimeSettings.InputLastVol[2] = 0;
+  RuntimeSettings.InputLastVol[3] = 0;
+  RuntimeSettings.InputLastVol[4] = 0;
+  RuntimeSettings.InputLastBal[0] = 127; // 127 = no balance shift (values < 127 = shift balance to the left channel, values > 127 = shift balance to the right channel)
+  RuntimeSettings.InputLastBal[1] = 127;
+  RuntimeSettings.InputLastBal[2] = 127;
+  RuntimeSettings.InputLastBal[3] = 127;
+  RuntimeSettings.InputLastBal[4] = 127;
+  RuntimeSettings.PrevSelectedInput = 0;
+  RuntimeSettings.Version = VERSION;
+}
+
+// Loads default presets into UserSettings - all presets are unused until the user stores the current setup in one of them
+void setUserSettingsToDefault()
+{
+  for (byte i = 0; i < PRESET_COUNT; i++)
+  {
+    UserSettings.Preset[i].IR = 0;
+    UserSettings.Preset[i].Name[0] = '\0';
+    UserSettings.Preset[i].Input = 0;
+    UserSettings.Preset[i].Volume = 0;
+    UserSettings.Preset[i].Balance = 127;
+    UserSettings.Preset[i].Gain = 0;
+    UserSettings.Preset[i].Triggers = 0;
+    UserSettings.Preset[i].DisplayVolume = 1;
+    UserSettings.Preset[i].DisplayOnLevel = 3;
+    UserSettings.Preset[i].DisplaySelectedInput = true;
+  }
+  UserSettings.LastRecalledPreset = 0;
+  UserSettings.Version = VERSION;
+}
+
+void setVolume(int16_t newVolumeStep)
+{
+  if (appMode == APP_NORMAL_MODE || appMode == APP_BALANCE_MODE)
+  {
+    if (newVolumeStep < Settings.Input[RuntimeSettings.CurrentInput].MinVol)
+      newVolumeStep = Settings.Input[RuntimeSettings.CurrentInput].MinVol;
+    else if (newVolumeStep > Settings.Input[RuntimeSettings.CurrentInput].MaxVol)
+      newVolumeStep = Settings.Input[RuntimeSettings.CurrentInput].MaxVol;
+
+    if (!RuntimeSettings.Muted)
+    {
+      int CurrentAttenuation = calculateAttenuation(RuntimeSettings.CurrentVolume, Settings.VolumeSteps, Settings.MinAttenuation, Settings.MaxAttenuation);
+      if (Settings.Input[RuntimeSettings.CurrentInput].Active != INPUT_HT_PASSTHROUGH)
+        RuntimeSettings.CurrentVolume = newVolumeStep;
+      else
+        RuntimeSettings.CurrentVolume = Settings.Input[RuntimeSettings.CurrentInput].MaxVol; // Set to max volume
+      RuntimeSettings.InputLastVol[RuntimeSettings.CurrentInput] = RuntimeSettings.CurrentVolume;
+
+      int NewAttenuation = calculateAttenuation(RuntimeSettings.CurrentVolume, Settings.VolumeSteps, Settings.MinAttenuation, Settings.MaxAttenuation);
+      rampVolume(CurrentAttenuation, NewAttenuation);
+    }
+    if (appMode == APP_NORMAL_MODE)
+      right_display_update();
+  }
+}
+
+// Fade the volume from one attenuation to another
+// The leader of a linked group starts the ramp LINK_LEAD_TIME after it has been sent, so the followers start at the same time - rampJob()
+// starts it, so the control loop goes on meanwhile. A ramp requested before the scheduled one has started only changes where it ends
+void rampVolume(int fromAttenuation, int toAttenuation)
+{
+  if (rampScheduled || (toAttenuation != fromAttenuation && linkIsLeader()))
+  {
+    if (!rampScheduled)
+    {
+      rampPending.From = fromAttenuation;
+      rampPending.Start = esp_timer_get_time() + LINK_LEAD_TIME * 1000;
+      rampScheduled = true;
+      jobSchedule(JOB_RAMP, LINK_LEAD_TIME);
+    }
+    rampPending.To = toAttenuation;
+    linkSend(rampPending.Start, toAttenuation);
+    return;
+  }
+  rampRun(fromAttenuation, toAttenuation);
+}
+
+// Start the ramp scheduled by rampVolume() - the job may run up to a millisecond before the start time
+void rampJob()
+{
+  if (!rampScheduled)
+    return;
+  rampScheduled = false;
+  linkWaitUntil(rampPending.Start);
+  rampRun(rampPending.From, rampPending.To);
+}
+
+// Drop the scheduled ramp - called when the Muses72323 is muted before it has started
+void rampCancel()
+{
+  rampScheduled = false;
+}
+
+// Fade the volume from one attenuation to another in 0.25 dB steps with 10 ms delay between each step
+void rampRun(int fromAttenuation, int toAttenuation)
+{
+  byte Balance = RuntimeSettings.InputLastBal[RuntimeSettings.CurrentInput];
+  if (toAttenuation > fromAttenuation) {
+    for (int i = fromAttenuation; i < toAttenuation; i++) {
+      musesSetVolume(i, Balance);
+      LOG_TRACE("Volume decreased to: %d", i);
+      delay(10);
+    }
+  } else {
+    for (int i = fromAttenuation; i > toAttenuation; i--) {
+      musesSetVolume(i, Balance);
+      LOG_TRACE("Volume increased to: %d", i);
+      delay(10);
+    }
+  }
+  // Finish at exactly the requested attenuation. If the attenuation is unchanged this is the only write (ie. at startup when the volume is set to the last used volume for the selected input)
+  musesSetVolume(toAttenuation, Balance);
+  LOG_DEBUG("Volume set to: %d", toAttenuation);
+
+  WarmState.Attenuation = toAttenuation;
+  WarmState.MusesMuted = false;
+  saveWarmState();
+}
+
+void left_display_update(void)
+{
+  if (!displaysReady || logoShown)
+    return;
+
+  // Display the name of the current input (but only if it has been chosen to be so by the user)
+  if (displayOptions.SelectedInput)
+  {
+    if (ScreenSaverIsOn)
+      ScreenSaverOff();
+    
+    left_display.setFont(u8g2_font_inb42_mr);
+      
+    // Calculate the width of the text 
+    int16_t textWidth = left_display.getStrWidth(Settings.Input[RuntimeSettings.CurrentInput].Name);
+    // Calculate the height of the text 
+    int16_t textHeight = left_display.getMaxCharHeight(); 
+    // Calculate the x-position to center the text horizontally 
+    int16_t xPos = (256 - textWidth) / 2; 
+    // Calculate the y-position to center the text vertically 
+    int16_t yPos = 52; 
+    // Draw the text 
+    left_display.clearBuffer();
+    left_display.drawStr(xPos, yPos, Settings.Input[RuntimeSettings.CurrentInput].Name);  
+    left_display.sendBuffer(); 
+  }
+}
+
+void right_display_update(void)
+{
+  if (!displaysReady || logoShown)
+    return;
+
+  right_display.clearBuffer();
+
+  // Display the volume or mute status
+  if (displayOptions.Volume)
+  {
+    right_display.setFont(u8g2_font_inb63_mn);
+    if (!RuntimeSettings.Muted)
+    {
+      // If show volume in steps
+      if (displayOptions.Volume == 1)
+      {
+        // Display volume as step
+        // Convert the integer to a string 
+        char buffer[10]; 
+        // Buffer to hold the string representation of the integer 
+        snprintf(buffer, sizeof(buffer), "%d", RuntimeSettings.CurrentVolume);
+        // Calculate the width of the text 
+        int16_t textWidth = right_display.getStrWidth(buffer); 
+        // Calculate the x-position to center the text horizontally 
+        int16_t xPos = (256 - textWidth) / 2; 
+        // Calculate the y-position to center the text vertically 
+        int16_t yPos = 63; 
+        // Draw the text 
+        right_display.drawStr(xPos, yPos, buffer);
+      }
+      else 
+      {
+        // Display volume as -dB - RuntimeSettings.CurrentAttennuation are converted to -dB and multiplied by 10 to be able to show 0.25 dB steps        
+        char buffer[10]; 
+        // Buffer to hold the string representation of the integer 
+        snprintf(buffer, sizeof(buffer), "%d", (calculateAttenuation(RuntimeSettings.CurrentVolume, Settings.VolumeSteps, Settings.MinAttenuation, Settings.MaxAttenuation) / 4) );
+        // Calculate the width of the text 
+        int16_t textWidth = right_display.getStrWidth(buffer); 
+        // Calculate the height of the text 
+        int16_t textHeight = right_display.getMaxCharHeight(); 
+        // Calculate the x-position to center the text horizontally 
+        int16_t xPos = (256 - textWidth) / 2; 
+        // Calculate the y-position to center the text vertically 
+        int16_t yPos = 63; 
+        // Draw the text 
+        right_display.drawStr(xPos,yPos, buffer);
+      }
+    }
+    else
+    {
+      right_display.setFont(u8g2_font_inb63_mn);
+      // Calculate the width of the text 
+      int16_t textWidth = right_display.getStrWidth("MUTE"); 
+      // Calculate the height of the text 
+      int16_t textHeight = right_display.getMaxCharHeight(); 
+      // Calculate the x-position to center the text horizontally 
+      int16_t xPos = (256 - textWidth) / 2; 
+      // Calculate the y-position to center the text vertically 
+      int16_t yPos = 63; 
+      // Draw the text 
+      right_display.drawStr(xPos,yPos, "MUTE");  
+    }
+  }
+
+  // Display the progress of the power up sequence (ie. while waiting for the trigger delay)
+  if (sequenceState == SEQUENCE_POWER_UP)
+  {
+    char buffer[20];
+    snprintf(buffer, sizeof(buffer), "Power up %d/%d", sequenceNext, sequenceCount);
+    right_display.setFont(u8g2_font_profont10_mf);
+    right_display.drawStr(0, 8, buffer);
+  }
+
+  // Display the WiFi status
+  if (wifiState == WIFI_STATE_CONNECTED)
+    drawSignalStrength(wifiRSSI);
+
+  // Display temperature measurements?
+  if (Settings.DisplayTemperature1 || Settings.DisplayTemperature2)
+  {
+    drawTemperatureMeasurements();
+  }
+
+  right_display.sendBuffer();
+  if (ScreenSaverIsOn)
+      ScreenSaverOff();
+}
+
+void drawSignalStrength(int rssi) 
+{ 
+  if (rssi >= -55) {
+    right_display.drawBox(232,4,4,4);
+    right_display.drawBox(237,3,4,5);
+    right_display.drawBox(242,2,4,6);
+    right_display.drawBox(247,1,4,7);
+    right_display.drawBox(252,0,4,8);
+  } else if (rssi >= -67) {
+    right_display.drawBox(232,4,4,4);
+    right_display.drawBox(237,3,4,5);
+    right_display.drawBox(242,2,4,6);
+    right_display.drawBox(247,1,4,7);
+    right_display.drawFrame(252,0,4,8);
+  } else if (rssi >= -70) {
+    right_display.drawBox(232,4,4,4);
+    right_display.drawBox(237,3,4,5);
+    right_display.drawBox(242,2,4,6);
+    right_display.drawFrame(247,1,4,7);
+    right_display.drawFrame(252,0,4,8);
+  } else if (rssi >= -80) {
+    right_display.drawBox(232,4,4,4);
+    right_display.drawBox(237,3,4,5);
+    right_display.drawFrame(242,2,4,6);
+    right_display.drawFrame(247,1,4,7);
+    right_display.drawFrame(252,0,4,8);
+  } else if (rssi >= -90) {
+     right_display.drawBox(232,4,4,4);
+     right_display.drawFrame(237,3,4,5);
+     right_display.drawFrame(242,2,4,6);
+     right_display.drawFrame(247,1,4,7);
+     right_display.drawFrame(252,0,4,8);
+  } else {
+     right_display.drawFrame(232,4,4,4);
+     right_display.drawFrame(237,3,4,5);
+     right_display.drawFrame(242,2,4,6);
+     right_display.drawFrame(247,1,4,7);
+     right_display.drawFrame(252,0,4,8);
+  } 
+}
+
+// Returns the last filtered temperature of the NTC on the specified pin of the ADS1115 - measured by temperatureLoop()
+float getTemperature(uint8_t pinNmbr)
+{
+  // 0 = A0 = Right channel NTC, 1 = A1 = Left channel NTC
+  return readTemperature(pinNmbr) / 10.0;
+}
+
+// Returns the last filtered temperature of NTC 1 (Channel 0) or NTC 2 (Channel 1) in 1/10 degrees Celcius - or the simulated temperature
+int16_t readTemperature(byte Channel)
+{
+  if (tempSimulated[Channel] != TEMP_NOT_SIMULATED)
+    return tempSimulated[Channel];
+  uint32_t Snapshot = temperatureSnapshot.load(std::memory_order_relaxed);
+  return (Channel == 0) ? (int16_t)(Snapshot & 0xFFFF) : (int16_t)(Snapshot >> 16);
+}
+
+// Measure the NTCs in turn without waiting for the ADS1115 - called from loop()
+// A one-shot job: it schedules itself for the next step that is due at a known time. While the result is being read it is not
+// scheduled - i2cTask runs it with jobSignal() when the result (or I2C_ADC_ERROR) is in i2cAdcResult
+void temperatureLoop()
+{
+  if (!adsReady)
+    return;
+
+  unsigned long Interval = (appMode == APP_STANDBY_MODE) ? TEMP_SAMPLE_INTERVAL_STANDBY : TEMP_SAMPLE_INTERVAL;
+  unsigned long Elapsed = millis() - mil_TempSample;
+
+  if (tempPhase == TEMP_IDLE)
+  {
+    if (mil_TempSample != 0 && Elapsed < Interval)
+    {
+      jobSchedule(JOB_TEMPERATURE, Interval - Elapsed);
+      return;
+    }
+    I2CTransaction T;
+    memset(&T, 0, sizeof(T));
+    T.Type = I2C_ADC_START;
+    T.Address = ADS1X15_REG_CONFIG_MUX_SINGLE_0 + tempChannel * 0x1000;
+    i2cAdcResult.store(I2C_ADC_PENDING, std::memory_order_relaxed);
+    mil_TempSample = millis();
+    if (!i2cPost(T, false))
+    {
+      // The I2C queue stayed full - try again at the next sample
+      temperatureErrors.fetch_add(1, std::memory_order_relaxed);
+      jobSchedule(JOB_TEMPERATURE, Interval);
+      return;
+    }
+    tempPhase = TEMP_CONVERTING;
+    jobSchedule(JOB_TEMPERATURE, TEMP_CONVERSION_TIME);
+    return;
+  }
+  if (tempPhase == TEMP_CONVERTING)
+  {
+    if (Elapsed < TEMP_CONVERSION_TIME)
+    {
+      jobSchedule(JOB_TEMPERATURE, TEMP_CONVERSION_TIME - Elapsed);
+      return;
+    }
+    I2CTransaction T;
+    memset(&T, 0, sizeof(T));
+    T.Type = I2C_ADC_READ;
+    if (i2cPost(T, false))
+    {
+      tempPhase = TEMP_READING;
+      return;
+    }
+    // The I2C queue stayed full - the measurement is discarded
+    i2cAdcResult.store(I2C_ADC_ERROR, std::memory_order_relaxed);
+  }
+  int32_t Result = i2cAdcResult.load(std::memory_order_acquire);
+  if (Result == I2C_ADC_PENDING)
+    return;
+  tempPhase = TEMP_IDLE;
+  // The next channel is measured when the interval from the start of this conversion has passed - at once if it already has
+  byte Measured = tempChannel;
+  tempChannel = (tempChannel + 1) % TEMP_CHANNELS;
+  jobSchedule(JOB_TEMPERATURE, jobIntervalLeft(mil_TempSample, Interval, millis()));
+  if (Result == I2C_ADC_ERROR)
+  {
+    temperatureErrors.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  TempChannel *Channel = &tempChannels[Measured];
+  int16_t Value = Result;
+  Channel->Raw[Channel->RawNext] = Value;
+  Channel->RawNext = (Channel->RawNext + 1) % 3;
+  if (Channel->RawCount < 3)
+    Channel->RawCount++;
+  temperatureSamples.fetch_add(1, std::memory_order_relaxed);
+
+  // The median of the last 3 values removes single spikes - the IIR filter smooths the noise
+  int16_t Median = Value;
+  if (Channel->RawCount == 3)
+    Median = std::max(std::min(Channel->Raw[0], Channel->Raw[1]), std::min(std::max(Channel->Raw[0], Channel->Raw[1]), Channel->Raw[2]));
+  if (Channel->RawCount == 1)
+    Channel->Filtered = Median * TEMP_FILTER_SCALE;
+  else
+    Channel->Filtered += (Median * TEMP_FILTER_SCALE - Channel->Filtered) >> TEMP_FILTER_SHIFT;
+
+  int16_t Temp = ntcTemperature(Channel->Filtered);
+  if (ntcFault(Channel->Filtered))
+    temperatureFaults.fetch_or(1 << Measured, std::memory_order_relaxed);
+  else
+    temperatureFaults.fetch_and(~(1 << Measured), std::memory_order_relaxed);
+  uint32_t Snapshot = temperatureSnapshot.load(std::memory_order_relaxed);
+  if (Measured == 0)
+    Snapshot = (Snapshot & 0xFFFF0000) | (uint16_t)Temp;
+  else
+    Snapshot = (Snapshot & 0x0000FFFF) | ((uint32_t)(uint16_t)Temp << 16);
+  temperatureSnapshot.store(Snapshot, std::memory_order_relaxed);
+}
+
+// Evaluate the temperatures against the limits of the thermal protection - called from loop()
+void protectionLoop()
+{
+  // Wait until both NTCs have been measured (or a temperature is simulated) - the rise would be measured from 0 degrees
+  bool Measured = temperatureSamples.load(std::memory_order_relaxed) >= TEMP_CHANNELS ||
+                  tempSimulated[0] != TEMP_NOT_SIMULATED || tempSimulated[1] != TEMP_NOT_SIMULATED;
+  if (!Measured)
+    return;
+
+  const byte Limits[TEMP_CHANNELS] = {Settings.Trigger1Temp, Settings.Trigger2Temp};
+  bool Cool = true;
+  byte Causes = 0;
+  for (byte i = 0; i < TEMP_CHANNELS; i++)
+  {
+    bool Fault = tempSimulated[i] == TEMP_NOT_SIMULATED && (temperatureFaults.load(std::memory_order_relaxed) & (1 << i));
+    Causes |= protectionCheck(protectionHistory[i], readTemperature(i), Limits[i], Fault, Cool) << i;
+  }
+
+  switch (protectionAction(protectionTripped, Causes, Cool, appMode == APP_STANDBY_MODE))
+  {
+  case PROTECTION_TRIP:
+    protectionTrip(Causes);
+    break;
+  case PROTECTION_BLOCK:
+    protectionTripped |= Causes; // Too hot to be turned on
+    break;
+  case PROTECTION_RELEASE:
+    protectionTripped = 0;
+    LOG_WARN("Thermal protection released - temperatures %d/%d", readTemperature(0), readTemperature(1));
+    break;
+  }
+}
+
+// Turn the controller off because of the temperatures - the output is muted first, as toStandbyMode() writes the EEPROM before it mutes
+void protectionTrip(byte Causes)
+{
+  rampCancel();
+  muses.mute();
+  WarmState.MusesMuted = true;
+  protectionTripped = Causes;
+  protectionTrips.fetch_add(1, std::memory_order_relaxed);
+  LOG_ERROR("Thermal protection tripped (0x%02x) - temperatures %d/%d", Causes, readTemperature(0), readTemperature(1));
+
+  toStandbyMode();
+
+  // toStandbyMode() sets the mute level (if MuteLevel is set) - the output stays fully muted until the controller is turned on again
+  muses.mute();
+  WarmState.MusesMuted = true;
+  saveWarmState();
+}
+
+void drawTemperatureMeasurements(void)
+{
+  // TO DO: Implement handling of Settings.DisplayTemperature1 and Settings.DisplayTemperature2 
+  
+  right_display.drawFrame(232,34,24,14);
+  right_display.drawFrame(232,50,24,14);
+  
+  right_display.setFontMode(1);
+  right_display.setDrawColor(1);
+
+  right_display.drawFrame(232,34,24,14);
+  int tempRight = static_cast<int>(getTemperature(0)); // Get temperature for right channel and convert to integer  
+  right_display.drawBox(234,36,map(minimum(tempRight, 65), 0, 65, 0, 20),10);
+
+  right_display.drawFrame(232,50,24,14);
+  int tempLeft = static_cast<int>(getTemperature(1)); // Get temperature for left channel and convert to integer
+  right_display.drawBox(234,52,map(minimum(tempLeft, 65), 0, 65, 0, 20),10);
+
+  right_display.setDrawColor(2);
+  right_display.setFont(u8g2_font_profont10_mf);
+
+  char tempRightStr[3];
+  snprintf(tempRightStr, sizeof(tempRightStr), "%d", tempRight);
+  right_display.drawStr(239, 44, tempRightStr);
+
+  char tempLeftStr[3];
+  snprintf(tempLeftStr, sizeof(tempLeftStr), "%d", tempLeft);
+  right_display.drawStr(239, 60, tempLeftStr);
+}
+
+// Returns input from the user - enumerated to be the same value no matter if input is from encoders or IR remote
+byte getUserInput()
+{
+
+  if (interruptCounter > 0)
+  {
+    portENTER_CRITICAL(&timerMux);
+    interruptCounter--;
+    portEXIT_CRITICAL(&timerMux);
+
+    totalInterruptCounter++;
+  }
+
+  byte receivedInput = KEY_NONE;
+
+  // Read input from encoder 1
+  e1value += encoder1->getValue();
+
+  if (e1value != e1last)
+  {
+    if (e1value > e1last)
+      receivedInput = KEY_UP;
+    if (e1value < e1last)
+      receivedInput = KEY_DOWN;
+    e1last = e1value;
+  }
+
+  // Check if button on encoder 1 is clicked
+  button1 = encoder1->getButton();
+  switch (button1)
+  {
+  case ClickEncoder::Clicked:
+    receivedInput = KEY_SELECT;
+    break;
+  case ClickEncoder::Released:
+    // Long press on rotary 1 steps through the stored presets
+    requestedPreset = getNextPreset();
+    if (requestedPreset < PRESET_COUNT)
+      receivedInput = KEY_PRESET;
+    break;
+  default:
+    break;
+  }
+
+  // Read input from encoder 2
+  e2value += encoder2->getValue();
+
+  if (e2value != e2last)
+  {
+    if (e2value > e2last)
+      receivedInput = KEY_RIGHT;
+    if (e2value < e2last)
+      receivedInput = KEY_LEFT;
+    e2last = e2value;
+  }
+
+  // Check if button on encoder 2 is clicked
+  button2 = encoder2->getButton();
+  switch (button2)
+  {
+  case ClickEncoder::Clicked:
+    receivedInput = KEY_BACK;
+    break;
+  
+  case ClickEncoder::DoubleClicked:
+    if (appMode == APP_STANDBY_MODE)
+      receivedInput = KEY_ON;
+    else 
+      receivedInput = KEY_OFF;
+    break;
+
+  case ClickEncoder::Released:
+    // Long press on rotary 2 shows the QR code for the WiFi configuration portal
+    receivedInput = KEY_WIFI_SETUP;
+    break;
+  
+  default:
+    break;
+  }
+
+  // While learning, the next code received is stored in the field being learned instead of being handled as user input
+  if (irLearnField >= 0)
+  {
+    if (millis() - mil_IrLearn > IR_LEARN_TIMEOUT)
+    {
+      if (networkReady)
+        WebSerial.println("IR learning timed out");
+      irLearnField = -1;
+    }
+    else if (irrecv.decode(&IRresults))
+    {
+      irFramesDecoded.fetch_add(1, std::memory_order_relaxed);
+      if (IRresults.value != Settings.IR_REPEAT && !IRresults.repeat)
+      {
+        memcpy(Settings.data + SettingFields[irLearnField].Offset, &IRresults.value, sizeof(uint64_t));
+        writeSettingsToEEPROM();
+        if (networkReady)
+          WebSerial.printf("%s = %s\n", SettingFields[irLearnField].Name, uint64ToString(IRresults.value, HEX).c_str());
+        irLearnField = -1;
+      }
+      irrecv.resume();
+      return KEY_NONE;
+    }
+  }
+
+  // Check if any input from the IR remote
+  if (irrecv.decode(&IRresults))
+  {
+      irFramesDecoded.fetch_add(1, std::memory_order_relaxed);
+      debug("IR code: "); debug(uint64ToString(IRresults.value, HEX).c_str());debugln("");
+      // Map the received IR input to UserInput values
+      if (IRresults.value == Settings.IR_UP)
+        receivedInput = KEY_UP;
+      else if (IRresults.value == Settings.IR_DOWN)
+        receivedInput = KEY_DOWN;
+      else if (IRresults.value == Settings.IR_LEFT)
+        receivedInput = KEY_LEFT;
+      else if (IRresults.value == Settings.IR_RIGHT)
+        receivedInput = KEY_RIGHT;
+      else if (IRresults.value == Settings.IR_SELECT)
+        receivedInput = KEY_SELECT;
+      else if (IRresults.value == Settings.IR_BACK)
+        receivedInput = KEY_BACK;
+      else if (IRresults.value == Settings.IR_MUTE)
+        receivedInput = KEY_MUTE;
+      else if (appMode == APP_STANDBY_MODE && IRresults.value == Settings.IR_ON)
+        receivedInput = KEY_ON;
+      else if (appMode == APP_NORMAL_MODE && IRresults.value == Settings.IR_OFF)
+        receivedInput = KEY_OFF;
+      else if (IRresults.value == Settings.IR_1)
+        receivedInput = KEY_1;
+      else if (IRresults.value == Settings.IR_2)
+        receivedInput = KEY_2;
+      else if (IRresults.value == Settings.IR_3)
+        receivedInput = KEY_3;
+      else if (IRresults.value == Settings.IR_4)
+        receivedInput = KEY_4;
+      else if (IRresults.value == Settings.IR_5)
+        receivedInput = KEY_5;
+      else if (IRresults.value == Settings.IR_PREVIOUS)
+        receivedInput = KEY_PREVIOUS;
+      else if (IRresults.value == Settings.IR_REPEAT)
+      {
+        receivedInput = KEY_REPEAT;
+        if (lastReceivedInput == KEY_UP)
+          receivedInput = KEY_UP;
+        else if (lastReceivedInput == KEY_DOWN)
+          receivedInput = KEY_DOWN;
+      }
+      else
+      {
+        // Check if the code is assigned to one of the presets
+        for (byte i = 0; i < PRESET_COUNT; i++)
+        {
+          if (UserSettings.Preset[i].IR != 0 && UserSettings.Preset[i].Name[0] != '\0' && IRresults.value == UserSettings.Preset[i].IR)
+          {
+            requestedPreset = i;
+            receivedInput = KEY_PRESET;
+            break;
+          }
+        }
+      }
+    if (receivedInput == KEY_NONE)
+      irFramesRejected.fetch_add(1, std::memory_order_relaxed);
+    lastReceivedInput = receivedInput;
+    irrecv.resume();  // Receive the next value
+  }
+  if (receivedInput != KEY_NONE) { 
+    mil_LastUserInput = millis();
+    debug("getUserInput: "); debugln(receivedInput); 
+  }
+  return (receivedInput);
+}
+
+void toAppNormalMode()
+{
+  debugln("toAppNormalMode");
+  left_display_update();
+  right_display_update();
+  appMode = APP_NORMAL_MODE;
+}
+
+void toStandbyMode()
+{
+  debugln("toStandbyMode");
+  appMode = APP_STANDBY_MODE;
+  writeRuntimeSettingsToEEPROM();
+  mute();
+  dropProvisioningScreen();
+  if (displaysReady)
+  {
+    left_display.clearDisplay();
+    right_display.clearDisplay();
+  }
+  // Turn off the output relay, the triggers and the external power relay in the order of Settings.PowerDownOrder
+  sequenceStart(SEQUENCE_POWER_DOWN);
+  saveWarmState();
+  last_KEY_ONOFF = millis();
+}
+
+// Use the display settings of Settings (ie. after they have been read or changed)
+void displayOptionsFromSettings()
+{
+  displayOptions.Volume = Settings.DisplayVolume;
+  displayOptions.OnLevel = Settings.DisplayOnLevel;
+  displayOptions.SelectedInput = Settings.DisplaySelectedInput;
+}
+
+// Set the contrast of the displays to displayOptions.OnLevel: 0 = 25%, 1 = 50%, 2 = 75%, 3 = 100%
+void setDisplayContrast()
+{
+  byte Contrast = (displayOptions.OnLevel + 1) * 64 - 1;
+  left_display.setContrast(Contrast);
+  right_display.setContrast(Contrast);
+}
+
+void ScreenSaverOn(void)
+{
+  debugln("Screensaver on");
+  ScreenSaverIsOn = true;
+  dropProvisioningScreen();
+  if (displaysReady)
+  {
+    left_display.clearDisplay();
+    right_display.clearDisplay();
+  }
+}
+
+void ScreenSaverOff(void)
+{
+  if (ScreenSaverIsOn) 
+  {
+    debugln("Screensaver off");
+    ScreenSaverIsOn = false;
+    left_display_update();
+    right_display_update();
+  }
+}
+
+boolean setInput(uint8_t NewInput)
+{
+  boolean result = false;
+  if (Settings.Input[NewInput].Active != INPUT_INACTIVATED && NewInput >= 0 && NewInput <= 4 && appMode == APP_NORMAL_MODE)
+  {
+    if (!RuntimeSettings.Muted)
+      mute();
+
+    // Input 1 relay -> RuntimeSettings.CurrentInput = 0 -> MCP23008 pin 7
+    // Input 2 relay -> RuntimeSettings.CurrentInput = 1 -> MCP23008 pin 6
+    // Input 3 relay -> RuntimeSettings.CurrentInput = 2 -> MCP23008 pin 5
+    // Input 4 relay -> RuntimeSettings.CurrentInput = 3 -> MCP23008 pin 4
+    // Input 5 relay -> RuntimeSettings.CurrentInput = 4 -> MCP23008 pin 3
+
+    // Save the currently selected input to enable switching between two inputs
+    RuntimeSettings.PrevSelectedInput = RuntimeSettings.CurrentInput;
+
+    // Select new input
+    muses.setGain(Settings.Input[NewInput].Gain);
+    WarmState.Gain = Settings.Input[NewInput].Gain;
+    RuntimeSettings.CurrentInput = NewInput;
+
+
+    if (Settings.RecallSetLevel)
+      RuntimeSettings.CurrentVolume = RuntimeSettings.InputLastVol[RuntimeSettings.CurrentInput];
+    else if (RuntimeSettings.CurrentVolume > Settings.Input[RuntimeSettings.CurrentInput].MaxVol)
+      RuntimeSettings.CurrentVolume = Settings.Input[RuntimeSettings.CurrentInput].MaxVol;
+    else if (RuntimeSettings.CurrentVolume < Settings.Input[RuntimeSettings.CurrentInput].MinVol)
+      RuntimeSettings.CurrentVolume = Settings.Input[RuntimeSettings.CurrentInput].MinVol;
+        
+    // Unselect the previous input and select the new one
+    relaySwitch(RELAY_INPUTS, RELAY_INPUT(NewInput));
+    
+    if (RuntimeSettings.Muted)
+      unmute();
+    else
+      setVolume(RuntimeSettings.CurrentVolume);
+
+    left_display_update();
+    result = true;
+  }
+  return result;
+}
+
+// Apply a target state as one transition: if the input or gain changes the output is muted once, the relays are switched once
+// and the volume is faded in once from the mute level. A change of volume only is faded directly from the current volume
+// Used by recallPreset() and the API so several changes do not result in the mute/unmute and fades of calling setInput() and setVolume() after each other
+boolean applyTransition(StateTarget Target)
+{
+  if (appMode != APP_NORMAL_MODE)
+    return false;
+  if ((Target.Fields & TARGET_INPUT) && (Target.Input > 4 || Settings.Input[Target.Input].Active == INPUT_INACTIVATED))
+    return false;
+
+  bool InputChange = (Target.Fields & TARGET_INPUT) && Target.Input != RuntimeSettings.CurrentInput;
+  byte NewVolume = (Target.Fields & TARGET_VOLUME) ? Target.Volume : RuntimeSettings.CurrentVolume;
+  if (InputChange)
+  {
+    // As setInput(): the gain of the new input and its last used volume (if RecallSetLevel is set) unless they are part of the target
+    if (!(Target.Fields & TARGET_GAIN))
+    {
+      Target.Gain = Settings.Input[Target.Input].Gain;
+      Target.Fields |= TARGET_GAIN;
+    }
+    if (!(Target.Fields & TARGET_VOLUME) && Settings.RecallSetLevel)
+      NewVolume = RuntimeSettings.InputLastVol[Target.Input];
+  }
+  bool GainChange = (Target.Fields & TARGET_GAIN) && Target.Gain != WarmState.Gain;
+  bool Muted = (Target.Fields & TARGET_MUTE) ? Target.Muted : RuntimeSettings.Muted;
+
+  debug("applyTransition: fields "); debugln(Target.Fields);
+
+  // Mute before any relay or the gain is switched
+  if ((InputChange || GainChange || Muted) && !RuntimeSettings.Muted)
+    mute();
+
+  // Switch input relays (see setInput for the mapping of inputs to MCP23008 pins)
+  if (InputChange)
+  {
+    RuntimeSettings.PrevSelectedInput = RuntimeSettings.CurrentInput;
+    RuntimeSettings.CurrentInput = Target.Input;
+    relaySwitch(RELAY_INPUTS, RELAY_INPUT(RuntimeSettings.CurrentInput));
+  }
+  if (GainChange)
+  {
+    muses.setGain(Target.Gain);
+    WarmState.Gain = Target.Gain;
+  }
+
+  // Apply triggers - only triggers changing state are switched (a trigger that is not active in the settings stays off)
+  if (Target.Fields & TARGET_TRIGGER1)
+  {
+    if ((Target.Triggers & 0x01) && !(WarmState.Triggers & 0x01))
+      setTrigger1On();
+    else if (!(Target.Triggers & 0x01) && (WarmState.Triggers & 0x01))
+      setTrigger1Off();
+  }
+  if (Target.Fields & TARGET_TRIGGER2)
+  {
+    if ((Target.Triggers & 0x02) && !(WarmState.Triggers & 0x02))
+      setTrigger2On();
+    else if (!(Target.Triggers & 0x02) && (WarmState.Triggers & 0x02))
+      setTrigger2Off();
+  }
+
+  if (Target.Fields & TARGET_BALANCE)
+    RuntimeSettings.InputLastBal[RuntimeSettings.CurrentInput] = Target.Balance;
+
+  // Keep the volume within the limits of the input
+  if (Settings.Input[RuntimeSettings.CurrentInput].Active == INPUT_HT_PASSTHROUGH || NewVolume > Settings.Input[RuntimeSettings.CurrentInput].MaxVol)
+    NewVolume = Settings.Input[RuntimeSettings.CurrentInput].MaxVol;
+  else if (NewVolume < Settings.Input[RuntimeSettings.CurrentInput].MinVol)
+    NewVolume = Settings.Input[RuntimeSettings.CurrentInput].MinVol;
+
+  // Fade in from the mute level (or the lowest volume allowed for the input) if muted - otherwise from the current volume
+  byte FromVolume = RuntimeSettings.CurrentVolume;
+  if (RuntimeSettings.Muted)
+  {
+    FromVolume = (Settings.MuteLevel) ? Settings.MuteLevel : Settings.Input[RuntimeSettings.CurrentInput].MinVol;
+    if (FromVolume > NewVolume)
+      FromVolume = NewVolume;
+  }
+  // The state is updated before the ramp (as in setVolume), so a linked leader sends the new state with the ramp
+  RuntimeSettings.CurrentVolume = NewVolume;
+  RuntimeSettings.InputLastVol[RuntimeSettings.CurrentInput] = NewVolume;
+  if (!Muted)
+  {
+    RuntimeSettings.Muted = false;
+    rampVolume(calculateAttenuation(FromVolume, Settings.VolumeSteps, Settings.MinAttenuation, Settings.MaxAttenuation),
+               calculateAttenuation(NewVolume, Settings.VolumeSteps, Settings.MinAttenuation, Settings.MaxAttenuation));
+  }
+
+  left_display_update();
+  right_display_update();
+  return true;
+}
+
+// Recall a stored preset as one transition (see applyTransition)
+boolean recallPreset(uint8_t PresetNo)
+{
+  if (PresetNo >= PRESET_COUNT || appMode != APP_NORMAL_MODE)
+    return false;
+
+  struct PresetSettings *Preset = &UserSettings.Preset[PresetNo];
+  if (Preset->Name[0] == '\0' || Preset->Input > 4 || Settings.Input[Preset->Input].Active == INPUT_INACTIVATED)
+    return false;
+
+  debug("recallPreset: "); debugln(Preset->Name);
+
+  StateTarget Target;
+  Target.Fields = TARGET_INPUT | TARGET_VOLUME | TARGET_BALANCE | TARGET_MUTE | TARGET_TRIGGER1 | TARGET_TRIGGER2 | TARGET_GAIN;
+  Target.Input = Preset->Input;
+  Target.Volume = Preset->Volume;
+  Target.Balance = Preset->Balance;
+  Target.Muted = false;
+  Target.Triggers = Preset->Triggers;
+  Target.Gain = Preset->Gain;
+  // The display settings only apply until the settings are changed or the controller is restarted - applyTransition() redraws the displays
+  displayOptions.Volume = Preset->DisplayVolume;
+  displayOptions.OnLevel = Preset->DisplayOnLevel;
+  displayOptions.SelectedInput = Preset->DisplaySelectedInput;
+  if (displaysReady)
+    setDisplayContrast();
+  if (!applyTransition(Target))
+    return false;
+
+  UserSettings.LastRecalledPreset = PresetNo;
+  return true;
+}
+
+// Store the current setup as a preset
+boolean storePreset(uint8_t PresetNo, const char *Name)
+{
+  if (PresetNo >= PRESET_COUNT || Name == NULL || Name[0] == '\0')
+    return false;
+
+  struct PresetSettings *Preset = &UserSettings.Preset[PresetNo];
+  strncpy(Preset->Name, Name, sizeof(Preset->Name) - 1);
+  Preset->Name[sizeof(Preset->Name) - 1] = '\0';
+  Preset->Input = RuntimeSettings.CurrentInput;
+  Preset->Volume = RuntimeSettings.CurrentVolume;
+  Preset->Balance = RuntimeSettings.InputLastBal[RuntimeSettings.CurrentInput];
+  Preset->Gain = Settings.Input[RuntimeSettings.CurrentInput].Gain;
+  Preset->Triggers = WarmState.Triggers;
+  Preset->DisplayVolume = displayOptions.Volume;
+  Preset->DisplayOnLevel = displayOptions.OnLevel;
+  Preset->DisplaySelectedInput = displayOptions.SelectedInput;
+  writeUserSettingsToEEPROM();
+
+  debug("storePreset: "); debugln(Preset->Name);
+  return true;
+}
+
+// Returns the next used preset after the one recalled most recently - or PRESET_COUNT if no presets are stored
+byte getNextPreset()
+{
+  for (byte i = 1; i <= PRESET_COUNT; i++)
+  {
+    byte PresetNo = (UserSettings.LastRecalledPreset + i) % PRESET_COUNT;
+    if (UserSettings.Preset[PresetNo].Name[0] != '\0')
+      return PresetNo;
+  }
+  return PRESET_COUNT;
+}
+
+// The queue of commandBus - a FreeRTOS queue, so the callbacks never block
+bool commandQueueSend(const Command &cmd)
+{
+  return xQueueSend(commandQueue, &cmd, 0) == pdTRUE;
+}
+
+bool commandQueuePeek(Command &cmd)
+{
+  return xQueuePeek(commandQueue, &cmd, 0) == pdTRUE;
+}
+
+void commandQueuePop()
+{
+  Command cmd;
+  xQueueReceive(commandQueue, &cmd, 0);
+}
+
+void commandQueueLock(bool Take)
+{
+  if (Take)
+    xSemaphoreTake(commandLock, portMAX_DELAY);
+  else
+    xSemaphoreGive(commandLock);
+}
+
+// Post a command to the control loop - can be called from any task
+// Returns the ticket of the command or 0 if the queue is full
+uint32_t postCommand(byte Type, int32_t Value, byte Source, const char *Text)
+{
+  if (commandQueue == NULL)
+    return 0;
+
+  Command cmd;
+  memset(&cmd, 0, sizeof(cmd));
+  cmd.Type = Type;
+  cmd.Source = Source;
+  cmd.Value = Value;
+  if (Text != NULL)
+    strncpy(cmd.Text, Text, sizeof(cmd.Text) - 1);
+
+  uint32_t ticket = commandPost(commandBus, cmd);
+  if (ticket == 0)
+  {
+    debugln("Command queue full - command dropped");
+    return 0;
+  }
+  if (loopWake != NULL)
+    xSemaphoreGive(loopWake);
+  return ticket;
+}
+
+// Execute the commands waiting in the queue - only called from loop()
+// A CMD_KEY is returned as user input so it is handled exactly like a key from the rotary encoders or the IR remote. If keyAllowed is false
+// (loop() already has user input to handle) the key and the commands after it are left in the queue until the next pass
+// An API transition is left waiting while the previous one is too recent - requests arriving meanwhile are merged into it
+byte processCommands(bool keyAllowed)
+{
+  Command cmd;
+
+  if (commandQueue == NULL)
+    return KEY_NONE;
+
+  while (commandTake(commandBus, cmd, keyAllowed, millis() - mil_LastTransition >= API_TRANSITION_INTERVAL))
+  {
+    if (cmd.Type == CMD_KEY)
+    {
+      commandDone(commandBus, cmd);
+      return cmd.Value;
+    }
+    executeCommand(cmd);
+    commandDone(commandBus, cmd);
+  }
+  return KEY_NONE;
+}
+
+// Execute a single command from the queue - commands that change the audio are only accepted in APP_NORMAL_MODE
+void executeCommand(const Command &cmd)
+{
+  LOG_DEBUG("Command %u type %d value %d source %d", cmd.Ticket, cmd.Type, cmd.Value, cmd.Source);
+
+  // Settings can be imported in any mode
+  if (cmd.Type == CMD_IMPORT_SETTINGS)
+  {
+    applyImportedSettings();
+    return;
+  }
+
+  // The EEPROM is read by the control loop, so WebSerial does not wait for i2cTask
+  if (cmd.Type == CMD_EEPROM_DUMP)
+  {
+    dumpEEPROM(WebSerial, cmd.Value >> 16, cmd.Value & 0xFFFF);
+    return;
+  }
+
+  // The power down sequence continues in standby
+  if (cmd.Type == CMD_SEQUENCE)
+  {
+    sequenceRun();
+    return;
+  }
+
+  // The WiFi configuration portal can be used in any mode - settings queued before the command have been saved when it is executed
+  if (cmd.Type == CMD_RESTART)
+  {
+    restartPending = true;
+    jobSchedule(JOB_RESTART, RESTART_DELAY);
+    return;
+  }
+
+  // WebSocket clients must be able to follow the state in any mode
+  if (cmd.Type == CMD_WS_RESYNC)
+  {
+    byte freeSlot = WS_MAX_CLIENTS;
+    for (byte i = 0; i < WS_MAX_CLIENTS; i++)
+    {
+      if (wsClients[i].Id == (uint32_t)cmd.Value)
+      {
+        wsClients[i].NeedsResync = true;
+        return;
+      }
+      if (wsClients[i].Id == 0 && freeSlot == WS_MAX_CLIENTS)
+        freeSlot = i;
+    }
+    if (freeSlot < WS_MAX_CLIENTS)
+    {
+      wsClients[freeSlot].Id = cmd.Value;
+      wsClients[freeSlot].NeedsResync = true;
+    }
+    else if (ws.client(cmd.Value) != NULL)
+      ws.client(cmd.Value)->close();
+    return;
+  }
+
+  // The target is taken in any mode, so the next API request posts a new CMD_TARGET - applyTransition() refuses it outside APP_NORMAL_MODE
+  if (cmd.Type == CMD_TARGET)
+  {
+    portENTER_CRITICAL(&apiTargetMux);
+    StateTarget Target = targetTake(apiTarget);
+    portEXIT_CRITICAL(&apiTargetMux);
+    applyTransition(Target);
+    mil_LastTransition = millis();
+    return;
+  }
+
+  // Likewise the pending volume, so the next volume request from MQTT or UDP posts a new CMD_VOLUME
+  if (cmd.Type == CMD_VOLUME)
+  {
+    int Volume = commandTakeVolume(pendingVolume);
+    if (Volume < 0)
+      return;
+    StateTarget Target;
+    memset(&Target, 0, sizeof(Target));
+    Target.Fields = TARGET_VOLUME;
+    Target.Volume = Volume;
+    applyTransition(Target);
+    return;
+  }
+
+  // And the state of the leader, so the next packet of the leader posts a new CMD_LINK
+  if (cmd.Type == CMD_LINK)
+  {
+    linkApply();
+    return;
+  }
+
+  if (appMode != APP_NORMAL_MODE)
+  {
+    debugln("Command ignored - not in normal mode");
+    return;
+  }
+
+  switch (cmd.Type)
+  {
+  case CMD_INPUT:
+    setInput(cmd.Value);
+    break;
+  case CMD_MUTE:
+    muteOutput();
+    break;
+  case CMD_UNMUTE:
+    unmuteOutput();
+    break;
+  case CMD_PRESET:
+    recallPreset(cmd.Value);
+    break;
+  case CMD_STORE_PRESET:
+    storePreset(cmd.Value, cmd.Text);
+    break;
+  case CMD_SET_MUTE:
+  {
+    StateTarget Target;
+    memset(&Target, 0, sizeof(Target));
+    Target.Fields = TARGET_MUTE;
+    Target.Muted = (cmd.Value != 0);
+    applyTransition(Target);
+    break;
+  }
+  case CMD_IR_LEARN:
+    irLearnField = cmd.Value;
+    mil_IrLearn = millis();
+    break;
+  }
+}
+
+// PATCH /api/v1/state - runs in the AsyncTCP task. The fields are validated and merged into apiTarget, which is applied by the control loop
+// Only one CMD_TARGET is queued at a time: requests arriving before it is executed are merged into it and get the same ticket
+void handleStatePatch(AsyncWebServerRequest *request, JsonVariant &json)
+{
+  StateTarget Target;
+  memset(&Target, 0, sizeof(Target));
+
+  if (!json["input"].isNull())
+  {
+    int Input = json["input"].as<int>();
+    if (Input < 1 || Input > 5 || Settings.Input[Input - 1].Active == INPUT_INACTIVATED)
+    {
+      request->send(400, "application/json", "{\"error\":\"input\"}");
+      return;
+    }
+    Target.Input = Input - 1;
+    Target.Fields |= TARGET_INPUT;
+  }
+  if (!json["volume"].isNull())
+  {
+    int Volume = json["volume"].as<int>();
+    if (Volume < 0 || Volume > Settings.VolumeSteps)
+    {
+      request->send(400, "application/json", "{\"error\":\"volume\"}");
+      return;
+    }
+    Target.Volume = Volume;
+    Target.Fields |= TARGET_VOLUME;
+  }
+  if (!json["balance"].isNull())
+  {
+    int Balance = json["balance"].as<int>();
+    if (Balance < 118 || Balance > 136)
+    {
+      request->send(400, "application/json", "{\"error\":\"balance\"}");
+      return;
+    }
+    Target.Balance = Balance;
+    Target.Fields |= TARGET_BALANCE;
+  }
+  if (!json["muted"].isNull())
+  {
+    Target.Muted = json["muted"].as<bool>();
+    Target.Fields |= TARGET_MUTE;
+  }
+  if (!json["trigger1"].isNull())
+  {
+    Target.Triggers |= json["trigger1"].as<bool>() ? 0x01 : 0;
+    Target.Fields |= TARGET_TRIGGER1;
+  }
+  if (!json["trigger2"].isNull())
+  {
+    Target.Triggers |= json["trigger2"].as<bool>() ? 0x02 : 0;
+    Target.Fields |= TARGET_TRIGGER2;
+  }
+  if (Target.Fields == 0)
+  {
+    request->send(400, "application/json", "{\"error\":\"no fields\"}");
+    return;
+  }
+
+  uint32_t ticket = postTarget(Target, SRC_WEB);
+  if (ticket == 0)
+  {
+    request->send(503, "application/json", "{\"error\":\"busy\"}");
+    return;
+  }
+  request->send(202, "application/json", "{\"ticket\":" + String(ticket) + "}");
+}
+
+// Merge Target into apiTarget and post a CMD_TARGET for it unless one is already queued - the newest value of a field wins
+// Must be called from the AsyncTCP task (web handlers and WebSerial), so no other caller can post a CMD_TARGET in between
+// Returns the ticket of the CMD_TARGET or 0 if the queue is full
+uint32_t postTarget(const StateTarget &Target, byte Source)
+{
+  portENTER_CRITICAL(&apiTargetMux);
+  bool Post = targetPut(apiTarget, Target);
+  uint32_t ticket = apiTarget.Ticket;
+  portEXIT_CRITICAL(&apiTargetMux);
+  if (!Post)
+    return ticket;
+
+  ticket = postCommand(CMD_TARGET, 0, Source);
+  portENTER_CRITICAL(&apiTargetMux);
+  targetPosted(apiTarget, ticket);
+  portEXIT_CRITICAL(&apiTargetMux);
+  return ticket;
+}
+
+// Request a volume step (already validated) - can be called from any task. Merged into a waiting CMD_VOLUME if there is one
+// Returns the ticket of the CMD_VOLUME or 0 if the queue is full
+uint32_t postVolume(byte Volume, byte Source)
+{
+  if (commandQueue == NULL)
+    return 0;
+
+  Command cmd;
+  memset(&cmd, 0, sizeof(cmd));
+  cmd.Source = Source;
+  uint32_t ticket = commandPostVolume(commandBus, pendingVolume, cmd, Volume);
+  if (ticket != 0 && loopWake != NULL)
+    xSemaphoreGive(loopWake);
+  return ticket;
+}
+
+// Answer a web request with the ticket of the posted command - or 503 if the command queue is full
+void sendTicket(AsyncWebServerRequest *request, uint32_t ticket)
+{
+  if (ticket == 0)
+    request->send(503, "text/plain", "Busy");
+  else
+    request->send(202, "text/plain", String(ticket));
+}
+
+// The commands of the WebSerial shell - listed by HELP in this order
+const ShellCommand ShellCommands[] = {
+  {"HELP", "", shellHelp, "", "List the commands"},
+  {"GET", "w", shellGet, "[setting]", "Show one setting - or all as JSON"},
+  {"SET", "WT", shellSet, "setting value", "Change a setting"},
+  {"VOL", "N", shellVolume, "step", "Set the volume"},
+  {"INPUT", "N", shellInput, "1-5", "Select an input"},
+  {"PRESET", "N", shellPreset, "1-8", "Recall a preset"},
+  {"MUTE", "", shellMute, "", "Mute the output"},
+  {"UNMUTE", "", shellUnmute, "", "Unmute the output"},
+  {"KEY", "Wn", shellKey, "key [count]", "Simulate key presses (UP, DOWN, LEFT, RIGHT, SELECT, BACK, MUTE)"},
+  {"IRLEARN", "W", shellIrLearn, "IR_setting", "Learn an IR code from the remote"},
+  {"METRICS", "", shellMetrics, "", "Show the metrics"},
+  {"LINK", "", shellLink, "", "Show the state of the linked group"},
+  {"WEBSTATS", "", shellWebStats, "", "Show the requests of the web pages"},
+  {"TRACE", "W", shellTrace, "ON|OFF", "Start/stop logging trace messages"},
+  {"EEPROM", "nn", shellEEPROM, "[address] [length]", "Hexdump of the EEPROM"},
+  {"TEMP", "nw", shellTemp, "[1|2 degrees|OFF]", "Show the temperatures - or simulate the temperature of an NTC"}
+};
+
+#define SHELL_COMMAND_COUNT (sizeof(ShellCommands) / sizeof(ShellCommands[0]))
+
+// Print the result of posting a command from the shell
+void shellReport(uint32_t ticket)
+{
+  if (ticket == 0)
+    WebSerial.println("Busy");
+  else
+    WebSerial.printf("Queued as %lu\n", (unsigned long)ticket);
+}
+
+void shellHelp(byte Count, const ShellArg *Args)
+{
+  for (byte i = 0; i < SHELL_COMMAND_COUNT; i++)
+    WebSerial.printf("%-8s %-18s %s\n", ShellCommands[i].Name, ShellCommands[i].Usage, ShellCommands[i].Help);
+}
+
+void shellGet(byte Count, const ShellArg *Args)
+{
+  if (Count == 0)
+  {
+    exportSettings(WebSerial);
+    WebSerial.println();
+    return;
+  }
+  int Field = findSettingField(Args[0].Text);
+  if (Field < 0)
+  {
+    WebSerial.println("Unknown setting");
+    return;
+  }
+  WebSerial.print(SettingFields[Field].Name);
+  WebSerial.print(" = ");
+  printSettingValue(WebSerial, &SettingFields[Field]);
+  WebSerial.println();
+}
+
+// The value is validated and applied exactly like a settings import via /api/settings
+void shellSet(byte Count, const ShellArg *Args)
+{
+  int Field = findSettingField(Args[0].Text);
+  if (Field < 0)
+  {
+    WebSerial.println("Unknown setting");
+    return;
+  }
+  const SettingField *Setting = &SettingFields[Field];
+  if (Setting->Type == SETTING_INPUTS || Setting->Type == SETTING_VERSION)
+  {
+    WebSerial.println("Not supported - use POST /api/settings");
+    return;
+  }
+
+  // Build {"Name":value} - text and IR codes are sent as JSON strings
+  char Json[2 * SHELL_LINE_LENGTH + 48]; // Room for a value where every character is escaped
+  bool Quoted = (Setting->Type != SETTING_BYTE);
+  size_t Length = snprintf(Json, sizeof(Json), "{\"%s\":%s", Setting->Name, Quoted ? "\"" : "");
+  for (const char *c = Args[1].Text; *c != '\0' && Length < sizeof(Json) - 4; c++)
+  {
+    if (*c == '"' || *c == '\\')
+      Json[Length++] = '\\';
+    Json[Length++] = *c;
+  }
+  Length += snprintf(Json + Length, sizeof(Json) - Length, "%s}", Quoted ? "\"" : "");
+
+  mySettings Base = Settings;
+  mySettings Staged = Settings;
+  const char *Error = stageSettings(Json, Length, Staged);
+  if (Error != NULL)
+  {
+    WebSerial.printf("Invalid value: %s\n", Error);
+    return;
+  }
+  switch (queueSettings(Base, Staged, SRC_WEBSERIAL))
+  {
+  case 200:
+    WebSerial.println("Unchanged");
+    break;
+  case 202:
+    WebSerial.println("Queued");
+    break;
+  default:
+    WebSerial.println("Busy");
+  }
+}
 
-/*
-  Settings.IR_UP = 0x80840BF;
-  Settings.IR_DOWN = 0x808E01F;
-  Settings.IR_REPEAT = 0xFFFFFFFFFFFFFFFF;
-  Settings.IR_LEFT = 0x808807F;
-  Settings.IR_RIGHT = 0x808609F;
-  Settings.IR_SELECT = 0x808AC53;
-  Settings.IR_BACK = 0x80822DD;
-  Settings.IR_MUTE = 0x80828D7;
-  Settings.IR_PREVIOUS = 0x80818E7;
-  Settings.IR_ON = 0x808926D;
-  Settings.IR_OFF = 0x808926D;
-  Settings.IR_1 = 0x808827D;
-  Settings.IR_2 = 0x80842BD;
-  Settings.IR_3 = 0x808E21D;
-  Settings.IR_4 = 0x808CC33;
-  Settings.IR_5 = 0x8082CD3;
+void shellVolume(byte Count, const ShellArg *Args)
+{
+  if (Args[0].Number < 0 || Args[0].Number > Settings.VolumeSteps)
+  {
+    WebSerial.printf("Volume must be 0-%u\n", Settings.VolumeSteps);
+    return;
+  }
+  StateTarget Target;
+  memset(&Target, 0, sizeof(Target));
+  Target.Fields = TARGET_VOLUME;
+  Target.Volume = Args[0].Number;
+  shellReport(postTarget(Target, SRC_WEBSERIAL));
+}
 
-  Settings.IR_UP = 0x48AC40BF;
-  Settings.IR_DOWN = 0x48AC609F;
-  Settings.IR_REPEAT = 0xFFFFFFFFFFFFFFFF;
-  Settings.IR_LEFT = 0x48ACC03F;
-  Settings.IR_RIGHT = 0x48ACA05F;
-  Settings.IR_SELECT = 0x48AC20DF;
-  Settings.IR_BACK = 0x80822DD;
-  Settings.IR_MUTE = 0x80828D7;
-  Settings.IR_PREVIOUS = 0x80818E7;
-  Settings.IR_ON = 0x48AC807F;
-  Settings.IR_OFF = 0x48AC807F;
-  Settings.IR_1 = 0x808827D;
-  Settings.IR_2 = 0x80842BD;
-  Settings.IR_3 = 0x808E21D;
-  Settings.IR_4 = 0x808CC33;
-  Settings.IR_5 = 0x8082CD3;
-*/   
-  Settings.Input[0].Active = INPUT_NORMAL;
-  strcpy(Settings.Input[0].Name, "Input 1");
-  Settings.Input[0].MaxVol = Settings.VolumeSteps;
-  Settings.Input[0].MinVol = 1;
-  Settings.Input[0].Gain = 0;
-  Settings.Input[1].Active = INPUT_NORMAL;
-  strcpy(Settings.Input[1].Name, "Input 2");
-  Settings.Input[1].MaxVol = Settings.VolumeSteps;
-  Settings.Input[1].MinVol = 1;
-  Settings.Input[1].Gain = 0;
-  Settings.Input[2].Active = INPUT_NORMAL;
-  strcpy(Settings.Input[2].Name, "Input 3");
-  Settings.Input[2].MaxVol = Settings.VolumeSteps;
-  Settings.Input[2].MinVol = 1;
-  Settings.Input[2].Gain = 0;
-  Settings.Input[3].Active = INPUT_NORMAL;
-  strcpy(Settings.Input[3].Name, "Input 4");
-  Settings.Input[3].MaxVol = Settings.VolumeSteps;
-  Settings.Input[3].MinVol = 1;
-  Settings.Input[3].Gain = 0;
-  Settings.Input[4].Active = INPUT_INACTIVATED;
-  strcpy(Settings.Input[4].Name, "Input 5");
-  Settings.Input[4].MaxVol = Settings.VolumeSteps;
-  Settings.Input[4].MinVol = 1;
-  Settings.Input[4].Gain = 0;
-  Settings.Trigger1Active = 1;
-  Settings.Trigger1Type = 0;
-  Settings.Trigger1OnDelay = 0;
-  Settings.Trigger1Temp = 0;
-  Settings.Trigger2Active = 1;
-  Settings.Trigger2Type = 0;
-  Settings.Trigger2OnDelay = 0;
-  Settings.Trigger2Temp = 0;
-  Settings.TriggerInactOffTimer = 0;
-  Settings.ScreenSaverActive = true;
-  Settings.DisplayOnLevel = 3;
-  Settings.DisplayDimLevel = 0;
-  Settings.DisplayTimeout = 30;
-  Settings.DisplayVolume = 1;
-  Settings.DisplaySelectedInput = true;
-  Settings.DisplayTemperature1 = 3;
-  Settings.DisplayTemperature2 = 3;
-  Settings.Version = VERSION;
+void shellInput(byte Count, const ShellArg *Args)
+{
+  if (Args[0].Number < 1 || Args[0].Number > 5)
+    WebSerial.println("Input must be 1-5");
+  else
+    shellReport(postCommand(CMD_INPUT, Args[0].Number - 1, SRC_WEBSERIAL));
+}
 
-  RuntimeSettings.CurrentInput = 0;
-  RuntimeSettings.CurrentVolume = 0;
-  RuntimeSettings.Muted = 0;
-  RuntimeSettings.InputLastVol[0] = 0;
-  RuntimeSettings.InputLastVol[1] = 0;
-  RuntimeSettings.InputLastVol[2] = 0;
-  RuntimeSettings.InputLastVol[3] = 0;
-  RuntimeSettings.InputLastVol[4] = 0;
-  RuntimeSettings.InputLastBal[0] = 127; // 127 = no balance shift (values < 127 = shift balance to the left channel, values > 127 = shift balance to the right channel)
-  RuntimeSettings.InputLastBal[1] = 127;
-  RuntimeSettings.InputLastBal[2] = 127;
-  RuntimeSettings.InputLastBal[3] = 127;
-  RuntimeSettings.InputLastBal[4] = 127;
-  RuntimeSettings.PrevSelectedInput = 0;
-  RuntimeSettings.Version = VERSION;
+void shellPreset(byte Count, const ShellArg *Args)
+{
+  if (Args[0].Number < 1 || Args[0].Number > PRESET_COUNT)
+    WebSerial.printf("Preset must be 1-%u\n", PRESET_COUNT);
+  else
+    shellReport(postCommand(CMD_PRESET, Args[0].Number - 1, SRC_WEBSERIAL));
 }
 
-void setVolume(int16_t newVolumeStep)
+void shellMute(byte Count, const ShellArg *Args)
 {
-  if (appMode == APP_NORMAL_MODE || appMode == APP_BALANCE_MODE)
+  shellReport(postCommand(CMD_MUTE, 0, SRC_WEBSERIAL));
+}
+
+void shellUnmute(byte Count, const ShellArg *Args)
+{
+  shellReport(postCommand(CMD_UNMUTE, 0, SRC_WEBSERIAL));
+}
+
+// Simulate key presses - handled exactly like keys from the rotary encoders or the IR remote
+void shellKey(byte Count, const ShellArg *Args)
+{
+  static const char *KeyNames[] = {"UP", "DOWN", "LEFT", "RIGHT", "SELECT", "BACK", "MUTE"};
+  static const byte Keys[] = {KEY_UP, KEY_DOWN, KEY_LEFT, KEY_RIGHT, KEY_SELECT, KEY_BACK, KEY_MUTE};
+
+  byte Key = KEY_NONE;
+  for (byte i = 0; i < sizeof(Keys); i++)
+    if (strcasecmp(Args[0].Text, KeyNames[i]) == 0)
+      Key = Keys[i];
+  if (Key == KEY_NONE)
   {
-    if (newVolumeStep < Settings.Input[RuntimeSettings.CurrentInput].MinVol)
-      newVolumeStep = Settings.Input[RuntimeSettings.CurrentInput].MinVol;
-    else if (newVolumeStep > Settings.Input[RuntimeSettings.CurrentInput].MaxVol)
-      newVolumeStep = Settings.Input[RuntimeSettings.CurrentInput].MaxVol;
+    WebSerial.println("Key must be UP, DOWN, LEFT, RIGHT, SELECT, BACK or MUTE");
+    return;
+  }
+  long Repeat = (Count > 1) ? Args[1].Number : 1;
+  if (Repeat < 1 || Repeat > COMMAND_QUEUE_LENGTH)
+  {
+    WebSerial.printf("Count must be 1-%u\n", COMMAND_QUEUE_LENGTH);
+    return;
+  }
+  uint32_t ticket = 0;
+  for (long i = 0; i < Repeat; i++)
+    if ((ticket = postCommand(CMD_KEY, Key, SRC_WEBSERIAL)) == 0)
+      break;
+  shellReport(ticket);
+}
 
-    if (!RuntimeSettings.Muted)
-    {
-      int CurrentAttenuation = calculateAttenuation(RuntimeSettings.CurrentVolume, Settings.VolumeSteps, Settings.MinAttenuation, Settings.MaxAttenuation);
-      if (Settings.Input[RuntimeSettings.CurrentInput].Active != INPUT_HT_PASSTHROUGH)
-        RuntimeSettings.CurrentVolume = newVolumeStep;
-      else
-        RuntimeSettings.CurrentVolume = Settings.Input[RuntimeSettings.CurrentInput].MaxVol; // Set to max volume
-      RuntimeSettings.InputLastVol[RuntimeSettings.CurrentInput] = RuntimeSettings.CurrentVolume;
+void shellIrLearn(byte Count, const ShellArg *Args)
+{
+  int Field = findSettingField(Args[0].Text);
+  if (Field < 0 || SettingFields[Field].Type != SETTING_IR)
+  {
+    WebSerial.println("Unknown IR code - see GET for the IR_ settings");
+    return;
+  }
+  shellReport(postCommand(CMD_IR_LEARN, Field, SRC_WEBSERIAL));
+  WebSerial.printf("Press the key on the remote within %u seconds\n", IR_LEARN_TIMEOUT / 1000);
+}
 
-      int NewAttenuation = calculateAttenuation(RuntimeSettings.CurrentVolume, Settings.VolumeSteps, Settings.MinAttenuation, Settings.MaxAttenuation);
-      if (NewAttenuation > CurrentAttenuation) {
-        // Volume is decreased - fade out the volume in 0.25 dB steps with 10 ms delay between each step
-        for (int i = CurrentAttenuation; i < NewAttenuation; i++) {
-          muses.setVolume(i, i);
-          debugln("Volume decreased to: " + String(i));
-          delay(10);
-        } 
-      } else {  
-        if (CurrentAttenuation == NewAttenuation) {
-          // Volume is unchanged - just set the volume to the new value. This is true at startup when the volume is set to the last used volume for the selected input
-          muses.setVolume(NewAttenuation, NewAttenuation);
-          debugln("Volume set to: " + String(NewAttenuation));
-        } else {
-          // Volume is increased - fade in the volume in 0.25 dB steps with 10 ms delay between each step
-          for (int i = CurrentAttenuation; i > NewAttenuation; i--) {
-            muses.setVolume(i, i);
-            debugln("Volume increased to: " + String(i));
-            delay(10);
-          }
-        }
-      }
-    }
-    if (appMode == APP_NORMAL_MODE)
-      right_display_update();
+void shellMetrics(byte Count, const ShellArg *Args)
+{
+  exportMetrics(WebSerial);
+}
+
+void shellLink(byte Count, const ShellArg *Args)
+{
+  if (Settings.LinkGroup == 0)
+  {
+    WebSerial.println("Not linked");
+    return;
+  }
+  WebSerial.printf("Group %d %s%s\n", Settings.LinkGroup, (Settings.LinkRole == LINK_LEADER) ? "leader" : "follower", linkReady ? "" : " (not started)");
+  WebSerial.printf("Packets sent %lu received %lu lost %lu\n", (unsigned long)linkSent.load(std::memory_order_relaxed),
+                   (unsigned long)linkReceived.load(std::memory_order_relaxed), (unsigned long)linkLost.load(std::memory_order_relaxed));
+  WebSerial.printf("Clock offset spread %ld us\n", (long)linkOffsetSpread.load(std::memory_order_relaxed));
+  WebSerial.printf("Ramps late %lu mismatched %lu\n", (unsigned long)linkLate.load(std::memory_order_relaxed),
+                   (unsigned long)linkMismatches.load(std::memory_order_relaxed));
+  for (byte i = 0; i <= LINK_LATENESS_BUCKETS; i++)
+  {
+    if (i < LINK_LATENESS_BUCKETS)
+      WebSerial.printf("Started <= %5lu us late: %lu\n", (unsigned long)linkLatenessBounds[i], (unsigned long)linkLatenessCounts[i].load(std::memory_order_relaxed));
+    else
+      WebSerial.printf("Started  > %5lu us late: %lu\n", (unsigned long)linkLatenessBounds[i - 1], (unsigned long)linkLatenessCounts[i].load(std::memory_order_relaxed));
   }
 }
 
-void left_display_update(void)
+void shellWebStats(byte Count, const ShellArg *Args)
 {
-  // Display the name of the current input (but only if it has been chosen to be so by the user)
-  if (Settings.DisplaySelectedInput)
+  for (byte i = 0; i < webAssetCount; i++)
+    WebSerial.printf("%-24s %6lu requests %6lu not modified %7lu bytes\n", webAssets[i].Url, (unsigned long)webAssets[i].Requests,
+                     (unsigned long)webAssets[i].NotModified, (unsigned long)(webAssets[i].Size * (webAssets[i].Requests - webAssets[i].NotModified)));
+  WebSerial.printf("Total %lu bytes\n", (unsigned long)webBytesServed);
+}
+
+void shellTrace(byte Count, const ShellArg *Args)
+{
+#if LOG_LEVEL >= LOG_LEVEL_TRACE
+  if (strcasecmp(Args[0].Text, "ON") == 0)
+    logTraceEnabled = true;
+  else if (strcasecmp(Args[0].Text, "OFF") == 0)
+    logTraceEnabled = false;
+  WebSerial.println(logTraceEnabled ? "Trace on" : "Trace off");
+#else
+  WebSerial.println("Trace messages are not compiled in (DEBUG 0)");
+#endif
+}
+
+void shellEEPROM(byte Count, const ShellArg *Args)
+{
+  long Address = (Count > 0) ? Args[0].Number : 0;
+  long Length = (Count > 1) ? Args[1].Number : EEPROM_DUMP_MAX;
+  if (Address < 0 || Address >= EEPROM_SIZE || Length < 1 || Length > EEPROM_DUMP_MAX)
   {
-    if (ScreenSaverIsOn)
-      ScreenSaverOff();
-    
-    left_display.setFont(u8g2_font_inb42_mr);
-      
-    // Calculate the width of the text 
-    int16_t textWidth = left_display.getStrWidth(Settings.Input[RuntimeSettings.CurrentInput].Name);
-    // Calculate the height of the text 
-    int16_t textHeight = left_display.getMaxCharHeight(); 
-    // Calculate the x-position to center the text horizontally 
-    int16_t xPos = (256 - textWidth) / 2; 
-    // Calculate the y-position to center the text vertically 
-    int16_t yPos = 52; 
-    // Draw the text 
-    left_display.clearBuffer();
-    left_display.drawStr(xPos, yPos, Settings.Input[RuntimeSettings.CurrentInput].Name);  
-    left_display.sendBuffer(); 
+    WebSerial.printf("Address must be 0-%u and length 1-%u\n", EEPROM_SIZE - 1, EEPROM_DUMP_MAX);
+    return;
   }
+  Length = minimum(Length, EEPROM_SIZE - Address);
+  shellReport(postCommand(CMD_EEPROM_DUMP, (Address << 16) | Length, SRC_WEBSERIAL));
 }
 
-void right_display_update(void)
+void shellTemp(byte Count, const ShellArg *Args)
 {
-  right_display.clearBuffer();
+  if (Count == 1 || (Count == 2 && (Args[0].Number < 1 || Args[0].Number > TEMP_CHANNELS)))
+  {
+    WebSerial.println("Usage: TEMP [1|2 degrees|OFF]");
+    return;
+  }
+  if (Count == 2)
+  {
+    byte Channel = Args[0].Number - 1;
+    if (strcasecmp(Args[1].Text, "OFF") == 0)
+      tempSimulated[Channel] = TEMP_NOT_SIMULATED;
+    else
+      tempSimulated[Channel] = constrain(atof(Args[1].Text), -50.0, 150.0) * 10;
+  }
+  const byte Limits[TEMP_CHANNELS] = {Settings.Trigger1Temp, Settings.Trigger2Temp};
+  for (byte i = 0; i < TEMP_CHANNELS; i++)
+    WebSerial.printf("NTC %d: %.1f degrees%s - limit %d\n", i + 1, readTemperature(i) / 10.0,
+                     (tempSimulated[i] != TEMP_NOT_SIMULATED) ? " (simulated)" : (temperatureFaults.load(std::memory_order_relaxed) & (1 << i)) ? " (sensor fault)" : "", Limits[i]);
+  WebSerial.printf("Protection %s - tripped %lu times\n", protectionTripped ? "tripped" : "ok", (unsigned long)protectionTrips.load(std::memory_order_relaxed));
+}
 
-  // Display the volume or mute status
-  if (Settings.DisplayVolume)
+// Returns the next word of the line at Line (and moves Line past it) - or NULL at the end of the line
+char *shellNextWord(char *&Line)
+{
+  while (*Line != '\0' && isspace((byte)*Line))
+    Line++;
+  if (*Line == '\0')
+    return NULL;
+  char *Word = Line;
+  while (*Line != '\0' && !isspace((byte)*Line))
+    Line++;
+  if (*Line != '\0')
+    *Line++ = '\0';
+  return Word;
+}
+
+// WebSerial message callback - runs in the AsyncTCP task
+void shellExecute(uint8_t *data, size_t len)
+{
+  if (len >= SHELL_LINE_LENGTH)
   {
-    right_display.setFont(u8g2_font_inb63_mn);
-    if (!RuntimeSettings.Muted)
+    WebSerial.println("Line too long");
+    return;
+  }
+  memcpy(shellLine, data, len);
+  shellLine[len] = '\0';
+
+  char *Line = shellLine;
+  char *Name = shellNextWord(Line);
+  if (Name == NULL)
+    return;
+
+  const ShellCommand *Command = NULL;
+  for (byte i = 0; i < SHELL_COMMAND_COUNT; i++)
+    if (strcasecmp(ShellCommands[i].Name, Name) == 0)
+      Command = &ShellCommands[i];
+  if (Command == NULL)
+  {
+    WebSerial.println("Unknown command - try HELP");
+    return;
+  }
+
+  // Check the arguments against the schema of the command
+  ShellArg Args[SHELL_MAX_ARGS];
+  byte Count = 0;
+  for (const char *Schema = Command->Schema; *Schema != '\0'; Schema++)
+  {
+    char *Word;
+    if (*Schema == 'T')
     {
-      // If show volume in steps
-      if (Settings.DisplayVolume == 1)
-      {
-        // Display volume as step
-        // Convert the integer to a string 
-        char buffer[10]; 
-        // Buffer to hold the string representation of the integer 
-        snprintf(buffer, sizeof(buffer), "%d", RuntimeSettings.CurrentVolume);
-        // Calculate the width of the text 
-        int16_t textWidth = right_display.getStrWidth(buffer); 
-        // Calculate the x-position to center the text horizontally 
-        int16_t xPos = (256 - textWidth) / 2; 
-        // Calculate the y-position to center the text vertically 
-        int16_t yPos = 63; 
-        // Draw the text 
-        right_display.drawStr(xPos, yPos, buffer);
-      }
-      else 
+      // The rest of the line (may contain spaces)
+      while (*Line != '\0' && isspace((byte)*Line))
+        Line++;
+      for (char *End = Line + strlen(Line); End > Line && isspace((byte)End[-1]); End--)
+        End[-1] = '\0';
+      Word = (*Line != '\0') ? Line : NULL;
+      Line += strlen(Line);
+    }
+    else
+      Word = shellNextWord(Line);
+
+    if (Word == NULL)
+    {
+      if (isupper(*Schema))
       {
-        // Display volume as -dB - RuntimeSettings.CurrentAttennuation are converted to -dB and multiplied by 10 to be able to show 0.25 dB steps        
-        char buffer[10]; 
-        // Buffer to hold the string representation of the integer 
-        snprintf(buffer, sizeof(buffer), "%d", (calculateAttenuation(RuntimeSettings.CurrentVolume, Settings.VolumeSteps, Settings.MinAttenuation, Settings.MaxAttenuation) / 4) );
-        // Calculate the width of the text 
-        int16_t textWidth = right_display.getStrWidth(buffer); 
-        // Calculate the height of the text 
-        int16_t textHeight = right_display.getMaxCharHeight(); 
-        // Calculate the x-position to center the text horizontally 
-        int16_t xPos = (256 - textWidth) / 2; 
-        // Calculate the y-position to center the text vertically 
-        int16_t yPos = 63; 
-        // Draw the text 
-        right_display.drawStr(xPos,yPos, buffer);
+        WebSerial.printf("Usage: %s %s\n", Command->Name, Command->Usage);
+        return;
       }
+      break;
     }
-    else
+    Args[Count].Text = Word;
+    Args[Count].Number = 0;
+    if (*Schema == 'N' || *Schema == 'n')
     {
-      right_display.setFont(u8g2_font_inb63_mn);
-      // Calculate the width of the text 
-      int16_t textWidth = right_display.getStrWidth("MUTE"); 
-      // Calculate the height of the text 
-      int16_t textHeight = right_display.getMaxCharHeight(); 
-      // Calculate the x-position to center the text horizontally 
-      int16_t xPos = (256 - textWidth) / 2; 
-      // Calculate the y-position to center the text vertically 
-      int16_t yPos = 63; 
-      // Draw the text 
-      right_display.drawStr(xPos,yPos, "MUTE");  
+      char *End;
+      Args[Count].Number = strtol(Word, &End, 0);
+      if (*End != '\0')
+      {
+        WebSerial.printf("Not a number: %s\n", Word);
+        return;
+      }
     }
+    Count++;
   }
-
-  // Display the WiFi status
-  switch(WiFi.status())
+  if (shellNextWord(Line) != NULL)
   {
-    case WL_CONNECTED:
-      drawSignalStrength(WiFi.RSSI());
-      break;
+    WebSerial.printf("Usage: %s %s\n", Command->Name, Command->Usage);
+    return;
   }
 
-  // Display temperature measurements?
-  if (Settings.DisplayTemperature1 || Settings.DisplayTemperature2)
+  Command->Handler(Count, Args);
+}
+
+// Write a hexdump of Length bytes of the EEPROM from Address - called by the control loop (CMD_EEPROM_DUMP)
+void dumpEEPROM(Print &out, uint16_t Address, uint16_t Length)
+{
+  byte Data[16] = {0};
+  char Line[80];
+
+  for (uint16_t Offset = 0; Offset < Length; Offset += sizeof(Data))
   {
-    drawTemperatureMeasurements();
+    byte Count = minimum(sizeof(Data), (size_t)(Length - Offset));
+    eepromRead(Address + Offset, Data, Count);
+    size_t Used = snprintf(Line, sizeof(Line), "%04x: ", Address + Offset);
+    for (byte i = 0; i < sizeof(Data); i++)
+      Used += snprintf(Line + Used, sizeof(Line) - Used, (i < Count) ? "%02x " : "   ", Data[i]);
+    for (byte i = 0; i < Count; i++)
+      Line[Used++] = (Data[i] >= 0x20 && Data[i] < 0x7F) ? Data[i] : '.';
+    Line[Used] = '\0';
+    out.println(Line);
   }
-
-  right_display.sendBuffer();
-  if (ScreenSaverIsOn)
-      ScreenSaverOff();
 }
 
-void drawSignalStrength(int rssi) 
-{ 
-  if (rssi >= -55) {
-    right_display.drawBox(232,4,4,4);
-    right_display.drawBox(237,3,4,5);
-    right_display.drawBox(242,2,4,6);
-    right_display.drawBox(247,1,4,7);
-    right_display.drawBox(252,0,4,8);
-  } else if (rssi >= -67) {
-    right_display.drawBox(232,4,4,4);
-    right_display.drawBox(237,3,4,5);
-    right_display.drawBox(242,2,4,6);
-    right_display.drawBox(247,1,4,7);
-    right_display.drawFrame(252,0,4,8);
-  } else if (rssi >= -70) {
-    right_display.drawBox(232,4,4,4);
-    right_display.drawBox(237,3,4,5);
-    right_display.drawBox(242,2,4,6);
-    right_display.drawFrame(247,1,4,7);
-    right_display.drawFrame(252,0,4,8);
-  } else if (rssi >= -80) {
-    right_display.drawBox(232,4,4,4);
-    right_display.drawBox(237,3,4,5);
-    right_display.drawFrame(242,2,4,6);
-    right_display.drawFrame(247,1,4,7);
-    right_display.drawFrame(252,0,4,8);
-  } else if (rssi >= -90) {
-     right_display.drawBox(232,4,4,4);
-     right_display.drawFrame(237,3,4,5);
-     right_display.drawFrame(242,2,4,6);
-     right_display.drawFrame(247,1,4,7);
-     right_display.drawFrame(252,0,4,8);
-  } else {
-     right_display.drawFrame(232,4,4,4);
-     right_display.drawFrame(237,3,4,5);
-     right_display.drawFrame(242,2,4,6);
-     right_display.drawFrame(247,1,4,7);
-     right_display.drawFrame(252,0,4,8);
-  } 
+// Runs in the AsyncTCP task - the clients are handled by the control loop, so a new client or a request for the full state ("resync") is posted as a command
+void onWebSocketEvent(AsyncWebSocket *server, AsyncWebSocketClient *client, AwsEventType type, void *arg, uint8_t *data, size_t len)
+{
+  switch (type)
+  {
+  case WS_EVT_CONNECT:
+    debug("WebSocket client connected: "); debugln(client->id());
+    postCommand(CMD_WS_RESYNC, client->id(), SRC_WEB);
+    break;
+  case WS_EVT_DATA:
+    if (len == 6 && memcmp(data, "resync", 6) == 0)
+      postCommand(CMD_WS_RESYNC, client->id(), SRC_WEB);
+    break;
+  case WS_EVT_DISCONNECT:
+    debug("WebSocket client disconnected: "); debugln(client->id());
+    break;
+  default:
+    break;
+  }
 }
 
-// Read temperature from NTC on specified pin on ADS1115
-float getTemperature(uint8_t pinNmbr)
+// The current state as shown to the WebSocket clients
+StateSnapshot getStateSnapshot()
 {
-  // 0 = A0 = Right channel NTC, 1 = A1 = Left channel NTC
+  StateSnapshot state;
+
+  memset(&state, 0, sizeof(state));
+  state.Mode = appMode;
+  state.Input = RuntimeSettings.CurrentInput;
+  state.Volume = RuntimeSettings.CurrentVolume;
+  state.Muted = RuntimeSettings.Muted;
+  state.Balance = RuntimeSettings.InputLastBal[RuntimeSettings.CurrentInput];
+  state.Preset = UserSettings.LastRecalledPreset;
+  state.Triggers = WarmState.Triggers;
+  state.Sequence = sequenceState;
+  state.SequenceLeft = sequenceCount - sequenceNext;
+  state.Temp1 = wsTemperature[0];
+  state.Temp2 = wsTemperature[1];
+  return state;
+}
 
-  float Vin = 3.3;   // Input voltage 3.3V for ESP32
-  float Vout = 0;    // Measured voltage
-  float Rref = 10000; // Reference resistor's value in ohms
-  float Rntc = 0;    // Measured resistance of NTC+
-  float Temp;
+// Build a state message in buffer - the full state if previous is NULL, otherwise only the fields that differ from previous
+// Returns the length of the message
+size_t buildStateMessage(const StateSnapshot &state, const StateSnapshot *previous, char *buffer, size_t size)
+{
+  JsonDocument doc;
 
-  // Read the analog value from the specified pin
-  //int16_t adcValue = ads1115.readADC_SingleEnded(pinNmbr);
-  int16_t adcValue = 15000; // TO DO: Implement reading of ADC value from ADS1115
-  Vout = (adcValue * Vin) / 32767.0; // Convert ADC value to voltage
+  doc["type"] = (previous == NULL) ? "state" : "delta";
+  if (previous == NULL || state.Mode != previous->Mode)
+    doc["mode"] = state.Mode;
+  if (previous == NULL || state.Input != previous->Input)
+  {
+    doc["input"] = state.Input + 1;
+    doc["name"] = Settings.Input[state.Input].Name;
+  }
+  if (previous == NULL)
+    doc["steps"] = Settings.VolumeSteps;
+  if (previous == NULL || state.Volume != previous->Volume)
+    doc["volume"] = state.Volume;
+  if (previous == NULL || state.Muted != previous->Muted)
+    doc["muted"] = (bool)state.Muted;
+  if (previous == NULL || state.Balance != previous->Balance)
+    doc["balance"] = state.Balance;
+  if (previous == NULL || state.Preset != previous->Preset)
+    doc["preset"] = state.Preset + 1;
+  if (previous == NULL || state.Triggers != previous->Triggers)
+  {
+    doc["trigger1"] = (bool)(state.Triggers & 0x01);
+    doc["trigger2"] = (bool)(state.Triggers & 0x02);
+  }
+  if (previous == NULL || state.Sequence != previous->Sequence || state.SequenceLeft != previous->SequenceLeft)
+  {
+    doc["sequence"] = state.Sequence;
+    doc["sequenceLeft"] = state.SequenceLeft;
+  }
+  if (previous == NULL || state.Temp1 != previous->Temp1)
+    doc["temp1"] = state.Temp1 / 10.0;
+  if (previous == NULL || state.Temp2 != previous->Temp2)
+    doc["temp2"] = state.Temp2 / 10.0;
 
-  Rntc = Rref * (Vin / Vout - 1); // Calculate the resistance of the NTC
+  return serializeJson(doc, buffer, size);
+}
 
-  if (Rntc < 0)
-    Temp = 0;
-  else
-    Temp = (-25.37 * log(Rntc)) + 239.43; // Calculate temperature from resistance
+// Update the temperatures used by the state snapshots (WebSocket, MQTT and UDP) from the readings of temperatureLoop()
+// Only done every TEMP_REFRESH_INTERVAL (less often in standby), so the last digit changing does not send a message every frame
+void refreshTemperatures()
+{
+  unsigned long tempInterval = (appMode == APP_STANDBY_MODE) ? TEMP_REFRESH_INTERVAL_STANDBY : TEMP_REFRESH_INTERVAL;
+  if (mil_WsTemperature == 0 || millis() - mil_WsTemperature >= tempInterval)
+  {
+    mil_WsTemperature = millis();
+    wsTemperature[0] = (int16_t)(getTemperature(0) * 10); // NTC 1 (A0)
+    wsTemperature[1] = (int16_t)(getTemperature(1) * 10); // NTC 2 (A1)
+  }
+}
 
-  if (Temp < 0)
-    Temp = 0;
-  else if (Temp > 65)
-    Temp = 65;
+// Push state changes to the WebSocket clients - called from loop() and handles at most one frame per WS_FRAME_INTERVAL
+// A client whose send queue is full gets no delta (it would only add to the backlog) but is marked to get the full state when it can receive again
+void webSocketLoop()
+{
+  if (millis() - mil_WsFrame < WS_FRAME_INTERVAL)
+    return;
+  mil_WsFrame = millis();
 
-  /*
-    debug("Voltage: ");
-  debugln(Vout);
-  debug(" Resistance: ");
-  debugln(Rntc);
-  debug(" Temperature: ");
-  debugln(Temp);
-  */
-  
-  return Temp;
-} 
+  ws.cleanupClients(WS_MAX_CLIENTS);
+  if (ws.count() == 0)
+    return;
 
+  refreshTemperatures();
 
-void drawTemperatureMeasurements(void)
-{
-  // TO DO: Implement handling of Settings.DisplayTemperature1 and Settings.DisplayTemperature2 
-  
-  right_display.drawFrame(232,34,24,14);
-  right_display.drawFrame(232,50,24,14);
-  
-  right_display.setFontMode(1);
-  right_display.setDrawColor(1);
+  StateSnapshot state = getStateSnapshot();
+  char delta[WS_MESSAGE_SIZE];
+  size_t deltaLen = 0;
+  if (memcmp(&state, &wsLastState, sizeof(state)) != 0)
+    deltaLen = buildStateMessage(state, &wsLastState, delta, sizeof(delta));
+  wsLastState = state;
 
-  right_display.drawFrame(232,34,24,14);
-  int tempRight = static_cast<int>(getTemperature(0)); // Get temperature for right channel and convert to integer  
-  right_display.drawBox(234,36,map(tempRight, 0, 65, 0, 20),10);
+  char full[WS_MESSAGE_SIZE];
+  size_t fullLen = 0;
 
-  right_display.drawFrame(232,50,24,14);
-  int tempLeft = static_cast<int>(getTemperature(1)); // Get temperature for left channel and convert to integer
-  right_display.drawBox(234,52,map(tempLeft, 0, 65, 0, 20),10);
+  for (byte i = 0; i < WS_MAX_CLIENTS; i++)
+  {
+    if (wsClients[i].Id == 0)
+      continue;
 
-  right_display.setDrawColor(2);
-  right_display.setFont(u8g2_font_profont10_mf);
+    AsyncWebSocketClient *client = ws.client(wsClients[i].Id);
+    if (client == NULL)
+    {
+      wsClients[i].Id = 0; // The client has disconnected
+      continue;
+    }
 
-  char tempRightStr[3];
-  snprintf(tempRightStr, sizeof(tempRightStr), "%d", tempRight);
-  right_display.drawStr(239, 44, tempRightStr);
+    if (client->queueIsFull())
+    {
+      if (deltaLen > 0)
+        wsClients[i].NeedsResync = true;
+      continue;
+    }
 
-  char tempLeftStr[3];
-  snprintf(tempLeftStr, sizeof(tempLeftStr), "%d", tempLeft);
-  right_display.drawStr(239, 60, tempLeftStr);
+    if (wsClients[i].NeedsResync)
+    {
+      if (fullLen == 0)
+        fullLen = buildStateMessage(state, NULL, full, sizeof(full));
+      client->text(full, fullLen);
+      wsClients[i].NeedsResync = false;
+      wsResyncs++;
+    }
+    else if (deltaLen > 0)
+      client->text(delta, deltaLen);
+  }
 }
 
-// Returns input from the user - enumerated to be the same value no matter if input is from encoders or IR remote
-byte getUserInput()
+// Start the MQTT client with the broker in Settings - a running client is stopped first, so this is also used when the settings change
+void mqttStart()
 {
+  static char StatusTopic[MQTT_TOPIC_LENGTH];
 
-  if (interruptCounter > 0)
+  if (mqttClient != NULL)
   {
-    portENTER_CRITICAL(&timerMux);
-    interruptCounter--;
-    portEXIT_CRITICAL(&timerMux);
-
-    totalInterruptCounter++;
+    esp_mqtt_client_stop(mqttClient);
+    esp_mqtt_client_destroy(mqttClient);
+    mqttClient = NULL;
+    mqttConnected = false;
   }
-
-  byte receivedInput = KEY_NONE;
-
-  // Read input from encoder 1
-  e1value += encoder1->getValue();
-
-  if (e1value != e1last)
+  if (Settings.MqttUri[0] == '\0')
+    return;
+
+  // The broker publishes "offline" on the status topic if the controller disappears
+  snprintf(StatusTopic, sizeof(StatusTopic), "%s/status", Settings.MqttTopic);
+  esp_mqtt_client_config_t Config;
+  memset(&Config, 0, sizeof(Config));
+  Config.uri = Settings.MqttUri;
+  Config.username = (Settings.MqttUser[0] != '\0') ? Settings.MqttUser : NULL;
+  Config.password = (Settings.MqttUser[0] != '\0') ? Settings.MqttPass : NULL;
+  Config.lwt_topic = StatusTopic;
+  Config.lwt_msg = "offline";
+  Config.lwt_qos = 1;
+  Config.lwt_retain = 1;
+  Config.reconnect_timeout_ms = MQTT_RECONNECT_INTERVAL;
+
+  mqttClient = esp_mqtt_client_init(&Config);
+  if (mqttClient == NULL)
   {
-    if (e1value > e1last)
-      receivedInput = KEY_UP;
-    if (e1value < e1last)
-      receivedInput = KEY_DOWN;
-    e1last = e1value;
+    LOG_ERROR("MQTT client could not be created");
+    return;
   }
+  esp_mqtt_client_register_event(mqttClient, MQTT_EVENT_ANY, mqttEvent, NULL);
+  esp_mqtt_client_start(mqttClient);
+  debug("MQTT broker: "); debugln(Settings.MqttUri);
+}
 
-  // Check if button on encoder 1 is clicked
-  button1 = encoder1->getButton();
-  switch (button1)
+// Runs in the MQTT task - commands are posted to the command bus like the commands from the web API
+void mqttEvent(void *args, esp_event_base_t base, int32_t id, void *data)
+{
+  esp_mqtt_event_handle_t Event = (esp_mqtt_event_handle_t)data;
+  char Topic[MQTT_TOPIC_LENGTH];
+
+  switch (id)
   {
-  case ClickEncoder::Clicked:
-    receivedInput = KEY_SELECT;
+  case MQTT_EVENT_CONNECTED:
+    snprintf(Topic, sizeof(Topic), "%s/+/set", Settings.MqttTopic);
+    esp_mqtt_client_subscribe(Event->client, Topic, 0);
+    mqttPublish("status", "online");
+    mqttResync = true;
+    mqttConnected = true;
+    LOG_INFO("MQTT connected");
     break;
-  default:
+  case MQTT_EVENT_DISCONNECTED:
+    mqttConnected = false;
+    LOG_INFO("MQTT disconnected");
+    break;
+  case MQTT_EVENT_DATA:
+    // Commands are short - a message split into several events is not a command
+    if (Event->current_data_offset == 0 && Event->data_len == Event->total_data_len)
+      mqttHandleCommand(Event->topic, Event->topic_len, Event->data, Event->data_len);
     break;
   }
+}
 
-  // Read input from encoder 2
-  e2value += encoder2->getValue();
-
-  if (e2value != e2last)
+// Handle a message received on <topic>/<name>/set - the topic and payload are not zero terminated
+void mqttHandleCommand(const char *Topic, int TopicLength, const char *Data, int DataLength)
+{
+  char Name[16];
+  char Payload[16];
+  size_t PrefixLength = strlen(Settings.MqttTopic);
+
+  if (TopicLength <= (int)PrefixLength + 5 || strncmp(Topic, Settings.MqttTopic, PrefixLength) != 0 || Topic[PrefixLength] != '/' ||
+      strncmp(Topic + TopicLength - 4, "/set", 4) != 0 || TopicLength - (int)PrefixLength - 5 >= (int)sizeof(Name) || DataLength >= (int)sizeof(Payload))
+    return;
+  memcpy(Name, Topic + PrefixLength + 1, TopicLength - PrefixLength - 5);
+  Name[TopicLength - PrefixLength - 5] = '\0';
+  memcpy(Payload, Data, DataLength);
+  Payload[DataLength] = '\0';
+
+  char *End;
+  long Number = strtol(Payload, &End, 10);
+  bool IsNumber = (End != Payload && *End == '\0');
+  bool On = (strcasecmp(Payload, "ON") == 0 || strcasecmp(Payload, "true") == 0 || strcmp(Payload, "1") == 0);
+  bool Off = (strcasecmp(Payload, "OFF") == 0 || strcasecmp(Payload, "false") == 0 || strcmp(Payload, "0") == 0);
+  uint32_t ticket = 0;
+
+  if (strcmp(Name, "volume") == 0 && IsNumber && Number >= 0 && Number <= Settings.VolumeSteps)
+    ticket = postVolume(Number, SRC_MQTT);
+  else if (strcmp(Name, "input") == 0 && IsNumber && Number >= 1 && Number <= 5)
+    ticket = postCommand(CMD_INPUT, Number - 1, SRC_MQTT);
+  else if (strcmp(Name, "preset") == 0 && IsNumber && Number >= 1 && Number <= PRESET_COUNT)
+    ticket = postCommand(CMD_PRESET, Number - 1, SRC_MQTT);
+  else if (strcmp(Name, "mute") == 0 && (On || Off))
+    ticket = postCommand(CMD_SET_MUTE, On, SRC_MQTT); // Not postTarget() - it may only be called from the AsyncTCP task
+  else if (strcmp(Name, "standby") == 0 && (On || Off))
+    ticket = postCommand(CMD_KEY, On ? KEY_OFF : KEY_ON, SRC_MQTT);
+  else
   {
-    if (e2value > e2last)
-      receivedInput = KEY_RIGHT;
-    if (e2value < e2last)
-      receivedInput = KEY_LEFT;
-    e2last = e2value;
+    LOG_WARN("MQTT command ignored");
+    return;
   }
+  if (ticket != 0)
+    mqttCommands.fetch_add(1, std::memory_order_relaxed);
+}
 
-  // Check if button on encoder 2 is clicked
-  button2 = encoder2->getButton();
-  switch (button2)
+// Publish a retained state topic - the message is queued in the outbox of the MQTT client and sent by its task
+void mqttPublish(const char *Name, const char *Value)
+{
+  char Topic[MQTT_TOPIC_LENGTH];
+
+  snprintf(Topic, sizeof(Topic), "%s/%s", Settings.MqttTopic, Name);
+  if (esp_mqtt_client_enqueue(mqttClient, Topic, Value, 0, 0, 1, true) >= 0)
+    mqttPublished.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Publish the topics that changed since the last publication - called from loop()
+void mqttLoop()
+{
+  if (!mqttConnected || millis() - mil_MqttPublish < MQTT_PUBLISH_INTERVAL)
+    return;
+  mil_MqttPublish = millis();
+
+  refreshTemperatures();
+  StateSnapshot state = getStateSnapshot();
+  bool All = mqttResync;
+  mqttResync = false;
+  char Value[16];
+
+  if (All || state.Volume != mqttLastState.Volume)
   {
-  case ClickEncoder::Clicked:
-    receivedInput = KEY_BACK;
-    break;
-  
-  case ClickEncoder::DoubleClicked:
-    if (appMode == APP_STANDBY_MODE)
-      receivedInput = KEY_ON;
-    else 
-      receivedInput = KEY_OFF;
-    break;
-  
-  default:
-    break;
+    snprintf(Value, sizeof(Value), "%u", state.Volume);
+    mqttPublish("volume", Value);
   }
-
-  // Check if any input from the IR remote
-  if (irrecv.decode(&IRresults))
+  if (All || state.Input != mqttLastState.Input)
   {
-      debug("IR code: "); debug(uint64ToString(IRresults.value, HEX).c_str());debugln("");
-      // Map the received IR input to UserInput values
-      if (IRresults.value == Settings.IR_UP)
-        receivedInput = KEY_UP;
-      else if (IRresults.value == Settings.IR_DOWN)
-        receivedInput = KEY_DOWN;
-      else if (IRresults.value == Settings.IR_LEFT)
-        receivedInput = KEY_LEFT;
-      else if (IRresults.value == Settings.IR_RIGHT)
-        receivedInput = KEY_RIGHT;
-      else if (IRresults.value == Settings.IR_SELECT)
-        receivedInput = KEY_SELECT;
-      else if (IRresults.value == Settings.IR_BACK)
-        receivedInput = KEY_BACK;
-      else if (IRresults.value == Settings.IR_MUTE)
-        receivedInput = KEY_MUTE;
-      else if (appMode == APP_STANDBY_MODE && IRresults.value == Settings.IR_ON)
-        receivedInput = KEY_ON;
-      else if (appMode == APP_NORMAL_MODE && IRresults.value == Settings.IR_OFF)
-        receivedInput = KEY_OFF;
-      else if (IRresults.value == Settings.IR_1)
-        receivedInput = KEY_1;
-      else if (IRresults.value == Settings.IR_2)
-        receivedInput = KEY_2;
-      else if (IRresults.value == Settings.IR_3)
-        receivedInput = KEY_3;
-      else if (IRresults.value == Settings.IR_4)
-        receivedInput = KEY_4;
-      else if (IRresults.value == Settings.IR_5)
-        receivedInput = KEY_5;
-      else if (IRresults.value == Settings.IR_PREVIOUS)
-        receivedInput = KEY_PREVIOUS;
-      else if (IRresults.value == Settings.IR_REPEAT)
-      {
-        receivedInput = KEY_REPEAT;
-        if (lastReceivedInput == KEY_UP)
-          receivedInput = KEY_UP;
-        else if (lastReceivedInput == KEY_DOWN)
-          receivedInput = KEY_DOWN;
-      }
-    lastReceivedInput = receivedInput;
-    irrecv.resume();  // Receive the next value
+    snprintf(Value, sizeof(Value), "%u", state.Input + 1);
+    mqttPublish("input", Value);
+  }
+  if (All || state.Muted != mqttLastState.Muted)
+    mqttPublish("mute", state.Muted ? "ON" : "OFF");
+  if (All || state.Mode != mqttLastState.Mode)
+    mqttPublish("standby", (state.Mode == APP_STANDBY_MODE) ? "ON" : "OFF");
+  if (All || state.Temp1 != mqttLastState.Temp1)
+  {
+    snprintf(Value, sizeof(Value), "%.1f", state.Temp1 / 10.0);
+    mqttPublish("temperature1", Value);
+  }
+  if (All || state.Temp2 != mqttLastState.Temp2)
+  {
+    snprintf(Value, sizeof(Value), "%.1f", state.Temp2 / 10.0);
+    mqttPublish("temperature2", Value);
   }
-  if (receivedInput != KEY_NONE) { 
-    mil_LastUserInput = millis();
-    debug("getUserInput: "); debugln(receivedInput); 
+  mqttLastState = state;
+}
+
+// Start listening for UDP control packets
+void udpStart()
+{
+  if (!udp.listen(UDP_PORT))
+  {
+    LOG_ERROR("UDP port %d could not be opened", UDP_PORT);
+    return;
   }
-  return (receivedInput);
+  udp.onPacket(udpHandlePacket);
 }
 
-void toAppNormalMode()
+// Fill in a UDP_STATE/UDP_ANNOUNCE packet with the current state
+void udpBuildState(UdpStatePacket &Packet, byte Type, uint32_t Sequence, byte Status, uint32_t Ticket)
 {
-  debugln("toAppNormalMode");
-  left_display_update();
-  right_display_update();
-  appMode = APP_NORMAL_MODE;
+  StateSnapshot state = getStateSnapshot();
+
+  memset(&Packet, 0, sizeof(Packet));
+  Packet.Header.Magic[0] = 'T';
+  Packet.Header.Magic[1] = 'P';
+  Packet.Header.Version = UDP_VERSION;
+  Packet.Header.Type = Type;
+  Packet.Header.Sequence = Sequence;
+  Packet.Status = Status;
+  Packet.Ticket = Ticket;
+  Packet.Mode = state.Mode;
+  Packet.Input = state.Input + 1;
+  Packet.Volume = state.Volume;
+  Packet.VolumeSteps = Settings.VolumeSteps;
+  Packet.Muted = state.Muted;
+  Packet.Balance = state.Balance;
+  Packet.Temp1 = state.Temp1;
+  Packet.Temp2 = state.Temp2;
 }
 
-void toStandbyMode()
+// Runs in the AsyncUDP task - commands are posted to the command bus like the commands from the web API
+void udpHandlePacket(AsyncUDPPacket &packet)
 {
-  debugln("toStandbyMode");
-  appMode = APP_STANDBY_MODE;
-  writeRuntimeSettingsToEEPROM();
-  mute();
-  unmuteOutput();
-  left_display.clearDisplay();
-  right_display.clearDisplay();
-  setTrigger1Off();
-  setTrigger2Off();
-  if (Settings.ExtPowerRelayTrigger)
+  if (packet.length() < sizeof(UdpHeader))
   {
-    digitalWrite(POWER_CONTROL_PIN, LOW);
+    udpInvalid.fetch_add(1, std::memory_order_relaxed);
+    return;
   }
-  last_KEY_ONOFF = millis();
+  UdpHeader Header;
+  memcpy(&Header, packet.data(), sizeof(Header));
+  if (Header.Magic[0] != 'T' || Header.Magic[1] != 'P' || Header.Version != UDP_VERSION || (Header.Type & 0x80) != 0)
+  {
+    udpInvalid.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  udpRequests.fetch_add(1, std::memory_order_relaxed);
+
+  byte Status = UDP_OK;
+  uint32_t ticket = 0;
+  if (Header.Type != UDP_GET_STATE)
+  {
+    int Value = (packet.length() > sizeof(UdpHeader)) ? packet.data()[sizeof(UdpHeader)] : -1;
+    bool Valid = (Header.Type == UDP_SET_VOLUME && Value >= 0 && Value <= Settings.VolumeSteps) ||
+                 (Header.Type == UDP_SET_INPUT && Value >= 1 && Value <= 5) ||
+                 (Header.Type == UDP_SET_MUTE && (Value == 0 || Value == 1));
+    if (!Valid)
+      Status = UDP_INVALID;
+    else if (!udpCheckSequence(packet.remoteIP(), packet.remotePort(), Header.Sequence))
+      Status = UDP_DUPLICATE;
+    else
+    {
+      if (Header.Type == UDP_SET_VOLUME)
+        ticket = postVolume(Value, SRC_UDP);
+      else if (Header.Type == UDP_SET_INPUT)
+        ticket = postCommand(CMD_INPUT, Value - 1, SRC_UDP);
+      else
+        ticket = postCommand(CMD_SET_MUTE, Value, SRC_UDP);
+      if (ticket == 0)
+        Status = UDP_BUSY;
+    }
+    if (Status == UDP_INVALID)
+      udpInvalid.fetch_add(1, std::memory_order_relaxed);
+    else if (Status == UDP_DUPLICATE)
+      udpDuplicates.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  // The reply carries the state as it is now - a SET request shows in the next announcement or UDP_GET_STATE when it has been executed
+  UdpStatePacket Reply;
+  udpBuildState(Reply, UDP_STATE, Header.Sequence, Status, ticket);
+  packet.write((const uint8_t *)&Reply, sizeof(Reply));
 }
 
-void ScreenSaverOn(void)
+// Multicast the state when it has changed - called from loop()
+void udpLoop()
 {
-  debugln("Screensaver on");
-  ScreenSaverIsOn = true;
-  left_display.clearDisplay();
-  right_display.clearDisplay();
+  if (!UDP_ANNOUNCE_ENABLED || millis() - mil_UdpAnnounce < UDP_ANNOUNCE_INTERVAL)
+    return;
+
+  StateSnapshot state = getStateSnapshot();
+  if (memcmp(&state, &udpLastState, sizeof(state)) == 0 && millis() - mil_UdpAnnounce < UDP_ANNOUNCE_HEARTBEAT)
+    return;
+  udpLastState = state;
+  mil_UdpAnnounce = millis();
+
+  UdpStatePacket Packet;
+  udpBuildState(Packet, UDP_ANNOUNCE, 0, UDP_OK, 0);
+  udp.writeTo((const uint8_t *)&Packet, sizeof(Packet), UDP_MULTICAST_GROUP, UDP_PORT);
 }
 
-void ScreenSaverOff(void)
+// Join the multicast group of the linked controllers - both roles listen, so LinkRole may be changed without a restart
+void linkStart()
 {
-  if (ScreenSaverIsOn) 
+  linkSession = esp_random();
+  if (!linkUdp.listenMulticast(LINK_MULTICAST_GROUP, LINK_PORT))
   {
-    debugln("Screensaver off");
-    ScreenSaverIsOn = false;
-    left_display_update();
-    right_display_update();
+    LOG_ERROR("Link port %d could not be opened", LINK_PORT);
+    return;
   }
+  linkUdp.onPacket(linkHandlePacket);
+  linkReady = true;
 }
 
-boolean setInput(uint8_t NewInput)
+bool linkIsLeader()
 {
-  boolean result = false;
-  if (Settings.Input[NewInput].Active != INPUT_INACTIVATED && NewInput >= 0 && NewInput <= 4 && appMode == APP_NORMAL_MODE)
+  return linkReady && Settings.LinkGroup != 0 && Settings.LinkRole == LINK_LEADER;
+}
+
+// Send the current state to the followers - Start is the time to start the ramp to Attenuation (0 = at once)
+void linkSend(int64_t Start, int16_t Attenuation)
+{
+  LinkPacket Packet;
+
+  memset(&Packet, 0, sizeof(Packet));
+  Packet.Magic[0] = 'T';
+  Packet.Magic[1] = 'L';
+  Packet.Version = LINK_VERSION;
+  Packet.Group = Settings.LinkGroup;
+  Packet.Session = linkSession;
+  Packet.Sequence = ++linkSequence;
+  Packet.StartTime = Start;
+  Packet.Input = RuntimeSettings.CurrentInput;
+  Packet.Volume = RuntimeSettings.CurrentVolume;
+  Packet.Muted = RuntimeSettings.Muted;
+  Packet.Attenuation = Attenuation;
+  Packet.LeaderTime = esp_timer_get_time();
+  linkUdp.writeTo((const uint8_t *)&Packet, sizeof(Packet), LINK_MULTICAST_GROUP, LINK_PORT);
+  linkSent.fetch_add(1, std::memory_order_relaxed);
+
+  linkLastState = getStateSnapshot();
+  mil_LinkSync = millis();
+}
+
+// Wait until esp_timer_get_time() reaches Time - the last millisecond is spent spinning, as delay() may return a tick late
+void linkWaitUntil(int64_t Time)
+{
+  int64_t Remaining = Time - esp_timer_get_time();
+  if (Remaining > 2000)
+    delay(Remaining / 1000 - 1);
+  while (esp_timer_get_time() < Time)
+    ;
+}
+
+// Returns true when a ramp starting at Start may be applied - at once or when it starts within LINK_SPIN_LIMIT
+bool linkDue(int64_t Start)
+{
+  return Start == 0 || Start - esp_timer_get_time() <= LINK_SPIN_LIMIT * 1000;
+}
+
+// Runs in the AsyncUDP task - the state of the leader is stored in linkPending and applied by the control loop
+void linkHandlePacket(AsyncUDPPacket &packet)
+{
+  int64_t Received = esp_timer_get_time();
+
+  if (Settings.LinkGroup == 0 || Settings.LinkRole != LINK_FOLLOWER || packet.length() < sizeof(LinkPacket))
+    return;
+  LinkPacket Packet;
+  memcpy(&Packet, packet.data(), sizeof(Packet));
+  if (Packet.Magic[0] != 'T' || Packet.Magic[1] != 'L' || Packet.Version != LINK_VERSION || Packet.Group != Settings.LinkGroup ||
+      Packet.Session == linkSession || Packet.Input > 4)
+    return;
+  linkReceived.fetch_add(1, std::memory_order_relaxed);
+
+  // A new leader (or the leader has restarted) - its clock and sequence numbers start over
+  if (Packet.Session != linkLeaderSession)
   {
-    if (!RuntimeSettings.Muted)
-      mute();
+    linkLeaderSession = Packet.Session;
+    linkLeaderSequence = Packet.Sequence - 1;
+    linkOffsetCount = 0;
+  }
+  int32_t Gap = Packet.Sequence - linkLeaderSequence;
+  if (Gap <= 0)
+    return;
+  if (Gap > 1)
+    linkLost.fetch_add(Gap - 1, std::memory_order_relaxed);
+  linkLeaderSequence = Packet.Sequence;
+
+  // The packet delayed the least gives the largest difference - the others only add their delay
+  linkOffsets[linkOffsetNext] = Packet.LeaderTime - Received;
+  linkOffsetNext = (linkOffsetNext + 1) % LINK_OFFSET_SAMPLES;
+  if (linkOffsetCount < LINK_OFFSET_SAMPLES)
+    linkOffsetCount++;
+  int64_t Offset = linkOffsets[0];
+  int64_t Smallest = linkOffsets[0];
+  for (byte i = 1; i < linkOffsetCount; i++)
+  {
+    Offset = std::max(Offset, linkOffsets[i]);
+    Smallest = std::min(Smallest, linkOffsets[i]);
+  }
+  linkOffsetSpread.store(Offset - Smallest, std::memory_order_relaxed);
 
-    // Input 1 relay -> RuntimeSettings.CurrentInput = 0 -> MCP23008 pin 7
-    // Input 2 relay -> RuntimeSettings.CurrentInput = 1 -> MCP23008 pin 6
-    // Input 3 relay -> RuntimeSettings.CurrentInput = 2 -> MCP23008 pin 5
-    // Input 4 relay -> RuntimeSettings.CurrentInput = 3 -> MCP23008 pin 4
-    // Input 5 relay -> RuntimeSettings.CurrentInput = 4 -> MCP23008 pin 3
+  int64_t Start = 0;
+  if (Packet.StartTime != 0)
+  {
+    Start = Packet.StartTime - Offset;
+    if (Start <= Received)
+    {
+      linkLate.fetch_add(1, std::memory_order_relaxed);
+      Start = 0;
+    }
+  }
 
-    // Unselect currently selected input
-    relayController.digitalWrite(7 - RuntimeSettings.CurrentInput, LOW);
+  // Nothing to do if the state is already the same (ie. a packet sent by the leader every LINK_SYNC_INTERVAL) - unless an older
+  // state is waiting in the queue, as the newer state replaces it
+  StateSnapshot state = getStateSnapshot();
+  bool Same = Start == 0 && state.Input == Packet.Input && state.Volume == Packet.Volume && state.Muted == Packet.Muted;
 
-    // Save the currently selected input to enable switching between two inputs
-    RuntimeSettings.PrevSelectedInput = RuntimeSettings.CurrentInput;
+  portENTER_CRITICAL(&linkMux);
+  if (Same && !linkFresh)
+  {
+    portEXIT_CRITICAL(&linkMux);
+    return;
+  }
+  linkPending.Input = Packet.Input;
+  linkPending.Volume = Packet.Volume;
+  linkPending.Muted = Packet.Muted;
+  linkPending.Attenuation = Packet.Attenuation;
+  linkPending.Start = Start;
+  linkFresh = true;
+  bool Post = !linkQueued;
+  linkQueued = true;
+  portEXIT_CRITICAL(&linkMux);
+
+  if (Post && postCommand(CMD_LINK, 0, SRC_LINK) == 0)
+  {
+    portENTER_CRITICAL(&linkMux);
+    linkQueued = false;
+    portEXIT_CRITICAL(&linkMux);
+  }
+}
 
-    // Select new input
-    muses.setGain(Settings.Input[RuntimeSettings.CurrentInput].Gain);
-    RuntimeSettings.CurrentInput = NewInput;
+// Send the state of the leader to the followers when it has changed - called from loop()
+void linkLoop()
+{
+  if (!linkIsLeader())
+    return;
+
+  StateSnapshot state = getStateSnapshot();
+  if (state.Input == linkLastState.Input && state.Volume == linkLastState.Volume && state.Muted == linkLastState.Muted &&
+      millis() - mil_LinkSync < LINK_SYNC_INTERVAL)
+    return;
+  linkSend(0, WarmState.Attenuation);
+}
 
+// Apply the state of the leader - called by executeCommand for CMD_LINK (in any mode) and as JOB_LINK
+// A ramp starting later is left in linkPending and JOB_LINK is scheduled for it, so the commands after the CMD_LINK are not held up
+void linkApply()
+{
+  LinkState Pending;
+  // Outside APP_NORMAL_MODE the state is dropped at once - applyTransition() would refuse it anyway
+  bool Normal = appMode == APP_NORMAL_MODE;
+  portENTER_CRITICAL(&linkMux);
+  Pending = linkPending;
+  linkQueued = false;
+  bool Fresh = linkFresh;
+  bool Due = !Normal || linkDue(Pending.Start);
+  if (Due)
+    linkFresh = false;
+  portEXIT_CRITICAL(&linkMux);
+
+  if (!Fresh || !Normal)
+    return;
+  if (!Due)
+  {
+    int64_t Wait = Pending.Start - esp_timer_get_time() - LINK_SPIN_LIMIT * 1000;
+    jobSchedule(JOB_LINK, (Wait + 999) / 1000);
+    return;
+  }
 
-    if (Settings.RecallSetLevel)
-      RuntimeSettings.CurrentVolume = RuntimeSettings.InputLastVol[RuntimeSettings.CurrentInput];
-    else if (RuntimeSettings.CurrentVolume > Settings.Input[RuntimeSettings.CurrentInput].MaxVol)
-      RuntimeSettings.CurrentVolume = Settings.Input[RuntimeSettings.CurrentInput].MaxVol;
-    else if (RuntimeSettings.CurrentVolume < Settings.Input[RuntimeSettings.CurrentInput].MinVol)
-      RuntimeSettings.CurrentVolume = Settings.Input[RuntimeSettings.CurrentInput].MinVol;
-        
-    relayController.digitalWrite(7 - NewInput, HIGH);
-    
-    if (RuntimeSettings.Muted)
-      unmute();
-    else
-      setVolume(RuntimeSettings.CurrentVolume);
+  if (Pending.Start != 0)
+  {
+    linkWaitUntil(Pending.Start);
+    uint32_t Lateness = esp_timer_get_time() - Pending.Start;
+    byte Bucket = 0;
+    while (Bucket < LINK_LATENESS_BUCKETS && Lateness > linkLatenessBounds[Bucket])
+      Bucket++;
+    linkLatenessCounts[Bucket].fetch_add(1, std::memory_order_relaxed);
+    linkLatenessSumUs.fetch_add(Lateness, std::memory_order_relaxed);
+  }
 
-    left_display_update();
-    result = true;
+  StateTarget Target;
+  memset(&Target, 0, sizeof(Target));
+  Target.Fields = TARGET_VOLUME | TARGET_MUTE;
+  Target.Volume = Pending.Volume;
+  Target.Muted = Pending.Muted;
+  // An input not active on this controller is left as it is
+  if (Settings.Input[Pending.Input].Active != INPUT_INACTIVATED)
+  {
+    Target.Input = Pending.Input;
+    Target.Fields |= TARGET_INPUT;
   }
-  return result;
+  applyTransition(Target);
+
+  // The settings of the controllers differ (ie. VolumeSteps, MinAttenuation or the limits of the input)
+  if (Pending.Start != 0 && !Pending.Muted && WarmState.Attenuation != Pending.Attenuation)
+    linkMismatches.fetch_add(1, std::memory_order_relaxed);
 }
 
 // Select the next active input (DOWN)
@@ -1604,12 +5220,19 @@ void setNextInput(void)
 
 void mute()
 {
+  rampCancel();
   if (Settings.MuteLevel)
-  // TO DO: This does not consider if channel balance has been set - it might not be a problem at all
-    muses.setVolume(calculateAttenuation(Settings.MuteLevel, Settings.VolumeSteps, Settings.MinAttenuation, Settings.MaxAttenuation), calculateAttenuation(Settings.MuteLevel, Settings.VolumeSteps, Settings.MinAttenuation, Settings.MaxAttenuation));
+  {
+    WarmState.Attenuation = calculateAttenuation(Settings.MuteLevel, Settings.VolumeSteps, Settings.MinAttenuation, Settings.MaxAttenuation);
+    musesSetVolume(WarmState.Attenuation, RuntimeSettings.InputLastBal[RuntimeSettings.CurrentInput]);
+  }
   else
+  {
     muses.mute();
+    WarmState.MusesMuted = true;
+  }
   RuntimeSettings.Muted = true;
+  saveWarmState();
 }
 
 void unmute()
@@ -1682,6 +5305,15 @@ bool changeBalance()
   return result;
 }
 
+// Set the volume of the Muses72323 with the balance shift applied: the channel the balance is shifted away from is attenuated 0.5 dB per step
+// 127 = no balance shift (values < 127 = shift balance to the left channel, values > 127 = shift balance to the right channel)
+void musesSetVolume(int Attenuation, byte Balance)
+{
+  int Shift = (Balance - 127) * 2;
+  muses.setVolume(std::max(Attenuation - std::max(Shift, 0), MUSES_MIN_VOLUME), std::max(Attenuation + std::min(Shift, 0), MUSES_MIN_VOLUME));
+  WarmState.Balance = Balance;
+}
+
 void displayBalance(byte Value)
 {
   /*- TO DO
@@ -1723,8 +5355,6 @@ int calculateAttenuation(byte logicalStep, byte maxLogicalSteps, byte minAttenua
   ** If the above constraints are not meet the calculateAttenuation() will return 0 (mute);
   **
   */
-  debug("Logical step: "); debugln(logicalStep);
-
   if (minAttenuation_dB >= maxAttenuation_dB ||
       logicalStep < 1 ||
       logicalStep > maxLogicalSteps ||
@@ -1741,8 +5371,7 @@ int calculateAttenuation(byte logicalStep, byte maxLogicalSteps, byte minAttenua
     attenuation = round(attenuation * 4) / 4;
     // Calculate the volume step
     int volumeStep = static_cast<int>(attenuation * -4);
-    debug("Attenuation: "); debugln((int)attenuation);
-    debug("Volume step: "); debugln(volumeStep);
+    LOG_TRACE("calculateAttenuation: step %d attenuation %d volume step %d", logicalStep, (int)attenuation, volumeStep);
     return volumeStep;
     
 }
@@ -1754,26 +5383,17 @@ void setTrigger1On()
 {
   if (Settings.Trigger1Active)
   {
-    relayController.digitalWrite(2, HIGH);
-    if (Settings.Trigger1Type == 0) // Momentary
-    {
-      delay(200);
-      relayController.digitalWrite(2, LOW);
-    }
+    sequenceAddTrigger(SEQ_TRIGGER1, true, Settings.Trigger1Type == 0, 0);
+    sequenceRun();
   }
-  
 }
 
 void setTrigger1Off()
 {
   if (Settings.Trigger1Active)
   {
-    if (Settings.Trigger1Type == 0) // Momentary
-    {
-      relayController.digitalWrite(2, HIGH);
-      delay(200);
-    }
-    relayController.digitalWrite(2, LOW);
+    sequenceAddTrigger(SEQ_TRIGGER1, false, Settings.Trigger1Type == 0, 0);
+    sequenceRun();
   }
 }
 
@@ -1781,12 +5401,8 @@ void setTrigger2On()
 {
   if (Settings.Trigger2Active)
   {
-    relayController.digitalWrite(1, HIGH);
-    if (Settings.Trigger2Type == 0) // Momentary
-    {
-      delay(200);
-      relayController.digitalWrite(1, LOW);
-    }
+    sequenceAddTrigger(SEQ_TRIGGER2, true, Settings.Trigger2Type == 0, 0);
+    sequenceRun();
   }
 }
 
@@ -1794,90 +5410,436 @@ void setTrigger2Off()
 {
   if (Settings.Trigger2Active)
   {
-    if (Settings.Trigger2Type == 0) // Momentary
+    sequenceAddTrigger(SEQ_TRIGGER2, false, Settings.Trigger2Type == 0, 0);
+    sequenceRun();
+  }
+}
+
+// Runs in the esp_timer task - the step is executed by the control loop. If the queue is full it is tried again a little later
+void sequenceTimerCallback(void *arg)
+{
+  if (postCommand(CMD_SEQUENCE, 0, SRC_LOCAL) == 0)
+    esp_timer_start_once(sequenceTimer, 10000);
+}
+
+// Add the steps switching a trigger to the end of the sequence - if the sequence is done, Delay is counted from now
+// The trigger is recorded as on/off in WarmState.Triggers when the steps are added
+void sequenceAddTrigger(byte Target, bool On, bool Momentary, uint32_t Delay)
+{
+  byte Bit = (Target == SEQ_TRIGGER1) ? 0x01 : 0x02;
+  WarmState.Triggers = On ? (WarmState.Triggers | Bit) : (WarmState.Triggers & ~Bit);
+  saveWarmState();
+  if (sequenceNext == sequenceCount)
+  {
+    sequenceNext = sequenceCount = 0;
+    sequenceLast = esp_timer_get_time();
+  }
+  if (!sequenceAppendTrigger(sequenceSteps, sequenceCount, Target, On, Momentary, Delay))
+    LOG_ERROR("Sequence full - step dropped");
+}
+
+// Replace the sequence with the power up or power down sequence (ie. the controller is turned on while it is being turned off)
+void sequenceStart(byte State)
+{
+  if (sequenceTimer != NULL)
+    esp_timer_stop(sequenceTimer);
+
+  // A trigger pulse that has begun is ended at once
+  byte Released = 0;
+  for (byte i = sequenceNext; i < sequenceCount; i++)
+    if (sequenceSteps[i].Release)
+      Released |= sequenceRelay(sequenceSteps[i].Target);
+  relaySet(Released, 0);
+  sequenceNext = sequenceCount = 0;
+  sequenceLast = esp_timer_get_time();
+
+  bool Up = (State == SEQUENCE_POWER_UP);
+  const char *Order = Up ? Settings.PowerUpOrder : Settings.PowerDownOrder;
+  SequenceOptions Options;
+  Options.ExtPower = Settings.ExtPowerRelayTrigger;
+  Options.TriggerActive[0] = Settings.Trigger1Active;
+  Options.TriggerActive[1] = Settings.Trigger2Active;
+  Options.TriggerMomentary[0] = (Settings.Trigger1Type == 0);
+  Options.TriggerMomentary[1] = (Settings.Trigger2Type == 0);
+  Options.TriggerOnDelay[0] = Settings.Trigger1OnDelay * 1000;
+  Options.TriggerOnDelay[1] = Settings.Trigger2OnDelay * 1000;
+  sequenceCount = sequenceCompose(Order, Up, Options, sequenceSteps);
+
+  // The triggers in the sequence are recorded as on/off in WarmState.Triggers
+  for (byte Trigger = 0; Trigger < 2; Trigger++)
+    if (Options.TriggerActive[Trigger] && strchr(Order, '1' + Trigger) != NULL)
+      WarmState.Triggers = Up ? (WarmState.Triggers | (1 << Trigger)) : (WarmState.Triggers & ~(1 << Trigger));
+  saveWarmState();
+  sequenceState = State;
+  sequenceRun();
+}
+
+// Execute the steps that are due and start the timer for the next one - only called from the control loop
+void sequenceRun()
+{
+  // The relay steps due at the same time are collected and written to the MCP23008 at once
+  byte Mask = 0;
+  byte Value = 0;
+  while (sequenceNext < sequenceCount && esp_timer_get_time() - sequenceLast >= (int64_t)sequenceSteps[sequenceNext].Delay * 1000)
+  {
+    SequenceStep *Step = &sequenceSteps[sequenceNext++];
+    LOG_DEBUG("Sequence step %d: target %d value %d", sequenceNext, Step->Target, Step->Value);
+    if (Step->Target == SEQ_POWER)
     {
-      relayController.digitalWrite(1, HIGH);
-      delay(200);
+      // Keep the order of the steps - the relays of the earlier steps are set first
+      relaySet(Mask, Value);
+      Mask = Value = 0;
+      digitalWrite(POWER_CONTROL_PIN, Step->Value);
+      WarmState.PowerOn = Step->Value;
+      saveWarmState();
     }
-    relayController.digitalWrite(1, LOW);
+    else
+      sequenceCollect(*Step, Mask, Value);
+    // The next delay is counted from when the step was actually executed, so a late step does not shorten a pulse
+    sequenceLast = esp_timer_get_time();
+  }
+  relaySet(Mask, Value);
+
+  if (sequenceNext < sequenceCount)
+  {
+    int64_t Wait = (int64_t)sequenceSteps[sequenceNext].Delay * 1000 - (esp_timer_get_time() - sequenceLast);
+    esp_timer_stop(sequenceTimer);
+    esp_timer_start_once(sequenceTimer, std::max(Wait, (int64_t)1));
   }
+  else
+    sequenceState = SEQUENCE_IDLE;
+
+  // Show the progress of the power up sequence
+  if (appMode == APP_NORMAL_MODE)
+    right_display_update();
+}
+
+// All relays are set through relaySet, which keeps the state of the outputs of the MCP23008 in WarmState.RelayMask
+// Sets the relays in Mask to the bits of Value with one write of the GPIO register - nothing is written if they are already set
+// The write is posted to i2cHighQueue - if Wait is set, return when the relays have been written
+void relaySet(byte Mask, byte Value, bool Wait)
+{
+  if (relayUpdate(WarmState.RelayMask, Mask, Value, Wait, relayWrite))
+    saveWarmState();
+}
+
+// Break before make (see relayChange) - used to switch the input relays, so two sources are never connected to each other
+void relaySwitch(byte Off, byte On)
+{
+  if (relayChange(WarmState.RelayMask, Off, On, relayWrite, relayPause))
+    saveWarmState();
+}
+
+// Post a write of the outputs of the MCP23008 to i2cHighQueue - the RelayWriter of relaySet and relaySwitch
+void relayWrite(uint8_t Relays, bool Wait)
+{
+  I2CTransaction T;
+  memset(&T, 0, sizeof(T));
+  T.Type = I2C_RELAYS;
+  T.Data[0] = Relays;
+  i2cPost(T, true, Wait);
 }
 
-// Mute relay -> MCP23008 pin 0
+void relayPause(uint32_t Milliseconds)
+{
+  delay(Milliseconds);
+}
 
 void unmuteOutput()
 {
-  relayController.digitalWrite(0, HIGH);
+  relaySet(RELAY_OUTPUT, RELAY_OUTPUT);
 }
 
 void muteOutput()
 {
-  relayController.digitalWrite(0, LOW);
-}
-
-String exportSettingsAsJson() {
-    StaticJsonDocument<2048> doc;
-
-    doc["ssid"] = Settings.ssid;
-    doc["pass"] = Settings.pass;
-    doc["ip"] = Settings.ip;
-    doc["gateway"] = Settings.gateway;
-
-    doc["VolumeSteps"] = Settings.VolumeSteps;
-    doc["MinAttenuation"] = Settings.MinAttenuation;
-    doc["MaxAttenuation"] = Settings.MaxAttenuation;
-    doc["MaxStartVolume"] = Settings.MaxStartVolume;
-    doc["MuteLevel"] = Settings.MuteLevel;
-    doc["RecallSetLevel"] = Settings.RecallSetLevel;
-
-    doc["IR_ON"] = String(Settings.IR_ON);
-    doc["IR_OFF"] = String(Settings.IR_OFF);
-    doc["IR_UP"] = String(Settings.IR_UP);
-    doc["IR_DOWN"] = String(Settings.IR_DOWN);
-    doc["IR_REPEAT"] = String(Settings.IR_REPEAT);
-    doc["IR_LEFT"] = String(Settings.IR_LEFT);
-    doc["IR_RIGHT"] = String(Settings.IR_RIGHT);
-    doc["IR_SELECT"] = String(Settings.IR_SELECT);
-    doc["IR_BACK"] = String(Settings.IR_BACK);
-    doc["IR_MUTE"] = String(Settings.IR_MUTE);
-    doc["IR_PREVIOUS"] = String(Settings.IR_PREVIOUS);
-    doc["IR_1"] = String(Settings.IR_1);
-    doc["IR_2"] = String(Settings.IR_2);
-    doc["IR_3"] = String(Settings.IR_3);
-    doc["IR_4"] = String(Settings.IR_4);
-    doc["IR_5"] = String(Settings.IR_5);
-
-    JsonArray inputs = doc.createNestedArray("Input");
-    for (int i = 0; i < 5; i++) {
-        JsonObject input = inputs.createNestedObject();
-        input["Active"] = Settings.Input[i].Active;
-        input["Name"] = Settings.Input[i].Name;
-        input["MaxVol"] = Settings.Input[i].MaxVol;
-        input["MinVol"] = Settings.Input[i].MinVol;
-        input["Gain"] = Settings.Input[i].Gain;
+  relaySet(RELAY_OUTPUT, 0);
+}
+
+// Write all settings as JSON to out (ie. an AsyncResponseStream or WebSerial) - field by field, without building a document in memory first
+void exportSettings(Print &out)
+{
+  out.print("{");
+  for (byte i = 0; i < SETTING_FIELD_COUNT; i++)
+  {
+    if (i > 0)
+      out.print(",");
+    out.print("\"");
+    out.print(SettingFields[i].Name);
+    out.print("\":");
+    printSettingValue(out, &SettingFields[i]);
+  }
+  out.print("}");
+}
+
+// Write the value of a single field of Settings as JSON
+void printSettingValue(Print &out, const SettingField *Field)
+{
+  char buffer[24];
+  const byte *Value = Settings.data + Field->Offset;
+
+  switch (Field->Type)
+  {
+  case SETTING_TEXT:
+    printJsonString(out, (const char *)Value);
+    break;
+  case SETTING_SECRET:
+    // Passwords are never sent - the export is served without authentication
+    printJsonString(out, *Value != '\0' ? SETTING_SECRET_MASK : "");
+    break;
+  case SETTING_BYTE:
+    out.print((unsigned)*Value);
+    break;
+  case SETTING_IR:
+  {
+    uint64_t Code;
+    memcpy(&Code, Value, sizeof(Code));
+    snprintf(buffer, sizeof(buffer), "\"%llu\"", (unsigned long long)Code);
+    out.print(buffer);
+    break;
+  }
+  case SETTING_INPUTS:
+    out.print("[");
+    for (byte Input = 0; Input < 5; Input++)
+    {
+      if (Input > 0)
+        out.print(",");
+      out.print("{\"Active\":");
+      out.print((unsigned)Settings.Input[Input].Active);
+      out.print(",\"Name\":");
+      printJsonString(out, Settings.Input[Input].Name);
+      snprintf(buffer, sizeof(buffer), ",\"MaxVol\":%u", Settings.Input[Input].MaxVol);
+      out.print(buffer);
+      snprintf(buffer, sizeof(buffer), ",\"MinVol\":%u", Settings.Input[Input].MinVol);
+      out.print(buffer);
+      snprintf(buffer, sizeof(buffer), ",\"Gain\":%u}", Settings.Input[Input].Gain);
+      out.print(buffer);
+    }
+    out.print("]");
+    break;
+  case SETTING_VERSION:
+    snprintf(buffer, sizeof(buffer), "%.3f", Settings.Version);
+    out.print(buffer);
+    break;
+  }
+}
+
+// Returns the index in SettingFields of the field called Name (not case sensitive) - or -1 if there is no such field
+int findSettingField(const char *Name)
+{
+  for (byte i = 0; i < SETTING_FIELD_COUNT; i++)
+    if (strcasecmp(SettingFields[i].Name, Name) == 0)
+      return i;
+  return -1;
+}
+
+// Write a string as a JSON string (with quotes and escaping)
+void printJsonString(Print &out, const char *Text)
+{
+  out.print("\"");
+  for (; *Text != '\0'; Text++)
+  {
+    if (*Text == '"' || *Text == '\\')
+    {
+      out.print('\\');
+      out.print(*Text);
+    }
+    else if ((byte)*Text < 0x20)
+    {
+      char buffer[8];
+      snprintf(buffer, sizeof(buffer), "\\u%04x", (byte)*Text);
+      out.print(buffer);
+    }
+    else
+      out.print(*Text);
+  }
+  out.print("\"");
+}
+
+// Body handler of POST /api/settings - runs in the AsyncTCP task
+// The body may arrive in several chunks. It is collected in importBuffer and validated when complete. The result is sent by the request handler
+void handleSettingsImport(AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total)
+{
+  if (index == 0)
+  {
+    // Only one import at a time - the buffer is in use until the request has been answered
+    if (importRequest != NULL)
+      return;
+    importRequest = request;
+    request->onDisconnect([request]()
+                          { if (importRequest == request) importRequest = NULL; });
+    importStatus = 0;
+    debug("Settings import - heap free: "); debugln(ESP.getFreeHeap());
+  }
+  if (request != importRequest || importStatus != 0)
+    return;
+
+  if (total >= IMPORT_BUFFER_SIZE)
+  {
+    importStatus = 413;
+    importError = "size";
+    return;
+  }
+  memcpy(importBuffer + index, data, len);
+  if (index + len < total)
+    return;
+
+  if (importPending)
+  {
+    importStatus = 409;
+    importError = "busy";
+    return;
+  }
+
+  mySettings Base = Settings;
+  mySettings Staged = Settings;
+  importError = stageSettings(importBuffer, total, Staged);
+  if (importError != NULL)
+  {
+    importStatus = 400;
+    return;
+  }
+  importStatus = queueSettings(Base, Staged, SRC_WEB);
+  if (importStatus != 200 && importStatus != 202)
+    importError = "busy";
+}
+
+// Queue validated settings to be applied by the control loop - Base is the copy of Settings that Staged was made from
+// Returns 200 if nothing was changed, 202 if the settings were queued and 409/503 if an import is already waiting or the command queue is full
+int queueSettings(const mySettings &Base, const mySettings &Staged, byte Source)
+{
+  if (importPending)
+    return 409;
+  if (memcmp(&Staged, &Base, sizeof(mySettings)) == 0)
+    return 200;
+
+  importBase = Base;
+  importedSettings = Staged;
+  importPending = true;
+  if (postCommand(CMD_IMPORT_SETTINGS, 0, Source) == 0)
+  {
+    importPending = false;
+    return 503;
+  }
+  return 202;
+}
+
+// Apply an imported configuration as one change - called by the control loop
+// Only the bytes changed by the import are copied, so changes made by the control loop since the import was validated are kept
+void applyImportedSettings()
+{
+  if (!importPending)
+    return;
+
+  const byte *New = (const byte *)&importedSettings;
+  const byte *Base = (const byte *)&importBase;
+  byte *Current = (byte *)&Settings;
+  unsigned int Changed = 0;
+  bool MqttChanged = false;
+  for (size_t i = 0; i < sizeof(mySettings); i++)
+  {
+    if (New[i] != Base[i])
+    {
+      Current[i] = New[i];
+      Changed++;
+      if (i >= offsetof(mySettings, MqttUri) && i < offsetof(mySettings, MqttTopic) + sizeof(Settings.MqttTopic))
+        MqttChanged = true;
     }
+  }
+  importPending = false;
+
+  writeSettingsToEEPROM();
+  debug("Settings imported - bytes changed: "); debugln(Changed);
+
+  // The display settings of a recalled preset are replaced by the changed settings
+  displayOptionsFromSettings();
+  if (displaysReady)
+    setDisplayContrast();
+
+  // Connect to the new broker (or disconnect if MQTT has been disabled)
+  if (MqttChanged && networkReady)
+    mqttStart();
+
+  // The limits of the current input may have changed
+  if (appMode == APP_NORMAL_MODE)
+  {
+    setVolume(RuntimeSettings.CurrentVolume);
+    left_display_update();
+    right_display_update();
+  }
+}
+
+// Copy the runtime state into WarmState and update its checksum - called every time the state of the relays or the Muses72323 is changed
+void saveWarmState()
+{
+  WarmState.Magic = WARM_STATE_MAGIC;
+  WarmState.AppMode = appMode;
+  WarmState.CurrentInput = RuntimeSettings.CurrentInput;
+  WarmState.CurrentVolume = RuntimeSettings.CurrentVolume;
+  WarmState.Muted = RuntimeSettings.Muted;
+  WarmState.PrevSelectedInput = RuntimeSettings.PrevSelectedInput;
+  WarmState.Checksum = calculateWarmStateChecksum();
+}
+
+// FNV-1a hash of WarmState (excluding the checksum itself)
+uint32_t calculateWarmStateChecksum()
+{
+  const byte *data = (const byte *)&WarmState;
+  uint32_t hash = 2166136261UL;
+  for (size_t i = 0; i < offsetof(myWarmState, Checksum); i++)
+  {
+    hash ^= data[i];
+    hash *= 16777619UL;
+  }
+  return hash;
+}
+
+// Restore the relays and the Muses72323 to the state saved in WarmState - only after a warm restart and only if the saved state is valid
+// Returns true if the state has been restored
+bool restoreWarmState()
+{
+  esp_reset_reason_t reason = esp_reset_reason();
+  if (reason != ESP_RST_SW && reason != ESP_RST_PANIC && reason != ESP_RST_INT_WDT && reason != ESP_RST_TASK_WDT && reason != ESP_RST_WDT)
+    return false;
+  if (WarmState.Magic != WARM_STATE_MAGIC || WarmState.Checksum != calculateWarmStateChecksum())
+    return false;
+
+  // The GPIO of the ESP32 is reset by the restart - the power relay must be set first
+  pinMode(POWER_CONTROL_PIN, OUTPUT);
+  digitalWrite(POWER_CONTROL_PIN, WarmState.PowerOn);
+
+  // The MCP23008 has kept its outputs - write the same state back before the pins are (re)defined as OUTPUT
+  relayController.begin();
+  metricBusStatus(DEVICE_MCP23008, relayController.writeRegister(MCP23008_GPIO, WarmState.RelayMask));
+  metricBusStatus(DEVICE_MCP23008, relayController.writeRegister(MCP23008_IODIR, 0x00));
+
+  muses.begin();
+  muses.setExternalClock(false);
+  muses.setGain(WarmState.Gain);
+  if (WarmState.MusesMuted)
+    muses.mute();
+  else
+    musesSetVolume(WarmState.Attenuation, WarmState.Balance);
 
-    doc["ExtPowerRelayTrigger"] = Settings.ExtPowerRelayTrigger;
-    doc["Trigger1Active"] = Settings.Trigger1Active;
-    doc["Trigger1Type"] = Settings.Trigger1Type;
-    doc["Trigger1OnDelay"] = Settings.Trigger1OnDelay;
-    doc["Trigger1Temp"] = Settings.Trigger1Temp;
-    doc["Trigger2Active"] = Settings.Trigger2Active;
-    doc["Trigger2Type"] = Settings.Trigger2Type;
-    doc["Trigger2OnDelay"] = Settings.Trigger2OnDelay;
-    doc["Trigger2Temp"] = Settings.Trigger2Temp;
-    doc["TriggerInactOffTimer"] = Settings.TriggerInactOffTimer;
-    doc["ScreenSaverActive"] = Settings.ScreenSaverActive;
-    doc["DisplayOnLevel"] = Settings.DisplayOnLevel;
-    doc["DisplayDimLevel"] = Settings.DisplayDimLevel;
-    doc["DisplayTimeout"] = Settings.DisplayTimeout;
-    doc["DisplayVolume"] = Settings.DisplayVolume;
-    doc["DisplaySelectedInput"] = Settings.DisplaySelectedInput;
-    doc["DisplayTemperature1"] = Settings.DisplayTemperature1;
-    doc["DisplayTemperature2"] = Settings.DisplayTemperature2;
-    doc["Version"] = Settings.Version;
-
-    String output;
-    serializeJson(doc, output);
-    return output;
-}
\ No newline at end of file
+  return true;
+}
+
+// Continue after a warm restart where the audio has already been restored by restoreWarmState - this replaces startUp() as no logo, delays or fades are wanted
+void resumeAfterWarmRestart()
+{
+  debugln("Resuming after warm restart...");
+  mil_On = millis();
+  UIkey = KEY_NONE;
+  lastReceivedInput = KEY_NONE;
+
+  if (WarmState.AppMode == APP_STANDBY_MODE)
+  {
+    appMode = APP_STANDBY_MODE;
+    last_KEY_ONOFF = millis();
+    return;
+  }
+
+  appMode = APP_NORMAL_MODE;
+  ScreenSaverOff();
+  left_display_update();
+  right_display_update();
+}
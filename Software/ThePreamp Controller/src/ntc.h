@@ -0,0 +1,44 @@
+// Conversion of the filtered ADC values of the NTCs into temperatures
+
+#ifndef NTC_H
+#define NTC_H
+
+#include <stdint.h>
+#include "ntc_table.h"
+
+#define TEMP_FILTER_SCALE 16 // The filtered value is kept with 4 extra bits, so the small steps are not lost
+
+// Calculate the temperature (1/10 degrees Celcius) from the ADC value measured across the reference resistor of the NTC
+// Value is the ADC value * TEMP_FILTER_SCALE - the temperature is interpolated in ntcTable (see scripts/ntc_table.py)
+inline int16_t ntcTemperature(int32_t Value)
+{
+  const int32_t Step = (1 << NTC_TABLE_SHIFT) * TEMP_FILTER_SCALE;
+  int32_t Position = Value - NTC_TABLE_FIRST * TEMP_FILTER_SCALE;
+  int32_t Temp;
+
+  if (Position <= 0)
+    Temp = ntcTable[0];
+  else if (Position >= (NTC_TABLE_SIZE - 1) * Step)
+    Temp = ntcTable[NTC_TABLE_SIZE - 1];
+  else
+  {
+    int32_t Index = Position / Step;
+    int32_t Fraction = Position % Step;
+    Temp = ntcTable[Index] + (ntcTable[Index + 1] - ntcTable[Index]) * Fraction / Step;
+  }
+
+  // Below 0 degrees is shown as 0 - above the table as its last entry (about 102 degrees)
+  if (Temp < 0)
+    Temp = 0;
+  return (Temp + 5) / 10;
+}
+
+// Returns true if Value (ADC value * TEMP_FILTER_SCALE) is outside ntcTable - an open NTC reads about 0 and a shorted NTC about the
+// supply of the divider, so both would otherwise be shown as a plausible temperature. The table covers about -6 to 102 degrees
+inline bool ntcFault(int32_t Value)
+{
+  return Value < NTC_TABLE_FIRST * TEMP_FILTER_SCALE ||
+         Value > (NTC_TABLE_FIRST + ((NTC_TABLE_SIZE - 1) << NTC_TABLE_SHIFT)) * TEMP_FILTER_SCALE;
+}
+
+#endif
@@ -0,0 +1,21 @@
+// Generated by scripts/ntc_table.py - do not edit
+// NTC 4700 ohms at 25 degrees Celcius, Beta 3500 K, reference resistor 10000 ohms, divider supply 3.3V, ADS1115 0.125mV per bit
+// Largest error of the linear interpolation between 0 and 65 degrees Celcius: 0.038 degrees
+
+#ifndef NTC_TABLE_H
+#define NTC_TABLE_H
+
+#define NTC_TABLE_FIRST 10240 // ADC value of the first entry
+#define NTC_TABLE_SHIFT 8 // log2 of the ADC values between two entries
+#define NTC_TABLE_SIZE 60
+
+// Temperature in 1/100 degrees Celcius for ADC value NTC_TABLE_FIRST + (index << NTC_TABLE_SHIFT)
+const int16_t ntcTable[NTC_TABLE_SIZE] = {
+  -289, -204, -119, -34, 51, 136, 221, 306, 391, 477, 563, 649,
+  736, 824, 912, 1001, 1091, 1181, 1273, 1365, 1459, 1554, 1650, 1748,
+  1847, 1948, 2051, 2155, 2262, 2371, 2483, 2597, 2714, 2834, 2958, 3085,
+  3216, 3351, 3492, 3637, 3788, 3945, 4109, 4281, 4462, 4652, 4853, 5067,
+  5294, 5538, 5801, 6087, 6399, 6743, 7128, 7562, 8062, 8650, 9360, 10255
+};
+
+#endif
@@ -0,0 +1,85 @@
+// Evaluation of the thermal protection - protectionLoop() in main.cpp checks the temperature of each NTC every PROTECTION_INTERVAL
+// against its limit. It trips when a temperature reaches its limit - or rises so fast that it would reach the limit within
+// PROTECTION_RISE_HORIZON. It can not be turned on again until all temperatures are PROTECTION_HYSTERESIS below their limits
+
+#ifndef PROTECTION_H
+#define PROTECTION_H
+
+#include <stdint.h>
+
+#define PROTECTION_INTERVAL 500     // Time between two evaluations (milliseconds)
+#define PROTECTION_HYSTERESIS 50    // 1/10 degrees Celcius
+#define PROTECTION_RISE_SAMPLES 20  // The rise is measured over PROTECTION_RISE_SAMPLES * PROTECTION_INTERVAL (10 seconds)
+#define PROTECTION_RISE_MIN 10      // Smaller rises over the 10 seconds are noise (1/10 degrees Celcius)
+#define PROTECTION_RISE_HORIZON 60  // Trip if the temperature rising at the same rate would reach the limit within this time (seconds)
+
+// The causes of NTC 2 are those of NTC 1 shifted left by 1
+enum ProtectionCauses
+{
+  PROTECTION_LIMIT_1 = 0x01, // NTC 1 reached Trigger1Temp
+  PROTECTION_LIMIT_2 = 0x02, // NTC 2 reached Trigger2Temp
+  PROTECTION_RISE_1 = 0x04,  // NTC 1 rises too fast
+  PROTECTION_RISE_2 = 0x08,  // NTC 2 rises too fast
+  PROTECTION_FAULT_1 = 0x10, // NTC 1 is open or shorted
+  PROTECTION_FAULT_2 = 0x20  // NTC 2 is open or shorted
+};
+
+enum ProtectionActions
+{
+  PROTECTION_NONE,
+  PROTECTION_TRIP,    // Mute and turn the controller off
+  PROTECTION_BLOCK,   // In standby already - add the causes, so it is not turned on
+  PROTECTION_RELEASE  // Cool again - it may be turned on
+};
+
+// The temperatures of the last evaluations of an NTC
+struct ProtectionHistory
+{
+  int16_t Temps[PROTECTION_RISE_SAMPLES];
+  uint8_t Next;  // The entry to write next - the oldest when the history is full
+  uint8_t Count; // Number of entries used
+};
+
+// Add Temp (1/10 degrees Celcius) to History and check it against Limit (degrees - 0 = no limit). Fault is set if the NTC is open
+// or shorted, ie. the temperature is unknown. Returns the causes as those of NTC 1 - Cool is cleared if the NTC is not cool enough
+// to turn the controller on again
+inline uint8_t protectionCheck(ProtectionHistory &History, int16_t Temp, uint8_t Limit, bool Fault, bool &Cool)
+{
+  bool Full = (History.Count == PROTECTION_RISE_SAMPLES);
+  int16_t Oldest = History.Temps[History.Next]; // Overwritten now - only valid when the history is full
+  History.Temps[History.Next] = Temp;
+  History.Next = (History.Next + 1) % PROTECTION_RISE_SAMPLES;
+  if (!Full)
+    History.Count++;
+  if (Limit == 0)
+    return 0;
+
+  int16_t Threshold = Limit * 10; // 1/10 degrees Celcius
+  int16_t Rise = Temp - Oldest;
+  uint8_t Causes = 0;
+  if (Fault)
+  {
+    Causes = PROTECTION_FAULT_1;
+    Cool = false;
+  }
+  else if (Temp >= Threshold)
+    Causes = PROTECTION_LIMIT_1;
+  else if (Full && Rise >= PROTECTION_RISE_MIN &&
+           Temp + (int32_t)Rise * PROTECTION_RISE_HORIZON * 1000 / (PROTECTION_RISE_SAMPLES * PROTECTION_INTERVAL) >= Threshold)
+    Causes = PROTECTION_RISE_1;
+  if (Temp > Threshold - PROTECTION_HYSTERESIS)
+    Cool = false;
+  return Causes;
+}
+
+// What to do after an evaluation - Tripped is the causes of the trip in force (0 = not tripped)
+inline uint8_t protectionAction(uint8_t Tripped, uint8_t Causes, bool Cool, bool Standby)
+{
+  if (Causes != 0)
+    return Standby ? PROTECTION_BLOCK : PROTECTION_TRIP;
+  if (Tripped != 0 && Cool)
+    return PROTECTION_RELEASE;
+  return PROTECTION_NONE;
+}
+
+#endif
@@ -0,0 +1,59 @@
+// The relays on the outputs of the MCP23008 - main.cpp keeps their state in WarmState.RelayMask and writes it with relaySet()
+// The state of the outputs is kept in RAM (the latch), so a change of any number of relays is one write of the GPIO register
+
+#ifndef RELAYS_H
+#define RELAYS_H
+
+#include <stdint.h>
+
+// The outputs of the MCP23008 as bits of WarmState.RelayMask
+#define RELAY_OUTPUT 0x01            // Output (mute) relay - pin 0
+#define RELAY_TRIGGER2 0x02          // Trigger 2 - pin 1
+#define RELAY_TRIGGER1 0x04          // Trigger 1 - pin 2
+#define RELAY_INPUTS 0xF8            // Input relays - pin 7 (input 1) to pin 3 (input 5)
+#define RELAY_INPUT(input) (0x80 >> (input))
+#define RELAY_BREAK_TIME 5           // Milliseconds from an input relay is released until the next is operated (release time of the relays plus margin)
+
+// The relays after the relays in Mask have been set to the bits of Value - the others are left as they are in Relays
+inline uint8_t relayMerge(uint8_t Relays, uint8_t Mask, uint8_t Value)
+{
+  return (Relays & ~Mask) | (Value & Mask);
+}
+
+// Returns true if switching the relays in Off to On releases a relay that is operated in Relays - the break of break before make
+inline bool relayBreakNeeded(uint8_t Relays, uint8_t Off, uint8_t On)
+{
+  return (Relays & Off & ~On) != 0;
+}
+
+// Writes Relays to the GPIO register of the MCP23008 - if Wait is set, returns when they have been written
+typedef void (*RelayWriter)(uint8_t Relays, bool Wait);
+// Waits Milliseconds - the break of break before make
+typedef void (*RelayPause)(uint32_t Milliseconds);
+
+// Set the relays in Mask to the bits of Value with one write and update Latch - nothing is written if they are already set
+// Returns true if the relays were written
+inline bool relayUpdate(uint8_t &Latch, uint8_t Mask, uint8_t Value, bool Wait, RelayWriter Write)
+{
+  uint8_t Relays = relayMerge(Latch, Mask, Value);
+  if (Relays == Latch)
+    return false;
+  Write(Relays, Wait);
+  Latch = Relays;
+  return true;
+}
+
+// Break before make: release the relays in Off, wait RELAY_BREAK_TIME if any was released and then operate the relays in On
+// At most two writes - the release is written before the pause starts. Returns true if the relays were written
+inline bool relayChange(uint8_t &Latch, uint8_t Off, uint8_t On, RelayWriter Write, RelayPause Pause)
+{
+  bool Written = false;
+  if (relayBreakNeeded(Latch, Off, On))
+  {
+    Written = relayUpdate(Latch, Off, 0, true, Write);
+    Pause(RELAY_BREAK_TIME);
+  }
+  return relayUpdate(Latch, Off | On, On, false, Write) || Written;
+}
+
+#endif
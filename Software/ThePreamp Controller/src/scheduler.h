@@ -0,0 +1,48 @@
+// Time arithmetic of the job scheduler in main.cpp - the times are millis() values, which wrap after 49.7 days
+// Two times are compared by their difference as a signed number, so a job may be scheduled at most 24.8 days ahead
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdint.h>
+
+// Returns true when Due has been reached at Now
+inline bool jobIsDue(uint32_t Now, uint32_t Due)
+{
+  return (int32_t)(Now - Due) >= 0;
+}
+
+// The milliseconds from Now until Due - negative if Due has passed
+inline int32_t jobTimeLeft(uint32_t Now, uint32_t Due)
+{
+  return (int32_t)(Due - Now);
+}
+
+// The next time a periodic job is due after it was run at Now for Due - it keeps its rhythm, but if it is a full period late
+// (ie. loop() was blocked) the missed runs are skipped
+inline uint32_t jobNextDue(uint32_t Due, uint32_t Period, uint32_t Now)
+{
+  Due += Period;
+  if (jobIsDue(Now, Due))
+    Due = Now + Period;
+  return Due;
+}
+
+// The milliseconds left at Now of an Interval started at Start - 0 if it has passed
+inline uint32_t jobIntervalLeft(uint32_t Start, uint32_t Interval, uint32_t Now)
+{
+  uint32_t Elapsed = Now - Start;
+  return (Elapsed < Interval) ? Interval - Elapsed : 0;
+}
+
+// The milliseconds from Now until the first of the Count jobs in Due is due - only the jobs with Scheduled set count. INT32_MAX if none is
+inline int32_t jobSleepTime(uint32_t Now, const uint32_t *Due, const bool *Scheduled, uint8_t Count)
+{
+  int32_t Sleep = INT32_MAX;
+  for (uint8_t Job = 0; Job < Count; Job++)
+    if (Scheduled[Job] && jobTimeLeft(Now, Due[Job]) < Sleep)
+      Sleep = jobTimeLeft(Now, Due[Job]);
+  return Sleep;
+}
+
+#endif
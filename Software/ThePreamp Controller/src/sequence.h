@@ -0,0 +1,132 @@
+// The steps of the power sequence - composed from Settings.PowerUpOrder/PowerDownOrder and executed by sequenceRun() in main.cpp
+
+#ifndef SEQUENCE_H
+#define SEQUENCE_H
+
+#include <stdint.h>
+#include <string.h>
+#include "relays.h"
+
+#define SEQUENCE_MAX_STEPS 16
+#define SEQUENCE_STEP_TIME 200  // Time between two steps of a power up/down sequence (milliseconds)
+#define SEQUENCE_PULSE_TIME 200 // Length of the pulse of a momentary trigger (milliseconds)
+
+enum SequenceTargets
+{
+  SEQ_POWER,    // POWER_CONTROL_PIN (external power relay)
+  SEQ_TRIGGER1, // MCP23008 pin 2
+  SEQ_TRIGGER2, // MCP23008 pin 1
+  SEQ_OUTPUT    // MCP23008 pin 0 (output relay)
+};
+
+struct SequenceStep
+{
+  uint8_t Target; // SequenceTargets
+  uint8_t Value;  // HIGH/LOW
+  bool Release;   // The end of a trigger pulse - executed at once if the sequence is replaced, so a trigger is never left on
+  uint32_t Delay; // Milliseconds after the previous step
+};
+
+// The outputs switched by a power sequence - taken from Settings by sequenceStart()
+struct SequenceOptions
+{
+  bool ExtPower;              // Settings.ExtPowerRelayTrigger
+  bool TriggerActive[2];      // Settings.Trigger1Active/Trigger2Active
+  bool TriggerMomentary[2];   // Settings.Trigger1Type/Trigger2Type == 0
+  uint32_t TriggerOnDelay[2]; // Settings.Trigger1OnDelay/Trigger2OnDelay in milliseconds
+};
+
+// The relay set by a step of the power sequence (0 for SEQ_POWER, which is not on the MCP23008)
+inline uint8_t sequenceRelay(uint8_t Target)
+{
+  switch (Target)
+  {
+  case SEQ_TRIGGER1:
+    return RELAY_TRIGGER1;
+  case SEQ_TRIGGER2:
+    return RELAY_TRIGGER2;
+  case SEQ_OUTPUT:
+    return RELAY_OUTPUT;
+  }
+  return 0;
+}
+
+// Returns true if Order only contains P, 1, 2 and O - each at most once
+inline bool sequenceOrderValid(const char *Order)
+{
+  for (const char *c = Order; *c != '\0'; c++)
+    if (strchr("P12O", *c) == NULL || strchr(c + 1, *c) != NULL)
+      return false;
+  return true;
+}
+
+// Add a step after the Count steps in Steps - returns false if there is no room for it
+inline bool sequenceAppend(SequenceStep *Steps, uint8_t &Count, uint8_t Target, uint8_t Value, uint32_t Delay, bool Release = false)
+{
+  if (Count == SEQUENCE_MAX_STEPS)
+    return false;
+  Steps[Count].Target = Target;
+  Steps[Count].Value = Value;
+  Steps[Count].Release = Release;
+  Steps[Count].Delay = Delay;
+  Count++;
+  return true;
+}
+
+// A momentary trigger gets a pulse both to be switched on and off - a latching trigger is switched on or off
+inline bool sequenceAppendTrigger(SequenceStep *Steps, uint8_t &Count, uint8_t Target, bool On, bool Momentary, uint32_t Delay)
+{
+  if (!Momentary)
+    return sequenceAppend(Steps, Count, Target, On ? 1 : 0, Delay);
+  if (Count + 2 > SEQUENCE_MAX_STEPS)
+    return false;
+  sequenceAppend(Steps, Count, Target, 1, Delay);
+  sequenceAppend(Steps, Count, Target, 0, SEQUENCE_PULSE_TIME, true);
+  return true;
+}
+
+// Compose the power up (Up) or power down sequence of the outputs in Order into Steps - returns the number of steps
+// The steps are SEQUENCE_STEP_TIME apart. A trigger is switched on no earlier than its OnDelay after the start of the power up sequence
+inline uint8_t sequenceCompose(const char *Order, bool Up, const SequenceOptions &Options, SequenceStep *Steps)
+{
+  uint8_t Count = 0;
+  uint32_t Elapsed = 0; // Milliseconds from the start of the sequence to the step being added
+  for (const char *c = Order; *c != '\0'; c++)
+  {
+    uint32_t Delay = (Count == 0) ? 0 : SEQUENCE_STEP_TIME;
+    uint32_t OnDelay = 0;
+    if (Up && (*c == '1' || *c == '2'))
+      OnDelay = Options.TriggerOnDelay[*c - '1'];
+    if (OnDelay > Elapsed + Delay)
+      Delay = OnDelay - Elapsed;
+    uint8_t First = Count;
+    switch (*c)
+    {
+    case 'P':
+      if (Options.ExtPower)
+        sequenceAppend(Steps, Count, SEQ_POWER, Up ? 1 : 0, Delay);
+      break;
+    case '1':
+    case '2':
+      if (Options.TriggerActive[*c - '1'])
+        sequenceAppendTrigger(Steps, Count, (*c == '1') ? SEQ_TRIGGER1 : SEQ_TRIGGER2, Up, Options.TriggerMomentary[*c - '1'], Delay);
+      break;
+    case 'O':
+      sequenceAppend(Steps, Count, SEQ_OUTPUT, Up ? 1 : 0, Delay);
+      break;
+    }
+    for (uint8_t i = First; i < Count; i++)
+      Elapsed += Steps[i].Delay;
+  }
+  return Count;
+}
+
+// Add the relay of a step to the relays collected in Mask/Value for one write by sequenceRun() - a later step of the same relay wins
+inline void sequenceCollect(const SequenceStep &Step, uint8_t &Mask, uint8_t &Value)
+{
+  uint8_t Relay = sequenceRelay(Step.Target);
+  Mask |= Relay;
+  Value = relayMerge(Value, Relay, Step.Value ? Relay : 0);
+}
+
+#endif
@@ -0,0 +1,306 @@
+// The settings of the controller as stored in the EEPROM, the description of their fields for export and import, and the validation
+// of imported settings
+
+#ifndef SETTINGS_H
+#define SETTINGS_H
+
+#include <stdint.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <ArduinoJson.h>
+#include "sequence.h"
+
+#ifndef ARDUINO
+typedef uint8_t byte;
+#endif
+
+#ifndef VERSION
+#error "VERSION must be defined before settings.h is included"
+#endif
+
+#define INPUT_HT_PASSTHROUGH 0
+#define INPUT_NORMAL 1
+#define INPUT_INACTIVATED 2
+
+struct InputSettings
+{
+  byte Active;
+  char Name[8];
+  byte MaxVol;  // The maximum volume allowed for this input in steps
+  byte MinVol;  // The minimum volume allowed for this input in steps
+  byte Gain;
+
+};
+
+// This holds all the settings of the controller
+// It is saved to the I2C EEPROM on the first run and read back into memory on subsequent runs
+// The settings can be changed from the menu and the user can also chose to reset to default values if something goes wrong
+// On startup of the controller it is checked if the EEPROM contains valid data by checking if the Version field equals the VERSION defined by the source code. If they are not the same default values will be written to EEPROM
+// This is created as a union to be able to serialize/deserialize the data when writing and reading to/from the EEPROM
+typedef union
+{
+  struct
+  {
+    char ssid[33];    // Wifi network SSDI
+    char pass[33];    // Wifi network password
+    char ip[16];      // Wifi network assigned IP address
+    char gateway[16]; // Wifi network gateway IP address
+
+    byte VolumeSteps;    // The number of steps of the volume control
+    byte MinAttenuation; // Minimum attenuation in -dB (as 0 db equals no attenuation this is equal to the highest volume allowed)
+    byte MaxAttenuation; // Maximum attenuation in -dB (as -111.5 db is the limit of the Muses72323 this is equal to the lowest volume possible). We only keep this setting as a positive number, and we do also only allow the user to set the value in 1 dB steps
+    byte MaxStartVolume; // If StoreSetLevel is true, then limit the volume to the specified value when the controller is powered on
+    byte MuteLevel;      // The level to be set when Mute is activated by the user. The Mute function of the Muses72323 is activated if 0 is specified
+    byte RecallSetLevel; // Remember/store the volume level for each separate input
+
+    uint64_t IR_ON;               // IR data to be interpreted as ON
+    uint64_t IR_OFF;              // IR data to be interpreted as OFF
+    uint64_t IR_UP;               // IR data to be interpreted as UP
+    uint64_t IR_DOWN;             // IR data to be interpreted as DOWN
+    uint64_t IR_REPEAT;           // IR data to be interpreted as REPEAT (ie Apple remotes sends a specific code, if a key is held down to indicate repeat of the previously sent code
+    uint64_t IR_LEFT;             // IR data to be interpreted as LEFT
+    uint64_t IR_RIGHT;            // IR data to be interpreted as RIGHT
+    uint64_t IR_SELECT;           // IR data to be interpreted as SELECT
+    uint64_t IR_BACK;             // IR data to be interpreted as BACK
+    uint64_t IR_MUTE;             // IR data to be interpreted as MUTE
+    uint64_t IR_PREVIOUS;         // IR data to be interpreted as "switch to previous selected input"
+    uint64_t IR_1;                // IR data to be interpreted as 1 (to select input 1 directly)
+    uint64_t IR_2;                // IR data to be interpreted as 2
+    uint64_t IR_3;                // IR data to be interpreted as 3
+    uint64_t IR_4;                // IR data to be interpreted as 5
+    uint64_t IR_5;                // IR data to be interpreted as 4
+    
+    struct InputSettings Input[5]; // Settings for all 5 inputs
+    bool ExtPowerRelayTrigger;     // Enable triggering of relay for external power (we use it to control the power of the Mezmerize)
+    byte Trigger1Active;           // 0 = the trigger is not active, 1 = the trigger is active
+    byte Trigger1Type;             // 0 = momentary, 1 = latching
+    byte Trigger1OnDelay;          // Seconds from controller power up to activation of trigger. The default delay allows time for the output relay of the Mezmerize to be activated before we turn on the power amps. The selection of an input of the Mezmerize will also be delayed.
+    byte Trigger1Temp;             // Temperature protection: if the temperature is measured to the set number of degrees Celcius (via the LDRs), the controller will attempt to trigger a shutdown of the connected power amps (if set to 0, the temperature protection is not active
+    byte Trigger2Active;           // 0 = the trigger is not active, 1 = the trigger is active
+    byte Trigger2Type;             // 0 = momentary, 1 = latching
+    byte Trigger2OnDelay;          // Seconds from controller power up to activation of trigger. The default delay allows time for the output relay of the Mezmerize to be activated before we turn on the power amps. The selection of an input of the Mezmerize will also be delayed.
+    byte Trigger2Temp;             // Temperature protection: if the temperature is measured to the set number of degrees Celcius (via the LDRs), the controller will attempt to trigger a shutdown of the connected power amps (if set to 0, the temperature protection is not active)
+    byte TriggerInactOffTimer;     // Hours without user interaction before automatic power down (0 = never)
+    byte ScreenSaverActive;        // 0 = the display will stay on/not be dimmed, 1 = the display will be dimmed to the specified level after a specified period of time with no user input
+    byte DisplayOnLevel;           // The contrast level of the display when it is on, 0 = 25%, 1 = 50%, 2 = 75%, 3 = 100%
+    byte DisplayDimLevel;          // The contrast level of the display when screen saver is active. 0 = off, 1 = 3, 2 = 7 ... 32 = 127. If DisplayDimLevel = 0 the display will be turned off when the screen saver is active (to reduce electrical noise)
+    byte DisplayTimeout;           // Number of seconds before the screen saver is activated.
+    byte DisplayVolume;            // 0 = no display of volume, 1 = show step number, 2 = show as -dB
+    byte DisplaySelectedInput;     // 0 = the name of the active input is not shown on the display (ie. if only one input is used), 1 = the name of the selected input is shown on the display
+    byte DisplayTemperature1;      // 0 = do not display the temperature measured by NTC 1, 1 = display in number of degrees Celcious, 2 = display as graphical representation, 3 = display both
+    byte DisplayTemperature2;      // 0 = do not display the temperature measured by NTC 2, 1 = display in number of degrees Celcious, 2 = display as graphical representation, 3 = display both
+    char MqttUri[64];              // MQTT broker, ie. mqtt://192.168.1.10:1883 - MQTT is disabled if empty
+    char MqttUser[33];             // MQTT user name (empty = no authentication)
+    char MqttPass[33];             // MQTT password
+    char MqttTopic[24];            // Prefix of all MQTT topics, ie. thepreamp -> thepreamp/volume, thepreamp/volume/set ...
+    byte LinkGroup;                // Linked controllers: 0 = not linked, 1-250 = the group this controller belongs to
+    byte LinkRole;                 // 0 = leader (sends its volume, mute and input to the group), 1 = follower (mirrors the leader)
+    char PowerUpOrder[6];          // The order the outputs are switched on when the controller is turned on: P = external power relay, 1 = trigger 1, 2 = trigger 2, O = output relay (see sequenceStart)
+    char PowerDownOrder[6];        // The order the outputs are switched off when the controller is turned off
+    float Version;                 // Used to check if data read from the EEPROM is valid with the compiled version of the code - if not a reset to default settings is necessary and they must be written to the EEPROM
+  };
+  byte data[488]; // Allows us to be able to write/read settings from EEPROM byte-by-byte (to avoid specific serialization/deserialization code)
+} mySettings;
+
+
+// Describes the fields of Settings for export and import - the fields are exported in the order of the table
+enum SettingTypes
+{
+  SETTING_TEXT,   // Zero terminated string of Size bytes
+  SETTING_SECRET, // As SETTING_TEXT but exported as SETTING_SECRET_MASK (if set) - the mask is ignored on import, so an export can be imported again
+  SETTING_BYTE,   // byte/bool in the range Min-Max
+  SETTING_IR,     // uint64_t IR code - exported as a string
+  SETTING_INPUTS, // The Input array
+  SETTING_VERSION // float - must match VERSION on import
+};
+
+#define SETTING_SECRET_MASK "********"
+
+struct SettingField
+{
+  const char *Name;
+  uint16_t Offset;
+  byte Type;
+  byte Size;
+  byte Min;
+  byte Max;
+};
+
+#define SETTING_FIELD(Field, Type, Min, Max) { #Field, offsetof(mySettings, Field), Type, sizeof(((mySettings *)0)->Field), Min, Max }
+
+const SettingField SettingFields[] = {
+  SETTING_FIELD(ssid, SETTING_TEXT, 0, 0),
+  SETTING_FIELD(pass, SETTING_SECRET, 0, 0),
+  SETTING_FIELD(ip, SETTING_TEXT, 0, 0),
+  SETTING_FIELD(gateway, SETTING_TEXT, 0, 0),
+  SETTING_FIELD(VolumeSteps, SETTING_BYTE, 10, 255),
+  SETTING_FIELD(MinAttenuation, SETTING_BYTE, 0, 111),
+  SETTING_FIELD(MaxAttenuation, SETTING_BYTE, 0, 111),
+  SETTING_FIELD(MaxStartVolume, SETTING_BYTE, 0, 255),
+  SETTING_FIELD(MuteLevel, SETTING_BYTE, 0, 255),
+  SETTING_FIELD(RecallSetLevel, SETTING_BYTE, 0, 1),
+  SETTING_FIELD(IR_ON, SETTING_IR, 0, 0),
+  SETTING_FIELD(IR_OFF, SETTING_IR, 0, 0),
+  SETTING_FIELD(IR_UP, SETTING_IR, 0, 0),
+  SETTING_FIELD(IR_DOWN, SETTING_IR, 0, 0),
+  SETTING_FIELD(IR_REPEAT, SETTING_IR, 0, 0),
+  SETTING_FIELD(IR_LEFT, SETTING_IR, 0, 0),
+  SETTING_FIELD(IR_RIGHT, SETTING_IR, 0, 0),
+  SETTING_FIELD(IR_SELECT, SETTING_IR, 0, 0),
+  SETTING_FIELD(IR_BACK, SETTING_IR, 0, 0),
+  SETTING_FIELD(IR_MUTE, SETTING_IR, 0, 0),
+  SETTING_FIELD(IR_PREVIOUS, SETTING_IR, 0, 0),
+  SETTING_FIELD(IR_1, SETTING_IR, 0, 0),
+  SETTING_FIELD(IR_2, SETTING_IR, 0, 0),
+  SETTING_FIELD(IR_3, SETTING_IR, 0, 0),
+  SETTING_FIELD(IR_4, SETTING_IR, 0, 0),
+  SETTING_FIELD(IR_5, SETTING_IR, 0, 0),
+  SETTING_FIELD(Input, SETTING_INPUTS, 0, 0),
+  SETTING_FIELD(ExtPowerRelayTrigger, SETTING_BYTE, 0, 1),
+  SETTING_FIELD(Trigger1Active, SETTING_BYTE, 0, 1),
+  SETTING_FIELD(Trigger1Type, SETTING_BYTE, 0, 1),
+  SETTING_FIELD(Trigger1OnDelay, SETTING_BYTE, 0, 255),
+  SETTING_FIELD(Trigger1Temp, SETTING_BYTE, 0, 99),
+  SETTING_FIELD(Trigger2Active, SETTING_BYTE, 0, 1),
+  SETTING_FIELD(Trigger2Type, SETTING_BYTE, 0, 1),
+  SETTING_FIELD(Trigger2OnDelay, SETTING_BYTE, 0, 255),
+  SETTING_FIELD(Trigger2Temp, SETTING_BYTE, 0, 99),
+  SETTING_FIELD(TriggerInactOffTimer, SETTING_BYTE, 0, 255),
+  SETTING_FIELD(ScreenSaverActive, SETTING_BYTE, 0, 1),
+  SETTING_FIELD(DisplayOnLevel, SETTING_BYTE, 0, 3),
+  SETTING_FIELD(DisplayDimLevel, SETTING_BYTE, 0, 32),
+  SETTING_FIELD(DisplayTimeout, SETTING_BYTE, 0, 255),
+  SETTING_FIELD(DisplayVolume, SETTING_BYTE, 0, 2),
+  SETTING_FIELD(DisplaySelectedInput, SETTING_BYTE, 0, 1),
+  SETTING_FIELD(DisplayTemperature1, SETTING_BYTE, 0, 3),
+  SETTING_FIELD(DisplayTemperature2, SETTING_BYTE, 0, 3),
+  SETTING_FIELD(MqttUri, SETTING_TEXT, 0, 0),
+  SETTING_FIELD(MqttUser, SETTING_TEXT, 0, 0),
+  SETTING_FIELD(MqttPass, SETTING_SECRET, 0, 0),
+  SETTING_FIELD(MqttTopic, SETTING_TEXT, 0, 0),
+  SETTING_FIELD(LinkGroup, SETTING_BYTE, 0, 250),
+  SETTING_FIELD(LinkRole, SETTING_BYTE, 0, 1),
+  SETTING_FIELD(PowerUpOrder, SETTING_TEXT, 0, 0),
+  SETTING_FIELD(PowerDownOrder, SETTING_TEXT, 0, 0),
+  SETTING_FIELD(Version, SETTING_VERSION, 0, 0)
+};
+
+#define SETTING_FIELD_COUNT (sizeof(SettingFields) / sizeof(SettingFields[0]))
+
+// Validate the settings in json into Staged (which must hold a copy of the current settings) - fields not in json are left unchanged
+// Returns NULL if all fields are valid, otherwise the name of the first invalid field
+inline const char *stageSettings(char *json, size_t length, mySettings &Staged)
+{
+  JsonDocument doc;
+
+  // Deserializing from a writeable buffer lets ArduinoJson point into it instead of copying the strings
+  if (deserializeJson(doc, json, length))
+    return "json";
+
+  for (byte i = 0; i < SETTING_FIELD_COUNT; i++)
+  {
+    const SettingField *Field = &SettingFields[i];
+    JsonVariant Value = doc[Field->Name];
+    byte *Target = Staged.data + Field->Offset;
+
+    if (Value.isNull())
+      continue;
+
+    switch (Field->Type)
+    {
+    case SETTING_TEXT:
+    case SETTING_SECRET:
+    {
+      const char *Text = Value.as<const char *>();
+      if (Text == NULL || strlen(Text) >= Field->Size)
+        return Field->Name;
+      if (Field->Type == SETTING_SECRET && strcmp(Text, SETTING_SECRET_MASK) == 0)
+        break;
+      memset(Target, 0, Field->Size);
+      strcpy((char *)Target, Text);
+      break;
+    }
+    case SETTING_BYTE:
+    {
+      if (!Value.is<int>() || Value.as<int>() < Field->Min || Value.as<int>() > Field->Max)
+        return Field->Name;
+      *Target = Value.as<int>();
+      break;
+    }
+    case SETTING_IR:
+    {
+      // The codes are exported as strings as JavaScript can not hold a 64 bit integer - numbers are accepted as well
+      uint64_t Code;
+      if (Value.is<const char *>())
+      {
+        char *End;
+        Code = strtoull(Value.as<const char *>(), &End, 0);
+        if (*End != '\0')
+          return Field->Name;
+      }
+      else if (Value.is<uint64_t>())
+        Code = Value.as<uint64_t>();
+      else
+        return Field->Name;
+      memcpy(Target, &Code, sizeof(Code));
+      break;
+    }
+    case SETTING_INPUTS:
+    {
+      if (Value.size() != 5)
+        return Field->Name;
+      for (byte Input = 0; Input < 5; Input++)
+      {
+        JsonVariant InputValue = Value[Input];
+        const char *Name = InputValue["Name"].as<const char *>();
+        int Active = InputValue["Active"].as<int>();
+        int MaxVol = InputValue["MaxVol"].as<int>();
+        int MinVol = InputValue["MinVol"].as<int>();
+        int Gain = InputValue["Gain"].as<int>();
+        if (Name == NULL || strlen(Name) >= sizeof(Staged.Input[Input].Name) || Active < INPUT_HT_PASSTHROUGH || Active > INPUT_INACTIVATED ||
+            MinVol < 1 || MaxVol < MinVol || MaxVol > 255 || Gain < 0 || Gain > 7)
+          return Field->Name;
+        memset(Staged.Input[Input].Name, 0, sizeof(Staged.Input[Input].Name));
+        strcpy(Staged.Input[Input].Name, Name);
+        Staged.Input[Input].Active = Active;
+        Staged.Input[Input].MaxVol = MaxVol;
+        Staged.Input[Input].MinVol = MinVol;
+        Staged.Input[Input].Gain = Gain;
+      }
+      break;
+    }
+    case SETTING_VERSION:
+      // Settings exported by another version of the code may have a different meaning
+      if (Value.as<float>() != (float)VERSION)
+        return Field->Name;
+      break;
+    }
+  }
+
+  // Check the fields that depend on each other - calculateAttenuation() in main.cpp returns the lowest attenuation (full volume) for a step
+  // below 1 or if VolumeSteps is not more than a quarter of the attenuation range (step 0 is only used as "no mute level")
+  if (Staged.MinAttenuation >= Staged.MaxAttenuation)
+    return "MaxAttenuation";
+  if (Staged.VolumeSteps <= (Staged.MaxAttenuation - Staged.MinAttenuation) / 4)
+    return "VolumeSteps";
+  if (Staged.MaxStartVolume > Staged.VolumeSteps)
+    return "MaxStartVolume";
+  if (Staged.MuteLevel > Staged.VolumeSteps)
+    return "MuteLevel";
+  for (byte Input = 0; Input < 5; Input++)
+    if (Staged.Input[Input].MaxVol > Staged.VolumeSteps)
+      return "Input";
+  if (Staged.MqttUri[0] != '\0' && strncmp(Staged.MqttUri, "mqtt://", 7) != 0 && strncmp(Staged.MqttUri, "mqtts://", 8) != 0)
+    return "MqttUri";
+  if (Staged.MqttTopic[0] == '\0' || strpbrk(Staged.MqttTopic, "+#") != NULL)
+    return "MqttTopic";
+  if (!sequenceOrderValid(Staged.PowerUpOrder))
+    return "PowerUpOrder";
+  if (!sequenceOrderValid(Staged.PowerDownOrder))
+    return "PowerDownOrder";
+
+  return NULL;
+}
+
+#endif
@@ -0,0 +1,77 @@
+// Low power standby - the decisions of standbyLoop() and schedulerSleep() in main.cpp. In standby loop() sleeps in light sleep instead
+// of waiting when nothing is going on that light sleep would disturb. An input that wakes the controller keeps it awake for
+// STANDBY_AWAKE_TIME, so the encoder timer runs long enough to decode a double click (KEY_ON)
+
+#ifndef STANDBY_H
+#define STANDBY_H
+
+#include <stdint.h>
+
+#define STANDBY_AWAKE_TIME 3000      // Time the controller stays awake after an encoder button or the IR receiver woke it (milliseconds)
+#define STANDBY_MIN_LIGHT_SLEEP 20   // Shorter sleeps are done without light sleep (milliseconds)
+
+// What keeps loop() out of light sleep - the bits of standbyBusy() in main.cpp
+enum StandbyBusy
+{
+  STANDBY_BUSY_BOOT = 0x01,     // setup() has not completed
+  STANDBY_BUSY_WIFI = 0x02,     // WiFi is connected or connecting, or the configuration portal is active
+  STANDBY_BUSY_COMMAND = 0x04,  // A command is waiting in the queue
+  STANDBY_BUSY_SEQUENCE = 0x08, // The power sequence is running
+  STANDBY_BUSY_I2C = 0x10,      // An I2C transaction is executed or waiting
+  STANDBY_BUSY_JOB = 0x20       // A job has been signalled
+};
+
+enum SleepKinds
+{
+  SLEEP_NONE,  // A job is due - do not sleep
+  SLEEP_IDLE,  // Wait for the next job or a command
+  SLEEP_LIGHT  // Light sleep until the next job or an input
+};
+
+struct StandbyState
+{
+  bool LowPower; // Set while the controller is in low power standby
+  bool Awake;    // Set for STANDBY_AWAKE_TIME after a wake by an input - the encoder timer runs
+  uint32_t Wake; // millis() when an input last woke the controller
+};
+
+// Enter (Standby set) or leave low power standby - returns true if the state changed
+inline bool standbySet(StandbyState &State, bool Standby)
+{
+  if (Standby == State.LowPower)
+    return false;
+  State.LowPower = Standby;
+  State.Awake = false;
+  return true;
+}
+
+// An input woke the controller at Now - returns true if it was not awake yet, ie. the encoder timer has to be started
+inline bool standbyWakeUp(StandbyState &State, uint32_t Now)
+{
+  State.Wake = Now;
+  if (State.Awake)
+    return false;
+  State.Awake = true;
+  return true;
+}
+
+// Returns true when STANDBY_AWAKE_TIME has passed at Now since the last wake, ie. the encoder timer has to be stopped
+inline bool standbyAwakeEnded(StandbyState &State, uint32_t Now)
+{
+  if (!State.Awake || Now - State.Wake <= STANDBY_AWAKE_TIME)
+    return false;
+  State.Awake = false;
+  return true;
+}
+
+// How loop() sleeps for Sleep milliseconds (until the next job is due) - Busy is the StandbyBusy bits
+inline uint8_t standbySleepKind(const StandbyState &State, int32_t Sleep, uint8_t Busy)
+{
+  if (Sleep <= 0)
+    return SLEEP_NONE;
+  if (Sleep >= STANDBY_MIN_LIGHT_SLEEP && State.LowPower && !State.Awake && Busy == 0)
+    return SLEEP_LIGHT;
+  return SLEEP_IDLE;
+}
+
+#endif
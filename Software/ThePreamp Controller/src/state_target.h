@@ -0,0 +1,95 @@
+// A target state that is applied as one transition by applyTransition() in main.cpp, and the slot targets requested via the API are
+// merged in until the control loop takes them
+
+#ifndef STATE_TARGET_H
+#define STATE_TARGET_H
+
+#include <stdint.h>
+
+// Only the fields marked in StateTarget.Fields are changed
+#define TARGET_INPUT 0x01
+#define TARGET_VOLUME 0x02
+#define TARGET_BALANCE 0x04
+#define TARGET_MUTE 0x08
+#define TARGET_TRIGGER1 0x10
+#define TARGET_TRIGGER2 0x20
+#define TARGET_GAIN 0x40
+
+struct StateTarget
+{
+  uint8_t Fields;   // The fields to change (TARGET_...)
+  uint8_t Input;    // 0-4
+  uint8_t Volume;   // Volume step
+  uint8_t Balance;  // 127 = no balance shift (118-136)
+  uint8_t Muted;
+  uint8_t Triggers; // Bit 0 = Trigger 1 on, bit 1 = Trigger 2 on
+  uint8_t Gain;     // The gain of the Muses72323: 0 = 0 dB, 1 = 3 dB ... 7 = 21 dB
+};
+
+// A target waiting for the control loop - requests are merged into Target and only the first one posts a command for it
+// The caller must hold the lock of the slot when calling the functions below
+struct TargetSlot
+{
+  StateTarget Target; // The merged target waiting to be applied
+  bool Queued;        // Set while a command for Target is in the command queue
+  uint32_t Ticket;    // The ticket of that command
+  uint32_t Merged;    // Number of requests merged into an already queued target
+};
+
+// Merge Target into Into - the newest value of a field wins, fields not in Target are left as they are
+inline void targetMerge(StateTarget &Into, const StateTarget &Target)
+{
+  if (Target.Fields & TARGET_INPUT)
+    Into.Input = Target.Input;
+  if (Target.Fields & TARGET_VOLUME)
+    Into.Volume = Target.Volume;
+  if (Target.Fields & TARGET_BALANCE)
+    Into.Balance = Target.Balance;
+  if (Target.Fields & TARGET_MUTE)
+    Into.Muted = Target.Muted;
+  if (Target.Fields & TARGET_TRIGGER1)
+    Into.Triggers = (Into.Triggers & ~0x01) | (Target.Triggers & 0x01);
+  if (Target.Fields & TARGET_TRIGGER2)
+    Into.Triggers = (Into.Triggers & ~0x02) | (Target.Triggers & 0x02);
+  if (Target.Fields & TARGET_GAIN)
+    Into.Gain = Target.Gain;
+  Into.Fields |= Target.Fields;
+}
+
+// Merge Target into the slot. Returns true if the caller must post a command for the slot and then call targetPosted() - false if
+// a command is already queued, which applies Target too (its ticket is Slot.Ticket)
+inline bool targetPut(TargetSlot &Slot, const StateTarget &Target)
+{
+  targetMerge(Slot.Target, Target);
+  if (Slot.Queued)
+  {
+    Slot.Merged++;
+    return false;
+  }
+  Slot.Queued = true;
+  return true;
+}
+
+// Record the ticket of the command posted after targetPut() - if it could not be posted (Ticket = 0) the slot is emptied
+inline void targetPosted(TargetSlot &Slot, uint32_t Ticket)
+{
+  if (Ticket == 0)
+  {
+    Slot.Target.Fields = 0;
+    Slot.Queued = false;
+  }
+  else
+    Slot.Ticket = Ticket;
+}
+
+// Take the merged target when its command is executed - in any mode, so the next request posts a new command even if the
+// target is refused
+inline StateTarget targetTake(TargetSlot &Slot)
+{
+  StateTarget Target = Slot.Target;
+  Slot.Target.Fields = 0;
+  Slot.Queued = false;
+  return Target;
+}
+
+#endif
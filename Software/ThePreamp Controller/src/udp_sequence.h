@@ -0,0 +1,43 @@
+// Sequence numbers of the clients of the UDP control protocol - a request is only executed if its sequence number is newer
+// than the last one executed for the same client (address and port)
+
+#ifndef UDP_SEQUENCE_H
+#define UDP_SEQUENCE_H
+
+#include <stdint.h>
+
+#define UDP_MAX_CLIENTS 8 // Number of clients whose last sequence number is remembered
+
+struct UdpClient
+{
+  uint32_t Address;
+  uint16_t Port;
+  uint32_t Sequence; // The last sequence number executed
+};
+
+// Defined in main.cpp - only used by the AsyncUDP task
+extern UdpClient udpClients[UDP_MAX_CLIENTS];
+extern uint8_t udpNextClient; // The entry to reuse when a new client is seen and the table is full
+
+// Returns false if the sequence number is not newer than the last one executed for the client - runs in the AsyncUDP task
+inline bool udpCheckSequence(uint32_t Address, uint16_t Port, uint32_t Sequence)
+{
+  for (uint8_t i = 0; i < UDP_MAX_CLIENTS; i++)
+  {
+    if (udpClients[i].Address == Address && udpClients[i].Port == Port)
+    {
+      // Serial number arithmetic, so the sequence number may wrap
+      if ((int32_t)(Sequence - udpClients[i].Sequence) <= 0)
+        return false;
+      udpClients[i].Sequence = Sequence;
+      return true;
+    }
+  }
+  udpClients[udpNextClient].Address = Address;
+  udpClients[udpNextClient].Port = Port;
+  udpClients[udpNextClient].Sequence = Sequence;
+  udpNextClient = (udpNextClient + 1) % UDP_MAX_CLIENTS;
+  return true;
+}
+
+#endif
@@ -0,0 +1,300 @@
+// Host tests of the command bus (src/command_bus.h) - as used by postCommand(), postVolume() and processCommands() in main.cpp
+// The FreeRTOS queue is replaced by a std::deque of the same length, so several threads can post while another one runs the control loop
+
+#include <unity.h>
+#include <string.h>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "command_bus.h"
+
+#define QUEUE_LENGTH 16 // As COMMAND_QUEUE_LENGTH
+
+std::deque<Command> hostQueue;
+std::mutex hostQueueMutex; // The FreeRTOS queue is thread safe - the deque is not
+std::mutex hostLock;       // As commandLock
+
+bool hostSend(const Command &cmd)
+{
+  std::this_thread::yield(); // A task may be preempted between issuing the ticket and queueing the command
+  std::lock_guard<std::mutex> Guard(hostQueueMutex);
+  if (hostQueue.size() >= QUEUE_LENGTH)
+    return false;
+  hostQueue.push_back(cmd);
+  return true;
+}
+
+bool hostPeek(Command &cmd)
+{
+  std::lock_guard<std::mutex> Guard(hostQueueMutex);
+  if (hostQueue.empty())
+    return false;
+  cmd = hostQueue.front();
+  return true;
+}
+
+void hostPop()
+{
+  std::lock_guard<std::mutex> Guard(hostQueueMutex);
+  hostQueue.pop_front();
+}
+
+void hostLockTake(bool Take)
+{
+  if (Take)
+    hostLock.lock();
+  else
+    hostLock.unlock();
+}
+
+CommandBus Bus = {hostSend, hostPeek, hostPop, hostLockTake, {0}, {0}, 0};
+VolumeSlot Slot = {-1, 0};
+
+void setUp()
+{
+  hostQueue.clear();
+  Bus.Issued = 0;
+  Bus.Completed = 0;
+  Bus.Dropped = 0;
+  Slot.Volume = -1;
+  Slot.Ticket = 0;
+}
+
+void tearDown()
+{
+}
+
+uint32_t post(uint8_t Type, int32_t Value = 0)
+{
+  Command cmd;
+  memset(&cmd, 0, sizeof(cmd));
+  cmd.Type = Type;
+  cmd.Value = Value;
+  return commandPost(Bus, cmd);
+}
+
+uint32_t postVolume(int Volume)
+{
+  Command cmd;
+  memset(&cmd, 0, sizeof(cmd));
+  return commandPostVolume(Bus, Slot, cmd, Volume);
+}
+
+void test_tickets_follow_the_queue_order()
+{
+  TEST_ASSERT_EQUAL_UINT32(1, post(CMD_INPUT, 1));
+  TEST_ASSERT_EQUAL_UINT32(2, post(CMD_MUTE));
+  Command cmd;
+  TEST_ASSERT_TRUE(commandTake(Bus, cmd, true, true));
+  TEST_ASSERT_EQUAL_UINT32(1, cmd.Ticket);
+  TEST_ASSERT_EQUAL_INT32(1, cmd.Value);
+  TEST_ASSERT_TRUE(commandTake(Bus, cmd, true, true));
+  TEST_ASSERT_EQUAL_UINT32(2, cmd.Ticket);
+  TEST_ASSERT_FALSE(commandTake(Bus, cmd, true, true));
+}
+
+void test_full_queue_drops_without_using_a_ticket()
+{
+  for (uint32_t i = 1; i <= QUEUE_LENGTH; i++)
+    TEST_ASSERT_EQUAL_UINT32(i, post(CMD_INPUT));
+  TEST_ASSERT_EQUAL_UINT32(0, post(CMD_INPUT));
+  TEST_ASSERT_EQUAL_UINT32(1, Bus.Dropped);
+  hostPop();
+  TEST_ASSERT_EQUAL_UINT32(QUEUE_LENGTH + 1, post(CMD_INPUT));
+}
+
+void test_key_waits_and_the_commands_behind_it_too()
+{
+  post(CMD_KEY, 3);
+  post(CMD_INPUT, 2);
+  Command cmd;
+  TEST_ASSERT_FALSE(commandTake(Bus, cmd, false, true));
+  TEST_ASSERT_EQUAL_UINT32(2, hostQueue.size());
+  TEST_ASSERT_TRUE(commandTake(Bus, cmd, true, true));
+  TEST_ASSERT_EQUAL(CMD_KEY, cmd.Type);
+}
+
+void test_target_waits_until_due()
+{
+  post(CMD_TARGET);
+  Command cmd;
+  TEST_ASSERT_FALSE(commandTake(Bus, cmd, true, false));
+  TEST_ASSERT_TRUE(commandTake(Bus, cmd, false, true));
+  TEST_ASSERT_EQUAL(CMD_TARGET, cmd.Type);
+}
+
+void test_done_after_the_command_is_executed()
+{
+  uint32_t Ticket = post(CMD_UNMUTE);
+  TEST_ASSERT_FALSE(commandIsDone(Bus, Ticket));
+  Command cmd;
+  TEST_ASSERT_TRUE(commandTake(Bus, cmd, true, true));
+  TEST_ASSERT_FALSE(commandIsDone(Bus, Ticket));
+  commandDone(Bus, cmd);
+  TEST_ASSERT_TRUE(commandIsDone(Bus, Ticket));
+  TEST_ASSERT_FALSE(commandIsDone(Bus, 0));
+}
+
+void test_volumes_are_merged_into_the_waiting_command()
+{
+  uint32_t Ticket = postVolume(20);
+  TEST_ASSERT_EQUAL_UINT32(Ticket, postVolume(30));
+  TEST_ASSERT_EQUAL_UINT32(Ticket, postVolume(25));
+  TEST_ASSERT_EQUAL_UINT32(1, hostQueue.size());
+  Command cmd;
+  TEST_ASSERT_TRUE(commandTake(Bus, cmd, true, true));
+  TEST_ASSERT_EQUAL(CMD_VOLUME, cmd.Type);
+  TEST_ASSERT_EQUAL_INT(25, commandTakeVolume(Slot));
+
+  // Taken - the next request posts a new CMD_VOLUME
+  TEST_ASSERT_EQUAL_UINT32(Ticket + 1, postVolume(40));
+}
+
+void test_volume_is_dropped_with_a_full_queue()
+{
+  for (uint32_t i = 0; i < QUEUE_LENGTH; i++)
+    post(CMD_INPUT);
+  TEST_ASSERT_EQUAL_UINT32(0, postVolume(20));
+  TEST_ASSERT_EQUAL_INT(-1, Slot.Volume);
+}
+
+// Stress test: POSTERS tasks post POSTS commands each, a volume task sweeps the volume and the control loop takes them as they come
+#define POSTERS 4
+#define POSTS 20000
+#define VOLUMES 20000
+#define MAX_TICKETS (POSTERS * POSTS + VOLUMES + 1)
+
+std::vector<std::atomic<bool>> Executed(MAX_TICKETS); // Set by the control loop before commandDone()
+std::vector<std::atomic<int>> Applied(MAX_TICKETS);   // The volume applied by each CMD_VOLUME
+std::atomic<uint32_t> EarlyDone(0);                   // A ticket reported done before it was executed
+std::atomic<uint32_t> StaleVolume(0);                 // A CMD_VOLUME that applied an older volume than the one merged into it
+std::atomic<bool> Posting(true);
+
+void poster(int Id)
+{
+  for (int i = 0; i < POSTS; i++)
+  {
+    uint32_t Ticket;
+    while ((Ticket = post(CMD_INPUT, (Id << 24) | i)) == 0)
+      std::this_thread::yield();
+    // A web client polling /COMMAND?ticket=
+    if (commandIsDone(Bus, Ticket) && !Executed[Ticket])
+      EarlyDone++;
+  }
+}
+
+std::vector<std::pair<uint32_t, int>> volumeTickets;
+
+void volumeTask()
+{
+  for (int Volume = 0; Volume < VOLUMES; Volume++)
+  {
+    uint32_t Ticket;
+    while ((Ticket = postVolume(Volume)) == 0)
+      std::this_thread::yield();
+    volumeTickets.push_back(std::make_pair(Ticket, Volume));
+  }
+}
+
+void test_stress_posting_tasks_and_control_loop()
+{
+  for (size_t i = 0; i < MAX_TICKETS; i++)
+  {
+    Executed[i] = false;
+    Applied[i] = -1;
+  }
+  Posting = true;
+
+  uint32_t OutOfOrder = 0;
+  uint32_t Lost = 0;
+  uint32_t Executions = 0;
+  int Last[POSTERS];
+  int LastVolume = -1;
+  uint32_t VolumesGoingBack = 0;
+  for (int i = 0; i < POSTERS; i++)
+    Last[i] = -1;
+
+  std::thread Loop([&]()
+  {
+    Command cmd;
+    uint32_t LastTicket = 0;
+    while (true)
+    {
+      bool Idle = !Posting;
+      while (commandTake(Bus, cmd, true, true))
+      {
+        if (cmd.Ticket <= LastTicket)
+          OutOfOrder++;
+        LastTicket = cmd.Ticket;
+        Executions++;
+        if (cmd.Type == CMD_VOLUME)
+        {
+          int Volume = commandTakeVolume(Slot);
+          if (Volume >= 0)
+          {
+            if (Volume <= LastVolume)
+              VolumesGoingBack++;
+            LastVolume = Volume;
+          }
+          Applied[cmd.Ticket] = Volume;
+        }
+        else
+        {
+          int Id = cmd.Value >> 24;
+          int Seq = cmd.Value & 0xFFFFFF;
+          if (Seq != Last[Id] + 1)
+            Lost++;
+          Last[Id] = Seq;
+        }
+        Executed[cmd.Ticket] = true;
+        commandDone(Bus, cmd);
+      }
+      if (Idle)
+        break;
+      std::this_thread::yield();
+    }
+  });
+
+  std::vector<std::thread> Posters;
+  for (int i = 0; i < POSTERS; i++)
+    Posters.push_back(std::thread(poster, i));
+  std::thread Volumes(volumeTask);
+  for (std::thread &Poster : Posters)
+    Poster.join();
+  Volumes.join();
+  Posting = false;
+  Loop.join();
+
+  TEST_ASSERT_EQUAL_UINT32(0, OutOfOrder);
+  TEST_ASSERT_EQUAL_UINT32(0, Lost);
+  TEST_ASSERT_EQUAL_UINT32(0, EarlyDone.load());
+  for (int i = 0; i < POSTERS; i++)
+    TEST_ASSERT_EQUAL_INT(POSTS - 1, Last[i]);
+  TEST_ASSERT_EQUAL_UINT32(Bus.Issued, Bus.Completed);
+  TEST_ASSERT_EQUAL_UINT32(Bus.Issued, Executions);
+  TEST_ASSERT_EQUAL_UINT32(0, hostQueue.size());
+
+  // The volumes: the last one wins, none goes back and every request is applied by the CMD_VOLUME whose ticket it got (or a newer one)
+  TEST_ASSERT_EQUAL_INT(VOLUMES - 1, LastVolume);
+  TEST_ASSERT_EQUAL_UINT32(0, VolumesGoingBack);
+  for (const std::pair<uint32_t, int> &Request : volumeTickets)
+    if (Applied[Request.first] < Request.second)
+      StaleVolume++;
+  TEST_ASSERT_EQUAL_UINT32(0, StaleVolume.load());
+  TEST_ASSERT_EQUAL_INT(-1, Slot.Volume);
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_tickets_follow_the_queue_order);
+  RUN_TEST(test_full_queue_drops_without_using_a_ticket);
+  RUN_TEST(test_key_waits_and_the_commands_behind_it_too);
+  RUN_TEST(test_target_waits_until_due);
+  RUN_TEST(test_done_after_the_command_is_executed);
+  RUN_TEST(test_volumes_are_merged_into_the_waiting_command);
+  RUN_TEST(test_volume_is_dropped_with_a_full_queue);
+  RUN_TEST(test_stress_posting_tasks_and_control_loop);
+  return UNITY_END();
+}
@@ -0,0 +1,236 @@
+// Host simulation of the I2C bus served by i2cTask (src/i2c_bus.h) - the latency of a relay change posted while the settings are saved
+// The transactions take the time they take on the bus at 400 kHz, and an EEPROM write the write cycle of the 24C64 after it
+
+#include <unity.h>
+#include <stdint.h>
+#include <deque>
+#include "i2c_bus.h"
+#include "relays.h"
+
+#define BYTE_NS 22500ULL            // 9 bits at 400 kHz
+#define WRITE_CYCLE_NS 5000000ULL   // tWR of the 24C64 - extEEPROM polls the EEPROM until the page is written
+#define US 1000ULL
+#define MS 1000000ULL
+
+// The EEPROM layout of main.cpp: Settings, RuntimeSettings and UserSettings (the presets)
+#define SETTINGS_SIZE 488
+#define RUNTIME_SIZE 18
+#define USER_SIZE 264
+#define RUNTIME_ADDRESS (SETTINGS_SIZE + 1)
+#define USER_ADDRESS (SETTINGS_SIZE + RUNTIME_SIZE + 1)
+
+enum SimTypes
+{
+  SIM_RELAYS,
+  SIM_EEPROM_WRITE,
+  SIM_EEPROM_READ,
+  SIM_ADC_READ
+};
+
+struct SimTransaction
+{
+  uint8_t Type;
+  uint8_t Length;
+  uint64_t Posted; // Nanoseconds
+};
+
+std::deque<SimTransaction> simQueues[2];
+bool simOneQueue; // Everything posted to the low queue - as if the bus had no priorities
+
+bool simReceive(bool High, void *T)
+{
+  std::deque<SimTransaction> &Queue = simQueues[High ? I2C_QUEUE_HIGH : I2C_QUEUE_LOW];
+  if (Queue.empty())
+    return false;
+  *(SimTransaction *)T = Queue.front();
+  Queue.pop_front();
+  return true;
+}
+
+// The time a transaction holds the bus - a relay write is the address, the register and the value
+uint64_t simDuration(const SimTransaction &T)
+{
+  switch (T.Type)
+  {
+  case SIM_RELAYS:
+    return 3 * BYTE_NS;
+  case SIM_EEPROM_WRITE:
+    return (3 + T.Length) * BYTE_NS + WRITE_CYCLE_NS;
+  case SIM_EEPROM_READ:
+    return (4 + T.Length) * BYTE_NS;
+  default:
+    return 5 * BYTE_NS;
+  }
+}
+
+void simPost(uint8_t Type, uint8_t Length, uint64_t Posted)
+{
+  bool High = Type == SIM_RELAYS && !simOneQueue;
+  simQueues[High ? I2C_QUEUE_HIGH : I2C_QUEUE_LOW].push_back({Type, Length, Posted});
+}
+
+// As eepromWrite(): one transaction per page
+uint32_t simSave(uint32_t Address, uint32_t Size, uint64_t Posted)
+{
+  uint32_t Transactions = 0;
+  for (uint32_t Offset = 0; Offset < Size; Transactions++)
+  {
+    uint8_t Length = i2cPageLength(Address + Offset, Size - Offset);
+    simPost(SIM_EEPROM_WRITE, Length, Posted);
+    Offset += Length;
+  }
+  return Transactions;
+}
+
+void simSaveAll()
+{
+  simSave(0, SETTINGS_SIZE, 0);
+  simSave(RUNTIME_ADDRESS, RUNTIME_SIZE, 0);
+  simSave(USER_ADDRESS, USER_SIZE, 0);
+}
+
+// Run i2cTask until the queues are empty, with a relay write posted at RelayAt. If Break is set a second relay write is posted Break after
+// the first was written, as relayChange() does for an input switch. Returns the time the last relay write was done
+// Finish is set to the time the bus is idle again
+uint64_t simRun(uint64_t RelayAt, uint64_t Break = 0, uint64_t *Finish = NULL)
+{
+  uint64_t Now = 0;
+  uint64_t Done = 0;
+  uint8_t Writes = Break > 0 ? 2 : 1;
+  uint8_t Posted = 0;
+  SimTransaction T;
+
+  while (true)
+  {
+    if (Posted < Writes && RelayAt <= Now)
+    {
+      simPost(SIM_RELAYS, 1, RelayAt);
+      Posted++;
+      RelayAt = UINT64_MAX;
+    }
+    if (i2cTake(simReceive, &T) == I2C_QUEUE_NONE)
+    {
+      if (Posted == Writes)
+        break;
+      Now = RelayAt; // The bus is idle until the next relay write
+      continue;
+    }
+    Now += simDuration(T);
+    if (T.Type == SIM_RELAYS)
+    {
+      Done = Now;
+      RelayAt = Now + Break;
+    }
+  }
+  if (Finish != NULL)
+    *Finish = Now;
+  return Done;
+}
+
+const uint64_t PageWrite = (3 + I2C_PAGE_SIZE) * BYTE_NS + WRITE_CYCLE_NS;
+const uint64_t RelayWrite = 3 * BYTE_NS;
+
+void setUp()
+{
+  simQueues[0].clear();
+  simQueues[1].clear();
+  simOneQueue = false;
+}
+
+void tearDown()
+{
+}
+
+void test_eeprom_transactions_end_at_the_page_end()
+{
+  TEST_ASSERT_EQUAL_UINT8(32, i2cPageLength(0, SETTINGS_SIZE));
+  TEST_ASSERT_EQUAL_UINT8(8, i2cPageLength(480, 8));
+  TEST_ASSERT_EQUAL_UINT8(23, i2cPageLength(RUNTIME_ADDRESS, RUNTIME_SIZE + 100));
+  TEST_ASSERT_EQUAL_UINT8(5, i2cPageLength(USER_ADDRESS, USER_SIZE));
+  TEST_ASSERT_EQUAL_UINT8(1, i2cPageLength(31, 1));
+  TEST_ASSERT_EQUAL_UINT8(0, i2cPageLength(10, 0));
+}
+
+void test_save_of_all_settings_fits_the_low_queue()
+{
+  uint32_t Transactions = simSave(0, SETTINGS_SIZE, 0) + simSave(RUNTIME_ADDRESS, RUNTIME_SIZE, 0) + simSave(USER_ADDRESS, USER_SIZE, 0);
+  TEST_ASSERT_EQUAL_UINT32(27, Transactions); // I2C_LOW_QUEUE_LENGTH is 32
+}
+
+void test_relays_go_first_when_both_queues_wait()
+{
+  simSaveAll();
+  simPost(SIM_RELAYS, 1, 0);
+  SimTransaction T;
+  TEST_ASSERT_EQUAL_INT(I2C_QUEUE_HIGH, i2cTake(simReceive, &T));
+  TEST_ASSERT_EQUAL_UINT8(SIM_RELAYS, T.Type);
+  TEST_ASSERT_EQUAL_INT(I2C_QUEUE_LOW, i2cTake(simReceive, &T));
+}
+
+// A relay change at any moment of the save waits for at most the page being written
+void test_relay_waits_for_at_most_one_page_during_a_save()
+{
+  uint64_t Save;
+  simSaveAll();
+  simRun(0, 0, &Save);
+  TEST_ASSERT_TRUE(Save > 27 * WRITE_CYCLE_NS);
+
+  uint64_t Worst = 0;
+  for (uint64_t RelayAt = 0; RelayAt < Save; RelayAt += 50 * US)
+  {
+    setUp();
+    simSaveAll();
+    uint64_t Latency = simRun(RelayAt) - RelayAt;
+    if (Latency > Worst)
+      Worst = Latency;
+  }
+  TEST_ASSERT_TRUE(Worst <= PageWrite + RelayWrite);
+  TEST_ASSERT_TRUE(Worst > WRITE_CYCLE_NS); // Posted just after a page write started
+}
+
+// The same on a bus without priorities: the relay waits for the rest of the save - over 100 ms when it comes at the start
+void test_relay_waits_for_the_whole_save_without_priorities()
+{
+  simOneQueue = true;
+  simSaveAll();
+  uint64_t Latency = simRun(1 * US) - 1 * US;
+  TEST_ASSERT_TRUE(Latency > 26 * PageWrite);
+  TEST_ASSERT_TRUE(Latency > 100 * MS);
+}
+
+// An input switch during a save: the release is written, the control loop waits RELAY_BREAK_TIME and then posts the make (see relayChange)
+void test_input_switch_during_a_save()
+{
+  uint64_t Worst = 0;
+  for (uint64_t SwitchAt = 0; SwitchAt < 40 * MS; SwitchAt += 250 * US)
+  {
+    setUp();
+    simSaveAll();
+    uint64_t Total = simRun(SwitchAt, RELAY_BREAK_TIME * MS) - SwitchAt;
+    if (Total > Worst)
+      Worst = Total;
+  }
+  TEST_ASSERT_TRUE(Worst <= RELAY_BREAK_TIME * MS + 2 * (PageWrite + RelayWrite));
+}
+
+// The ADS1115 is read through the low queue too - a relay waits for at most one of its short transactions
+void test_relay_waits_for_at_most_one_adc_transaction()
+{
+  for (int i = 0; i < 8; i++)
+    simPost(SIM_ADC_READ, 2, 0);
+  uint64_t Latency = simRun(10 * US) - 10 * US;
+  TEST_ASSERT_TRUE(Latency <= 5 * BYTE_NS + RelayWrite);
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_eeprom_transactions_end_at_the_page_end);
+  RUN_TEST(test_save_of_all_settings_fits_the_low_queue);
+  RUN_TEST(test_relays_go_first_when_both_queues_wait);
+  RUN_TEST(test_relay_waits_for_at_most_one_page_during_a_save);
+  RUN_TEST(test_relay_waits_for_the_whole_save_without_priorities);
+  RUN_TEST(test_input_switch_during_a_save);
+  RUN_TEST(test_relay_waits_for_at_most_one_adc_transaction);
+  return UNITY_END();
+}
@@ -0,0 +1,136 @@
+// Host tests of the ring buffer of the logger (src/log_ring.h)
+
+#include <unity.h>
+#include <thread>
+#include "log_ring.h"
+
+// As main.cpp
+LogSlot logSlots[LOG_BUFFER_SIZE];
+std::atomic<uint32_t> logHead(0);
+uint32_t logTail = 0;
+std::atomic<uint32_t> logDropped(0);
+
+LogRecord makeRecord(int32_t Value)
+{
+  LogRecord Record;
+  Record.Time = Value;
+  Record.Format = "%d";
+  Record.Args[0] = Value;
+  Record.Level = 3;
+  Record.Length = 0;
+  return Record;
+}
+
+void setUp()
+{
+  logTail = 0;
+  logDropped = 0;
+  logInit();
+}
+
+void tearDown()
+{
+}
+
+void test_empty_buffer_returns_nothing()
+{
+  LogRecord Record;
+  TEST_ASSERT_FALSE(logPop(Record));
+}
+
+void test_records_are_read_in_order()
+{
+  for (int32_t i = 0; i < 10; i++)
+    TEST_ASSERT_TRUE(logPush(makeRecord(i)));
+  LogRecord Record;
+  for (int32_t i = 0; i < 10; i++)
+  {
+    TEST_ASSERT_TRUE(logPop(Record));
+    TEST_ASSERT_EQUAL_INT32(i, Record.Args[0]);
+  }
+  TEST_ASSERT_FALSE(logPop(Record));
+}
+
+void test_full_buffer_drops_and_counts()
+{
+  for (int32_t i = 0; i < LOG_BUFFER_SIZE; i++)
+    TEST_ASSERT_TRUE(logPush(makeRecord(i)));
+  TEST_ASSERT_FALSE(logPush(makeRecord(-1)));
+  TEST_ASSERT_FALSE(logPush(makeRecord(-2)));
+  TEST_ASSERT_EQUAL_UINT32(2, logDropped.load());
+
+  // A slot that has been read is free again - the dropped records are never read
+  LogRecord Record;
+  TEST_ASSERT_TRUE(logPop(Record));
+  TEST_ASSERT_EQUAL_INT32(0, Record.Args[0]);
+  TEST_ASSERT_TRUE(logPush(makeRecord(LOG_BUFFER_SIZE)));
+  for (int32_t i = 1; i <= LOG_BUFFER_SIZE; i++)
+  {
+    TEST_ASSERT_TRUE(logPop(Record));
+    TEST_ASSERT_EQUAL_INT32(i, Record.Args[0]);
+  }
+  TEST_ASSERT_FALSE(logPop(Record));
+}
+
+void test_positions_wrap_around()
+{
+  logTail = UINT32_MAX - LOG_BUFFER_SIZE / 2;
+  logInit();
+  LogRecord Record;
+  for (int32_t i = 0; i < 3 * LOG_BUFFER_SIZE; i++)
+  {
+    TEST_ASSERT_TRUE(logPush(makeRecord(i)));
+    TEST_ASSERT_TRUE(logPop(Record));
+    TEST_ASSERT_EQUAL_INT32(i, Record.Args[0]);
+  }
+  TEST_ASSERT_FALSE(logPop(Record));
+  TEST_ASSERT_EQUAL_UINT32(0, logDropped.load());
+}
+
+// Several tasks log at the same time as the drain task reads - every record is either read once or counted as dropped,
+// and the records of one writer are read in the order they were written
+void test_concurrent_writers()
+{
+  const int Writers = 4;
+  const int32_t Count = 20000;
+  std::thread Threads[Writers];
+  for (int w = 0; w < Writers; w++)
+    Threads[w] = std::thread([w, Count]()
+                             { for (int32_t i = 0; i < Count; i++) logPush(makeRecord(w * Count + i)); });
+
+  int32_t Last[Writers];
+  for (int w = 0; w < Writers; w++)
+    Last[w] = -1;
+  uint32_t Read = 0;
+  bool Ordered = true;
+  LogRecord Record;
+  for (;;)
+  {
+    if (logPop(Record))
+    {
+      int w = Record.Args[0] / Count;
+      Ordered = Ordered && (Record.Args[0] % Count > Last[w]);
+      Last[w] = Record.Args[0] % Count;
+      Read++;
+    }
+    else if (Read + logDropped.load() == (uint32_t)(Writers * Count))
+      break;
+  }
+  for (int w = 0; w < Writers; w++)
+    Threads[w].join();
+
+  TEST_ASSERT_TRUE(Ordered);
+  TEST_ASSERT_FALSE(logPop(Record));
+  TEST_ASSERT_EQUAL_UINT32(Writers * Count, Read + logDropped.load());
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_empty_buffer_returns_nothing);
+  RUN_TEST(test_records_are_read_in_order);
+  RUN_TEST(test_full_buffer_drops_and_counts);
+  RUN_TEST(test_positions_wrap_around);
+  RUN_TEST(test_concurrent_writers);
+  return UNITY_END();
+}
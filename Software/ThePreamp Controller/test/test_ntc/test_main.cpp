@@ -0,0 +1,112 @@
+// Host tests of the NTC conversion (src/ntc.h) - compared with the Beta model used by scripts/ntc_table.py to generate the table
+
+#include <unity.h>
+#include <math.h>
+#include "ntc.h"
+
+// The parameters of scripts/ntc_table.py
+#define R25 4700.0
+#define BETA 3500.0
+#define RREF 10000.0
+#define VIN 3.3
+#define ADC_LSB (4.096 / 32768)
+#define KELVIN 273.15
+
+// The ADC value measured at Temp degrees Celcius
+double adcValue(double Temp)
+{
+  double Rntc = R25 * exp(BETA * (1.0 / (Temp + KELVIN) - 1.0 / (25.0 + KELVIN)));
+  return VIN * RREF / (RREF + Rntc) / ADC_LSB;
+}
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+void test_table_entries_are_returned_exactly()
+{
+  for (int i = 0; i < NTC_TABLE_SIZE; i++)
+  {
+    int32_t Expected = (ntcTable[i] < 0) ? 0 : (ntcTable[i] + 5) / 10;
+    TEST_ASSERT_EQUAL_INT16(Expected, ntcTemperature((NTC_TABLE_FIRST + (i << NTC_TABLE_SHIFT)) * TEMP_FILTER_SCALE));
+  }
+}
+
+void test_follows_the_beta_model_within_the_display_range()
+{
+  // 0.05 degrees of rounding and up to 0.05 degrees of interpolation error (the limit checked by scripts/ntc_table.py)
+  for (double Temp = 0.5; Temp <= 65.0; Temp += 0.5)
+  {
+    int32_t Value = (int32_t)lround(adcValue(Temp) * TEMP_FILTER_SCALE);
+    TEST_ASSERT_INT_WITHIN(1, (int)lround(Temp * 10), ntcTemperature(Value));
+  }
+}
+
+void test_interpolates_between_entries()
+{
+  // Halfway between two entries - also with the extra bits of the filter
+  int32_t Value = (NTC_TABLE_FIRST + (20 << NTC_TABLE_SHIFT) + (1 << (NTC_TABLE_SHIFT - 1))) * TEMP_FILTER_SCALE;
+  TEST_ASSERT_EQUAL_INT16((ntcTable[20] + ntcTable[21] + 10) / 20, ntcTemperature(Value));
+  TEST_ASSERT_TRUE(ntcTemperature(Value + 1) >= ntcTemperature(Value));
+}
+
+void test_is_monotonic()
+{
+  int16_t Previous = ntcTemperature(0);
+  for (int32_t Value = 0; Value <= 32767 * TEMP_FILTER_SCALE; Value += 7)
+  {
+    int16_t Temp = ntcTemperature(Value);
+    TEST_ASSERT_TRUE(Temp >= Previous);
+    Previous = Temp;
+  }
+}
+
+void test_clamps_outside_the_table()
+{
+  // Below 0 degrees is shown as 0 - above the table as its last entry
+  TEST_ASSERT_EQUAL_INT16(0, ntcTemperature(0));
+  TEST_ASSERT_EQUAL_INT16(0, ntcTemperature(-1000));
+  TEST_ASSERT_EQUAL_INT16(0, ntcTemperature((int32_t)(adcValue(-3.0) * TEMP_FILTER_SCALE)));
+  TEST_ASSERT_EQUAL_INT16((ntcTable[NTC_TABLE_SIZE - 1] + 5) / 10, ntcTemperature(32767 * TEMP_FILTER_SCALE));
+  TEST_ASSERT_EQUAL_INT16((ntcTable[NTC_TABLE_SIZE - 1] + 5) / 10, ntcTemperature(INT32_MAX));
+}
+
+void test_reaches_the_highest_temperature_limit()
+{
+  // Trigger1Temp/Trigger2Temp accept up to 99 degrees (settings.h) - above the display range the interpolation reads up to 0.3 degrees high
+  for (double Temp = 65.0; Temp <= 99.0; Temp += 1.0)
+  {
+    int32_t Value = (int32_t)lround(adcValue(Temp) * TEMP_FILTER_SCALE);
+    TEST_ASSERT_INT_WITHIN(4, (int)lround(Temp * 10), ntcTemperature(Value));
+    TEST_ASSERT_TRUE(ntcTemperature(Value) >= lround(Temp * 10));
+  }
+}
+
+void test_open_or_shorted_ntc_is_a_fault()
+{
+  // Open: the reference resistor pulls the input to 0 - shorted: the input is at the supply of the divider
+  TEST_ASSERT_TRUE(ntcFault(0));
+  TEST_ASSERT_TRUE(ntcFault(5 * TEMP_FILTER_SCALE));
+  TEST_ASSERT_TRUE(ntcFault((int32_t)(VIN / ADC_LSB) * TEMP_FILTER_SCALE));
+  TEST_ASSERT_TRUE(ntcFault((int32_t)(adcValue(110.0) * TEMP_FILTER_SCALE)));
+  TEST_ASSERT_TRUE(ntcFault((int32_t)(adcValue(-10.0) * TEMP_FILTER_SCALE)));
+  for (double Temp = 0.0; Temp <= 99.0; Temp += 0.5)
+    TEST_ASSERT_FALSE(ntcFault((int32_t)lround(adcValue(Temp) * TEMP_FILTER_SCALE)));
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_table_entries_are_returned_exactly);
+  RUN_TEST(test_follows_the_beta_model_within_the_display_range);
+  RUN_TEST(test_interpolates_between_entries);
+  RUN_TEST(test_is_monotonic);
+  RUN_TEST(test_clamps_outside_the_table);
+  RUN_TEST(test_reaches_the_highest_temperature_limit);
+  RUN_TEST(test_open_or_shorted_ntc_is_a_fault);
+  return UNITY_END();
+}
@@ -0,0 +1,188 @@
+// Host tests of the thermal protection (src/protection.h) fed with simulated temperatures - one evaluation per PROTECTION_INTERVAL,
+// as protectionLoop() in main.cpp
+
+#include <unity.h>
+#include <string.h>
+#include <math.h>
+#include "protection.h"
+
+#define LIMIT 60 // Degrees, as Settings.Trigger1Temp
+
+ProtectionHistory History;
+uint8_t Tripped;
+
+void setUp()
+{
+  memset(&History, 0, sizeof(History));
+  Tripped = 0;
+}
+
+void tearDown()
+{
+}
+
+// Evaluate one temperature of NTC 1 and act as protectionLoop() - returns the causes
+uint8_t evaluate(int16_t Temp, bool Fault = false, bool Standby = false, uint8_t Limit = LIMIT)
+{
+  bool Cool = true;
+  uint8_t Causes = protectionCheck(History, Temp, Limit, Fault, Cool);
+  switch (protectionAction(Tripped, Causes, Cool, Standby))
+  {
+  case PROTECTION_TRIP:
+    Tripped = Causes;
+    break;
+  case PROTECTION_BLOCK:
+    Tripped |= Causes;
+    break;
+  case PROTECTION_RELEASE:
+    Tripped = 0;
+    break;
+  }
+  return Causes;
+}
+
+// A heatsink warming up after power on: first order towards Final (degrees) with time constant Tau (seconds)
+int16_t heatsink(float Ambient, float Final, float Tau, uint32_t Evaluation)
+{
+  float Seconds = Evaluation * PROTECTION_INTERVAL / 1000.0f;
+  return (int16_t)lroundf((Ambient + (Final - Ambient) * (1 - expf(-Seconds / Tau))) * 10);
+}
+
+// Feed the model until the protection trips - returns the evaluation it tripped at or -1
+int feed(float Final, float Tau, int Evaluations, uint8_t &Causes)
+{
+  for (int i = 0; i < Evaluations; i++)
+  {
+    Causes = evaluate(heatsink(25, Final, Tau, i));
+    if (Causes != 0)
+      return i;
+  }
+  return -1;
+}
+
+void test_steady_temperature_below_the_limit_does_not_trip()
+{
+  uint8_t Causes;
+  TEST_ASSERT_EQUAL_INT(-1, feed(LIMIT - 3, 600, 7200, Causes)); // One hour
+  TEST_ASSERT_EQUAL_HEX8(0, Tripped);
+}
+
+void test_limit_trips()
+{
+  for (int i = 0; i < 5; i++)
+    TEST_ASSERT_EQUAL_HEX8(0, evaluate(LIMIT * 10 - 1));
+  TEST_ASSERT_EQUAL_HEX8(PROTECTION_LIMIT_1, evaluate(LIMIT * 10));
+  TEST_ASSERT_EQUAL_HEX8(PROTECTION_LIMIT_1, Tripped);
+}
+
+// A slow drift up to the limit trips on the limit - a fast one on the rise, before the limit is reached
+void test_slow_heating_trips_on_the_limit()
+{
+  uint8_t Causes;
+  int At = feed(LIMIT + 10, 1800, 14400, Causes);
+  TEST_ASSERT_TRUE(At > 0);
+  TEST_ASSERT_EQUAL_HEX8(PROTECTION_LIMIT_1, Causes);
+}
+
+void test_fast_heating_trips_on_the_rise_before_the_limit()
+{
+  // A failing output stage: 80 degrees with a time constant of 2 minutes - it would reach the limit after 121 seconds
+  uint8_t Causes;
+  int At = feed(LIMIT + 20, 120, 600, Causes);
+  TEST_ASSERT_EQUAL_HEX8(PROTECTION_RISE_1, Causes);
+  TEST_ASSERT_TRUE(heatsink(25, LIMIT + 20, 120, At) < LIMIT * 10);
+
+  // The rise is measured over PROTECTION_RISE_SAMPLES - the trip is before the limit but not before the history is full
+  TEST_ASSERT_TRUE(At >= PROTECTION_RISE_SAMPLES);
+}
+
+void test_no_rise_trip_before_the_history_is_full()
+{
+  for (int i = 0; i < PROTECTION_RISE_SAMPLES; i++)
+    TEST_ASSERT_EQUAL_HEX8(0, evaluate(i == 0 ? 250 : 550));
+  // Full - the rise from 25 to 55 degrees in 10 seconds reaches the limit well within PROTECTION_RISE_HORIZON
+  TEST_ASSERT_EQUAL_HEX8(PROTECTION_RISE_1, evaluate(550));
+}
+
+void test_noise_does_not_trip_on_the_rise()
+{
+  // +-0.4 degrees around 58 degrees - the rise over 10 seconds stays below PROTECTION_RISE_MIN
+  for (int i = 0; i < 1000; i++)
+    TEST_ASSERT_EQUAL_HEX8(0, evaluate(580 + ((i * 7) % 9) - 4));
+}
+
+void test_release_after_the_hysteresis()
+{
+  evaluate(LIMIT * 10 + 5);
+  TEST_ASSERT_EQUAL_HEX8(PROTECTION_LIMIT_1, Tripped);
+
+  // Cooling down slowly: still tripped until PROTECTION_HYSTERESIS below the limit
+  int16_t Temp = LIMIT * 10;
+  for (; Temp > LIMIT * 10 - PROTECTION_HYSTERESIS; Temp--)
+  {
+    evaluate(Temp);
+    TEST_ASSERT_EQUAL_HEX8(PROTECTION_LIMIT_1, Tripped);
+  }
+  evaluate(Temp);
+  TEST_ASSERT_EQUAL_HEX8(0, Tripped);
+}
+
+void test_faulty_ntc_trips_and_stays_tripped()
+{
+  for (int i = 0; i < 3; i++)
+    evaluate(250);
+  // An open NTC reads as 0 degrees - a plausible, cool temperature
+  TEST_ASSERT_EQUAL_HEX8(PROTECTION_FAULT_1, evaluate(0, true));
+  TEST_ASSERT_EQUAL_HEX8(PROTECTION_FAULT_1, Tripped);
+  for (int i = 0; i < 10; i++)
+    evaluate(0, true);
+  TEST_ASSERT_EQUAL_HEX8(PROTECTION_FAULT_1, Tripped);
+  // Repaired
+  evaluate(250);
+  TEST_ASSERT_EQUAL_HEX8(0, Tripped);
+}
+
+void test_no_limit_never_trips()
+{
+  for (int i = 0; i < 100; i++)
+    TEST_ASSERT_EQUAL_HEX8(0, evaluate(250 + i * 10, i > 50, false, 0));
+  TEST_ASSERT_EQUAL_HEX8(0, Tripped);
+}
+
+void test_too_hot_in_standby_blocks_turning_on()
+{
+  TEST_ASSERT_EQUAL_INT(PROTECTION_BLOCK, protectionAction(0, PROTECTION_LIMIT_1, false, true));
+  evaluate(LIMIT * 10, false, true);
+  TEST_ASSERT_EQUAL_HEX8(PROTECTION_LIMIT_1, Tripped);
+  evaluate(LIMIT * 10 - PROTECTION_HYSTERESIS, false, true);
+  TEST_ASSERT_EQUAL_HEX8(0, Tripped);
+}
+
+void test_causes_of_ntc_2_are_shifted()
+{
+  ProtectionHistory History2;
+  memset(&History2, 0, sizeof(History2));
+  bool Cool = true;
+  uint8_t Causes = protectionCheck(History2, 700, LIMIT, false, Cool) << 1;
+  TEST_ASSERT_EQUAL_HEX8(PROTECTION_LIMIT_2, Causes);
+  Causes = protectionCheck(History2, 0, LIMIT, true, Cool) << 1;
+  TEST_ASSERT_EQUAL_HEX8(PROTECTION_FAULT_2, Causes);
+  TEST_ASSERT_FALSE(Cool);
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_steady_temperature_below_the_limit_does_not_trip);
+  RUN_TEST(test_limit_trips);
+  RUN_TEST(test_slow_heating_trips_on_the_limit);
+  RUN_TEST(test_fast_heating_trips_on_the_rise_before_the_limit);
+  RUN_TEST(test_no_rise_trip_before_the_history_is_full);
+  RUN_TEST(test_noise_does_not_trip_on_the_rise);
+  RUN_TEST(test_release_after_the_hysteresis);
+  RUN_TEST(test_faulty_ntc_trips_and_stays_tripped);
+  RUN_TEST(test_no_limit_never_trips);
+  RUN_TEST(test_too_hot_in_standby_blocks_turning_on);
+  RUN_TEST(test_causes_of_ntc_2_are_shifted);
+  return UNITY_END();
+}
@@ -0,0 +1,193 @@
+// Host tests of the relay layer (src/relays.h) and the relays set by the steps of the power sequence (src/sequence.h)
+// The writes go to a mock of the I2C bus that counts the transactions, as relayWrite() posts them to i2cTask in main.cpp
+
+#include <unity.h>
+#include <string.h>
+#include "relays.h"
+#include "sequence.h"
+
+// Mock I2C bus - records the transactions to the MCP23008
+#define MOCK_MAX_TRANSACTIONS 16
+
+struct MockTransaction
+{
+  bool Read;
+  uint8_t Value;  // The value written to the GPIO register
+  uint32_t Time;  // Mock time in milliseconds
+};
+
+MockTransaction mockBus[MOCK_MAX_TRANSACTIONS];
+uint8_t mockCount;
+uint8_t mockGpio;  // The outputs of the MCP23008
+uint32_t mockTime; // Advanced by mockPause
+
+void mockWrite(uint8_t Relays, bool Wait)
+{
+  (void)Wait;
+  mockBus[mockCount++ % MOCK_MAX_TRANSACTIONS] = {false, Relays, mockTime};
+  mockGpio = Relays;
+}
+
+void mockPause(uint32_t Milliseconds)
+{
+  mockTime += Milliseconds;
+}
+
+// Adafruit_MCP23XXX::digitalWrite() as used before the relay layer: it reads the output latch and writes it back with one pin changed
+void mockDigitalWrite(uint8_t Pin, bool Value)
+{
+  mockBus[mockCount++ % MOCK_MAX_TRANSACTIONS] = {true, mockGpio, mockTime};
+  mockWrite(Value ? (mockGpio | (1 << Pin)) : (mockGpio & ~(1 << Pin)), false);
+}
+
+uint8_t Latch; // As WarmState.RelayMask
+
+void setUp()
+{
+  memset(mockBus, 0, sizeof(mockBus));
+  mockCount = 0;
+  mockGpio = 0;
+  mockTime = 0;
+  Latch = 0;
+}
+
+void tearDown()
+{
+}
+
+void test_merge_only_changes_the_relays_in_the_mask()
+{
+  uint8_t Relays = RELAY_OUTPUT | RELAY_INPUT(1);
+  TEST_ASSERT_EQUAL_HEX8(RELAY_OUTPUT | RELAY_INPUT(1) | RELAY_TRIGGER1, relayMerge(Relays, RELAY_TRIGGER1, RELAY_TRIGGER1));
+  TEST_ASSERT_EQUAL_HEX8(RELAY_INPUT(1), relayMerge(Relays, RELAY_OUTPUT, 0));
+  // Bits of Value outside the mask are ignored
+  TEST_ASSERT_EQUAL_HEX8(RELAY_INPUT(1), relayMerge(Relays, RELAY_OUTPUT, RELAY_TRIGGER2));
+  TEST_ASSERT_EQUAL_HEX8(Relays, relayMerge(Relays, 0, 0xFF));
+  TEST_ASSERT_EQUAL_HEX8(0xFF, relayMerge(Relays, 0xFF, 0xFF));
+}
+
+void test_input_relays_are_separate_outputs()
+{
+  uint8_t Seen = 0;
+  for (uint8_t Input = 0; Input < 5; Input++)
+  {
+    uint8_t Relay = RELAY_INPUT(Input);
+    TEST_ASSERT_EQUAL_HEX8(Relay, Relay & RELAY_INPUTS);
+    TEST_ASSERT_EQUAL_HEX8(0, Relay & Seen);
+    Seen |= Relay;
+  }
+  TEST_ASSERT_EQUAL_HEX8(RELAY_INPUTS, Seen);
+  TEST_ASSERT_EQUAL_HEX8(0, RELAY_INPUTS & (RELAY_OUTPUT | RELAY_TRIGGER1 | RELAY_TRIGGER2));
+}
+
+// As relaySwitch() when another input is selected: the old input relay is released in the first write, the new one operated in the second
+void test_switching_input_breaks_before_make()
+{
+  uint8_t Relays = RELAY_OUTPUT | RELAY_TRIGGER1 | RELAY_INPUT(0);
+  TEST_ASSERT_TRUE(relayBreakNeeded(Relays, RELAY_INPUTS, RELAY_INPUT(3)));
+  Relays = relayMerge(Relays, RELAY_INPUTS, 0);
+  TEST_ASSERT_EQUAL_HEX8(RELAY_OUTPUT | RELAY_TRIGGER1, Relays);
+  Relays = relayMerge(Relays, RELAY_INPUTS, RELAY_INPUT(3));
+  TEST_ASSERT_EQUAL_HEX8(RELAY_OUTPUT | RELAY_TRIGGER1 | RELAY_INPUT(3), Relays);
+}
+
+void test_no_break_if_nothing_is_released()
+{
+  // The same input again, or no input relay operated yet (ie. at power up)
+  TEST_ASSERT_FALSE(relayBreakNeeded(RELAY_INPUT(2), RELAY_INPUTS, RELAY_INPUT(2)));
+  TEST_ASSERT_FALSE(relayBreakNeeded(RELAY_OUTPUT, RELAY_INPUTS, RELAY_INPUT(4)));
+}
+
+void test_sequence_targets_map_to_their_relays()
+{
+  TEST_ASSERT_EQUAL_HEX8(RELAY_TRIGGER1, sequenceRelay(SEQ_TRIGGER1));
+  TEST_ASSERT_EQUAL_HEX8(RELAY_TRIGGER2, sequenceRelay(SEQ_TRIGGER2));
+  TEST_ASSERT_EQUAL_HEX8(RELAY_OUTPUT, sequenceRelay(SEQ_OUTPUT));
+  TEST_ASSERT_EQUAL_HEX8(0, sequenceRelay(SEQ_POWER));
+}
+
+// The steps due at the same time are collected by sequenceCollect() and written at once - a later step of the same relay wins
+void test_steps_due_together_are_one_write()
+{
+  SequenceStep Steps[3] = {{SEQ_TRIGGER1, 1, false, 0}, {SEQ_OUTPUT, 1, false, 0}, {SEQ_TRIGGER1, 0, true, 0}};
+  uint8_t Mask = 0;
+  uint8_t Value = 0;
+  for (uint8_t i = 0; i < 3; i++)
+    sequenceCollect(Steps[i], Mask, Value);
+  TEST_ASSERT_EQUAL_HEX8(RELAY_TRIGGER1 | RELAY_OUTPUT, Mask);
+  TEST_ASSERT_EQUAL_HEX8(RELAY_OUTPUT, Value);
+
+  Latch = RELAY_TRIGGER1 | RELAY_TRIGGER2 | RELAY_INPUT(0);
+  TEST_ASSERT_TRUE(relayUpdate(Latch, Mask, Value, false, mockWrite));
+  TEST_ASSERT_EQUAL_UINT8(1, mockCount);
+  TEST_ASSERT_EQUAL_HEX8(RELAY_OUTPUT | RELAY_TRIGGER2 | RELAY_INPUT(0), mockGpio);
+}
+
+// As relaySwitch() in setInput(): two writes per input switch - the old input released, then the new one operated after the break
+void test_input_switch_is_two_writes()
+{
+  Latch = RELAY_OUTPUT | RELAY_INPUT(0);
+  mockGpio = Latch;
+  TEST_ASSERT_TRUE(relayChange(Latch, RELAY_INPUTS, RELAY_INPUT(2), mockWrite, mockPause));
+  TEST_ASSERT_EQUAL_UINT8(2, mockCount);
+  TEST_ASSERT_FALSE(mockBus[0].Read);
+  TEST_ASSERT_EQUAL_HEX8(RELAY_OUTPUT, mockBus[0].Value);
+  TEST_ASSERT_EQUAL_HEX8(RELAY_OUTPUT | RELAY_INPUT(2), mockBus[1].Value);
+  TEST_ASSERT_EQUAL_UINT32(RELAY_BREAK_TIME, mockBus[1].Time - mockBus[0].Time);
+  TEST_ASSERT_EQUAL_HEX8(mockGpio, Latch);
+}
+
+// The same with Adafruit_MCP23XXX::digitalWrite() for each pin: a read and a write per relay - four transactions
+void test_input_switch_with_digital_write_was_four_transactions()
+{
+  mockGpio = RELAY_OUTPUT | RELAY_INPUT(0);
+  mockDigitalWrite(7 - 0, false);
+  mockDigitalWrite(7 - 2, true);
+  TEST_ASSERT_EQUAL_UINT8(4, mockCount);
+  TEST_ASSERT_EQUAL_HEX8(RELAY_OUTPUT | RELAY_INPUT(2), mockGpio);
+}
+
+void test_no_write_if_the_relays_are_already_set()
+{
+  Latch = RELAY_OUTPUT | RELAY_INPUT(3);
+  TEST_ASSERT_FALSE(relayChange(Latch, RELAY_INPUTS, RELAY_INPUT(3), mockWrite, mockPause));
+  TEST_ASSERT_FALSE(relayUpdate(Latch, RELAY_OUTPUT, RELAY_OUTPUT, false, mockWrite));
+  TEST_ASSERT_FALSE(relayUpdate(Latch, 0, 0xFF, false, mockWrite));
+  TEST_ASSERT_EQUAL_UINT8(0, mockCount);
+  TEST_ASSERT_EQUAL_UINT32(0, mockTime);
+}
+
+void test_first_input_is_one_write_without_a_break()
+{
+  // At power up no input relay is operated yet
+  Latch = RELAY_OUTPUT;
+  TEST_ASSERT_TRUE(relayChange(Latch, RELAY_INPUTS, RELAY_INPUT(4), mockWrite, mockPause));
+  TEST_ASSERT_EQUAL_UINT8(1, mockCount);
+  TEST_ASSERT_EQUAL_UINT32(0, mockTime);
+  TEST_ASSERT_EQUAL_HEX8(RELAY_OUTPUT | RELAY_INPUT(4), mockGpio);
+}
+
+void test_mute_relay_is_one_write()
+{
+  Latch = RELAY_OUTPUT | RELAY_TRIGGER1 | RELAY_INPUT(1);
+  TEST_ASSERT_TRUE(relayUpdate(Latch, RELAY_OUTPUT, 0, false, mockWrite));
+  TEST_ASSERT_EQUAL_UINT8(1, mockCount);
+  TEST_ASSERT_EQUAL_HEX8(RELAY_TRIGGER1 | RELAY_INPUT(1), mockGpio);
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_merge_only_changes_the_relays_in_the_mask);
+  RUN_TEST(test_input_relays_are_separate_outputs);
+  RUN_TEST(test_switching_input_breaks_before_make);
+  RUN_TEST(test_no_break_if_nothing_is_released);
+  RUN_TEST(test_sequence_targets_map_to_their_relays);
+  RUN_TEST(test_steps_due_together_are_one_write);
+  RUN_TEST(test_input_switch_is_two_writes);
+  RUN_TEST(test_input_switch_with_digital_write_was_four_transactions);
+  RUN_TEST(test_no_write_if_the_relays_are_already_set);
+  RUN_TEST(test_first_input_is_one_write_without_a_break);
+  RUN_TEST(test_mute_relay_is_one_write);
+  return UNITY_END();
+}
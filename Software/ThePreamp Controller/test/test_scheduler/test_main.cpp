@@ -0,0 +1,106 @@
+// Host tests of the time arithmetic of the job scheduler (src/scheduler.h) - millis() wraps after 49.7 days
+
+#include <unity.h>
+#include "scheduler.h"
+
+#define WRAP_SOON 0xFFFFFF00 // millis() 256 ms before it wraps
+
+void setUp()
+{
+}
+
+void tearDown()
+{
+}
+
+void test_due_at_and_after_the_time()
+{
+  TEST_ASSERT_FALSE(jobIsDue(999, 1000));
+  TEST_ASSERT_TRUE(jobIsDue(1000, 1000));
+  TEST_ASSERT_TRUE(jobIsDue(1001, 1000));
+}
+
+void test_due_across_the_wrap()
+{
+  uint32_t Due = WRAP_SOON + 1000; // 744 ms after the wrap
+  TEST_ASSERT_FALSE(jobIsDue(WRAP_SOON, Due));
+  TEST_ASSERT_FALSE(jobIsDue(0xFFFFFFFF, Due));
+  TEST_ASSERT_FALSE(jobIsDue(743, Due));
+  TEST_ASSERT_TRUE(jobIsDue(744, Due));
+  // Due before the wrap and checked after it
+  TEST_ASSERT_TRUE(jobIsDue(10, WRAP_SOON));
+}
+
+void test_up_to_24_days_ahead()
+{
+  const uint32_t Days24 = 24UL * 24 * 3600 * 1000;
+  TEST_ASSERT_FALSE(jobIsDue(WRAP_SOON, WRAP_SOON + Days24));
+  TEST_ASSERT_EQUAL_INT32(Days24, jobTimeLeft(WRAP_SOON, WRAP_SOON + Days24));
+}
+
+void test_time_left_across_the_wrap()
+{
+  TEST_ASSERT_EQUAL_INT32(1000, jobTimeLeft(WRAP_SOON, WRAP_SOON + 1000));
+  TEST_ASSERT_EQUAL_INT32(0, jobTimeLeft(5, 5));
+  // Overdue
+  TEST_ASSERT_EQUAL_INT32(-300, jobTimeLeft(44, WRAP_SOON));
+}
+
+void test_periodic_job_keeps_its_rhythm()
+{
+  // Run 3 ms late - the next run is still a period after the time it was due
+  TEST_ASSERT_EQUAL_UINT32(2000, jobNextDue(1000, 1000, 1003));
+  TEST_ASSERT_EQUAL_UINT32(WRAP_SOON + 1000, jobNextDue(WRAP_SOON, 1000, WRAP_SOON + 3));
+}
+
+void test_missed_runs_are_skipped()
+{
+  // A full period late (ie. loop() was blocked) - the next run is a period from now rather than at once
+  TEST_ASSERT_EQUAL_UINT32(3500, jobNextDue(1000, 1000, 2500));
+  TEST_ASSERT_EQUAL_UINT32(1200, jobNextDue(WRAP_SOON, 250, 950));
+}
+
+// A periodic job checked every millisecond through the wrap is run exactly every period
+void test_periodic_job_through_the_wrap()
+{
+  const uint32_t Period = 100;
+  uint32_t Due = WRAP_SOON;
+  uint32_t LastRun = 0;
+  int Runs = 0;
+  for (uint32_t Now = WRAP_SOON; Now != WRAP_SOON + 1000; Now++)
+  {
+    if (!jobIsDue(Now, Due))
+      continue;
+    if (Runs > 0)
+      TEST_ASSERT_EQUAL_UINT32(Period, Now - LastRun);
+    LastRun = Now;
+    Runs++;
+    Due = jobNextDue(Due, Period, Now);
+  }
+  TEST_ASSERT_EQUAL_INT(10, Runs);
+}
+
+void test_interval_left()
+{
+  TEST_ASSERT_EQUAL_UINT32(250, jobIntervalLeft(1000, 250, 1000));
+  TEST_ASSERT_EQUAL_UINT32(40, jobIntervalLeft(1000, 250, 1210));
+  TEST_ASSERT_EQUAL_UINT32(0, jobIntervalLeft(1000, 250, 1250));
+  TEST_ASSERT_EQUAL_UINT32(0, jobIntervalLeft(1000, 250, 5000));
+  // Started before the wrap
+  TEST_ASSERT_EQUAL_UINT32(200, jobIntervalLeft(0xFFFFFFF0, 250, 34));
+  TEST_ASSERT_EQUAL_UINT32(0, jobIntervalLeft(0xFFFFFFF0, 250, 300));
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_due_at_and_after_the_time);
+  RUN_TEST(test_due_across_the_wrap);
+  RUN_TEST(test_up_to_24_days_ahead);
+  RUN_TEST(test_time_left_across_the_wrap);
+  RUN_TEST(test_periodic_job_keeps_its_rhythm);
+  RUN_TEST(test_missed_runs_are_skipped);
+  RUN_TEST(test_periodic_job_through_the_wrap);
+  RUN_TEST(test_interval_left);
+  return UNITY_END();
+}
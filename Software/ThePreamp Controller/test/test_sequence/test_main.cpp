@@ -0,0 +1,148 @@
+// Host tests of the composition of the power sequence (src/sequence.h)
+
+#include <unity.h>
+#include "sequence.h"
+
+SequenceStep Steps[SEQUENCE_MAX_STEPS];
+SequenceOptions Options;
+
+// Everything switched, latching triggers without OnDelay
+void setUp()
+{
+  memset(Steps, 0, sizeof(Steps));
+  Options.ExtPower = true;
+  Options.TriggerActive[0] = Options.TriggerActive[1] = true;
+  Options.TriggerMomentary[0] = Options.TriggerMomentary[1] = false;
+  Options.TriggerOnDelay[0] = Options.TriggerOnDelay[1] = 0;
+}
+
+void tearDown()
+{
+}
+
+// Check step Index - Time is milliseconds from the start of the sequence
+void assertStep(uint8_t Index, uint8_t Target, uint8_t Value, uint32_t Time)
+{
+  uint32_t Start = 0;
+  for (uint8_t i = 0; i <= Index; i++)
+    Start += Steps[i].Delay;
+  TEST_ASSERT_EQUAL_UINT8(Target, Steps[Index].Target);
+  TEST_ASSERT_EQUAL_UINT8(Value, Steps[Index].Value);
+  TEST_ASSERT_EQUAL_UINT32(Time, Start);
+}
+
+void test_power_up_steps_are_spaced()
+{
+  TEST_ASSERT_EQUAL_UINT8(4, sequenceCompose("P12O", true, Options, Steps));
+  assertStep(0, SEQ_POWER, 1, 0);
+  assertStep(1, SEQ_TRIGGER1, 1, SEQUENCE_STEP_TIME);
+  assertStep(2, SEQ_TRIGGER2, 1, 2 * SEQUENCE_STEP_TIME);
+  assertStep(3, SEQ_OUTPUT, 1, 3 * SEQUENCE_STEP_TIME);
+}
+
+void test_power_down_follows_its_order()
+{
+  TEST_ASSERT_EQUAL_UINT8(4, sequenceCompose("O21P", false, Options, Steps));
+  // The output relay is switched off at once
+  assertStep(0, SEQ_OUTPUT, 0, 0);
+  assertStep(1, SEQ_TRIGGER2, 0, SEQUENCE_STEP_TIME);
+  assertStep(2, SEQ_TRIGGER1, 0, 2 * SEQUENCE_STEP_TIME);
+  assertStep(3, SEQ_POWER, 0, 3 * SEQUENCE_STEP_TIME);
+}
+
+void test_inactive_outputs_are_left_out()
+{
+  Options.ExtPower = false;
+  Options.TriggerActive[0] = false;
+  TEST_ASSERT_EQUAL_UINT8(2, sequenceCompose("P12O", true, Options, Steps));
+  // The first step that is switched starts the sequence
+  assertStep(0, SEQ_TRIGGER2, 1, 0);
+  assertStep(1, SEQ_OUTPUT, 1, SEQUENCE_STEP_TIME);
+}
+
+void test_momentary_trigger_gets_a_pulse()
+{
+  Options.TriggerMomentary[0] = true;
+  TEST_ASSERT_EQUAL_UINT8(4, sequenceCompose("P1O", true, Options, Steps));
+  assertStep(0, SEQ_POWER, 1, 0);
+  assertStep(1, SEQ_TRIGGER1, 1, SEQUENCE_STEP_TIME);
+  assertStep(2, SEQ_TRIGGER1, 0, SEQUENCE_STEP_TIME + SEQUENCE_PULSE_TIME);
+  TEST_ASSERT_FALSE(Steps[1].Release);
+  TEST_ASSERT_TRUE(Steps[2].Release);
+  // The next step is counted from the end of the pulse
+  assertStep(3, SEQ_OUTPUT, 1, 2 * SEQUENCE_STEP_TIME + SEQUENCE_PULSE_TIME);
+
+  // Switching a momentary trigger off is also a pulse
+  TEST_ASSERT_EQUAL_UINT8(3, sequenceCompose("1O", false, Options, Steps));
+  assertStep(0, SEQ_TRIGGER1, 1, 0);
+  assertStep(1, SEQ_TRIGGER1, 0, SEQUENCE_PULSE_TIME);
+  assertStep(2, SEQ_OUTPUT, 0, SEQUENCE_PULSE_TIME + SEQUENCE_STEP_TIME);
+}
+
+void test_on_delay_holds_back_a_trigger()
+{
+  Options.TriggerOnDelay[0] = 5000;
+  TEST_ASSERT_EQUAL_UINT8(4, sequenceCompose("P12O", true, Options, Steps));
+  assertStep(0, SEQ_POWER, 1, 0);
+  assertStep(1, SEQ_TRIGGER1, 1, 5000);
+  // The steps after it keep their spacing
+  assertStep(2, SEQ_TRIGGER2, 1, 5000 + SEQUENCE_STEP_TIME);
+  assertStep(3, SEQ_OUTPUT, 1, 5000 + 2 * SEQUENCE_STEP_TIME);
+}
+
+void test_on_delay_is_counted_from_the_start()
+{
+  // The OnDelay of trigger 2 has already passed when it is its turn - of trigger 1 it has not
+  Options.TriggerOnDelay[0] = 1000;
+  Options.TriggerOnDelay[1] = 300;
+  TEST_ASSERT_EQUAL_UINT8(4, sequenceCompose("PO21", true, Options, Steps));
+  assertStep(0, SEQ_POWER, 1, 0);
+  assertStep(1, SEQ_OUTPUT, 1, SEQUENCE_STEP_TIME);
+  assertStep(2, SEQ_TRIGGER2, 1, 2 * SEQUENCE_STEP_TIME);
+  assertStep(3, SEQ_TRIGGER1, 1, 1000);
+}
+
+void test_on_delay_is_ignored_when_powering_down()
+{
+  Options.TriggerOnDelay[0] = Options.TriggerOnDelay[1] = 5000;
+  TEST_ASSERT_EQUAL_UINT8(4, sequenceCompose("O12P", false, Options, Steps));
+  assertStep(3, SEQ_POWER, 0, 3 * SEQUENCE_STEP_TIME);
+}
+
+void test_order_validation()
+{
+  TEST_ASSERT_TRUE(sequenceOrderValid("P12O"));
+  TEST_ASSERT_TRUE(sequenceOrderValid("O"));
+  TEST_ASSERT_TRUE(sequenceOrderValid(""));
+  TEST_ASSERT_FALSE(sequenceOrderValid("P12OP"));
+  TEST_ASSERT_FALSE(sequenceOrderValid("P3"));
+  TEST_ASSERT_FALSE(sequenceOrderValid("p"));
+}
+
+void test_append_stops_when_full()
+{
+  uint8_t Count = 0;
+  for (uint8_t i = 0; i < SEQUENCE_MAX_STEPS - 1; i++)
+    TEST_ASSERT_TRUE(sequenceAppend(Steps, Count, SEQ_OUTPUT, 1, 0));
+  // A pulse needs two steps - it is not added at all rather than left without its end
+  TEST_ASSERT_FALSE(sequenceAppendTrigger(Steps, Count, SEQ_TRIGGER1, true, true, 0));
+  TEST_ASSERT_EQUAL_UINT8(SEQUENCE_MAX_STEPS - 1, Count);
+  TEST_ASSERT_TRUE(sequenceAppendTrigger(Steps, Count, SEQ_TRIGGER1, true, false, 0));
+  TEST_ASSERT_FALSE(sequenceAppend(Steps, Count, SEQ_OUTPUT, 0, 0));
+  TEST_ASSERT_EQUAL_UINT8(SEQUENCE_MAX_STEPS, Count);
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_power_up_steps_are_spaced);
+  RUN_TEST(test_power_down_follows_its_order);
+  RUN_TEST(test_inactive_outputs_are_left_out);
+  RUN_TEST(test_momentary_trigger_gets_a_pulse);
+  RUN_TEST(test_on_delay_holds_back_a_trigger);
+  RUN_TEST(test_on_delay_is_counted_from_the_start);
+  RUN_TEST(test_on_delay_is_ignored_when_powering_down);
+  RUN_TEST(test_order_validation);
+  RUN_TEST(test_append_stops_when_full);
+  return UNITY_END();
+}
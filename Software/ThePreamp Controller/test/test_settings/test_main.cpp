@@ -0,0 +1,261 @@
+// Host tests of the validation of imported settings (stageSettings in src/settings.h)
+
+#define VERSION (float)0.998 // As main.cpp
+
+#include <unity.h>
+#include <stdio.h>
+#include "settings.h"
+#include "ntc.h"
+
+mySettings Base;
+mySettings Staged;
+
+// A valid set of settings, like the defaults of setSettingsToDefault()
+void setUp()
+{
+  memset(&Base, 0, sizeof(Base));
+  strcpy(Base.ssid, "network");
+  strcpy(Base.pass, "secret");
+  strcpy(Base.ip, "192.168.1.50");
+  Base.VolumeSteps = 60;
+  Base.MinAttenuation = 0;
+  Base.MaxAttenuation = 59;
+  Base.MaxStartVolume = 60;
+  Base.RecallSetLevel = 1;
+  for (byte Input = 0; Input < 5; Input++)
+  {
+    Base.Input[Input].Active = INPUT_NORMAL;
+    snprintf(Base.Input[Input].Name, sizeof(Base.Input[Input].Name), "INPUT %d", Input + 1);
+    Base.Input[Input].MaxVol = 60;
+    Base.Input[Input].MinVol = 1;
+  }
+  strcpy(Base.MqttTopic, "thepreamp");
+  strcpy(Base.PowerUpOrder, "P12O");
+  strcpy(Base.PowerDownOrder, "O21P");
+  Base.Version = VERSION;
+  Staged = Base;
+}
+
+void tearDown()
+{
+}
+
+// stageSettings() parses in place - the JSON is copied to a writeable buffer as in handleSettingsImport()
+const char *stage(const char *Json)
+{
+  static char Buffer[1024];
+  strcpy(Buffer, Json);
+  return stageSettings(Buffer, strlen(Buffer), Staged);
+}
+
+void test_fields_not_in_the_json_are_left_unchanged()
+{
+  TEST_ASSERT_NULL(stage("{}"));
+  TEST_ASSERT_EQUAL_MEMORY(&Base, &Staged, sizeof(mySettings));
+  TEST_ASSERT_NULL(stage("{\"VolumeSteps\":80,\"Unknown\":1}"));
+  TEST_ASSERT_EQUAL_UINT8(80, Staged.VolumeSteps);
+  TEST_ASSERT_EQUAL_UINT8(Base.MaxAttenuation, Staged.MaxAttenuation);
+}
+
+void test_invalid_json_is_rejected()
+{
+  TEST_ASSERT_EQUAL_STRING("json", stage("{\"VolumeSteps\":"));
+  TEST_ASSERT_EQUAL_STRING("json", stage("not json"));
+}
+
+void test_byte_fields_are_range_checked()
+{
+  TEST_ASSERT_EQUAL_STRING("VolumeSteps", stage("{\"VolumeSteps\":0}"));
+  TEST_ASSERT_EQUAL_STRING("VolumeSteps", stage("{\"VolumeSteps\":9}"));
+  TEST_ASSERT_EQUAL_STRING("VolumeSteps", stage("{\"VolumeSteps\":256}"));
+  TEST_ASSERT_EQUAL_STRING("VolumeSteps", stage("{\"VolumeSteps\":\"60\"}"));
+  TEST_ASSERT_EQUAL_STRING("RecallSetLevel", stage("{\"RecallSetLevel\":2}"));
+  TEST_ASSERT_EQUAL_STRING("LinkGroup", stage("{\"LinkGroup\":251}"));
+  TEST_ASSERT_NULL(stage("{\"LinkGroup\":250,\"DisplayOnLevel\":3}"));
+  TEST_ASSERT_EQUAL_UINT8(250, Staged.LinkGroup);
+  TEST_ASSERT_EQUAL_UINT8(3, Staged.DisplayOnLevel);
+}
+
+void test_text_must_fit_its_field()
+{
+  // ssid is char[33] - 32 characters and the terminator
+  TEST_ASSERT_NULL(stage("{\"ssid\":\"0123456789abcdef0123456789abcdef\"}"));
+  TEST_ASSERT_EQUAL_STRING("0123456789abcdef0123456789abcdef", Staged.ssid);
+  TEST_ASSERT_EQUAL_STRING("ssid", stage("{\"ssid\":\"0123456789abcdef0123456789abcdefX\"}"));
+  TEST_ASSERT_EQUAL_STRING("ip", stage("{\"ip\":\"192.168.100.100.1\"}"));
+  TEST_ASSERT_EQUAL_STRING("ssid", stage("{\"ssid\":1234}"));
+  TEST_ASSERT_EQUAL_STRING("pass", stage("{\"pass\":1234}"));
+}
+
+void test_shorter_text_clears_the_rest_of_the_field()
+{
+  TEST_ASSERT_NULL(stage("{\"ip\":\"10.0.0.2\"}"));
+  TEST_ASSERT_EQUAL_STRING("10.0.0.2", Staged.ip);
+  for (size_t i = strlen("10.0.0.2"); i < sizeof(Staged.ip); i++)
+    TEST_ASSERT_EQUAL_UINT8(0, Staged.ip[i]);
+}
+
+void test_masked_secrets_are_left_unchanged()
+{
+  // The export shows SETTING_SECRET_MASK instead of the passwords, so an exported file can be imported again
+  TEST_ASSERT_NULL(stage("{\"pass\":\"" SETTING_SECRET_MASK "\",\"MqttPass\":\"" SETTING_SECRET_MASK "\"}"));
+  TEST_ASSERT_EQUAL_STRING("secret", Staged.pass);
+  TEST_ASSERT_EQUAL_STRING("", Staged.MqttPass);
+  TEST_ASSERT_NULL(stage("{\"pass\":\"newsecret\",\"MqttPass\":\"broker\"}"));
+  TEST_ASSERT_EQUAL_STRING("newsecret", Staged.pass);
+  TEST_ASSERT_EQUAL_STRING("broker", Staged.MqttPass);
+  TEST_ASSERT_NULL(stage("{\"pass\":\"\"}"));
+  TEST_ASSERT_EQUAL_STRING("", Staged.pass);
+  TEST_ASSERT_EQUAL_STRING("MqttPass", stage("{\"MqttPass\":\"0123456789abcdef0123456789abcdefX\"}"));
+}
+
+void test_ir_codes_as_strings_or_numbers()
+{
+  TEST_ASSERT_NULL(stage("{\"IR_ON\":\"18446744073709551615\",\"IR_OFF\":\"0x20DF10EF\",\"IR_UP\":1234}"));
+  TEST_ASSERT_EQUAL_UINT64(UINT64_MAX, Staged.IR_ON);
+  TEST_ASSERT_EQUAL_UINT64(0x20DF10EF, Staged.IR_OFF);
+  TEST_ASSERT_EQUAL_UINT64(1234, Staged.IR_UP);
+  TEST_ASSERT_EQUAL_STRING("IR_DOWN", stage("{\"IR_DOWN\":\"12ab\"}"));
+  TEST_ASSERT_EQUAL_STRING("IR_DOWN", stage("{\"IR_DOWN\":-1}"));
+}
+
+void test_inputs_are_validated_as_a_whole()
+{
+  const char *Valid = "{\"Input\":[{\"Active\":0,\"Name\":\"TV\",\"MaxVol\":60,\"MinVol\":1,\"Gain\":0},"
+                      "{\"Active\":1,\"Name\":\"PHONO\",\"MaxVol\":50,\"MinVol\":10,\"Gain\":7},"
+                      "{\"Active\":2,\"Name\":\"\",\"MaxVol\":60,\"MinVol\":1,\"Gain\":0},"
+                      "{\"Active\":1,\"Name\":\"CD\",\"MaxVol\":60,\"MinVol\":1,\"Gain\":3},"
+                      "{\"Active\":1,\"Name\":\"STREAM\",\"MaxVol\":60,\"MinVol\":1,\"Gain\":0}]}";
+  TEST_ASSERT_NULL(stage(Valid));
+  TEST_ASSERT_EQUAL_STRING("PHONO", Staged.Input[1].Name);
+  TEST_ASSERT_EQUAL_UINT8(10, Staged.Input[1].MinVol);
+  TEST_ASSERT_EQUAL_UINT8(7, Staged.Input[1].Gain);
+  TEST_ASSERT_EQUAL_UINT8(INPUT_INACTIVATED, Staged.Input[2].Active);
+
+  TEST_ASSERT_EQUAL_STRING("Input", stage("{\"Input\":[]}"));
+  TEST_ASSERT_EQUAL_STRING("Input", stage("{\"Input\":[{\"Active\":1,\"Name\":\"A\",\"MaxVol\":60,\"MinVol\":1,\"Gain\":0}]}"));
+}
+
+void test_invalid_input_values_are_rejected()
+{
+  const char *Format = "{\"Input\":[{\"Active\":%d,\"Name\":\"%s\",\"MaxVol\":%d,\"MinVol\":%d,\"Gain\":%d},"
+                       "{\"Active\":1,\"Name\":\"B\",\"MaxVol\":60,\"MinVol\":1,\"Gain\":0},{\"Active\":1,\"Name\":\"C\",\"MaxVol\":60,\"MinVol\":1,\"Gain\":0},"
+                       "{\"Active\":1,\"Name\":\"D\",\"MaxVol\":60,\"MinVol\":1,\"Gain\":0},{\"Active\":1,\"Name\":\"E\",\"MaxVol\":60,\"MinVol\":1,\"Gain\":0}]}";
+  char Json[1024];
+  snprintf(Json, sizeof(Json), Format, 1, "LONGNAME", 60, 1, 0); // Name is char[8]
+  TEST_ASSERT_EQUAL_STRING("Input", stage(Json));
+  snprintf(Json, sizeof(Json), Format, 3, "A", 60, 1, 0);
+  TEST_ASSERT_EQUAL_STRING("Input", stage(Json));
+  snprintf(Json, sizeof(Json), Format, 1, "A", 10, 20, 0);
+  TEST_ASSERT_EQUAL_STRING("Input", stage(Json));
+  snprintf(Json, sizeof(Json), Format, 1, "A", 60, 1, 8);
+  TEST_ASSERT_EQUAL_STRING("Input", stage(Json));
+  // Volume step 0 would play at full volume (see calculateAttenuation)
+  snprintf(Json, sizeof(Json), Format, 1, "A", 60, 0, 0);
+  TEST_ASSERT_EQUAL_STRING("Input", stage(Json));
+  // Above VolumeSteps
+  snprintf(Json, sizeof(Json), Format, 1, "A", 61, 1, 0);
+  TEST_ASSERT_EQUAL_STRING("Input", stage(Json));
+}
+
+void test_version_must_match()
+{
+  TEST_ASSERT_EQUAL_STRING("Version", stage("{\"Version\":0.5}"));
+  TEST_ASSERT_NULL(stage("{\"Version\":0.998}"));
+}
+
+void test_dependent_fields_are_checked_together()
+{
+  TEST_ASSERT_EQUAL_STRING("MaxAttenuation", stage("{\"MinAttenuation\":59}"));
+  Staged = Base;
+  TEST_ASSERT_EQUAL_STRING("MaxStartVolume", stage("{\"MaxStartVolume\":61}"));
+  Staged = Base;
+  TEST_ASSERT_EQUAL_STRING("MuteLevel", stage("{\"MuteLevel\":61}"));
+  Staged = Base;
+  // Fewer volume steps than the inputs allow
+  TEST_ASSERT_EQUAL_STRING("MaxStartVolume", stage("{\"VolumeSteps\":40}"));
+  Staged = Base;
+  TEST_ASSERT_EQUAL_STRING("Input", stage("{\"VolumeSteps\":40,\"MaxStartVolume\":40}"));
+  Staged = Base;
+  // Several fields changed at once are checked against each other, not against the current settings
+  TEST_ASSERT_NULL(stage("{\"MinAttenuation\":70,\"MaxAttenuation\":100}"));
+}
+
+void test_volume_steps_must_cover_the_attenuation_range()
+{
+  // calculateAttenuation() needs more steps than a quarter of the range in dB - otherwise every step plays at full volume
+  TEST_ASSERT_EQUAL_STRING("VolumeSteps", stage("{\"VolumeSteps\":27,\"MaxAttenuation\":111,\"MaxStartVolume\":27}"));
+  Staged = Base;
+  TEST_ASSERT_EQUAL_STRING("VolumeSteps", stage("{\"MaxAttenuation\":111,\"VolumeSteps\":10,\"MaxStartVolume\":10}"));
+  Staged = Base;
+  TEST_ASSERT_NULL(stage("{\"VolumeSteps\":28,\"MinAttenuation\":0,\"MaxAttenuation\":111,\"MaxStartVolume\":28,"
+                         "\"Input\":[{\"Active\":1,\"Name\":\"A\",\"MaxVol\":28,\"MinVol\":1,\"Gain\":0},"
+                         "{\"Active\":1,\"Name\":\"B\",\"MaxVol\":28,\"MinVol\":1,\"Gain\":0},{\"Active\":1,\"Name\":\"C\",\"MaxVol\":28,\"MinVol\":1,\"Gain\":0},"
+                         "{\"Active\":1,\"Name\":\"D\",\"MaxVol\":28,\"MinVol\":1,\"Gain\":0},{\"Active\":1,\"Name\":\"E\",\"MaxVol\":28,\"MinVol\":1,\"Gain\":0}]}"));
+}
+
+void test_mqtt_fields()
+{
+  TEST_ASSERT_NULL(stage("{\"MqttUri\":\"mqtt://192.168.1.10:1883\"}"));
+  TEST_ASSERT_NULL(stage("{\"MqttUri\":\"mqtts://broker\"}"));
+  TEST_ASSERT_NULL(stage("{\"MqttUri\":\"\"}"));
+  TEST_ASSERT_EQUAL_STRING("MqttUri", stage("{\"MqttUri\":\"http://broker\"}"));
+  Staged = Base;
+  TEST_ASSERT_EQUAL_STRING("MqttTopic", stage("{\"MqttTopic\":\"\"}"));
+  Staged = Base;
+  TEST_ASSERT_EQUAL_STRING("MqttTopic", stage("{\"MqttTopic\":\"preamp/#\"}"));
+}
+
+void test_power_orders()
+{
+  TEST_ASSERT_NULL(stage("{\"PowerUpOrder\":\"O\",\"PowerDownOrder\":\"\"}"));
+  TEST_ASSERT_EQUAL_STRING("PowerUpOrder", stage("{\"PowerUpOrder\":\"P11O\"}"));
+  Staged = Base;
+  TEST_ASSERT_EQUAL_STRING("PowerDownOrder", stage("{\"PowerDownOrder\":\"O2X\"}"));
+  Staged = Base;
+  // PowerUpOrder is char[6]
+  TEST_ASSERT_EQUAL_STRING("PowerUpOrder", stage("{\"PowerUpOrder\":\"P12OP1\"}"));
+}
+
+void test_field_table_matches_the_settings()
+{
+  for (byte i = 0; i < SETTING_FIELD_COUNT; i++)
+  {
+    const SettingField *Field = &SettingFields[i];
+    TEST_ASSERT_TRUE(Field->Offset + Field->Size <= sizeof(mySettings));
+    TEST_ASSERT_TRUE(Field->Min <= Field->Max);
+    for (byte j = i + 1; j < SETTING_FIELD_COUNT; j++)
+      TEST_ASSERT_TRUE(strcasecmp(Field->Name, SettingFields[j].Name) != 0);
+  }
+}
+
+void test_temperature_limits_are_within_the_ntc_table()
+{
+  // A limit above the last entry of the table could never be reached
+  int16_t Highest = ntcTemperature(INT32_MAX);
+  for (byte i = 0; i < SETTING_FIELD_COUNT; i++)
+    if (strcmp(SettingFields[i].Name, "Trigger1Temp") == 0 || strcmp(SettingFields[i].Name, "Trigger2Temp") == 0)
+      TEST_ASSERT_TRUE(SettingFields[i].Max * 10 < Highest);
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_fields_not_in_the_json_are_left_unchanged);
+  RUN_TEST(test_invalid_json_is_rejected);
+  RUN_TEST(test_byte_fields_are_range_checked);
+  RUN_TEST(test_text_must_fit_its_field);
+  RUN_TEST(test_shorter_text_clears_the_rest_of_the_field);
+  RUN_TEST(test_masked_secrets_are_left_unchanged);
+  RUN_TEST(test_ir_codes_as_strings_or_numbers);
+  RUN_TEST(test_inputs_are_validated_as_a_whole);
+  RUN_TEST(test_invalid_input_values_are_rejected);
+  RUN_TEST(test_version_must_match);
+  RUN_TEST(test_dependent_fields_are_checked_together);
+  RUN_TEST(test_volume_steps_must_cover_the_attenuation_range);
+  RUN_TEST(test_mqtt_fields);
+  RUN_TEST(test_power_orders);
+  RUN_TEST(test_field_table_matches_the_settings);
+  RUN_TEST(test_temperature_limits_are_within_the_ntc_table);
+  return UNITY_END();
+}
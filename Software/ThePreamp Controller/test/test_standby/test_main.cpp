@@ -0,0 +1,220 @@
+// Host model of the scheduler in low power standby (src/standby.h and src/scheduler.h) - loop() runs the jobs that are due and then
+// sleeps as schedulerSleep() in main.cpp. Time is simulated in milliseconds; a pass of loop() that runs jobs takes 1 millisecond
+
+#include <unity.h>
+#include <string.h>
+#include "scheduler.h"
+#include "standby.h"
+
+#define MAX_SLEEP 10 // As SCHEDULER_MAX_SLEEP
+#define JOBS 4
+#define MAX_INPUTS 4
+
+// The periodic jobs in standby: protection, temperature (TEMP_SAMPLE_INTERVAL_STANDBY), screen saver and inactivity
+const uint32_t Periods[JOBS] = {500, 5000, 1000, 1000};
+
+struct Model
+{
+  StandbyState State;
+  uint32_t Due[JOBS];
+  bool Scheduled[JOBS];
+  uint32_t Runs[JOBS];
+  uint32_t MaxLate;     // The most a job was run after it was due (milliseconds)
+  uint32_t LightMs;     // Time in light sleep
+  uint32_t IdleMs;      // Time waiting for the next job
+  uint32_t Wakeups;     // Light sleeps ended
+  uint32_t Inputs[MAX_INPUTS]; // Times an input (IR or encoder button) arrives - relative to the start
+  uint8_t InputCount;
+  uint32_t FirstLightAfterInput; // Time the first light sleep after an input started - relative to the start
+};
+
+Model M;
+
+void setUp()
+{
+  memset(&M, 0, sizeof(M));
+}
+
+void tearDown()
+{
+}
+
+// Run the model from Start for Duration milliseconds with Busy (StandbyBusy) - Standby as appMode == APP_STANDBY_MODE
+void run(uint32_t Start, uint32_t Duration, uint8_t Busy, bool Standby = true)
+{
+  uint32_t Now = Start;
+  uint8_t NextInput = 0;
+  bool Input = false;
+  for (uint8_t Job = 0; Job < JOBS; Job++)
+  {
+    M.Due[Job] = Now + Periods[Job];
+    M.Scheduled[Job] = true;
+  }
+  standbySet(M.State, Standby);
+
+  while (Now - Start < Duration)
+  {
+    // The encoder buttons are polled on every pass - a light sleep is woken by them (see below)
+    if (NextInput < M.InputCount && Now - Start >= M.Inputs[NextInput])
+    {
+      standbyWakeUp(M.State, Now);
+      NextInput++;
+      Input = true;
+    }
+    standbyAwakeEnded(M.State, Now);
+
+    bool Ran = false;
+    for (uint8_t Job = 0; Job < JOBS; Job++)
+      if (M.Scheduled[Job] && jobIsDue(Now, M.Due[Job]))
+      {
+        if (Now - M.Due[Job] > M.MaxLate)
+          M.MaxLate = Now - M.Due[Job];
+        M.Due[Job] = jobNextDue(M.Due[Job], Periods[Job], Now);
+        M.Runs[Job]++;
+        Ran = true;
+      }
+    if (Ran)
+    {
+      Now++;
+      continue;
+    }
+
+    int32_t Sleep = jobSleepTime(Now, M.Due, M.Scheduled, JOBS);
+    uint32_t ToInput = NextInput < M.InputCount ? M.Inputs[NextInput] - (Now - Start) : UINT32_MAX;
+    switch (standbySleepKind(M.State, Sleep, Busy))
+    {
+    case SLEEP_LIGHT:
+      if (Input && M.FirstLightAfterInput == 0)
+        M.FirstLightAfterInput = Now - Start;
+      if (ToInput < (uint32_t)Sleep)
+        Sleep = ToInput;
+      M.LightMs += Sleep;
+      M.Wakeups++;
+      Now += Sleep;
+      break;
+    case SLEEP_IDLE:
+      if (Sleep > MAX_SLEEP)
+        Sleep = MAX_SLEEP;
+      M.IdleMs += Sleep;
+      Now += Sleep;
+      break;
+    default:
+      Now++;
+      break;
+    }
+  }
+}
+
+#define TEN_MINUTES 600000UL
+
+void test_standby_sleeps_in_light_sleep_between_the_jobs()
+{
+  run(0, TEN_MINUTES, 0);
+  TEST_ASSERT_EQUAL_UINT32(0, M.MaxLate);
+  TEST_ASSERT_EQUAL_UINT32(0, M.IdleMs);
+  TEST_ASSERT_TRUE(M.LightMs >= TEN_MINUTES * 99 / 100);
+  // Woken for the protection only - the other jobs are due at the same time
+  TEST_ASSERT_TRUE(M.Wakeups <= TEN_MINUTES / Periods[0] + 1);
+  // The last runs are due at the end of the ten minutes
+  TEST_ASSERT_EQUAL_UINT32(TEN_MINUTES / Periods[0] - 1, M.Runs[0]);
+  TEST_ASSERT_EQUAL_UINT32(TEN_MINUTES / Periods[1] - 1, M.Runs[1]);
+}
+
+void test_no_light_sleep_while_busy()
+{
+  const uint8_t Busy[] = {STANDBY_BUSY_BOOT, STANDBY_BUSY_WIFI, STANDBY_BUSY_COMMAND, STANDBY_BUSY_SEQUENCE, STANDBY_BUSY_I2C, STANDBY_BUSY_JOB};
+  for (uint8_t i = 0; i < sizeof(Busy); i++)
+  {
+    setUp();
+    run(0, 60000, Busy[i]);
+    TEST_ASSERT_EQUAL_UINT32(0, M.LightMs);
+    TEST_ASSERT_EQUAL_UINT32(0, M.MaxLate);
+    TEST_ASSERT_TRUE(M.IdleMs >= 60000 * 99 / 100);
+  }
+}
+
+void test_no_light_sleep_when_on()
+{
+  run(0, 60000, 0, false);
+  TEST_ASSERT_EQUAL_UINT32(0, M.LightMs);
+  TEST_ASSERT_EQUAL_UINT32(0, M.MaxLate);
+}
+
+// An input keeps the controller awake for STANDBY_AWAKE_TIME, so the encoder timer can decode a double click
+void test_input_keeps_it_awake()
+{
+  M.Inputs[0] = 60250;
+  M.InputCount = 1;
+  run(0, TEN_MINUTES, 0);
+  TEST_ASSERT_TRUE(M.FirstLightAfterInput > M.Inputs[0] + STANDBY_AWAKE_TIME);
+  TEST_ASSERT_TRUE(M.FirstLightAfterInput <= M.Inputs[0] + STANDBY_AWAKE_TIME + Periods[0] + 1);
+  TEST_ASSERT_FALSE(M.State.Awake);
+  TEST_ASSERT_TRUE(M.IdleMs >= STANDBY_AWAKE_TIME * 99 / 100); // Less the passes that ran jobs
+  TEST_ASSERT_EQUAL_UINT32(0, M.MaxLate);
+}
+
+// A second input while awake extends the time awake
+void test_input_while_awake_extends_it()
+{
+  M.Inputs[0] = 60250;
+  M.Inputs[1] = 62250;
+  M.InputCount = 2;
+  run(0, TEN_MINUTES, 0);
+  TEST_ASSERT_TRUE(M.FirstLightAfterInput > M.Inputs[1] + STANDBY_AWAKE_TIME);
+}
+
+// A job due more often than STANDBY_MIN_LIGHT_SLEEP (a volume ramp) is waited for without light sleep
+void test_short_sleeps_are_not_light_sleeps()
+{
+  StandbyState State = {true, false, 0};
+  TEST_ASSERT_EQUAL(SLEEP_IDLE, standbySleepKind(State, STANDBY_MIN_LIGHT_SLEEP - 1, 0));
+  TEST_ASSERT_EQUAL(SLEEP_LIGHT, standbySleepKind(State, STANDBY_MIN_LIGHT_SLEEP, 0));
+  TEST_ASSERT_EQUAL(SLEEP_NONE, standbySleepKind(State, 0, 0));
+  TEST_ASSERT_EQUAL(SLEEP_NONE, standbySleepKind(State, -5, 0));
+}
+
+// millis() wraps after 49.7 days - the jobs stay on time and the light sleeps go on
+void test_millis_wrap()
+{
+  run(UINT32_MAX - 30000, TEN_MINUTES, 0);
+  TEST_ASSERT_EQUAL_UINT32(0, M.MaxLate);
+  TEST_ASSERT_TRUE(M.LightMs >= TEN_MINUTES * 99 / 100);
+}
+
+void test_leaving_standby_ends_the_wake()
+{
+  StandbyState State = {false, false, 0};
+  TEST_ASSERT_TRUE(standbySet(State, true));
+  TEST_ASSERT_FALSE(standbySet(State, true));
+  TEST_ASSERT_TRUE(standbyWakeUp(State, 100));
+  TEST_ASSERT_FALSE(standbyWakeUp(State, 200));
+  TEST_ASSERT_FALSE(standbyAwakeEnded(State, 200 + STANDBY_AWAKE_TIME));
+  TEST_ASSERT_TRUE(standbySet(State, false));
+  TEST_ASSERT_FALSE(State.Awake);
+}
+
+void test_no_jobs_sleeps_forever()
+{
+  bool Scheduled[2] = {false, false};
+  uint32_t Due[2] = {0, 0};
+  TEST_ASSERT_EQUAL_INT32(INT32_MAX, jobSleepTime(1000, Due, Scheduled, 2));
+  Scheduled[1] = true;
+  Due[1] = 1250;
+  TEST_ASSERT_EQUAL_INT32(250, jobSleepTime(1000, Due, Scheduled, 2));
+  TEST_ASSERT_EQUAL_INT32(-50, jobSleepTime(1300, Due, Scheduled, 2));
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_standby_sleeps_in_light_sleep_between_the_jobs);
+  RUN_TEST(test_no_light_sleep_while_busy);
+  RUN_TEST(test_no_light_sleep_when_on);
+  RUN_TEST(test_input_keeps_it_awake);
+  RUN_TEST(test_input_while_awake_extends_it);
+  RUN_TEST(test_short_sleeps_are_not_light_sleeps);
+  RUN_TEST(test_millis_wrap);
+  RUN_TEST(test_leaving_standby_ends_the_wake);
+  RUN_TEST(test_no_jobs_sleeps_forever);
+  return UNITY_END();
+}
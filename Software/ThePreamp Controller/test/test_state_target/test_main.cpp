@@ -0,0 +1,136 @@
+// Host contract tests of the merging of API targets (src/state_target.h) - as used by postTarget() and the CMD_TARGET command in main.cpp
+
+#include <unity.h>
+#include <string.h>
+#include "state_target.h"
+
+TargetSlot Slot;
+uint32_t LastTicket;
+
+void setUp()
+{
+  memset(&Slot, 0, sizeof(Slot));
+  LastTicket = 0;
+}
+
+void tearDown()
+{
+}
+
+StateTarget makeTarget(uint8_t Fields, uint8_t Value)
+{
+  StateTarget Target;
+  memset(&Target, 0, sizeof(Target));
+  Target.Fields = Fields;
+  Target.Input = Value;
+  Target.Volume = Value;
+  Target.Balance = Value;
+  Target.Muted = Value & 1;
+  Target.Triggers = Value & 0x03;
+  Target.Gain = Value;
+  return Target;
+}
+
+// As postTarget() with a command queue that accepts Accept commands
+uint32_t post(const StateTarget &Target, bool Accept = true)
+{
+  if (!targetPut(Slot, Target))
+    return Slot.Ticket;
+  uint32_t Ticket = Accept ? ++LastTicket : 0;
+  targetPosted(Slot, Ticket);
+  return Ticket;
+}
+
+void test_first_request_posts_a_command()
+{
+  TEST_ASSERT_TRUE(targetPut(Slot, makeTarget(TARGET_VOLUME, 30)));
+  TEST_ASSERT_TRUE(Slot.Queued);
+  targetPosted(Slot, 7);
+  TEST_ASSERT_EQUAL_UINT32(7, Slot.Ticket);
+}
+
+void test_requests_while_queued_are_merged_and_get_the_same_ticket()
+{
+  uint32_t Ticket = post(makeTarget(TARGET_VOLUME, 30));
+  TEST_ASSERT_NOT_EQUAL(0, Ticket);
+  TEST_ASSERT_EQUAL_UINT32(Ticket, post(makeTarget(TARGET_VOLUME, 31)));
+  TEST_ASSERT_EQUAL_UINT32(Ticket, post(makeTarget(TARGET_INPUT, 2)));
+  TEST_ASSERT_EQUAL_UINT32(2, Slot.Merged);
+  TEST_ASSERT_EQUAL_UINT32(1, LastTicket);
+}
+
+void test_newest_value_of_a_field_wins()
+{
+  post(makeTarget(TARGET_VOLUME | TARGET_BALANCE, 30));
+  post(makeTarget(TARGET_VOLUME, 45));
+  StateTarget Target = targetTake(Slot);
+  TEST_ASSERT_EQUAL_HEX8(TARGET_VOLUME | TARGET_BALANCE, Target.Fields);
+  TEST_ASSERT_EQUAL_UINT8(45, Target.Volume);
+  TEST_ASSERT_EQUAL_UINT8(30, Target.Balance);
+}
+
+void test_triggers_are_merged_one_by_one()
+{
+  StateTarget Trigger1On = makeTarget(TARGET_TRIGGER1, 0);
+  Trigger1On.Triggers = 0x01;
+  StateTarget Trigger2Off = makeTarget(TARGET_TRIGGER2, 0);
+  StateTarget Trigger2On = makeTarget(TARGET_TRIGGER2, 0);
+  Trigger2On.Triggers = 0x02;
+
+  post(Trigger1On);
+  post(Trigger2On);
+  post(Trigger2Off); // Must not change trigger 1
+  StateTarget Target = targetTake(Slot);
+  TEST_ASSERT_EQUAL_HEX8(TARGET_TRIGGER1 | TARGET_TRIGGER2, Target.Fields);
+  TEST_ASSERT_EQUAL_HEX8(0x01, Target.Triggers);
+}
+
+void test_take_empties_the_slot()
+{
+  post(makeTarget(TARGET_VOLUME | TARGET_MUTE, 31));
+  StateTarget Target = targetTake(Slot);
+  TEST_ASSERT_EQUAL_HEX8(TARGET_VOLUME | TARGET_MUTE, Target.Fields);
+  TEST_ASSERT_FALSE(Slot.Queued);
+  TEST_ASSERT_EQUAL_HEX8(0, Slot.Target.Fields);
+}
+
+void test_request_after_take_posts_a_new_command()
+{
+  // The command is executed (the target is taken) also when the transition is refused, ie. in standby
+  uint32_t First = post(makeTarget(TARGET_VOLUME, 20));
+  targetTake(Slot);
+  uint32_t Second = post(makeTarget(TARGET_INPUT, 1));
+  TEST_ASSERT_NOT_EQUAL(First, Second);
+  TEST_ASSERT_EQUAL_UINT32(2, LastTicket);
+  // Fields of the first target are not applied again
+  TEST_ASSERT_EQUAL_HEX8(TARGET_INPUT, targetTake(Slot).Fields);
+}
+
+void test_full_queue_empties_the_slot()
+{
+  TEST_ASSERT_EQUAL_UINT32(0, post(makeTarget(TARGET_VOLUME, 20), false));
+  TEST_ASSERT_FALSE(Slot.Queued);
+  TEST_ASSERT_EQUAL_HEX8(0, Slot.Target.Fields);
+  // The next request posts again and does not carry the rejected volume
+  TEST_ASSERT_NOT_EQUAL(0, post(makeTarget(TARGET_BALANCE, 127)));
+  TEST_ASSERT_EQUAL_HEX8(TARGET_BALANCE, targetTake(Slot).Fields);
+}
+
+void test_take_of_an_empty_slot_has_no_fields()
+{
+  TEST_ASSERT_EQUAL_HEX8(0, targetTake(Slot).Fields);
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_first_request_posts_a_command);
+  RUN_TEST(test_requests_while_queued_are_merged_and_get_the_same_ticket);
+  RUN_TEST(test_newest_value_of_a_field_wins);
+  RUN_TEST(test_triggers_are_merged_one_by_one);
+  RUN_TEST(test_take_empties_the_slot);
+  RUN_TEST(test_request_after_take_posts_a_new_command);
+  RUN_TEST(test_full_queue_empties_the_slot);
+  RUN_TEST(test_take_of_an_empty_slot_has_no_fields);
+  return UNITY_END();
+}
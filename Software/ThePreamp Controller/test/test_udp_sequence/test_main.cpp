@@ -0,0 +1,87 @@
+// Host tests of the sequence number check of the UDP control protocol (src/udp_sequence.h)
+
+#include <unity.h>
+#include <string.h>
+#include "udp_sequence.h"
+
+#define ADDRESS 0x0A01A8C0 // 192.168.1.10
+#define PORT 40000
+
+// As main.cpp
+UdpClient udpClients[UDP_MAX_CLIENTS];
+uint8_t udpNextClient = 0;
+
+void setUp()
+{
+  memset(udpClients, 0, sizeof(udpClients));
+  udpNextClient = 0;
+}
+
+void tearDown()
+{
+}
+
+void test_first_request_of_a_client_is_executed()
+{
+  TEST_ASSERT_TRUE(udpCheckSequence(ADDRESS, PORT, 1234));
+}
+
+void test_duplicate_and_older_requests_are_not_executed()
+{
+  TEST_ASSERT_TRUE(udpCheckSequence(ADDRESS, PORT, 10));
+  TEST_ASSERT_FALSE(udpCheckSequence(ADDRESS, PORT, 10));
+  TEST_ASSERT_FALSE(udpCheckSequence(ADDRESS, PORT, 9));
+  TEST_ASSERT_TRUE(udpCheckSequence(ADDRESS, PORT, 11));
+  // A request overtaken by a newer one is not executed
+  TEST_ASSERT_TRUE(udpCheckSequence(ADDRESS, PORT, 15));
+  TEST_ASSERT_FALSE(udpCheckSequence(ADDRESS, PORT, 13));
+}
+
+void test_sequence_number_may_wrap()
+{
+  TEST_ASSERT_TRUE(udpCheckSequence(ADDRESS, PORT, 0xFFFFFFFE));
+  TEST_ASSERT_TRUE(udpCheckSequence(ADDRESS, PORT, 0xFFFFFFFF));
+  TEST_ASSERT_TRUE(udpCheckSequence(ADDRESS, PORT, 0));
+  TEST_ASSERT_TRUE(udpCheckSequence(ADDRESS, PORT, 1));
+  TEST_ASSERT_FALSE(udpCheckSequence(ADDRESS, PORT, 0xFFFFFFFF));
+}
+
+void test_half_the_range_ahead_is_older()
+{
+  TEST_ASSERT_TRUE(udpCheckSequence(ADDRESS, PORT, 100));
+  TEST_ASSERT_FALSE(udpCheckSequence(ADDRESS, PORT, 100u + 0x80000000u));
+  TEST_ASSERT_TRUE(udpCheckSequence(ADDRESS, PORT, 100u + 0x7FFFFFFFu));
+}
+
+void test_clients_are_told_apart_by_address_and_port()
+{
+  TEST_ASSERT_TRUE(udpCheckSequence(ADDRESS, PORT, 50));
+  TEST_ASSERT_TRUE(udpCheckSequence(ADDRESS, PORT + 1, 5));
+  TEST_ASSERT_TRUE(udpCheckSequence(ADDRESS + 1, PORT, 5));
+  TEST_ASSERT_FALSE(udpCheckSequence(ADDRESS, PORT + 1, 5));
+  TEST_ASSERT_FALSE(udpCheckSequence(ADDRESS, PORT, 49));
+}
+
+void test_oldest_client_is_forgotten_when_the_table_is_full()
+{
+  for (uint32_t i = 0; i < UDP_MAX_CLIENTS; i++)
+    TEST_ASSERT_TRUE(udpCheckSequence(ADDRESS + i, PORT, 100));
+  // A new client replaces the first entry - the first client is then seen as new and its old sequence number is accepted
+  TEST_ASSERT_TRUE(udpCheckSequence(ADDRESS + UDP_MAX_CLIENTS, PORT, 100));
+  TEST_ASSERT_TRUE(udpCheckSequence(ADDRESS, PORT, 100));
+  // The others are still remembered
+  TEST_ASSERT_FALSE(udpCheckSequence(ADDRESS + 2, PORT, 100));
+  TEST_ASSERT_FALSE(udpCheckSequence(ADDRESS + UDP_MAX_CLIENTS, PORT, 100));
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_first_request_of_a_client_is_executed);
+  RUN_TEST(test_duplicate_and_older_requests_are_not_executed);
+  RUN_TEST(test_sequence_number_may_wrap);
+  RUN_TEST(test_half_the_range_ahead_is_older);
+  RUN_TEST(test_clients_are_told_apart_by_address_and_port);
+  RUN_TEST(test_oldest_client_is_forgotten_when_the_table_is_full);
+  return UNITY_END();
+}